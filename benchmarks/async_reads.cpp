@@ -0,0 +1,173 @@
+// Reads many small files concurrently through the event loop, both driven from C++ and from Lox
+// fibers, on each available backend, and compares them with reading the files one by one.
+//
+// Usage: async_reads [-n files] [-s size]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <print>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "event_loop.h"
+#include "harness.h"
+#include "isolate.h"
+
+namespace
+{
+
+// File names are four digits so that the Lox script can build them from a list of digits.
+constexpr int MAX_FILES = 10'000;
+
+std::string file_name(int index)
+{
+    return std::format("{:04}", index);
+}
+
+std::vector<std::string> create_files(const std::filesystem::path& directory, int files, int size)
+{
+    std::filesystem::create_directories(directory);
+
+    std::vector<std::string> paths;
+    std::string contents(size, 'x');
+
+    for(int i = 0; i < files; ++i)
+    {
+        paths.push_back(directory / file_name(i));
+        std::ofstream{paths.back()} << contents;
+    }
+
+    return paths;
+}
+
+void report(std::string_view name, size_t files, std::chrono::duration<double> elapsed)
+{
+    std::println("{:<22} {:>10.0f} files/s {:>10.2f} ms",
+                 name,
+                 files / elapsed.count(),
+                 elapsed.count() * 1000);
+}
+
+void blocking(const std::vector<std::string>& paths)
+{
+    auto elapsed = measure([&] {
+        for(const auto& path : paths)
+        {
+            std::ifstream ifs{path};
+            std::stringstream buf;
+            buf << ifs.rdbuf();
+        }
+    });
+
+    report("blocking:", paths.size(), elapsed);
+}
+
+std::string_view backend_name(lox::EventLoop::Backend backend)
+{
+    return backend == lox::EventLoop::Backend::IoUring ? "io_uring" : "epoll";
+}
+
+void event_loop(const std::vector<std::string>& paths, lox::EventLoop::Backend backend)
+{
+    auto loop = lox::EventLoop::create(backend);
+
+    if(!loop)
+    {
+        std::println("{} is unavailable", backend_name(backend));
+        return;
+    }
+
+    size_t completed = 0;
+
+    auto elapsed = measure([&] {
+        for(const auto& path : paths)
+        {
+            loop->read_file(path, [&](lox::EventLoop::Result result) {
+                if(!result)
+                {
+                    std::println(stderr, "{}: {}", path, result.error().message());
+                    std::exit(74);
+                }
+
+                ++completed;
+            });
+        }
+
+        loop->run();
+    });
+
+    report(std::format("{} loop:", backend_name(backend)), completed, elapsed);
+}
+
+// Runs a script which spawns a fiber per file, each of which reads its file asynchronously.
+void fibers(const std::filesystem::path& directory, int files, lox::EventLoop::Backend backend)
+{
+    auto source = std::format(R"(
+var digits = ["0", "1", "2", "3", "4", "5", "6", "7", "8", "9"];
+var remaining = {};
+var completed = 0;
+
+fun reader(path) {{
+    fun read() {{
+        read_file_async(path);
+        completed = completed + 1;
+    }}
+    return read;
+}}
+
+for(var a = 0; a < 10; a = a + 1) {{
+    for(var b = 0; b < 10; b = b + 1) {{
+        for(var c = 0; c < 10; c = c + 1) {{
+            for(var d = 0; d < 10; d = d + 1) {{
+                if(remaining > 0) {{
+                    spawn(reader("{}/" + digits[a] + digits[b] + digits[c] + digits[d]));
+                    remaining = remaining - 1;
+                }}
+            }}
+        }}
+    }}
+}}
+)",
+                              files,
+                              directory.string());
+
+    auto program = check(lox::Program::compile(source));
+
+    // The event loop picks its backend when the VM first needs it.
+    setenv("LOX_EVENT_LOOP", backend == lox::EventLoop::Backend::Epoll ? "epoll" : "", 1);
+
+    auto elapsed = measure([&] {
+        lox::Isolate isolate{program};
+        check(isolate.run() == lox::InterpretResult::OK);
+    });
+
+    report(std::format("{} fibers:", backend_name(backend)), files, elapsed);
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "async_reads [-n files] [-s size]", {"-n", "-s"}};
+    auto files = options.get_count("-n", 2'000, MAX_FILES);
+    auto size = options.get_count("-s", 4096);
+
+    auto directory = std::filesystem::temp_directory_path() / "lox_async_reads";
+    auto paths = create_files(directory, files, size);
+
+    blocking(paths);
+
+    for(auto backend : {lox::EventLoop::Backend::IoUring, lox::EventLoop::Backend::Epoll})
+    {
+        event_loop(paths, backend);
+        fibers(directory, files, backend);
+    }
+
+    std::filesystem::remove_all(directory);
+}
@@ -0,0 +1,116 @@
+// Measures channel throughput, both for the raw queue driven from C++ and for a two-isolate Lox
+// pipeline sending numbers, strings and lists, with lists both copied and transferred.
+//
+// Usage: channel_throughput [-n messages] [-p producers] [-c consumers] [-k capacity]
+
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "channel.h"
+#include "harness.h"
+#include "isolate.h"
+
+namespace
+{
+
+constexpr int LIST_SIZE = 200;
+
+void raw_queue(int messages, int producers, int consumers, size_t capacity)
+{
+    lox::Channel channel{capacity};
+    // Numbers never refer to a heap, so any will do.
+    const lox::ObjectAllocator heap;
+
+    auto elapsed = measure([&] {
+        std::vector<std::jthread> threads;
+
+        for(int p = 0; p < producers; ++p)
+        {
+            threads.emplace_back([&, p] {
+                for(int i = p; i < messages; i += producers)
+                {
+                    channel.send(lox::Message::copy(lox::Value{double(i)}, heap).value());
+                }
+            });
+        }
+
+        for(int c = 0; c < consumers; ++c)
+        {
+            threads.emplace_back([&, c] {
+                for(int i = c; i < messages; i += consumers)
+                {
+                    channel.receive();
+                }
+            });
+        }
+    });
+
+    std::println(
+        "{:<22} {:>12.0f} msg/s",
+        std::format("raw queue ({}P/{}C):", producers, consumers),
+        messages / elapsed.count());
+}
+
+// Runs a producer and a consumer isolate on separate threads, connected by a channel.
+void pipeline(std::string_view name, std::string_view payload, bool transfer, int messages,
+              size_t capacity)
+{
+    auto producer = check(lox::Program::compile(std::format(
+        "for(var i = 0; i < {}; i = i + 1) {{ {}(out, {}); }}",
+        messages,
+        transfer ? "transfer" : "send",
+        payload)));
+    auto consumer = check(lox::Program::compile(
+        std::format("for(var i = 0; i < {}; i = i + 1) {{ recv(in); }}", messages)));
+
+    auto channel = std::make_shared<lox::Channel>(capacity);
+
+    auto elapsed = measure([&] {
+        std::jthread producer_thread{[&] {
+            lox::Isolate isolate{producer};
+            isolate.define_channel("out", channel);
+            check(isolate.run() == lox::InterpretResult::OK);
+        }};
+
+        lox::Isolate isolate{consumer};
+        isolate.define_channel("in", channel);
+        check(isolate.run() == lox::InterpretResult::OK);
+    });
+
+    std::println("{:<22} {:>12.0f} msg/s", name, messages / elapsed.count());
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc,
+                    argv,
+                    "channel_throughput [-n messages] [-p producers] [-c consumers] [-k capacity]",
+                    {"-n", "-p", "-c", "-k"}};
+    auto messages = options.get_count("-n", 1'000'000);
+    auto producers = options.get_count("-p", 1);
+    auto consumers = options.get_count("-c", 1);
+    auto capacity = options.get_count<size_t>("-k", 1024, lox::MAX_CHANNEL_CAPACITY);
+
+    raw_queue(messages, producers, consumers, capacity);
+
+    std::string list = "[i";
+
+    for(int i = 1; i < LIST_SIZE; ++i)
+    {
+        list += ", i";
+    }
+
+    list += "]";
+
+    pipeline("lox numbers:", "i", false, messages, capacity);
+    pipeline("lox strings:", "\"payload\"", false, messages, capacity);
+    pipeline(std::format("lox {}-lists (copy):", LIST_SIZE), list, false, messages / 10, capacity);
+    pipeline(std::format("lox {}-lists (move):", LIST_SIZE), list, true, messages / 10, capacity);
+}
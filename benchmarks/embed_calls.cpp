@@ -0,0 +1,114 @@
+// Measures the cost of calling small Lox functions from C++ through the embedding API, of natives
+// calling back into Lox, and of the same calls made from Lox for comparison.
+//
+// Usage: embed_calls [-n calls]
+
+#include <chrono>
+#include <print>
+#include <span>
+#include <string_view>
+
+#include "harness.h"
+#include "isolate.h"
+#include "vm.h"
+
+namespace
+{
+
+constexpr std::string_view SOURCE = R"(
+fun add(a, b) {
+    return a + b;
+}
+
+fun identity(x) {
+    return x;
+}
+
+fun calls_from_lox(n) {
+    var total = 0;
+    for(var i = 0; i < n; i = i + 1) {
+        total = add(total, i);
+    }
+    return total;
+}
+
+fun reentering(n) {
+    var total = 0;
+    for(var i = 0; i < n; i = i + 1) {
+        total = apply(add, total, i);
+    }
+    return total;
+}
+)";
+
+// Calls its first argument with the others, from C++.
+lox::Value apply_native(lox::VM& vm, std::span<lox::Value> args)
+{
+    auto result = vm.call(args[0], args.subspan(1));
+
+    if(!result)
+    {
+        vm.raise("apply() failed.");
+        return lox::Value{};
+    }
+
+    return result.value();
+}
+
+void report(std::string_view what, int calls, std::chrono::duration<double> elapsed)
+{
+    std::println("{:<32} {:>10.1f} ns/call",
+                 what,
+                 std::chrono::duration<double, std::nano>(elapsed).count() / calls);
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "embed_calls [-n calls]", {"-n"}};
+    auto calls = options.get_count("-n", 10'000'000);
+
+    lox::Isolate isolate{check(lox::Program::compile(std::string{SOURCE}))};
+    isolate.get_vm().define_native("apply", &apply_native);
+    check(isolate.run() == lox::InterpretResult::OK);
+
+    auto add = check(isolate.get_function("add"));
+    auto identity = check(isolate.get_function("identity"));
+    double total = 0;
+
+    report("C++ -> add(a, b)", calls, measure([&] {
+               for(int i = 0; i < calls; ++i)
+               {
+                   total = check(isolate.call(add, total, i)).as_number();
+               }
+           }));
+
+    report("C++ -> identity(x)", calls, measure([&] {
+               for(int i = 0; i < calls; ++i)
+               {
+                   check(isolate.call(identity, i));
+               }
+           }));
+
+    // Through a plain handle, which is checked to be callable on every call.
+    auto handle = check(isolate.get_global("add"));
+
+    report("C++ -> add(a, b) by handle", calls, measure([&] {
+               for(int i = 0; i < calls; ++i)
+               {
+                   check(isolate.call(handle, 1, i));
+               }
+           }));
+
+    auto from_lox = check(isolate.get_function("calls_from_lox"));
+    report("Lox -> add(a, b)", calls, measure([&] { check(isolate.call(from_lox, calls)); }));
+
+    auto reentering = check(isolate.get_function("reentering"));
+    report("Lox -> native -> add(a, b)",
+           calls,
+           measure([&] { check(isolate.call(reentering, calls)); }));
+
+    // Keeps the result from being optimized away.
+    return total < 0 ? 1 : 0;
+}
@@ -0,0 +1,81 @@
+// Spawns many short fibers from main() and runs them on the scheduler with increasing numbers of
+// workers, reporting throughput, how many tasks were stolen and how long tasks waited to start.
+//
+// Usage: fiber_scheduler [-n tasks] [-w work]
+
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <string_view>
+
+#include "harness.h"
+#include "isolate.h"
+#include "scheduler.h"
+
+namespace
+{
+
+// Every task counts up to n, yielding halfway so that the worker's other fibers run in between.
+std::string make_source(int tasks, int work)
+{
+    return std::format(R"(
+fun work(n) {{
+    var total = 0;
+    for(var i = 0; i < n; i = i + 1) {{
+        total = total + i;
+        if(i == n / 2) yield();
+    }}
+    return total;
+}}
+
+fun main() {{
+    for(var i = 0; i < {}; i = i + 1) {{
+        spawn(work, {});
+    }}
+}}
+)",
+                       tasks,
+                       work);
+}
+
+template <typename Duration>
+double microseconds(Duration duration)
+{
+    return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "fiber_scheduler [-n tasks] [-w work]", {"-n", "-w"}};
+    auto tasks = options.get_count("-n", 100'000);
+    auto work = options.get_count("-w", 100);
+
+    auto program = check(lox::Program::compile(make_source(tasks, work)));
+
+    std::println("{:>7} {:>12} {:>8} {:>10} {:>10} {:>10}",
+                 "workers",
+                 "tasks/s",
+                 "steals",
+                 "p50 us",
+                 "p99 us",
+                 "max us");
+
+    for(unsigned workers : {1, 2, 4, 8})
+    {
+        lox::Scheduler scheduler{program, workers};
+        check(scheduler.run() == lox::InterpretResult::OK);
+
+        const auto& stats = scheduler.get_stats();
+
+        std::println("{:>7} {:>12.0f} {:>8} {:>10.1f} {:>10.1f} {:>10.1f}",
+                     workers,
+                     stats.tasks / (stats.wall_time.count() / 1000),
+                     stats.steals,
+                     microseconds(stats.latency_p50),
+                     microseconds(stats.latency_p99),
+                     microseconds(stats.latency_max));
+    }
+}
@@ -0,0 +1,143 @@
+// What the main() of every benchmark shares: reading its command line, timing its steps, and giving
+// up once a step fails.
+
+#ifndef LOX_BENCHMARKS_HARNESS_H
+#define LOX_BENCHMARKS_HARNESS_H
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <print>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// The command line of a benchmark: its positional arguments, followed by options which each take
+// a value. An unknown option, a missing value or a count which is not a whole number in range
+// prints the usage and exits, rather than running the benchmark with a count of zero.
+class Options
+{
+    std::string_view _usage;
+    std::vector<std::string_view> _positional;
+    std::vector<std::pair<std::string_view, std::string_view>> _options;
+
+    std::optional<std::string_view> _find(std::string_view name) const
+    {
+        // Later options win, as with most command lines.
+        for(auto it = _options.rbegin(); it != _options.rend(); ++it)
+        {
+            if(it->first == name)
+            {
+                return it->second;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+public:
+    Options(int argc,
+            const char* argv[],
+            std::string_view usage,
+            std::initializer_list<std::string_view> names,
+            int positional = 0)
+        : _usage(usage)
+    {
+        if(argc - 1 < positional || (argc - 1 - positional) % 2 != 0)
+        {
+            fail();
+        }
+
+        _positional.assign(argv + 1, argv + 1 + positional);
+
+        for(int i = 1 + positional; i < argc; i += 2)
+        {
+            if(std::ranges::find(names, std::string_view{argv[i]}) == names.end())
+            {
+                fail();
+            }
+
+            _options.emplace_back(argv[i], argv[i + 1]);
+        }
+    }
+
+    [[noreturn]] void fail() const
+    {
+        std::println(stderr, "Usage: {}", _usage);
+        std::exit(64);
+    }
+
+    std::string_view get_positional(size_t index) const
+    {
+        return _positional[index];
+    }
+
+    std::optional<std::string_view> get_string(std::string_view name) const
+    {
+        return _find(name);
+    }
+
+    // The value of a count option between min and max, or the fallback if it was not given.
+    template <typename T = int>
+    T get_count(std::string_view name,
+                T fallback,
+                T max = std::numeric_limits<T>::max(),
+                T min = 1) const
+    {
+        auto value = _find(name);
+
+        if(!value)
+        {
+            return fallback;
+        }
+
+        T count{};
+        auto [end, error] = std::from_chars(value->data(), value->data() + value->size(), count);
+
+        if(error != std::errc{} || end != value->data() + value->size() || count < min
+           || count > max)
+        {
+            std::println(stderr, "{} expects a whole number between {} and {}.", name, min, max);
+            fail();
+        }
+
+        return count;
+    }
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Runs the function once, returning how long it took.
+template <typename Duration = std::chrono::duration<double>, typename F>
+Duration measure(F&& function)
+{
+    auto start = Clock::now();
+    std::forward<F>(function)();
+
+    return std::chrono::duration_cast<Duration>(Clock::now() - start);
+}
+
+// Exits with the status of a script which failed to run, as nothing after a failed step is worth
+// measuring.
+inline void check(bool succeeded)
+{
+    if(!succeeded)
+    {
+        std::exit(70);
+    }
+}
+
+// The value of a step's result, such as a compiled program or what a call returned, exiting as
+// check() does if it has none.
+template <typename Result>
+auto check(Result result)
+{
+    check(static_cast<bool>(result));
+    return *std::move(result);
+}
+
+#endif // LOX_BENCHMARKS_HARNESS_H
@@ -0,0 +1,124 @@
+// Sums a computed value over C++ records read in place as host objects, and over the same records
+// copied into Lox instances, and reports the time per record read. Host objects are read once
+// through the property cache, with every record of one class, and once without it, with records
+// alternating between two classes so that every read misses the cache.
+//
+// Usage: host_objects [-n passes]
+
+#include <chrono>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "harness.h"
+#include "host_class.h"
+#include "isolate.h"
+#include "object.h"
+
+namespace
+{
+
+constexpr int RECORDS = 200;
+
+struct Trade
+{
+    double price;
+    int quantity;
+};
+
+constexpr std::string_view SOURCE = R"(
+class Trade {
+    init(price, quantity) {
+        this.price = price;
+        this.quantity = quantity;
+    }
+}
+
+fun sum(records, passes) {
+    var total = 0;
+    for(var pass = 0; pass < passes; pass = pass + 1) {
+        for(var i = 0; i < 200; i = i + 1) {
+            var record = records[i];
+            total = total + record.price * record.quantity;
+        }
+    }
+    return total;
+}
+
+fun copy(record) {
+    return Trade(record.price, record.quantity);
+}
+)";
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "host_objects [-n passes]", {"-n"}};
+    auto passes = options.get_count("-n", 20'000);
+
+    auto program = check(lox::Program::compile(std::string{SOURCE}));
+
+    lox::HostType<Trade> trade_class{"Trade"};
+    trade_class.field<&Trade::price>("price").field<&Trade::quantity>("quantity");
+    lox::HostType<Trade> quote_class{"Quote"};
+    quote_class.field<&Trade::price>("price").field<&Trade::quantity>("quantity");
+
+    std::vector<Trade> trades;
+
+    for(int i = 0; i < RECORDS; ++i)
+    {
+        trades.push_back({.price = 1.0 + i % 7, .quantity = i % 13});
+    }
+
+    lox::Isolate isolate{program};
+    check(isolate.run() == lox::InterpretResult::OK);
+
+    auto& allocator = isolate.get_vm().get_allocator();
+    auto copy = check(isolate.get_function("copy"));
+    std::vector<lox::Handle> handles;
+    std::vector<lox::Value> wrapped;
+    std::vector<lox::Value> alternating;
+    std::vector<lox::Value> copied;
+
+    for(size_t i = 0; i < trades.size(); ++i)
+    {
+        auto& trade = trades[i];
+        auto record = lox::Value{trade_class.wrap(allocator, trade)};
+        handles.push_back(isolate.hold(record));
+        auto other = lox::Value{(i % 2 ? quote_class : trade_class).wrap(allocator, trade)};
+        handles.push_back(isolate.hold(other));
+        alternating.push_back(other);
+        auto instance = check(isolate.call(copy, record));
+        handles.push_back(isolate.hold(instance));
+        wrapped.push_back(record);
+        copied.push_back(instance);
+    }
+
+    auto records =
+        isolate.hold(lox::Value{allocator.allocate<lox::ListObject>(true, std::span{wrapped})});
+    auto uncached = isolate.hold(
+        lox::Value{allocator.allocate<lox::ListObject>(true, std::span{alternating})});
+    auto copies =
+        isolate.hold(lox::Value{allocator.allocate<lox::ListObject>(true, std::span{copied})});
+    auto sum = check(isolate.get_function("sum"));
+
+    std::println("{:<20} {:>14} {:>10}", "records", "ns per record", "sum");
+
+    for(auto [name, list] : {std::pair{"host objects", &records},
+                             std::pair{"host objects, uncached", &uncached},
+                             std::pair{"instances", &copies}})
+    {
+        lox::Value total;
+        auto elapsed = measure<std::chrono::duration<double, std::nano>>(
+            [&] { total = check(isolate.call(sum, *list, passes)); });
+
+        std::println("{:<20} {:>14.1f} {:>10.0f}",
+                     name,
+                     elapsed.count() / (passes * RECORDS),
+                     total.as_number());
+    }
+}
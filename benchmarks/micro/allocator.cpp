@@ -0,0 +1,148 @@
+// Allocating each kind of object, and interning strings which are or are not interned already.
+// Allocations may collect, as they do when scripts run, so the cost of sweeping what they leave
+// behind is included.
+
+#include <format>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "isolate.h"
+#include "object.h"
+#include "value.h"
+
+namespace
+{
+
+// Objects the allocated ones refer to are pinned in the same heap beforehand.
+template <typename Allocate>
+void allocate_objects(benchmark::State& state, lox::ObjectAllocator& heap, Allocate allocate)
+{
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(allocate(heap));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+void allocate_function(benchmark::State& state)
+{
+    lox::Isolate isolate;
+
+    allocate_objects(state, isolate.get_allocator(), [](lox::ObjectAllocator& heap) {
+        return heap.allocate<lox::FunctionObject>(true, "function", 0);
+    });
+}
+
+void allocate_closure(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& heap = isolate.get_allocator();
+    auto* function = heap.allocate<lox::FunctionObject>(false, "function", 0);
+    heap.pin(function);
+
+    allocate_objects(state, heap, [function](lox::ObjectAllocator& heap) {
+        return heap.allocate<lox::ClosureObject>(
+            true, *function, std::vector<lox::UpValueObject*>{});
+    });
+}
+
+void allocate_class(benchmark::State& state)
+{
+    lox::Isolate isolate;
+
+    allocate_objects(state, isolate.get_allocator(), [](lox::ObjectAllocator& heap) {
+        return heap.allocate<lox::ClassObject>(true, "Class");
+    });
+}
+
+void allocate_instance(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& heap = isolate.get_allocator();
+    auto* klass = heap.allocate<lox::ClassObject>(false, "Class");
+    heap.pin(klass);
+
+    allocate_objects(state, heap, [klass](lox::ObjectAllocator& heap) {
+        return heap.allocate<lox::InstanceObject>(true, *klass);
+    });
+}
+
+void allocate_list(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    std::vector<lox::Value> elements(state.range(0), lox::Value{1.0});
+
+    allocate_objects(state, isolate.get_allocator(), [&elements](lox::ObjectAllocator& heap) {
+        return heap.allocate<lox::ListObject>(true, elements);
+    });
+}
+
+void allocate_upvalue(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    lox::Value value{1.0};
+
+    allocate_objects(state, isolate.get_allocator(), [&value](lox::ObjectAllocator& heap) {
+        return heap.allocate<lox::UpValueObject>(true, &value);
+    });
+}
+
+void allocate_string_hit(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& heap = isolate.get_allocator();
+
+    heap.pin(heap.allocate_string("an interned string"));
+
+    for(auto _ : state)
+    {
+        benchmark::DoNotOptimize(heap.allocate_string("an interned string"));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+void allocate_string_miss(benchmark::State& state)
+{
+    constexpr size_t STRINGS = 1 << 16;
+
+    lox::Isolate isolate;
+    auto& heap = isolate.get_allocator();
+    std::vector<std::string> strings;
+
+    for(size_t i = 0; i < STRINGS; ++i)
+    {
+        strings.push_back(std::format("string which is not interned {}", i));
+    }
+
+    size_t next = 0;
+
+    for(auto _ : state)
+    {
+        // Interning strings never collects, so the strings are collected before being reused.
+        if(next == STRINGS)
+        {
+            state.PauseTiming();
+            heap.collect_garbage();
+            next = 0;
+            state.ResumeTiming();
+        }
+
+        benchmark::DoNotOptimize(heap.allocate_string(strings[next++]));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+} // namespace
+
+BENCHMARK(allocate_function);
+BENCHMARK(allocate_closure);
+BENCHMARK(allocate_class);
+BENCHMARK(allocate_instance);
+BENCHMARK(allocate_list)->Arg(0)->Arg(8)->Arg(64);
+BENCHMARK(allocate_upvalue);
+BENCHMARK(allocate_string_hit);
+BENCHMARK(allocate_string_miss);
@@ -0,0 +1,164 @@
+// Running straight-line scripts which repeat one instruction, or one instruction with what it
+// needs to run, so that the cost of dispatching it and of the instruction itself can be compared
+// between opcodes.
+
+#include <cstdint>
+#include <initializer_list>
+
+#include "benchmark/benchmark.h"
+#include "chunk.h"
+#include "isolate.h"
+#include "object.h"
+#include "value.h"
+
+namespace
+{
+
+constexpr int REPETITIONS = 10000;
+
+struct Instruction
+{
+    lox::OpCode op;
+    // The operand of instructions which take one, or -1.
+    int operand = -1;
+};
+
+// Makes a script which runs the prologue, then the body over and over, and returns nil.
+lox::FunctionObject& make_script(lox::Isolate& isolate,
+                                 std::initializer_list<Instruction> prologue,
+                                 std::initializer_list<Instruction> body,
+                                 std::initializer_list<lox::Value> constants)
+{
+    auto& heap = isolate.get_allocator();
+    auto* script = heap.allocate<lox::FunctionObject>(false, "", 0);
+    heap.pin(script);
+
+    auto& chunk = script->chunk;
+
+    for(auto constant : constants)
+    {
+        chunk.add_constant(constant);
+    }
+
+    auto write = [&chunk](const Instruction& instruction) {
+        chunk.write(instruction.op, 1);
+
+        if(instruction.operand >= 0)
+        {
+            chunk.write(static_cast<uint8_t>(instruction.operand), 1);
+        }
+    };
+
+    for(const auto& instruction : prologue)
+    {
+        write(instruction);
+    }
+
+    for(int i = 0; i < REPETITIONS; ++i)
+    {
+        for(const auto& instruction : body)
+        {
+            write(instruction);
+        }
+    }
+
+    chunk.write(lox::OpCode::NIL, 1);
+    chunk.write(lox::OpCode::RETURN, 1);
+
+    return *script;
+}
+
+void run_script(benchmark::State& state, lox::Isolate& isolate, lox::FunctionObject& script)
+{
+    for(auto _ : state)
+    {
+        if(isolate.run(script) != lox::InterpretResult::OK)
+        {
+            state.SkipWithError("Runtime error");
+            return;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * REPETITIONS);
+}
+
+void dispatch_nil(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& script = make_script(isolate, {}, {{lox::OpCode::NIL}, {lox::OpCode::POP}}, {});
+
+    run_script(state, isolate, script);
+}
+
+void dispatch_constant(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& script =
+        make_script(isolate, {}, {{lox::OpCode::CONSTANT, 0}, {lox::OpCode::POP}}, {1.0});
+
+    run_script(state, isolate, script);
+}
+
+void dispatch_get_local(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    // Slot 0 holds the script itself.
+    auto& script = make_script(isolate, {}, {{lox::OpCode::GET_LOCAL, 0}, {lox::OpCode::POP}}, {});
+
+    run_script(state, isolate, script);
+}
+
+void dispatch_get_global(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    isolate.get_globals()["global"] = lox::Value{1.0};
+
+    auto* name = isolate.get_allocator().allocate_identifier("global");
+    auto& script =
+        make_script(isolate, {}, {{lox::OpCode::GET_GLOBAL, 0}, {lox::OpCode::POP}}, {name});
+
+    run_script(state, isolate, script);
+}
+
+void dispatch_add(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& script = make_script(isolate,
+                               {{lox::OpCode::CONSTANT, 0}},
+                               {{lox::OpCode::CONSTANT, 0}, {lox::OpCode::ADD}},
+                               {1.0});
+
+    run_script(state, isolate, script);
+}
+
+void dispatch_less(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& script = make_script(isolate,
+                               {},
+                               {{lox::OpCode::CONSTANT, 0},
+                                {lox::OpCode::CONSTANT, 1},
+                                {lox::OpCode::LESS},
+                                {lox::OpCode::POP}},
+                               {1.0, 2.0});
+
+    run_script(state, isolate, script);
+}
+
+void dispatch_not(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    auto& script = make_script(isolate, {{lox::OpCode::TRUE}}, {{lox::OpCode::NOT}}, {});
+
+    run_script(state, isolate, script);
+}
+
+} // namespace
+
+BENCHMARK(dispatch_nil);
+BENCHMARK(dispatch_constant);
+BENCHMARK(dispatch_get_local);
+BENCHMARK(dispatch_get_global);
+BENCHMARK(dispatch_add);
+BENCHMARK(dispatch_less);
+BENCHMARK(dispatch_not);
@@ -0,0 +1,106 @@
+// Scanning, parsing and compiling the workloads, each step on its own.
+
+#include <optional>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "compiler.h"
+#include "object.h"
+#include "parser.h"
+#include "scanner.h"
+#include "workloads.h"
+
+namespace
+{
+
+void scan_tokens(benchmark::State& state)
+{
+    const auto& source = get_workload_sources();
+    size_t tokens = 0;
+
+    for(auto _ : state)
+    {
+        lox::Scanner scanner{source};
+
+        while(scanner.scan_token().type != lox::TokenType::END_OF_FILE)
+        {
+            ++tokens;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.SetItemsProcessed(tokens);
+}
+
+void parse(benchmark::State& state)
+{
+    const auto& source = get_workload_sources();
+    // Literals are interned into the same heap every time, as they are when a VM parses scripts.
+    lox::ObjectAllocator heap;
+
+    for(auto _ : state)
+    {
+        lox::Scanner scanner{source};
+        lox::Parser parser{scanner, heap};
+
+        auto declarations = parser.parse();
+
+        if(!declarations)
+        {
+            state.SkipWithError("Parse error");
+            return;
+        }
+
+        benchmark::DoNotOptimize(declarations);
+    }
+
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+
+void compile(benchmark::State& state)
+{
+    const auto& source = get_workload_sources();
+    lox::ObjectAllocator source_heap;
+    lox::Scanner scanner{source};
+    lox::Parser parser{scanner, source_heap};
+
+    auto declarations = parser.parse();
+
+    if(!declarations)
+    {
+        state.SkipWithError("Parse error");
+        return;
+    }
+
+    // A heap for each compile keeps the functions of earlier ones from piling up. Freeing them is
+    // not counted.
+    std::optional<lox::ObjectAllocator> heap;
+
+    for(auto _ : state)
+    {
+        state.PauseTiming();
+        heap.reset();
+        heap.emplace();
+        state.ResumeTiming();
+
+        lox::Compiler compiler{*heap};
+
+        auto script = compiler.compile(declarations.value());
+
+        if(!script)
+        {
+            state.SkipWithError("Compile error");
+            return;
+        }
+
+        benchmark::DoNotOptimize(script);
+    }
+
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+
+} // namespace
+
+BENCHMARK(scan_tokens);
+BENCHMARK(parse);
+BENCHMARK(compile);
@@ -0,0 +1,92 @@
+// Collecting heaps of different shapes: many objects reachable from one list, a long chain of
+// objects, and objects which are all garbage.
+
+#include <array>
+#include <span>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "isolate.h"
+#include "object.h"
+#include "value.h"
+
+namespace
+{
+
+// Makes a global list of instances, which marking visits breadth first.
+void make_wide_heap(lox::Isolate& isolate, int objects)
+{
+    auto& heap = isolate.get_allocator();
+    auto* klass = heap.allocate<lox::ClassObject>(false, "Class");
+    std::vector<lox::Value> instances;
+
+    for(int i = 0; i < objects; ++i)
+    {
+        instances.emplace_back(heap.allocate<lox::InstanceObject>(false, *klass));
+    }
+
+    isolate.get_globals()["root"] = lox::Value{heap.allocate<lox::ListObject>(false, instances)};
+}
+
+// Makes a global linked list of two element lists, which marking visits one after another.
+void make_deep_heap(lox::Isolate& isolate, int objects)
+{
+    auto& heap = isolate.get_allocator();
+    lox::Value head;
+
+    for(int i = 0; i < objects; ++i)
+    {
+        std::array<lox::Value, 2> node{lox::Value{static_cast<double>(i)}, head};
+        head = lox::Value{heap.allocate<lox::ListObject>(false, node)};
+    }
+
+    isolate.get_globals()["root"] = head;
+}
+
+void make_garbage(lox::Isolate& isolate, int objects)
+{
+    auto& heap = isolate.get_allocator();
+
+    for(int i = 0; i < objects; ++i)
+    {
+        heap.allocate<lox::ListObject>(false, std::span<lox::Value>{});
+    }
+}
+
+// Live heaps are made once and collected over and over, which marks them every time.
+template <void (*make_heap)(lox::Isolate&, int)>
+void collect_live(benchmark::State& state)
+{
+    lox::Isolate isolate;
+    make_heap(isolate, state.range(0));
+
+    for(auto _ : state)
+    {
+        isolate.get_allocator().collect_garbage();
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Garbage is made again before every collection, which sweeps it.
+void collect_garbage(benchmark::State& state)
+{
+    lox::Isolate isolate;
+
+    for(auto _ : state)
+    {
+        state.PauseTiming();
+        make_garbage(isolate, state.range(0));
+        state.ResumeTiming();
+
+        isolate.get_allocator().collect_garbage();
+    }
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+} // namespace
+
+BENCHMARK(collect_live<make_wide_heap>)->Name("collect_wide")->Range(1 << 10, 1 << 17);
+BENCHMARK(collect_live<make_deep_heap>)->Name("collect_deep")->Range(1 << 10, 1 << 17);
+BENCHMARK(collect_garbage)->Range(1 << 10, 1 << 17);
@@ -0,0 +1,41 @@
+#ifndef LOX_MICRO_WORKLOADS_H
+#define LOX_MICRO_WORKLOADS_H
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// The sources of every workload the bench target runs, one after another, as realistic input for
+// the front end. They are never run together, so names they share do not matter.
+inline const std::string& get_workload_sources()
+{
+    static const std::string sources = [] {
+        std::vector<std::filesystem::path> paths;
+
+        for(const auto& entry : std::filesystem::directory_iterator(LOX_WORKLOADS_DIR))
+        {
+            if(entry.path().extension() == ".lox")
+            {
+                paths.push_back(entry.path());
+            }
+        }
+
+        std::ranges::sort(paths);
+
+        std::stringstream buf;
+
+        for(const auto& path : paths)
+        {
+            buf << std::ifstream{path}.rdbuf() << '\n';
+        }
+
+        return buf.str();
+    }();
+
+    return sources;
+}
+
+#endif // LOX_MICRO_WORKLOADS_H
@@ -0,0 +1,109 @@
+// Compiles scripts which import the same libraries, as a batch of scripts does, and reports the
+// time of the first compile, which compiles the libraries, and of later ones, which reuse them.
+// Run it twice with the same cache directory to see the first compile load the libraries from
+// the cache instead.
+//
+// Usage: module_compile [-m libraries] [-n compiles] [-c cache-dir]
+
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <print>
+#include <string>
+#include <string_view>
+
+#include "harness.h"
+#include "isolate.h"
+#include "module.h"
+
+namespace
+{
+
+constexpr int FUNCTIONS = 100;
+
+std::string make_library(int library)
+{
+    std::string source;
+
+    for(int i = 0; i < FUNCTIONS; ++i)
+    {
+        source += std::format(R"(
+fun f{0}(x) {{
+    var total = 0;
+    for(var i = 0; i < x; i = i + 1) {{
+        if(i < {0}) total = total + i * {1}; else total = total - 1;
+    }}
+    return total;
+}}
+)",
+                              i,
+                              library);
+    }
+
+    return source;
+}
+
+std::string make_script(int libraries)
+{
+    std::string source;
+
+    for(int i = 0; i < libraries; ++i)
+    {
+        source += std::format("import \"lib{}.lox\";\n", i);
+    }
+
+    source += "var total = 0;\n";
+
+    for(int i = 0; i < libraries; ++i)
+    {
+        source += std::format("total = total + lib{}.f{}(10);\n", i, i % FUNCTIONS);
+    }
+
+    return source + "print(total);\n";
+}
+
+// Returns the time the compile took in milliseconds.
+double compile(const std::string& source, const std::filesystem::path& directory)
+{
+    return measure<std::chrono::duration<double, std::milli>>(
+               [&] { check(lox::Program::compile(source, directory)); })
+        .count();
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc,
+                    argv,
+                    "module_compile [-m libraries] [-n compiles] [-c cache-dir]",
+                    {"-m", "-n", "-c"}};
+    auto libraries = options.get_count("-m", 16);
+    auto compiles = options.get_count("-n", 20);
+
+    if(auto cache = options.get_string("-c"))
+    {
+        lox::ModuleLoader::set_cache_directory(*cache);
+    }
+
+    auto directory = std::filesystem::temp_directory_path() / "lox_module_compile";
+    std::filesystem::create_directories(directory);
+
+    for(int i = 0; i < libraries; ++i)
+    {
+        std::ofstream{directory / std::format("lib{}.lox", i)} << make_library(i);
+    }
+
+    auto script = make_script(libraries);
+    auto first = compile(script, directory);
+    double later = 0;
+
+    for(int i = 0; i < compiles; ++i)
+    {
+        later += compile(script, directory);
+    }
+
+    std::println("{:<12} {:>16} {:>16}", "libraries", "first ms", "later ms");
+    std::println("{:<12} {:>16.3f} {:>16.3f}", libraries, first, later / compiles);
+}
@@ -0,0 +1,143 @@
+// Measures natives called from Lox, each written once by hand against the raw native interface and
+// once as a plain function bound with VM::bind(), which checks and converts the arguments itself.
+//
+// Usage: native_binding [-n calls]
+
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <print>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "bind.h"
+#include "harness.h"
+#include "isolate.h"
+#include "object.h"
+#include "vm.h"
+
+namespace
+{
+
+std::string make_source(std::string_view name, std::string_view args, int calls)
+{
+    return std::format(R"(
+var total = 0;
+for(var i = 0; i < {}; i = i + 1) {{
+    total = total + {}({});
+}}
+)",
+                       calls,
+                       name,
+                       args);
+}
+
+lox::Value hypot_native(lox::VM& vm, std::span<lox::Value> args)
+{
+    if(args.size() != 2 || !args[0].is_number() || !args[1].is_number())
+    {
+        vm.raise("hypot() expects two numbers.");
+        return lox::Value{};
+    }
+
+    return lox::Value{std::hypot(args[0].as_number(), args[1].as_number())};
+}
+
+lox::Value length_native(lox::VM& vm, std::span<lox::Value> args)
+{
+    auto* string = args.size() == 1 && args[0].is_object()
+                       ? args[0].as_object()->as<lox::StringObject>()
+                       : nullptr;
+
+    if(!string)
+    {
+        vm.raise("length() expects a string.");
+        return lox::Value{};
+    }
+
+    return lox::Value{(double)string->value().size()};
+}
+
+lox::Value sum_native(lox::VM& vm, std::span<lox::Value> args)
+{
+    auto* list = args.size() == 1 && args[0].is_object()
+                     ? args[0].as_object()->as<lox::ListObject>()
+                     : nullptr;
+
+    if(!list)
+    {
+        vm.raise("sum() expects a list.");
+        return lox::Value{};
+    }
+
+    double sum = 0;
+
+    for(auto element : list->elements)
+    {
+        sum += element.is_number() ? element.as_number() : 0;
+    }
+
+    return lox::Value{sum};
+}
+
+double hypot_bound(double x, double y)
+{
+    return std::hypot(x, y);
+}
+
+size_t length_bound(std::string_view string)
+{
+    return string.size();
+}
+
+double sum_bound(std::span<const lox::Value> elements)
+{
+    double sum = 0;
+
+    for(auto element : elements)
+    {
+        sum += element.is_number() ? element.as_number() : 0;
+    }
+
+    return sum;
+}
+
+// Returns the time per call of the named native.
+double run(std::string_view name, std::string_view args, int calls)
+{
+    lox::Isolate isolate{check(lox::Program::compile(make_source(name, args, calls)))};
+    auto& vm = isolate.get_vm();
+
+    vm.define_native("hypot", &hypot_native);
+    vm.define_native("length", &length_native);
+    vm.define_native("sum", &sum_native);
+    vm.bind<&hypot_bound>("bound_hypot");
+    vm.bind<&length_bound>("bound_length");
+    vm.bind<&sum_bound>("bound_sum");
+
+    auto elapsed = measure<std::chrono::duration<double, std::nano>>(
+        [&] { check(isolate.run() == lox::InterpretResult::OK); });
+
+    return elapsed.count() / calls;
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "native_binding [-n calls]", {"-n"}};
+    auto calls = options.get_count("-n", 5'000'000);
+
+    std::println("{:<12} {:>14} {:>14}", "native", "by hand ns", "bound ns");
+
+    for(auto [name, args] : {std::pair{"hypot", "i, 4"},
+                             std::pair{"length", "\"some string\""},
+                             std::pair{"sum", "[1, 2, 3, 4]"}})
+    {
+        auto by_hand = run(name, args, calls);
+        auto bound = run(std::format("bound_{}", name), args, calls);
+        std::println("{:<12} {:>14.1f} {:>14.1f}", name, by_hand, bound);
+    }
+}
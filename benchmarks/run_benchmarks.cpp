@@ -0,0 +1,461 @@
+// Runs the Lox benchmarks in a directory with the interpreter, each several times, and writes the
+// median and percentiles of wall time, instructions retired and peak RSS of every benchmark as
+// JSON, one benchmark per line. Given the results of an earlier run, it also reports how each
+// median changed, and fails if the wall time of any grew by more than the threshold. A baseline
+// which is missing or cannot be read fails the run too, with exit status 2, unless -w asks for the
+// results to be written there as the new baseline.
+//
+// Instructions are counted with perf events, and reported as null where those are unavailable.
+//
+// Usage: run_benchmarks <interpreter> <directory> [-n runs] [-o results.json] [-b baseline.json]
+//                       [-w] [-t percent] [benchmark...]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <linux/perf_event.h>
+#include <optional>
+#include <print>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+struct Run
+{
+    double wall_ms;
+    std::optional<uint64_t> instructions;
+    long peak_rss_kib;
+};
+
+enum class Comparison
+{
+    Passed,
+    Regressed,
+    NoBaseline
+};
+
+struct Percentiles
+{
+    double median;
+    double p10;
+    double p90;
+    double min;
+    double max;
+};
+
+// Counts the instructions a process retires in user space, from when it next calls exec.
+std::optional<int> open_instruction_counter(pid_t pid)
+{
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;
+
+    auto fd = static_cast<int>(
+        ::syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+
+    return fd >= 0 ? std::optional{fd} : std::nullopt;
+}
+
+// Runs the script once with its output discarded. Returns nothing if it could not be run or
+// did not exit successfully.
+std::optional<Run> run_once(const std::string& interpreter, const std::string& script)
+{
+    int ready[2];
+
+    if(::pipe2(ready, O_CLOEXEC) != 0)
+    {
+        return std::nullopt;
+    }
+
+    auto pid = ::fork();
+
+    if(pid < 0)
+    {
+        ::close(ready[0]);
+        ::close(ready[1]);
+        return std::nullopt;
+    }
+
+    if(pid == 0)
+    {
+        // Waits for the counter to be attached before starting the interpreter.
+        char byte;
+        ::close(ready[1]);
+
+        if(::read(ready[0], &byte, 1) != 1)
+        {
+            ::_exit(127);
+        }
+
+        auto null_fd = ::open("/dev/null", O_WRONLY);
+        ::dup2(null_fd, STDOUT_FILENO);
+        ::execl(interpreter.c_str(), interpreter.c_str(), script.c_str(), nullptr);
+        ::_exit(127);
+    }
+
+    ::close(ready[0]);
+
+    auto counter = open_instruction_counter(pid);
+    auto start = std::chrono::steady_clock::now();
+
+    [[maybe_unused]] auto written = ::write(ready[1], "", 1);
+    ::close(ready[1]);
+
+    int status = 0;
+    rusage usage{};
+    ::wait4(pid, &status, 0, &usage);
+
+    auto wall_time = std::chrono::steady_clock::now() - start;
+    std::optional<uint64_t> instructions;
+
+    if(counter)
+    {
+        uint64_t count;
+
+        if(::read(*counter, &count, sizeof(count)) == sizeof(count))
+        {
+            instructions = count;
+        }
+
+        ::close(*counter);
+    }
+
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return std::nullopt;
+    }
+
+    return Run{.wall_ms = std::chrono::duration<double, std::milli>(wall_time).count(),
+               .instructions = instructions,
+               .peak_rss_kib = usage.ru_maxrss};
+}
+
+Percentiles get_percentiles(std::vector<double> values)
+{
+    std::ranges::sort(values);
+
+    auto percentile = [&values](double p) {
+        return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+    };
+
+    return {.median = percentile(0.5),
+            .p10 = percentile(0.1),
+            .p90 = percentile(0.9),
+            .min = values.front(),
+            .max = values.back()};
+}
+
+std::string to_json(const Percentiles& percentiles)
+{
+    return std::format(R"({{"median": {}, "p10": {}, "p90": {}, "min": {}, "max": {}}})",
+                       percentiles.median,
+                       percentiles.p10,
+                       percentiles.p90,
+                       percentiles.min,
+                       percentiles.max);
+}
+
+std::string to_json(std::string_view name, const std::vector<Run>& runs)
+{
+    std::vector<double> wall_ms;
+    std::vector<double> instructions;
+    std::vector<double> peak_rss_kib;
+
+    for(const auto& run : runs)
+    {
+        wall_ms.push_back(run.wall_ms);
+        peak_rss_kib.push_back(run.peak_rss_kib);
+
+        if(run.instructions)
+        {
+            instructions.push_back(*run.instructions);
+        }
+    }
+
+    // Counts from only some of the runs would not be comparable.
+    auto instructions_json =
+        instructions.size() == runs.size() ? to_json(get_percentiles(instructions)) : "null";
+
+    return std::format(
+        R"({{"name": "{}", "runs": {}, "wall_ms": {}, "instructions": {}, "peak_rss_kib": {}}})",
+        name,
+        runs.size(),
+        to_json(get_percentiles(wall_ms)),
+        instructions_json,
+        to_json(get_percentiles(peak_rss_kib)));
+}
+
+// Reads the median of a measurement from a line which this program wrote.
+std::optional<double> get_median(std::string_view line, std::string_view measurement)
+{
+    auto key = std::format(R"("{}": {{"median": )", measurement);
+    auto position = line.find(key);
+
+    if(position == std::string_view::npos)
+    {
+        return std::nullopt;
+    }
+
+    return std::strtod(line.data() + position + key.size(), nullptr);
+}
+
+std::optional<std::string> get_name(std::string_view line)
+{
+    constexpr std::string_view key = R"("name": ")";
+    auto start = line.find(key);
+
+    if(start == std::string_view::npos)
+    {
+        return std::nullopt;
+    }
+
+    start += key.size();
+
+    return std::string{line.substr(start, line.find('"', start) - start)};
+}
+
+// Prints how the medians changed against the baseline, reporting whether any wall time grew by
+// more than the threshold. A baseline without any results counts as missing.
+Comparison compare(const std::vector<std::string>& results,
+                   const std::string& baseline_path,
+                   std::optional<double> threshold)
+{
+    std::ifstream baseline(baseline_path);
+    std::vector<std::pair<std::string, std::string>> previous;
+
+    for(std::string line; std::getline(baseline, line);)
+    {
+        if(auto name = get_name(line))
+        {
+            previous.emplace_back(std::move(*name), std::move(line));
+        }
+    }
+
+    if(previous.empty())
+    {
+        return Comparison::NoBaseline;
+    }
+
+    auto change = [](std::optional<double> before, std::optional<double> after) -> std::string {
+        if(!before || !after || *before == 0)
+        {
+            return "-";
+        }
+
+        return std::format("{:+.1f}%", (*after / *before - 1) * 100);
+    };
+
+    auto regressed = false;
+
+    std::println(stderr, "{:<20} {:>12} {:>14} {:>12}", "benchmark", "wall", "instructions", "rss");
+
+    for(const auto& result : results)
+    {
+        auto name = get_name(result);
+        auto it = std::ranges::find(previous, *name, &std::pair<std::string, std::string>::first);
+
+        if(it == previous.end())
+        {
+            continue;
+        }
+
+        auto before = get_median(it->second, "wall_ms");
+        auto after = get_median(result, "wall_ms");
+
+        std::println(stderr,
+                     "{:<20} {:>12} {:>14} {:>12}",
+                     *name,
+                     change(before, after),
+                     change(get_median(it->second, "instructions"),
+                            get_median(result, "instructions")),
+                     change(get_median(it->second, "peak_rss_kib"),
+                            get_median(result, "peak_rss_kib")));
+
+        if(threshold && before && after && *after > *before * (1 + *threshold / 100))
+        {
+            regressed = true;
+        }
+    }
+
+    return regressed ? Comparison::Regressed : Comparison::Passed;
+}
+
+[[noreturn]] void usage()
+{
+    std::println(stderr,
+                 "Usage: run_benchmarks <interpreter> <directory> [-n runs] [-o results.json] "
+                 "[-b baseline.json] [-w] [-t percent] [benchmark...]");
+    std::exit(64);
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    if(argc < 3)
+    {
+        usage();
+    }
+
+    std::string interpreter = argv[1];
+    std::filesystem::path directory = argv[2];
+    int runs = 10;
+    std::optional<std::string> output;
+    std::optional<std::string> baseline;
+    auto write_baseline = false;
+    std::optional<double> threshold;
+    std::vector<std::string> names;
+
+    for(int i = 3; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+
+        auto value = [&] {
+            if(i + 1 == argc)
+            {
+                usage();
+            }
+
+            return std::string{argv[++i]};
+        };
+
+        if(arg == "-n")
+        {
+            runs = std::max(1, std::atoi(value().c_str()));
+        }
+        else if(arg == "-o")
+        {
+            output = value();
+        }
+        else if(arg == "-b")
+        {
+            baseline = value();
+        }
+        else if(arg == "-w")
+        {
+            write_baseline = true;
+        }
+        else if(arg == "-t")
+        {
+            threshold = std::atof(value().c_str());
+        }
+        else
+        {
+            names.emplace_back(arg);
+        }
+    }
+
+    if(names.empty())
+    {
+        for(const auto& entry : std::filesystem::directory_iterator(directory))
+        {
+            if(entry.path().extension() == ".lox")
+            {
+                names.push_back(entry.path().stem().string());
+            }
+        }
+
+        std::ranges::sort(names);
+    }
+
+    std::vector<std::string> results;
+    auto failed = false;
+
+    for(const auto& name : names)
+    {
+        auto script = (directory / (name + ".lox")).string();
+        std::vector<Run> measured;
+
+        for(int i = 0; i < runs; ++i)
+        {
+            auto run = run_once(interpreter, script);
+
+            if(!run)
+            {
+                break;
+            }
+
+            measured.push_back(*run);
+        }
+
+        if(measured.size() != static_cast<size_t>(runs))
+        {
+            std::println(stderr, "{}: failed", name);
+            failed = true;
+            continue;
+        }
+
+        results.push_back(to_json(name, measured));
+        std::println(stderr, "{}: {:.3f} ms", name, get_median(results.back(), "wall_ms").value());
+    }
+
+    std::ostringstream json;
+    json << "[\n";
+
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        json << "  " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+
+    json << "]\n";
+
+    if(output)
+    {
+        std::ofstream{*output} << json.str();
+    }
+    else
+    {
+        std::print("{}", json.str());
+    }
+
+    if(!baseline)
+    {
+        return failed ? 1 : 0;
+    }
+
+    switch(compare(results, *baseline, threshold))
+    {
+    case Comparison::Passed:
+        break;
+    case Comparison::Regressed:
+        failed = true;
+        break;
+    case Comparison::NoBaseline:
+        if(!write_baseline)
+        {
+            std::println(stderr, "Missing or unreadable baseline: {}", *baseline);
+            return 2;
+        }
+
+        if(std::ofstream file{*baseline}; !(file << json.str()))
+        {
+            std::println(stderr, "Could not write baseline: {}", *baseline);
+            return 2;
+        }
+
+        std::println(stderr, "Wrote new baseline: {}", *baseline);
+        break;
+    }
+
+    return failed ? 1 : 0;
+}
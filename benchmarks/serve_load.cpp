@@ -0,0 +1,114 @@
+// Load generator for `interpreter --serve`. Sends the same script from several concurrent clients
+// and reports throughput and request latency percentiles.
+//
+// Usage: serve_load <socket> <script> [-c concurrency] [-n requests]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <print>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "harness.h"
+#include "server.h"
+
+namespace
+{
+
+std::string read_file(const std::string& filename)
+{
+    std::ifstream ifs(filename);
+
+    if(ifs.fail())
+    {
+        throw std::runtime_error{"Failed to read file"};
+    }
+
+    std::stringstream buf;
+
+    buf << ifs.rdbuf();
+
+    return buf.str();
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc,
+                    argv,
+                    "serve_load <socket> <script> [-c concurrency] [-n requests]",
+                    {"-c", "-n"},
+                    2};
+    auto socket_path = options.get_positional(0);
+    const auto source = read_file(std::string{options.get_positional(1)});
+    auto concurrency = options.get_count("-c", 8);
+    auto requests = options.get_count("-n", 10000);
+
+    // Script output is discarded so that only the server is measured.
+    auto null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    std::atomic<int> next_request = 0;
+    std::atomic<int> failures = 0;
+    std::vector<std::vector<double>> latencies(concurrency);
+
+    auto elapsed = measure([&] {
+        std::vector<std::jthread> clients;
+
+        for(int c = 0; c < concurrency; ++c)
+        {
+            clients.emplace_back([&, c] {
+                while(next_request++ < requests)
+                {
+                    auto latency = measure<std::chrono::duration<double, std::milli>>([&] {
+                        auto status = lox::Server::request(socket_path, source, null_fd, null_fd);
+
+                        if(!status || status.value() != 0)
+                        {
+                            ++failures;
+                        }
+                    });
+
+                    latencies[c].push_back(latency.count());
+                }
+            });
+        }
+    });
+
+    std::vector<double> all;
+
+    for(auto& client_latencies : latencies)
+    {
+        all.insert(all.end(), client_latencies.begin(), client_latencies.end());
+    }
+
+    if(all.empty())
+    {
+        return 0;
+    }
+
+    std::ranges::sort(all);
+
+    std::println("requests:    {} ({} failed)", all.size(), failures.load());
+    std::println("concurrency: {}", concurrency);
+    std::println("throughput:  {:.1f} req/s", all.size() / elapsed.count());
+    std::println("latency ms:  p50 {:.3f}  p90 {:.3f}  p99 {:.3f}  max {:.3f}",
+                 percentile(all, 0.50),
+                 percentile(all, 0.90),
+                 percentile(all, 0.99),
+                 all.back());
+
+    return failures > 0 ? 1 : 0;
+}
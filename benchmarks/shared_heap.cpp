@@ -0,0 +1,92 @@
+// Splits a fixed amount of allocation-heavy work between increasing numbers of threads sharing one
+// heap, each of which also reads a tree built by the main thread, and reports the throughput.
+//
+// Usage: shared_heap [-n objects] [-d depth]
+
+#include <chrono>
+#include <format>
+#include <print>
+#include <string>
+#include <string_view>
+
+#include "harness.h"
+#include "isolate.h"
+#include "shared_heap.h"
+
+namespace
+{
+
+// Every thread builds short lived lists and instances, and walks the shared tree now and then.
+std::string make_source(int objects, int depth, unsigned threads)
+{
+    return std::format(R"(
+class Node {{
+    init(left, right) {{
+        this.left = left;
+        this.right = right;
+    }}
+}}
+
+fun build(d) {{
+    if(d == 0) return nil;
+    return Node(build(d - 1), build(d - 1));
+}}
+
+fun count(node) {{
+    if(node == nil) return 0;
+    return 1 + count(node.left) + count(node.right);
+}}
+
+var tree = build({});
+
+fun work(n) {{
+    var seen = 0;
+    var until_walk = 0;
+    for(var i = 0; i < n; i = i + 1) {{
+        var garbage = [i, Node(nil, nil), i + 1];
+        until_walk = until_walk - 1;
+        if(until_walk < 0) {{
+            seen = seen + count(tree);
+            until_walk = 1000;
+        }}
+    }}
+    return seen;
+}}
+
+var threads = nil;
+for(var t = 0; t < {}; t = t + 1) {{
+    threads = [threads, thread(work, {})];
+}}
+while(threads != nil) {{
+    join(threads[1]);
+    threads = threads[0];
+}}
+)",
+                       depth,
+                       threads,
+                       objects / threads);
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "shared_heap [-n objects] [-d depth]", {"-n", "-d"}};
+    auto objects = options.get_count("-n", 400'000);
+    auto depth = options.get_count("-d", 10);
+
+    std::println("{:>7} {:>10} {:>14}", "threads", "ms", "iterations/s");
+
+    for(unsigned threads : {1, 2, 4, 8})
+    {
+        auto program = check(lox::Program::compile(make_source(objects, depth, threads)));
+
+        auto elapsed = measure<std::chrono::duration<double, std::milli>>(
+            [&] { check(lox::SharedHeap{program}.run() == lox::InterpretResult::OK); });
+
+        std::println("{:>7} {:>10.1f} {:>14.0f}",
+                     threads,
+                     elapsed.count(),
+                     objects / (elapsed.count() / 1000));
+    }
+}
@@ -0,0 +1,148 @@
+// Interns strings from increasing numbers of threads, mostly looking up names which are already
+// there, into a StringTable and into a map behind a mutex as interning used to be, and reports
+// the throughput of each. Then compiles the same program on every thread and reports how many
+// strings the common table ended up with.
+//
+// Usage: string_intern [-n lookups] [-k names]
+
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <print>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "harness.h"
+#include "isolate.h"
+#include "object.h"
+#include "string_table.h"
+
+namespace
+{
+
+// Looks up every name in turn, interning the ones which are missing, and returns how many were.
+template <typename Intern>
+size_t intern_all(const std::vector<std::string>& names,
+                  int lookups,
+                  unsigned thread,
+                  Intern intern)
+{
+    size_t created = 0;
+
+    for(int i = 0; i < lookups; ++i)
+    {
+        created += intern(names[(i * 7919 + thread * 104729) % names.size()]);
+    }
+
+    return created;
+}
+
+template <typename Intern>
+double run_threads(unsigned threads, Intern intern)
+{
+    return measure([threads, &intern] {
+               std::vector<std::jthread> workers;
+
+               for(unsigned t = 0; t < threads; ++t)
+               {
+                   workers.emplace_back([&intern, t] { intern(t); });
+               }
+           })
+        .count();
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options{argc, argv, "string_intern [-n lookups] [-k names]", {"-n", "-k"}};
+    auto lookups = options.get_count("-n", 2'000'000);
+    auto count = options.get_count("-k", 4096);
+
+    std::vector<std::string> names;
+
+    for(int i = 0; i < count; ++i)
+    {
+        names.push_back(std::format("identifier_{}", i));
+    }
+
+    std::println("{:>7} {:>16} {:>16}", "threads", "table lookups/s", "mutex lookups/s");
+
+    for(unsigned threads : {1, 2, 4, 8})
+    {
+        std::vector<std::unique_ptr<lox::StringObject>> strings(threads * names.size());
+        std::atomic<size_t> next = 0;
+
+        auto make = [&](std::string_view name) {
+            auto& slot = strings[next.fetch_add(1)];
+            slot = std::make_unique<lox::StringObject>(name);
+            return slot.get();
+        };
+
+        lox::StringTable table;
+
+        auto table_time = run_threads(threads, [&](unsigned t) {
+            intern_all(names, lookups, t, [&](const std::string& name) {
+                if(table.find(name))
+                {
+                    return 0;
+                }
+
+                table.insert(make(name));
+                return 1;
+            });
+        });
+
+        next = 0;
+
+        std::mutex mutex;
+        lox::HashMap<lox::StringObject*> map;
+
+        auto mutex_time = run_threads(threads, [&](unsigned t) {
+            intern_all(names, lookups, t, [&](const std::string& name) {
+                std::scoped_lock lock{mutex};
+
+                if(map.contains(name))
+                {
+                    return 0;
+                }
+
+                auto* string = make(name);
+                map[string->value()] = string;
+                return 1;
+            });
+        });
+
+        std::println("{:>7} {:>16.0f} {:>16.0f}",
+                     threads,
+                     threads * lookups / table_time,
+                     threads * lookups / mutex_time);
+    }
+
+    // Every thread compiles the same names, which the common table holds once.
+    auto before = lox::StringTable::get_common().size();
+    std::string source;
+
+    for(int i = 0; i < 50; ++i)
+    {
+        source += std::format(
+            "var global_{0} = {0}; fun function_{0}(a) {{ return a.field_{0}; }}\n", i);
+    }
+
+    {
+        std::vector<std::jthread> compilers;
+
+        for(unsigned t = 0; t < 8; ++t)
+        {
+            compilers.emplace_back([&source] { lox::Program::compile(source); });
+        }
+    }
+
+    std::println("8 programs using the same 150 names added {} common strings",
+                 lox::StringTable::get_common().size() - before);
+}
@@ -0,0 +1,214 @@
+#include "alloc_profiler.h"
+
+#include <algorithm>
+#include <format>
+#include <print>
+#include <ranges>
+
+#include "object.h"
+#include "stack.h"
+#include "vm.h"
+
+namespace lox
+{
+
+AllocationProfiler::AllocationProfiler(VM& vm, ObjectAllocator& allocator, size_t sample_interval)
+    : _vm(vm)
+    , _allocator(allocator)
+    , _sample_interval(sample_interval)
+{ }
+
+AllocationProfiler::~AllocationProfiler()
+{
+    stop();
+}
+
+void AllocationProfiler::start()
+{
+    _started = true;
+    _allocator.set_allocation_profiler(this);
+}
+
+void AllocationProfiler::stop()
+{
+    if(std::exchange(_started, false))
+    {
+        _allocator.set_allocation_profiler(nullptr);
+    }
+}
+
+std::string AllocationProfiler::_get_location() const
+{
+    const auto& callstack = _vm.get_callstack();
+
+    // Such as compiling, or loading a snapshot.
+    if(callstack.size() == 0)
+    {
+        return "(outside scripts)";
+    }
+
+    const auto& frame = callstack.top();
+    const auto& function = frame.closure->function;
+    auto offset = frame.ip - function.chunk.get_code();
+
+    return std::format("{}:{}",
+                       function.name.empty() ? "script" : function.name,
+                       function.chunk.get_line(offset > 0 ? offset - 1 : 0));
+}
+
+void AllocationProfiler::allocated(Object* object, size_t size)
+{
+    _unsampled += size;
+
+    if(_unsampled < _sample_interval)
+    {
+        return;
+    }
+
+    auto bytes = static_cast<double>(std::exchange(_unsampled, 0));
+    auto key = std::pair{_get_location(), get_kind_name(*object)};
+    auto [it, inserted] = _site_indices.try_emplace(key, _sites.size());
+
+    if(inserted)
+    {
+        _sites.push_back({.location = std::move(key.first), .kind = key.second});
+    }
+
+    auto& site = _sites[it->second];
+    auto objects = bytes / size;
+
+    site.bytes += bytes;
+    site.objects += objects;
+
+    _sampled[object] = {.site = it->second, .bytes = bytes, .objects = objects};
+}
+
+void AllocationProfiler::freed(Object* object)
+{
+    _sampled.erase(object);
+}
+
+void AllocationProfiler::collected()
+{
+    // Whatever was sampled and not freed survived this collection.
+    Collection collection;
+
+    for(auto& site : _sites)
+    {
+        site.live_bytes = 0;
+    }
+
+    for(const auto& [object, sampled] : _sampled)
+    {
+        _sites[sampled.site].live_bytes += sampled.bytes;
+        collection.live_bytes += sampled.bytes;
+        collection.live_objects += sampled.objects;
+    }
+
+    for(size_t i = 0; i < _sites.size(); ++i)
+    {
+        auto& site = _sites[i];
+        site.peak_live_bytes = std::max(site.peak_live_bytes, site.live_bytes);
+
+        if(site.live_bytes > 0
+           && (!collection.top_site || site.live_bytes > _sites[*collection.top_site].live_bytes))
+        {
+            collection.top_site = i;
+        }
+    }
+
+    _collections.push_back(collection);
+}
+
+void AllocationProfiler::write_report(std::FILE* file, size_t top) const
+{
+    double total = 0;
+
+    for(const auto& site : _sites)
+    {
+        total += site.bytes;
+    }
+
+    std::println(file,
+                 "{:.0f} bytes allocated, sampled every {} bytes, {} collections",
+                 total,
+                 _sample_interval,
+                 _collections.size());
+
+    auto write_sites = [&](std::string_view title, auto order) {
+        std::vector<const Site*> sorted;
+
+        for(const auto& site : _sites)
+        {
+            sorted.push_back(&site);
+        }
+
+        std::ranges::sort(sorted, [&order](const Site* a, const Site* b) {
+            return order(*a) > order(*b);
+        });
+
+        std::println(file,
+                     "\n{:<40} {:<14} {:>12} {:>14} {:>14} {:>14}",
+                     title,
+                     "kind",
+                     "objects",
+                     "bytes",
+                     "live bytes",
+                     "peak live");
+
+        for(const auto* site : sorted | std::views::take(top))
+        {
+            if(order(*site) == 0)
+            {
+                break;
+            }
+
+            std::println(file,
+                         "{:<40} {:<14} {:>12.0f} {:>14.0f} {:>14.0f} {:>14.0f}",
+                         site->location,
+                         site->kind,
+                         site->objects,
+                         site->bytes,
+                         site->live_bytes,
+                         site->peak_live_bytes);
+        }
+    };
+
+    write_sites("Allocated by", [](const Site& site) { return site.bytes; });
+    write_sites("Surviving the last collection", [](const Site& site) { return site.live_bytes; });
+
+    if(_collections.empty())
+    {
+        return;
+    }
+
+    std::println(file,
+                 "\n{:<12} {:>14} {:>14}  {}",
+                 "Collection",
+                 "live objects",
+                 "live bytes",
+                 "most from");
+
+    auto first = _collections.size() - std::min(_collections.size(), top);
+
+    for(auto i = first; i < _collections.size(); ++i)
+    {
+        const auto& collection = _collections[i];
+        std::string most_from = "-";
+
+        if(collection.top_site)
+        {
+            const auto& site = _sites[*collection.top_site];
+            most_from = std::format("{} ({})", site.location, site.kind);
+        }
+
+        std::println(file,
+                     "{:<12} {:>14.0f} {:>14.0f}  {}",
+                     i + 1,
+                     collection.live_objects,
+                     collection.live_bytes,
+                     most_from);
+    }
+}
+
+} // namespace lox
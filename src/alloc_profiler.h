@@ -0,0 +1,96 @@
+#ifndef LOX_ALLOC_PROFILER_H
+#define LOX_ALLOC_PROFILER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+
+namespace lox
+{
+
+class Object;
+class ObjectAllocator;
+class VM;
+
+// Attributes what a heap allocates to the function and line of the script allocating it, and
+// follows the objects it sampled through collections to report which code allocates the objects
+// which survive them.
+//
+// Allocations are sampled once for every so many bytes allocated, and each sampled object stands
+// for every byte allocated since the one before it, so the totals are estimates which need not
+// look at most allocations. Threads sharing a heap are not followed.
+class AllocationProfiler
+{
+public:
+    // Samples an allocation every time the bytes allocated since the last one reach the interval.
+    AllocationProfiler(VM&, ObjectAllocator&, size_t sample_interval);
+    ~AllocationProfiler();
+
+    AllocationProfiler(const AllocationProfiler&) = delete;
+    AllocationProfiler& operator=(const AllocationProfiler&) = delete;
+
+    void start();
+    void stop();
+
+    // Called by the heap while the profiler is started.
+    void allocated(Object*, size_t size);
+    void freed(Object*);
+    void collected();
+
+    // Writes the sites which allocated the most and those whose objects survived the last
+    // collection, followed by what survived each of the most recent collections.
+    void write_report(std::FILE*, size_t top) const;
+
+private:
+    struct Site
+    {
+        std::string location;
+        std::string_view kind;
+        // Estimated from the samples.
+        double objects = 0;
+        double bytes = 0;
+        double live_bytes = 0;
+        double peak_live_bytes = 0;
+    };
+
+    struct Sampled
+    {
+        size_t site;
+        // The bytes, and the objects, the sample stands for.
+        double bytes;
+        double objects;
+    };
+
+    struct Collection
+    {
+        double live_bytes = 0;
+        double live_objects = 0;
+        // The site which the most surviving bytes came from, if any survived.
+        std::optional<size_t> top_site;
+    };
+
+    VM& _vm;
+    ObjectAllocator& _allocator;
+    size_t _sample_interval;
+    size_t _unsampled = 0;
+    bool _started = false;
+
+    std::vector<Site> _sites;
+    absl::flat_hash_map<std::pair<std::string, std::string_view>, size_t> _site_indices;
+    absl::flat_hash_map<const Object*, Sampled> _sampled;
+    std::vector<Collection> _collections;
+
+    // The function and line of the frame running now.
+    std::string _get_location() const;
+};
+
+} // namespace lox
+
+#endif // LOX_ALLOC_PROFILER_H
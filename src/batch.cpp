@@ -0,0 +1,277 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <sstream>
+#include <thread>
+
+#include "absl/container/flat_hash_map.h"
+#include "isolate.h"
+
+namespace lox
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Exit status for scripts which could not be read, following sysexits.h.
+constexpr int NO_INPUT = 66;
+
+struct CompiledScript
+{
+    std::shared_ptr<const Program> program;
+    int status = 0;
+    // What compiling reported, written out with the result of every run of the script.
+    std::string errors;
+};
+
+std::optional<std::string> read_file(const std::string& path)
+{
+    std::ifstream ifs(path);
+
+    if(ifs.fail())
+    {
+        return std::nullopt;
+    }
+
+    std::stringstream buf;
+
+    buf << ifs.rdbuf();
+
+    return buf.str();
+}
+
+// Collects everything written to a FILE in memory.
+class OutputBuffer
+{
+    char* _data = nullptr;
+    size_t _size = 0;
+    std::FILE* _file;
+
+public:
+    OutputBuffer()
+        : _file(::open_memstream(&_data, &_size))
+    { }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    std::FILE* get()
+    {
+        return _file;
+    }
+
+    std::string take()
+    {
+        std::fclose(_file);
+        _file = nullptr;
+
+        return std::string(_data, _size);
+    }
+
+    ~OutputBuffer()
+    {
+        if(_file)
+        {
+            std::fclose(_file);
+        }
+
+        std::free(_data);
+    }
+};
+
+CompiledScript compile_script(const std::string& path)
+{
+    auto source = read_file(path);
+
+    if(!source)
+    {
+        return {.status = NO_INPUT, .errors = "Failed to read file\n"};
+    }
+
+    OutputBuffer errors;
+    auto* previous = get_diagnostics();
+
+    set_diagnostics(errors.get());
+    auto program = Program::compile(*source, std::filesystem::path{path}.parent_path());
+    set_diagnostics(previous);
+
+    if(!program)
+    {
+        return {.status = exit_status(program.error()), .errors = errors.take()};
+    }
+
+    return {.program = std::move(program.value()), .errors = errors.take()};
+}
+
+Batch::Result run_script(const CompiledScript& script)
+{
+    Batch::Result result{.status = script.status, .errors = script.errors};
+
+    if(!script.program)
+    {
+        return result;
+    }
+
+    OutputBuffer output;
+    OutputBuffer errors;
+
+    auto start = Clock::now();
+
+    {
+        Isolate isolate{script.program};
+        isolate.get_vm().set_output(output.get(), errors.get());
+
+        result.status = exit_status(isolate.run());
+        result.peak_heap = isolate.get_allocator().get_peak_bytes_allocated();
+    }
+
+    result.wall_time = Clock::now() - start;
+    result.output = output.take();
+    result.errors += errors.take();
+
+    return result;
+}
+
+} // namespace
+
+Batch::Batch(std::vector<std::string> scripts)
+    : _scripts(std::move(scripts))
+{ }
+
+std::expected<Batch, Batch::Error> Batch::from_manifest(std::string_view path)
+{
+    std::ifstream ifs{std::string{path}};
+
+    if(ifs.fail())
+    {
+        return std::unexpected(Error::ManifestUnreadable);
+    }
+
+    std::vector<std::string> scripts;
+
+    for(std::string line; std::getline(ifs, line);)
+    {
+        if(!line.empty() && !line.starts_with('#'))
+        {
+            scripts.push_back(std::move(line));
+        }
+    }
+
+    return Batch{std::move(scripts)};
+}
+
+size_t Batch::run(unsigned jobs)
+{
+    jobs = std::max(jobs, 1u);
+
+    // Scripts listed more than once share a single compilation.
+    absl::flat_hash_map<std::string_view, size_t> unique_index;
+    std::vector<std::string_view> unique;
+    std::vector<size_t> script_index;
+
+    for(const auto& path : _scripts)
+    {
+        auto [it, inserted] = unique_index.try_emplace(path, unique.size());
+
+        if(inserted)
+        {
+            unique.push_back(path);
+        }
+
+        script_index.push_back(it->second);
+    }
+
+    std::vector<CompiledScript> compiled(unique.size());
+
+    {
+        std::atomic<size_t> next = 0;
+        std::vector<std::jthread> workers;
+
+        for(unsigned i = 0; i < jobs; ++i)
+        {
+            workers.emplace_back([&] {
+                for(size_t index; (index = next++) < unique.size();)
+                {
+                    compiled[index] = compile_script(std::string{unique[index]});
+                }
+            });
+        }
+    }
+
+    // Workers hand results to this thread, which writes them out as soon as every earlier script
+    // has been written.
+    std::vector<std::optional<Result>> results(_scripts.size());
+    std::mutex results_mutex;
+    std::condition_variable result_ready;
+    std::atomic<size_t> next = 0;
+    size_t failures = 0;
+
+    std::vector<std::jthread> workers;
+
+    for(unsigned i = 0; i < jobs; ++i)
+    {
+        workers.emplace_back([&] {
+            for(size_t index; (index = next++) < _scripts.size();)
+            {
+                auto result = run_script(compiled[script_index[index]]);
+
+                std::lock_guard lock{results_mutex};
+                results[index] = std::move(result);
+                result_ready.notify_one();
+            }
+        });
+    }
+
+    for(size_t index = 0; index < _scripts.size(); ++index)
+    {
+        Result result;
+
+        {
+            std::unique_lock lock{results_mutex};
+            result_ready.wait(lock, [&] { return results[index].has_value(); });
+            result = std::move(*results[index]);
+            results[index].reset();
+        }
+
+        std::fwrite(result.output.data(), 1, result.output.size(), stdout);
+        std::fflush(stdout);
+        std::fwrite(result.errors.data(), 1, result.errors.size(), stderr);
+        std::println(stderr,
+                     "[batch] {}: exit {}, {:.3f} ms, peak heap {} bytes",
+                     _scripts[index],
+                     result.status,
+                     result.wall_time.count(),
+                     result.peak_heap);
+
+        if(result.status != 0)
+        {
+            ++failures;
+        }
+    }
+
+    std::println(stderr, "[batch] {} scripts, {} failed", _scripts.size(), failures);
+
+    return failures;
+}
+
+std::string_view Batch::get_error_message(Error error)
+{
+    switch(error)
+    {
+    case Error::ManifestUnreadable:
+        return "Failed to read manifest";
+    }
+}
+
+} // namespace lox
@@ -0,0 +1,53 @@
+#ifndef LOX_BATCH_H
+#define LOX_BATCH_H
+
+#include <chrono>
+#include <cstddef>
+#include <expected>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace lox
+{
+
+// Runs many scripts concurrently on a pool of threads.
+//
+// Every distinct script is compiled once into a Program, and every run gets a fresh Isolate on top
+// of it, so runs never observe each other. What a script prints, and the errors compiling or
+// running it reports, are buffered and written out in the order the scripts were given, each
+// followed by a report line on stderr.
+class Batch
+{
+public:
+    enum class Error
+    {
+        ManifestUnreadable
+    };
+
+    struct Result
+    {
+        int status = 0;
+        std::chrono::duration<double, std::milli> wall_time{};
+        size_t peak_heap = 0;
+        std::string output;
+        std::string errors;
+    };
+
+    explicit Batch(std::vector<std::string> scripts);
+
+    // Reads one script path per line, skipping blank lines and lines starting with '#'.
+    static std::expected<Batch, Error> from_manifest(std::string_view path);
+
+    // Runs every script on the given number of threads, returning how many of them failed.
+    size_t run(unsigned jobs);
+
+    static std::string_view get_error_message(Error);
+
+private:
+    std::vector<std::string> _scripts;
+};
+
+} // namespace lox
+
+#endif // LOX_BATCH_H
@@ -0,0 +1,382 @@
+#ifndef LOX_BIND_H
+#define LOX_BIND_H
+
+#include <cmath>
+#include <concepts>
+#include <cstddef>
+#include <expected>
+#include <format>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+namespace lox
+{
+
+// Natives written as plain C++ functions. VM::bind() generates a NativeFn for such a function at
+// compile time, which checks the number and types of the arguments, converts them, calls the
+// function and converts its result back, without allocating on the way.
+//
+// Parameters may be double or other arithmetic types, bool, std::string_view (borrowed from the
+// string for the duration of the call), std::span<const Value> (the elements of a list, which the
+// native must not keep), Value, or a pointer to a kind of object such as ListObject*. A first
+// parameter of type VM& receives the calling VM, through which natives allocate or call back into
+// scripts.
+//
+// Results may be void, arithmetic types, bool, strings, which are interned, Value, pointers to
+// objects, std::optional of any of these, where nothing becomes nil, or std::expected of any of
+// these with a message to raise as the error.
+namespace binding
+{
+
+template <typename T>
+struct Parameter;
+
+template <>
+struct Parameter<double>
+{
+    static constexpr std::string_view DESCRIPTION = "a number";
+
+    static std::optional<double> get(Value value)
+    {
+        return value.is_number() ? std::optional{value.as_number()} : std::nullopt;
+    }
+};
+
+// Other arithmetic types, for which a number must be in range, and whole for integral types.
+template <typename T>
+    requires std::is_arithmetic_v<T> && (!std::same_as<T, bool>) && (!std::same_as<T, double>)
+struct Parameter<T>
+{
+    static constexpr std::string_view DESCRIPTION =
+        std::is_integral_v<T> ? "an integer" : "a number";
+
+    static std::optional<T> get(Value value)
+    {
+        if(!value.is_number())
+        {
+            return std::nullopt;
+        }
+
+        auto number = value.as_number();
+
+        if constexpr(std::is_integral_v<T>)
+        {
+            // One past the largest value, which unlike the largest itself is a power of two and so
+            // exactly a double.
+            constexpr auto END = 2.0 * static_cast<double>(std::numeric_limits<T>::max() / 2 + 1);
+
+            if(!(number >= static_cast<double>(std::numeric_limits<T>::min()) && number < END)
+               || number != std::trunc(number))
+            {
+                return std::nullopt;
+            }
+        }
+
+        return static_cast<T>(number);
+    }
+};
+
+template <>
+struct Parameter<bool>
+{
+    static constexpr std::string_view DESCRIPTION = "a boolean";
+
+    static std::optional<bool> get(Value value)
+    {
+        return value.is_bool() ? std::optional{value.as_bool()} : std::nullopt;
+    }
+};
+
+template <>
+struct Parameter<std::string_view>
+{
+    static constexpr std::string_view DESCRIPTION = "a string";
+
+    static std::optional<std::string_view> get(Value value)
+    {
+        auto* string = value.is_object() ? value.as_object()->as<StringObject>() : nullptr;
+        return string ? std::optional<std::string_view>{string->value()} : std::nullopt;
+    }
+};
+
+template <>
+struct Parameter<std::span<const Value>>
+{
+    static constexpr std::string_view DESCRIPTION = "a list";
+
+    static std::optional<std::span<const Value>> get(Value value)
+    {
+        auto* list = value.is_object() ? value.as_object()->as<ListObject>() : nullptr;
+        return list ? std::optional<std::span<const Value>>{list->elements} : std::nullopt;
+    }
+};
+
+template <>
+struct Parameter<Value>
+{
+    static constexpr std::string_view DESCRIPTION = "a value";
+
+    static std::optional<Value> get(Value value)
+    {
+        return value;
+    }
+};
+
+template <typename T>
+    requires std::derived_from<T, Object>
+struct Parameter<T*>
+{
+    static constexpr std::string_view DESCRIPTION =
+        std::same_as<T, ListObject>     ? "a list"
+        : std::same_as<T, StringObject> ? "a string"
+                                        : "an object of the right kind";
+
+    static std::optional<T*> get(Value value)
+    {
+        auto* object = value.is_object() ? value.as_object()->as<T>() : nullptr;
+        return object ? std::optional{object} : std::nullopt;
+    }
+};
+
+template <typename T>
+Value to_value(VM& vm, T&& result)
+{
+    using R = std::remove_cvref_t<T>;
+
+    if constexpr(std::same_as<R, Value>)
+    {
+        return result;
+    }
+    else if constexpr(std::same_as<R, bool>)
+    {
+        return Value{result};
+    }
+    else if constexpr(std::is_arithmetic_v<R>)
+    {
+        return Value{static_cast<double>(result)};
+    }
+    else if constexpr(std::convertible_to<T, std::string_view>)
+    {
+        // Collecting is fine, as the last object allocated is kept alive until it is on the stack.
+        return Value{vm.get_allocator().allocate_string(std::string_view{result})};
+    }
+    else if constexpr(std::is_pointer_v<R> && std::derived_from<std::remove_pointer_t<R>, Object>)
+    {
+        return result ? Value{static_cast<Object*>(result)} : Value{};
+    }
+    else
+    {
+        static_assert(!sizeof(R), "Natives cannot return this type");
+    }
+}
+
+template <typename T>
+struct Result
+{
+    template <typename Call>
+    static Value get(VM& vm, Call&& call)
+    {
+        return to_value(vm, call());
+    }
+};
+
+template <>
+struct Result<void>
+{
+    template <typename Call>
+    static Value get(VM&, Call&& call)
+    {
+        call();
+        return Value{};
+    }
+};
+
+template <typename T>
+struct Result<std::optional<T>>
+{
+    template <typename Call>
+    static Value get(VM& vm, Call&& call)
+    {
+        auto result = call();
+        return result ? to_value(vm, *std::move(result)) : Value{};
+    }
+};
+
+template <typename T, typename E>
+struct Result<std::expected<T, E>>
+{
+    template <typename Call>
+    static Value get(VM& vm, Call&& call)
+    {
+        auto result = call();
+
+        if(!result)
+        {
+            vm.raise(std::string{std::move(result).error()});
+            return Value{};
+        }
+
+        if constexpr(std::is_void_v<T>)
+        {
+            return Value{};
+        }
+        else
+        {
+            return to_value(vm, *std::move(result));
+        }
+    }
+};
+
+// The parameters of a function, less the VM it may take first, and its result.
+template <typename R, typename... Args>
+struct Signature
+{
+    using Return = R;
+    using Parameters = std::tuple<Args...>;
+    static constexpr bool TAKES_VM = false;
+};
+
+template <typename R, typename... Args>
+struct Signature<R, VM&, Args...> : Signature<R, Args...>
+{
+    static constexpr bool TAKES_VM = true;
+};
+
+// The signature of a method of a host object, whose first parameter after the VM is the receiver.
+template <typename Signature, typename Parameters = typename Signature::Parameters>
+struct MethodSignature;
+
+template <typename Signature, typename Self, typename... Args>
+struct MethodSignature<Signature, std::tuple<Self, Args...>> : Signature
+{
+    using Receiver = Self;
+    using Parameters = std::tuple<Args...>;
+};
+
+template <typename F>
+struct SignatureOf : SignatureOf<decltype(&F::operator())>
+{ };
+
+template <typename R, typename... Args>
+struct SignatureOf<R (*)(Args...)> : Signature<R, Args...>
+{ };
+
+template <typename R, typename... Args>
+struct SignatureOf<R (*)(Args...) noexcept> : Signature<R, Args...>
+{ };
+
+template <typename C, typename R, typename... Args>
+struct SignatureOf<R (C::*)(Args...) const> : Signature<R, Args...>
+{ };
+
+template <typename C, typename R, typename... Args>
+struct SignatureOf<R (C::*)(Args...) const noexcept> : Signature<R, Args...>
+{ };
+
+// Calls a function given as a template argument, so that it needs no storage.
+template <auto function>
+struct Constant
+{
+    template <typename... Args>
+    decltype(auto) operator()(Args&&... args) const
+    {
+        return function(std::forward<Args>(args)...);
+    }
+};
+
+template <typename Callable, typename Signature, typename Parameters>
+struct Trampoline;
+
+template <typename Callable, typename Signature, typename... Args>
+struct Trampoline<Callable, Signature, std::tuple<Args...>>
+{
+    static Value call(VM& vm, std::span<Value> args)
+    {
+        return invoke(vm, args);
+    }
+
+    // Passes the receivers, if any, ahead of the arguments.
+    template <typename... Receivers>
+    static Value invoke(VM& vm, std::span<Value> args, Receivers&... receivers)
+    {
+        if(args.size() != sizeof...(Args))
+        {
+            vm.raise(
+                std::format("Expected {} arguments but got {}.", sizeof...(Args), args.size()));
+            return Value{};
+        }
+
+        return _convert(vm, args, std::index_sequence_for<Args...>{}, receivers...);
+    }
+
+private:
+    template <size_t... I, typename... Receivers>
+    static Value _convert(VM& vm,
+                          std::span<Value> args,
+                          std::index_sequence<I...>,
+                          Receivers&... receivers)
+    {
+        std::tuple<std::optional<std::remove_cvref_t<Args>>...> converted{
+            Parameter<std::remove_cvref_t<Args>>::get(args[I])...};
+
+        if(!(std::get<I>(converted) && ...))
+        {
+            // Reports the first argument which did not convert.
+            (void)((std::get<I>(converted)
+                    || (vm.raise(std::format("Expected {} as argument {}.",
+                                             Parameter<std::remove_cvref_t<Args>>::DESCRIPTION,
+                                             I + 1)),
+                        false))
+                   && ...);
+            return Value{};
+        }
+
+        return Result<typename Signature::Return>::get(vm, [&]() -> decltype(auto) {
+            if constexpr(Signature::TAKES_VM)
+            {
+                return Callable{}(vm, receivers..., *std::get<I>(std::move(converted))...);
+            }
+            else
+            {
+                return Callable{}(receivers..., *std::get<I>(std::move(converted))...);
+            }
+        });
+    }
+};
+
+template <typename Callable, typename Signature>
+constexpr NativeFn make_native()
+{
+    return &Trampoline<Callable, Signature, typename Signature::Parameters>::call;
+}
+
+} // namespace binding
+
+template <typename F>
+    requires std::is_empty_v<F> && std::default_initializable<F>
+void VM::bind(std::string_view name, F)
+{
+    define_native(name, binding::make_native<F, binding::SignatureOf<F>>());
+}
+
+template <auto function>
+void VM::bind(std::string_view name)
+{
+    define_native(name,
+                  binding::make_native<binding::Constant<function>,
+                                       binding::SignatureOf<decltype(function)>>());
+}
+
+} // namespace lox
+
+#endif // LOX_BIND_H
@@ -0,0 +1,601 @@
+#include "channel.h"
+
+#include <bit>
+#include <format>
+#include <span>
+#include <utility>
+
+#include "absl/container/flat_hash_map.h"
+#include "string_table.h"
+#include "vm.h"
+
+namespace lox
+{
+
+class Message::Encoder
+{
+    Message& _message;
+    const ObjectAllocator& _heap;
+    absl::flat_hash_map<Object*, uint32_t> _indices;
+    // Lists and instances whose nodes have been created but whose contents are yet to be encoded.
+    std::vector<std::pair<Object*, uint32_t>> _pending;
+
+    // Copies the contents of a list or an instance into its node.
+    bool _encode_contents(Object* object, uint32_t index)
+    {
+        if(auto* list = object->as<ListObject>())
+        {
+            List node;
+            node.elements.reserve(list->elements.size());
+
+            if(!encode_elements(list->elements, &node.elements, node.fixups))
+            {
+                return false;
+            }
+
+            _message._nodes[index] = std::move(node);
+
+            return true;
+        }
+
+        auto* instance = object->as<InstanceObject>();
+        Instance node{.klass = instance->klass.name};
+        node.fields.reserve(instance->fields.size());
+
+        for(auto [name, field] : instance->fields)
+        {
+            if(field.is_object())
+            {
+                auto field_node = encode(field.as_object());
+
+                if(!field_node)
+                {
+                    return false;
+                }
+
+                node.fixups.push_back({.slot = static_cast<uint32_t>(node.fields.size()),
+                                       .node = *field_node});
+                field = Value{};
+            }
+
+            node.fields.emplace_back(name, field);
+        }
+
+        _message._nodes[index] = std::move(node);
+
+        return true;
+    }
+
+public:
+    Encoder(Message& message, const ObjectAllocator& heap)
+        : _message(message)
+        , _heap(heap)
+    { }
+
+    // Returns the index of the node standing for the object.
+    std::optional<uint32_t> encode(Object* object)
+    {
+        if(auto it = _indices.find(object); it != _indices.end())
+        {
+            return it->second;
+        }
+
+        auto index = static_cast<uint32_t>(_message._nodes.size());
+
+        if(auto* string = object->as<StringObject>())
+        {
+            // Common strings are copied by value, since the receiver may have interned its own
+            // copy before the common table had one. Finding the common one does not allocate.
+            if(string->is_shared() && _heap.get_shared()
+               && !StringTable::get_common().contains(string))
+            {
+                _message._heap = _heap.get_shared();
+                _message._nodes.emplace_back(string);
+            }
+            else
+            {
+                _message._nodes.emplace_back(string->value());
+            }
+        }
+        else if(auto* channel = object->as<ChannelObject>())
+        {
+            _message._nodes.emplace_back(channel->channel);
+        }
+        else if(auto* list = object->as<ListObject>())
+        {
+            _message._nodes.emplace_back(List{});
+            _pending.emplace_back(list, index);
+        }
+        else if(auto* instance = object->as<InstanceObject>())
+        {
+            _message._nodes.emplace_back(Instance{});
+            _pending.emplace_back(instance, index);
+        }
+        else
+        {
+            return std::nullopt;
+        }
+
+        _indices[object] = index;
+
+        return index;
+    }
+
+    // Encodes the elements of a list into the given vectors, leaving object slots as they are.
+    bool encode_elements(std::span<const Value> elements,
+                         std::vector<Value>* copy,
+                         std::vector<Fixup>& fixups)
+    {
+        for(uint32_t slot = 0; slot < elements.size(); ++slot)
+        {
+            auto element = elements[slot];
+
+            if(element.is_object())
+            {
+                auto node = encode(element.as_object());
+
+                if(!node)
+                {
+                    return false;
+                }
+
+                fixups.push_back({.slot = slot, .node = *node});
+                element = Value{};
+            }
+
+            if(copy)
+            {
+                copy->push_back(element);
+            }
+        }
+
+        return true;
+    }
+
+    // Encodes the contents of every list and instance reached so far. They are handled from a
+    // worklist rather than recursively so deeply nested ones cannot overflow the stack.
+    bool finish()
+    {
+        while(!_pending.empty())
+        {
+            auto [object, index] = _pending.back();
+            _pending.pop_back();
+
+            // Only one object is locked at a time, so encoding cannot deadlock with other threads.
+            std::unique_lock<ObjectLock> lock;
+
+            if(_heap.is_concurrent())
+            {
+                auto* list = object->as<ListObject>();
+                lock = std::unique_lock{list ? list->lock : object->as<InstanceObject>()->lock};
+            }
+
+            if(!_encode_contents(object, index))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void reserve(Object* object, uint32_t index)
+    {
+        _indices[object] = index;
+    }
+};
+
+std::expected<Message, Message::Error> Message::copy(Value value, const ObjectAllocator& heap)
+{
+    Message message;
+
+    if(!value.is_object())
+    {
+        message._root = value;
+        return message;
+    }
+
+    Encoder encoder{message, heap};
+    message._root_node = encoder.encode(value.as_object());
+
+    if(!message._root_node || !encoder.finish())
+    {
+        return std::unexpected(Error::Unsendable);
+    }
+
+    return message;
+}
+
+std::expected<Message, Message::Error> Message::transfer(ListObject& list,
+                                                         const ObjectAllocator& heap)
+{
+    if(list.is_shared())
+    {
+        return std::unexpected(Error::Shared);
+    }
+
+    Message message;
+    Encoder encoder{message, heap};
+
+    message._nodes.emplace_back(List{});
+    message._root_node = 0;
+    encoder.reserve(&list, 0);
+
+    // The buffer is taken before it is encoded, so that threads sharing the heap only hold the
+    // list's lock briefly, and is put back on failure.
+    List root;
+
+    {
+        std::unique_lock<ObjectLock> lock;
+
+        if(heap.is_concurrent())
+        {
+            lock = std::unique_lock{list.lock};
+        }
+
+        root.elements = std::move(list.elements);
+        list.elements.clear();
+    }
+
+    if(!encoder.encode_elements(root.elements, nullptr, root.fixups) || !encoder.finish())
+    {
+        std::unique_lock<ObjectLock> lock;
+
+        if(heap.is_concurrent())
+        {
+            lock = std::unique_lock{list.lock};
+        }
+
+        list.elements = std::move(root.elements);
+
+        return std::unexpected(Error::Unsendable);
+    }
+
+    for(auto fixup : root.fixups)
+    {
+        root.elements[fixup.slot] = Value{};
+    }
+
+    message._nodes[0] = std::move(root);
+
+    return message;
+}
+
+std::expected<Value, Message::Error> Message::unpack(VM& vm)
+{
+    auto& allocator = vm.get_allocator();
+
+    // Nothing is collected until the root is handed back, so the new objects need no rooting.
+    std::vector<Object*> objects;
+    objects.reserve(_nodes.size());
+
+    for(auto& node : _nodes)
+    {
+        Object* object = nullptr;
+
+        if(auto* string = std::get_if<std::string>(&node))
+        {
+            object = allocator.allocate_string(*string, false);
+        }
+        else if(auto* shared = std::get_if<StringObject*>(&node))
+        {
+            object = allocator.get_shared() == _heap
+                         ? *shared
+                         : allocator.allocate_string((*shared)->value(), false);
+        }
+        else if(auto* channel = std::get_if<std::shared_ptr<Channel>>(&node))
+        {
+            object = allocator.allocate<ChannelObject>(false, std::move(*channel));
+        }
+        else if(auto* list_node = std::get_if<List>(&node))
+        {
+            auto* list = allocator.allocate<ListObject>(false, std::span<Value>{});
+            list->elements = std::move(list_node->elements);
+            object = list;
+        }
+        else
+        {
+            auto& instance_node = std::get<Instance>(node);
+            auto klass = vm.get_global(instance_node.klass);
+            auto* klass_object =
+                klass && klass->is_object() ? klass->as_object()->as<ClassObject>() : nullptr;
+
+            if(!klass_object)
+            {
+                _nodes.clear();
+                _heap.reset();
+
+                return std::unexpected(Error::UnknownClass);
+            }
+
+            auto* instance = allocator.allocate<InstanceObject>(false, *klass_object);
+
+            for(auto [name, field] : instance_node.fields)
+            {
+                // The fields only view their names, so a name which is not in the common table
+                // (being too long, or arriving once it is full) stays pinned to outlive them.
+                auto* key = allocator.allocate_identifier(name);
+
+                if(!key->is_shared())
+                {
+                    allocator.pin(key);
+                }
+
+                instance->fields[key->value()] = field;
+            }
+
+            object = instance;
+        }
+
+        objects.push_back(object);
+    }
+
+    for(uint32_t i = 0; i < _nodes.size(); ++i)
+    {
+        if(auto* node = std::get_if<List>(&_nodes[i]))
+        {
+            auto& elements = static_cast<ListObject*>(objects[i])->elements;
+
+            for(auto fixup : node->fixups)
+            {
+                elements[fixup.slot] = Value{objects[fixup.node]};
+            }
+        }
+        else if(auto* node = std::get_if<Instance>(&_nodes[i]))
+        {
+            auto& fields = static_cast<InstanceObject*>(objects[i])->fields;
+
+            for(auto fixup : node->fixups)
+            {
+                fields.find(node->fields[fixup.slot].first)->second = Value{objects[fixup.node]};
+            }
+        }
+    }
+
+    auto root = _root_node ? Value{objects[*_root_node]} : _root;
+
+    _nodes.clear();
+    _heap.reset();
+
+    return root;
+}
+
+std::string_view Message::get_error_message(Error error)
+{
+    switch(error)
+    {
+    case Error::Unsendable:
+        return "Only nil, booleans, numbers, strings, lists, instances and channels can be sent.";
+    case Error::UnknownClass:
+        return "The class of a received instance is not defined here.";
+    case Error::Shared:
+        return "Lists shared with other threads cannot be transferred; send a copy instead.";
+    }
+}
+
+Channel::Channel(size_t capacity)
+    : _mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1)
+    , _cells(new Cell[_mask + 1])
+{
+    for(size_t i = 0; i <= _mask; ++i)
+    {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool Channel::try_send(Message& message)
+{
+    auto position = _enqueue_position.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    while(true)
+    {
+        cell = &_cells[position & _mask];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+        if(difference == 0)
+        {
+            if(_enqueue_position.compare_exchange_weak(
+                   position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = _enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->message = std::move(message);
+    cell->sequence.store(position + 1, std::memory_order_release);
+
+    return true;
+}
+
+std::optional<Message> Channel::try_receive()
+{
+    auto position = _dequeue_position.load(std::memory_order_relaxed);
+    Cell* cell;
+
+    while(true)
+    {
+        cell = &_cells[position & _mask];
+        auto sequence = cell->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+        if(difference == 0)
+        {
+            if(_dequeue_position.compare_exchange_weak(
+                   position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(difference < 0)
+        {
+            return std::nullopt;
+        }
+        else
+        {
+            position = _dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    auto message = std::move(cell->message);
+    cell->sequence.store(position + _mask + 1, std::memory_order_release);
+
+    return message;
+}
+
+void Channel::send(Message message)
+{
+    while(true)
+    {
+        // Read the counter before trying, so a receive in between makes the wait return at once.
+        auto receives = _receives.load(std::memory_order_acquire);
+
+        if(try_send(message))
+        {
+            _sends.fetch_add(1, std::memory_order_release);
+            _sends.notify_one();
+            return;
+        }
+
+        _receives.wait(receives, std::memory_order_acquire);
+    }
+}
+
+Message Channel::receive()
+{
+    while(true)
+    {
+        auto sends = _sends.load(std::memory_order_acquire);
+
+        if(auto message = try_receive())
+        {
+            _receives.fetch_add(1, std::memory_order_release);
+            _receives.notify_one();
+            return std::move(*message);
+        }
+
+        _sends.wait(sends, std::memory_order_acquire);
+    }
+}
+
+namespace
+{
+
+ChannelObject* as_channel(Value value)
+{
+    return value.is_object() ? value.as_object()->as<ChannelObject>() : nullptr;
+}
+
+Value channel_native(VM& vm, std::span<Value> args)
+{
+    if(args.size() != 1 || !args[0].is_number() || !(args[0].as_number() >= 1)
+       || args[0].as_number() > MAX_CHANNEL_CAPACITY)
+    {
+        vm.raise(std::format("channel() expects a capacity between 1 and {}.",
+                             MAX_CHANNEL_CAPACITY));
+        return Value{};
+    }
+
+    auto channel = std::make_shared<Channel>(static_cast<size_t>(args[0].as_number()));
+
+    return Value{vm.get_allocator().allocate<ChannelObject>(true, std::move(channel))};
+}
+
+Value send_native(VM& vm, std::span<Value> args)
+{
+    auto* channel = args.size() == 2 ? as_channel(args[0]) : nullptr;
+
+    if(!channel)
+    {
+        vm.raise("send() expects a channel and a value.");
+        return Value{};
+    }
+
+    auto message = Message::copy(args[1], vm.get_allocator());
+
+    if(!message)
+    {
+        vm.raise(std::string{Message::get_error_message(message.error())});
+        return Value{};
+    }
+
+    ObjectAllocator::Parked parked{vm.get_allocator()};
+    channel->channel->send(std::move(message.value()));
+
+    return Value{};
+}
+
+Value transfer_native(VM& vm, std::span<Value> args)
+{
+    auto* channel = args.size() == 2 ? as_channel(args[0]) : nullptr;
+    auto* list = channel && args[1].is_object() ? args[1].as_object()->as<ListObject>() : nullptr;
+
+    if(!list)
+    {
+        vm.raise("transfer() expects a channel and a list.");
+        return Value{};
+    }
+
+    auto message = Message::transfer(*list, vm.get_allocator());
+
+    if(!message)
+    {
+        vm.raise(std::string{Message::get_error_message(message.error())});
+        return Value{};
+    }
+
+    ObjectAllocator::Parked parked{vm.get_allocator()};
+    channel->channel->send(std::move(message.value()));
+
+    return Value{};
+}
+
+Value recv_native(VM& vm, std::span<Value> args)
+{
+    auto* channel = args.size() == 1 ? as_channel(args[0]) : nullptr;
+
+    if(!channel)
+    {
+        vm.raise("recv() expects a channel.");
+        return Value{};
+    }
+
+    Message message;
+
+    {
+        ObjectAllocator::Parked parked{vm.get_allocator()};
+        message = channel->channel->receive();
+    }
+
+    auto value = message.unpack(vm);
+
+    if(!value)
+    {
+        vm.raise(std::string{Message::get_error_message(value.error())});
+        return Value{};
+    }
+
+    return *value;
+}
+
+} // namespace
+
+void define_channel_natives(VM& vm)
+{
+    vm.define_native("channel", &channel_native);
+    vm.define_native("send", &send_native);
+    vm.define_native("transfer", &transfer_native);
+    vm.define_native("recv", &recv_native);
+}
+
+} // namespace lox
@@ -0,0 +1,139 @@
+#ifndef LOX_CHANNEL_H
+#define LOX_CHANNEL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <optional>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+namespace lox
+{
+
+class VM;
+
+// A value detached from the heap it was created in, so that it can be handed to another isolate.
+//
+// Numbers, booleans and nil are carried as they are. Strings from a frozen program heap are carried
+// by reference, keeping that heap alive, and are used in place when the receiving isolate shares
+// the same heap; other strings are copied. Lists and instances are copied deeply, preserving
+// aliasing and cycles, except that a transferred list gives up its element buffer to the message
+// instead. Instances carry the name of their class, which the receiver looks up among its globals,
+// so both sides must define the class, as isolates running the same program do. Functions, classes
+// and the other objects which hold code or state of their isolate cannot be sent.
+class Message
+{
+public:
+    enum class Error
+    {
+        Unsendable,
+        UnknownClass,
+        Shared
+    };
+
+    Message() = default;
+
+    static std::expected<Message, Error> copy(Value, const ObjectAllocator& heap);
+
+    // Moves the elements of the list into the message, leaving the list empty. Only the top level
+    // buffer is moved; lists nested in it are copied. Lists of a frozen heap are read by other
+    // threads and cannot be emptied, so they have to be sent as copies.
+    static std::expected<Message, Error> transfer(ListObject&, const ObjectAllocator& heap);
+
+    // Recreates the value in the heap of the VM, resolving the classes of instances against its
+    // globals. The message is left empty.
+    std::expected<Value, Error> unpack(VM&);
+
+    static std::string_view get_error_message(Error);
+
+private:
+    struct Fixup
+    {
+        uint32_t slot;
+        uint32_t node;
+    };
+
+    // Element slots holding objects are left as nil and patched using the fixups.
+    struct List
+    {
+        std::vector<Value> elements;
+        std::vector<Fixup> fixups;
+    };
+
+    // Fields holding objects are patched the same way, the fixups giving their index.
+    struct Instance
+    {
+        std::string klass;
+        std::vector<std::pair<std::string, Value>> fields;
+        std::vector<Fixup> fixups;
+    };
+
+    using Node =
+        std::variant<std::string, StringObject*, std::shared_ptr<Channel>, List, Instance>;
+
+    class Encoder;
+
+    Value _root;
+    std::optional<uint32_t> _root_node;
+    std::vector<Node> _nodes;
+    std::shared_ptr<const ObjectAllocator> _heap;
+};
+
+// A bounded multi-producer multi-consumer queue of messages, after Dmitry Vyukov's design. Every
+// cell carries a sequence number telling producers and consumers whose turn it is, so neither side
+// takes a lock. Blocked senders and receivers sleep on a counter using std::atomic::wait, which
+// is backed by a futex.
+class Channel
+{
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        Message message;
+    };
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+
+    alignas(64) std::atomic<size_t> _enqueue_position = 0;
+    alignas(64) std::atomic<size_t> _dequeue_position = 0;
+
+    // Bumped after every send and receive respectively.
+    alignas(64) std::atomic<uint32_t> _sends = 0;
+    alignas(64) std::atomic<uint32_t> _receives = 0;
+
+public:
+    // The capacity is rounded up to a power of two.
+    explicit Channel(size_t capacity);
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    // Returns false, leaving the message untouched, if the channel is full.
+    bool try_send(Message&);
+    std::optional<Message> try_receive();
+
+    void send(Message);
+    Message receive();
+
+    size_t get_capacity() const
+    {
+        return _mask + 1;
+    }
+};
+
+// The largest capacity channel() accepts.
+constexpr size_t MAX_CHANNEL_CAPACITY = 1 << 20;
+
+// Defines channel(capacity), send(channel, value), transfer(channel, list) and recv(channel).
+void define_channel_natives(VM&);
+
+} // namespace lox
+
+#endif // LOX_CHANNEL_H
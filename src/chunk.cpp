@@ -1,5 +1,6 @@
 #include "chunk.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <print>
 #include <string_view>
@@ -9,6 +10,57 @@
 
 namespace lox
 {
+const char* get_opcode_name(OpCode op)
+{
+    switch(op)
+    {
+#define CASE(x)                                                                                    \
+    case OpCode::x:                                                                                \
+        return #x;
+        CASE(RETURN)
+        CASE(POP)
+        CASE(DEFINE_GLOBAL)
+        CASE(GET_GLOBAL)
+        CASE(SET_GLOBAL)
+        CASE(GET_LOCAL)
+        CASE(SET_LOCAL)
+        CASE(CONSTANT)
+        CASE(NIL)
+        CASE(TRUE)
+        CASE(FALSE)
+        CASE(NOT)
+        CASE(NEGATE)
+        CASE(EQUAL)
+        CASE(GREATER)
+        CASE(LESS)
+        CASE(ADD)
+        CASE(SUBTRACT)
+        CASE(MULTIPLY)
+        CASE(DIVIDE)
+        CASE(JUMP_IF_FALSE)
+        CASE(JUMP_IF_TRUE)
+        CASE(JUMP)
+        CASE(LOOP)
+        CASE(CALL)
+        CASE(CLOSURE)
+        CASE(GET_UPVALUE)
+        CASE(SET_UPVALUE)
+        CASE(CLOSE_UPVALUE)
+        CASE(CLASS)
+        CASE(GET_PROPERTY)
+        CASE(SET_PROPERTY)
+        CASE(METHOD)
+        CASE(INVOKE)
+        CASE(INHERIT)
+        CASE(GET_SUPER)
+        CASE(SUPER_INVOKE)
+        CASE(LIST)
+        CASE(LIST_INDEX)
+        CASE(IMPORT)
+#undef CASE
+    }
+}
+
 namespace
 {
 
@@ -75,20 +127,35 @@ void Chunk::write(OpCode byte, int line)
 
 void Chunk::write(uint8_t byte, int line)
 {
+    if(_lines.empty() || _lines.back().line != line)
+    {
+        _lines.push_back({.offset = static_cast<uint32_t>(_code.size()), .line = line});
+    }
+
     _code.push_back(byte);
-    _lines.push_back(line);
+}
+
+int Chunk::get_line(size_t offset) const
+{
+    // Find the last run starting at or before the offset.
+    auto it = std::ranges::upper_bound(
+        _lines, offset, std::less{}, [](const LineStart& start) { return start.offset; });
+
+    return std::prev(it)->line;
 }
 
 int Chunk::_disassemble_instruction(int offset)
 {
     std::print("{:04d} ", offset);
-    if(offset > 0 && _lines.at(offset) == _lines[offset - 1])
+    auto line = get_line(offset);
+
+    if(offset > 0 && line == get_line(offset - 1))
     {
         std::print("   | ");
     }
     else
     {
-        std::print("{:4d} ", _lines.at(offset));
+        std::print("{:4d} ", line);
     }
 
     auto instruction = static_cast<OpCode>(_code.at(offset));
@@ -108,6 +175,7 @@ int Chunk::_disassemble_instruction(int offset)
         INSTRUCTION(METHOD, _constant_instruction)
         INSTRUCTION(GET_SUPER, _constant_instruction)
         INSTRUCTION(LIST, _constant_instruction)
+        INSTRUCTION(IMPORT, _constant_instruction)
         INSTRUCTION(NEGATE, simple_instruction)
         INSTRUCTION(ADD, simple_instruction)
         INSTRUCTION(SUBTRACT, simple_instruction)
@@ -166,6 +234,7 @@ int Chunk::_disassemble_instruction(int offset)
 int Chunk::add_constant(const Value& value)
 {
     _constants.push_back(value);
+    _property_caches.emplace_back();
     return _constants.size() - 1;
 }
 
@@ -1,8 +1,10 @@
 #ifndef LOX_CHUNK_H
 #define LOX_CHUNK_H
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <span>
 #include <string_view>
 #include <vector>
 
@@ -11,6 +13,8 @@
 namespace lox
 {
 
+struct HostProperty;
+
 enum class OpCode : uint8_t
 {
     RETURN,
@@ -51,14 +55,56 @@ enum class OpCode : uint8_t
     GET_SUPER,
     SUPER_INVOKE,
     LIST,
-    LIST_INDEX
+    LIST_INDEX,
+    IMPORT
 };
 
+inline constexpr size_t OPCODE_COUNT = static_cast<size_t>(OpCode::IMPORT) + 1;
+
+const char* get_opcode_name(OpCode);
+
 class Chunk
 {
+public:
+    // Marks the first byte of a run of bytecode emitted for the same source line. Lines are only
+    // needed for error reporting and disassembly, so a run-length encoded table keeps them out of
+    // the way of the code itself.
+    struct LineStart
+    {
+        uint32_t offset;
+        int line;
+    };
+
+    // The host property last found through a property name constant. Every property access
+    // compiles to its own name constant, so this caches per access, and accesses which keep
+    // finding records of the same class skip looking the name up.
+    class PropertyCache
+    {
+        std::atomic<const HostProperty*> _property = nullptr;
+
+    public:
+        PropertyCache() = default;
+
+        PropertyCache(const PropertyCache& other)
+            : _property(other._property.load(std::memory_order_relaxed))
+        { }
+
+        const HostProperty* get() const
+        {
+            return _property.load(std::memory_order_acquire);
+        }
+
+        void set(const HostProperty* property)
+        {
+            _property.store(property, std::memory_order_release);
+        }
+    };
+
+private:
     std::vector<uint8_t> _code;
     std::vector<Value> _constants;
-    std::vector<int> _lines;
+    std::vector<PropertyCache> _property_caches;
+    std::vector<LineStart> _lines;
 
     int _disassemble_instruction(int offset);
     int _constant_instruction(std::string_view name, int offset) const;
@@ -93,9 +139,16 @@ public:
         return _constants[index];
     };
 
-    int get_line(size_t index) const
+    PropertyCache& get_property_cache(size_t constant)
+    {
+        return _property_caches[constant];
+    }
+
+    int get_line(size_t offset) const;
+
+    std::span<const LineStart> get_lines() const
     {
-        return _lines[index];
+        return _lines;
     }
 
     size_t size() const
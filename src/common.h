@@ -2,6 +2,7 @@
 #define LOX_COMMON_H
 
 #include "absl/container/flat_hash_map.h"
+#include <cstdio>
 #include <stack>
 
 namespace lox
@@ -21,6 +22,20 @@ struct CallFrame
     int offset;
 };
 
+// Where scanning, parsing, compiling and loading modules report errors on the calling thread,
+// stderr unless redirected.
+inline thread_local std::FILE* diagnostics = stderr;
+
+inline std::FILE* get_diagnostics()
+{
+    return diagnostics;
+}
+
+inline void set_diagnostics(std::FILE* file)
+{
+    diagnostics = file;
+}
+
 } // namespace lox
 
 #endif // LOX_COMMON_H
\ No newline at end of file
@@ -1,12 +1,16 @@
 #include "compiler.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <filesystem>
 #include <format>
 #include <limits>
 #include <optional>
 #include <print>
+#include <string>
 #include <string_view>
+#include <system_error>
 #include <sys/stat.h>
 #include <variant>
 #include <vector>
@@ -15,6 +19,7 @@
 #include "object.h"
 #include "parser.h"
 #include "scanner.h"
+#include "tracer.h"
 #include "value.h"
 
 namespace lox
@@ -34,8 +39,9 @@ Compiler::Compiler(ObjectAllocator& allocator, FunctionType type, Compiler* encl
 }
 
 std::expected<FunctionObject*, Compiler::Error>
-Compiler::compile(const std::vector<ASTNodePtr>& declarations)
+Compiler::compile(const std::vector<ASTNodePtr>& declarations, std::filesystem::path directory)
 {
+    _directory = std::move(directory);
     _function = _allocator.allocate<FunctionObject>(false, "", 0);
 
     for(auto& node : declarations)
@@ -47,7 +53,7 @@ Compiler::compile(const std::vector<ASTNodePtr>& declarations)
         catch(const Exception& ex)
         {
             auto msg = _get_error_message(ex);
-            std::println("{}", msg);
+            std::println(get_diagnostics(), "{}", msg);
             return std::unexpected(ex.error);
         }
     }
@@ -77,6 +83,8 @@ FunctionObject* Compiler::_compile_function(std::string_view name,
                                             const std::vector<Token>& params,
                                             const std::vector<ASTNodePtr>& declarations)
 {
+    Tracer::Span span{"compile", name};
+
     _function = _allocator.allocate<FunctionObject>(
         false, std::string{name}, static_cast<uint8_t>(params.size()));
 
@@ -133,6 +141,10 @@ std::string Compiler::_get_error_message(const Exception& ex) const
     case Error::SuperUsedOutsideClass:
         return std::format(
             "Super used outside class: line [{}] at '{}'", ex.token.line, ex.token.lexeme);
+    case Error::InvalidModuleName:
+        return std::format("Module name is not an identifier, import it with 'as': line [{}] at {}",
+                           ex.token.line,
+                           ex.token.lexeme);
     }
 }
 
@@ -225,7 +237,7 @@ void Compiler::operator()(const PropertyExprNode& node)
 {
     std::visit(*this, *node.instance);
 
-    auto name = _make_constant(Value{_allocator.allocate_string(node.name.lexeme, false)});
+    auto name = _make_constant(Value{_allocator.allocate_identifier(node.name.lexeme)});
 
     _emit_bytes(static_cast<uint8_t>(OpCode::GET_PROPERTY), name, node.name.line);
 }
@@ -354,7 +366,7 @@ void Compiler::operator()(const FunDeclNode& node)
 
     if(node.method)
     {
-        auto index = _make_constant(Value{_allocator.allocate_string(node.name.lexeme, false)});
+        auto index = _make_constant(Value{_allocator.allocate_identifier(node.name.lexeme)});
         _emit_bytes(static_cast<uint8_t>(OpCode::METHOD), index, node.name.line);
     }
     else
@@ -368,7 +380,7 @@ void Compiler::operator()(const ClassDeclNode& node)
     auto prev = _current_class;
     _current_class = ClassCompiler{};
 
-    auto constant = _make_constant(Value{_allocator.allocate_string(node.name.lexeme, false)});
+    auto constant = _make_constant(Value{_allocator.allocate_identifier(node.name.lexeme)});
 
     _emit_bytes(static_cast<uint8_t>(OpCode::CLASS), constant, node.name.line);
 
@@ -423,7 +435,7 @@ void Compiler::operator()(const SuperExprNode& node)
         throw Exception{node.super, Error::SuperUsedInClassWithNoSuperClass};
     }
 
-    auto index = _make_constant(Value{_allocator.allocate_string(node.method.lexeme, false)});
+    auto index = _make_constant(Value{_allocator.allocate_identifier(node.method.lexeme)});
 
     _compile_named_variable(node.super);
     _compile_named_variable({TokenType::THIS, node.super.line, "this"});
@@ -454,14 +466,14 @@ void Compiler::operator()(const CallNode& node)
 
     if(method)
     {
-        auto name = _make_constant(Value{_allocator.allocate_string(method->name.lexeme, false)});
+        auto name = _make_constant(Value{_allocator.allocate_identifier(method->name.lexeme)});
 
         _emit_bytes(static_cast<uint8_t>(OpCode::INVOKE), name, node.paren.line);
         _emit_byte(node.args.size(), node.paren.line);
     }
     else if(super)
     {
-        auto name = _make_constant(Value{_allocator.allocate_string(super->method.lexeme, false)});
+        auto name = _make_constant(Value{_allocator.allocate_identifier(super->method.lexeme)});
         _compile_named_variable(super->super);
         _emit_bytes(static_cast<uint8_t>(OpCode::SUPER_INVOKE), name, super->method.line);
         _emit_byte(node.args.size(), node.paren.line);
@@ -570,7 +582,7 @@ void Compiler::_define_variable(const Token& identifier)
 {
     if(_scope_depth == 0)
     {
-        auto index = _make_constant(Value{_allocator.allocate_string(identifier.lexeme, false)});
+        auto index = _make_constant(Value{_allocator.allocate_identifier(identifier.lexeme)});
         _emit_bytes(static_cast<uint8_t>(OpCode::DEFINE_GLOBAL), index, identifier.line);
 
         return;
@@ -593,6 +605,55 @@ void Compiler::operator()(const VarDeclNode& node)
     _define_variable(node.identifier);
 }
 
+void Compiler::operator()(const ImportStmtNode& node)
+{
+    const auto& line = node.keyword.line;
+    auto& root = _get_root();
+    auto relative = node.path.lexeme.substr(1, node.path.lexeme.size() - 2);
+
+    // Every import of the same file resolves to the same path, whichever file it is imported from.
+    std::error_code error;
+    auto absolute = std::filesystem::absolute(root._directory / relative, error).lexically_normal();
+    auto path = std::filesystem::weakly_canonical(absolute, error);
+
+    if(error)
+    {
+        path = absolute;
+    }
+
+    if(std::ranges::find(root._imports, path.string()) == root._imports.end())
+    {
+        root._imports.push_back(path.string());
+    }
+
+    auto constant = _make_constant(Value{_allocator.allocate_string(path.string(), false)});
+    _emit_bytes(static_cast<uint8_t>(OpCode::IMPORT), constant, line);
+    // Running the module leaves its result above the module itself.
+    _emit_bytecode(OpCode::POP, line);
+
+    if(node.alias)
+    {
+        _define_variable(*node.alias);
+        return;
+    }
+
+    // Names the module after its file, slicing the name out of the source so that it lives as long
+    // as other tokens do.
+    auto name = relative.substr(relative.find_last_of('/') + 1);
+    name = name.substr(0, name.find('.'));
+
+    std::string name_source{name};
+    Scanner scanner{name_source};
+    auto token = scanner.scan_token();
+
+    if(token.type != TokenType::IDENTIFIER || token.lexeme.size() != name.size())
+    {
+        throw Exception{node.path, Error::InvalidModuleName};
+    }
+
+    _define_variable(Token{TokenType::IDENTIFIER, line, name});
+}
+
 void Compiler::operator()(const VariableExprNode& node)
 {
     _compile_named_variable(node.var);
@@ -618,7 +679,7 @@ void Compiler::_compile_named_variable(const Token& name)
     }
     else
     {
-        arg = _make_constant(Value{_allocator.allocate_string(name.lexeme, false)});
+        arg = _make_constant(Value{_allocator.allocate_identifier(name.lexeme)});
         op = OpCode::GET_GLOBAL;
     }
 
@@ -640,7 +701,7 @@ void Compiler::operator()(const AssignmentExprNode& node)
         // Compile the expression to be stored.
         std::visit(*this, *node.value);
 
-        auto name = _make_constant(Value{_allocator.allocate_string(property->name.lexeme, false)});
+        auto name = _make_constant(Value{_allocator.allocate_identifier(property->name.lexeme)});
         _emit_bytes(static_cast<uint8_t>(OpCode::SET_PROPERTY), name, property->name.line);
 
         return;
@@ -661,7 +722,7 @@ void Compiler::operator()(const AssignmentExprNode& node)
     }
     else
     {
-        arg = _make_constant(Value{_allocator.allocate_string(var->var.lexeme, false)});
+        arg = _make_constant(Value{_allocator.allocate_identifier(var->var.lexeme)});
         op = OpCode::SET_GLOBAL;
     }
 
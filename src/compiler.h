@@ -4,8 +4,11 @@
 #include <cassert>
 #include <cstdint>
 #include <expected>
+#include <filesystem>
 #include <limits>
+#include <string>
 #include <string_view>
+#include <vector>
 
 #include "chunk.h"
 #include "object.h"
@@ -30,7 +33,8 @@ public:
         ReturnInsideInitializer,
         CyclicInheritance,
         SuperUsedOutsideClass,
-        SuperUsedInClassWithNoSuperClass
+        SuperUsedInClassWithNoSuperClass,
+        InvalidModuleName
     };
 
 private:
@@ -38,6 +42,16 @@ private:
     ObjectAllocator& _allocator;
     Compiler* _enclosing = nullptr;
 
+    // Imports are resolved against the directory of the file being compiled, and the script's
+    // compiler collects the canonical paths of every module imported anywhere in it.
+    std::filesystem::path _directory;
+    std::vector<std::string> _imports;
+
+    Compiler& _get_root()
+    {
+        return _enclosing ? _enclosing->_get_root() : *this;
+    }
+
     enum class FunctionType
     {
         SCRIPT,
@@ -154,7 +168,14 @@ private:
 public:
     Compiler(ObjectAllocator&, FunctionType = FunctionType::SCRIPT, Compiler* = nullptr);
 
-    std::expected<FunctionObject*, Error> compile(const std::vector<ASTNodePtr>& declarations);
+    std::expected<FunctionObject*, Error> compile(const std::vector<ASTNodePtr>& declarations,
+                                                  std::filesystem::path directory = {});
+
+    // The modules the script imports, which must be compiled before it runs.
+    const std::vector<std::string>& get_imports() const
+    {
+        return _imports;
+    }
 
     void operator()(const BinExprNode&);
     void operator()(const ValueNode&);
@@ -175,6 +196,7 @@ public:
     void operator()(const CallNode&);
     void operator()(const ListDeclNode&);
     void operator()(const ListIndexExprNode&);
+    void operator()(const ImportStmtNode&);
 };
 } // namespace lox
 
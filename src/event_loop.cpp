@@ -0,0 +1,1014 @@
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_set.h"
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// The size of the first read of a file. Reads which fill the buffer double it.
+constexpr size_t INITIAL_READ_SIZE = 16 * 1024;
+// The most the epoll backend transfers in one step, so large files do not hold up other work.
+constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+std::unexpected<std::error_code> system_error(int error)
+{
+    return std::unexpected(std::error_code{error, std::system_category()});
+}
+
+// A file operation in progress, which moves through its stages as each one completes.
+struct FileRequest
+{
+    enum class Stage
+    {
+        Open,
+        Transfer,
+        Close,
+        Timeout
+    };
+
+    Stage stage = Stage::Open;
+    bool write = false;
+    std::string path;
+    // The contents to write.
+    std::string data;
+    // The contents read so far. Unlike a string, the buffer is not zeroed as it grows.
+    std::unique_ptr<char[]> buffer;
+    size_t capacity = 0;
+    // The size of a regular file being read, after which no more reads are needed.
+    size_t size = SIZE_MAX;
+    size_t done = 0;
+    int fd = -1;
+    int error = 0;
+    __kernel_timespec timeout{};
+    EventLoop::Handler handler;
+
+    int get_open_flags() const
+    {
+        return write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+    }
+
+    void opened(int file)
+    {
+        fd = file;
+        stage = Stage::Transfer;
+
+        struct stat status;
+
+        if(!write && fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0)
+        {
+            size = status.st_size;
+            buffer = std::make_unique_for_overwrite<char[]>(size);
+            capacity = size;
+        }
+    }
+
+    bool is_finished(ssize_t transferred) const
+    {
+        return transferred == 0 || done == (write ? data.size() : size);
+    }
+
+    // Makes room for the next read.
+    void reserve()
+    {
+        if(write || done < capacity)
+        {
+            return;
+        }
+
+        auto grown = std::max(capacity * 2, INITIAL_READ_SIZE);
+        auto replacement = std::make_unique_for_overwrite<char[]>(grown);
+        std::copy_n(buffer.get(), done, replacement.get());
+
+        buffer = std::move(replacement);
+        capacity = grown;
+    }
+
+    char* get_cursor()
+    {
+        return write ? data.data() + done : buffer.get() + done;
+    }
+
+    size_t get_remaining() const
+    {
+        return write ? data.size() - done : capacity - done;
+    }
+
+    EventLoop::Result take_result()
+    {
+        if(error != 0)
+        {
+            return system_error(error);
+        }
+
+        return write ? std::string{} : std::string{buffer.get(), done};
+    }
+};
+
+class IoUringLoop final : public EventLoop
+{
+    static constexpr unsigned ENTRIES = 256;
+
+    int _ring = -1;
+    void* _sq_map = MAP_FAILED;
+    size_t _sq_map_size = 0;
+    void* _cq_map = MAP_FAILED;
+    size_t _cq_map_size = 0;
+    io_uring_sqe* _sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+
+    unsigned* _sq_tail = nullptr;
+    unsigned _sq_mask = 0;
+    unsigned* _cq_head = nullptr;
+    unsigned* _cq_tail = nullptr;
+    unsigned _cq_mask = 0;
+    io_uring_cqe* _cqes = nullptr;
+
+    unsigned _entries = 0;
+    // Entries queued since the last io_uring_enter().
+    unsigned _unsubmitted = 0;
+    // Entries submitted whose completions are yet to be reaped, which is kept within the size of
+    // the submission queue so the completion queue never overflows.
+    unsigned _in_flight = 0;
+    std::deque<FileRequest*> _backlog;
+    absl::flat_hash_set<FileRequest*> _requests;
+
+    bool _setup()
+    {
+        io_uring_params params{};
+        _ring = static_cast<int>(syscall(__NR_io_uring_setup, ENTRIES, &params));
+
+        if(_ring < 0 || !(params.features & IORING_FEAT_RW_CUR_POS))
+        {
+            return false;
+        }
+
+        _entries = params.sq_entries;
+        _sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        if(params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            _sq_map_size = _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+        }
+
+        _sq_map = mmap(nullptr,
+                       _sq_map_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       _ring,
+                       IORING_OFF_SQ_RING);
+
+        if(_sq_map == MAP_FAILED)
+        {
+            return false;
+        }
+
+        _cq_map = params.features & IORING_FEAT_SINGLE_MMAP ? _sq_map
+                                                            : mmap(nullptr,
+                                                                   _cq_map_size,
+                                                                   PROT_READ | PROT_WRITE,
+                                                                   MAP_SHARED | MAP_POPULATE,
+                                                                   _ring,
+                                                                   IORING_OFF_CQ_RING);
+
+        if(_cq_map == MAP_FAILED)
+        {
+            return false;
+        }
+
+        _sqes = static_cast<io_uring_sqe*>(mmap(nullptr,
+                                                params.sq_entries * sizeof(io_uring_sqe),
+                                                PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE,
+                                                _ring,
+                                                IORING_OFF_SQES));
+
+        if(_sqes == MAP_FAILED)
+        {
+            return false;
+        }
+
+        auto* sq = static_cast<char*>(_sq_map);
+        auto* cq = static_cast<char*>(_cq_map);
+
+        _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // Every slot of the submission queue always refers to the entry of the same index.
+        auto* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        for(unsigned i = 0; i < params.sq_entries; ++i)
+        {
+            array[i] = i;
+        }
+
+        return true;
+    }
+
+    int _enter(unsigned wait)
+    {
+        auto submitted = static_cast<int>(syscall(__NR_io_uring_enter,
+                                                  _ring,
+                                                  _unsubmitted,
+                                                  wait,
+                                                  wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                                                  nullptr,
+                                                  0));
+
+        if(submitted > 0)
+        {
+            _unsubmitted -= submitted;
+        }
+
+        return submitted;
+    }
+
+    // Queues the entry for the request's current stage.
+    void _submit(FileRequest* request)
+    {
+        if(_in_flight == _entries)
+        {
+            _backlog.push_back(request);
+            return;
+        }
+
+        auto tail = *_sq_tail;
+        auto& sqe = _sqes[tail & _sq_mask];
+        sqe = {};
+        sqe.user_data = reinterpret_cast<uintptr_t>(request);
+
+        switch(request->stage)
+        {
+        case FileRequest::Stage::Open:
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uintptr_t>(request->path.c_str());
+            sqe.len = 0644;
+            sqe.open_flags = request->get_open_flags();
+            break;
+        case FileRequest::Stage::Transfer:
+            request->reserve();
+
+            sqe.opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = request->fd;
+            sqe.addr = reinterpret_cast<uintptr_t>(request->get_cursor());
+            sqe.len = static_cast<unsigned>(std::min<size_t>(request->get_remaining(), 1u << 30));
+            // Use the file position, which also works for pipes.
+            sqe.off = static_cast<uint64_t>(-1);
+            break;
+        case FileRequest::Stage::Close:
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = request->fd;
+            break;
+        case FileRequest::Stage::Timeout:
+            sqe.opcode = IORING_OP_TIMEOUT;
+            sqe.addr = reinterpret_cast<uintptr_t>(&request->timeout);
+            sqe.len = 1;
+            break;
+        }
+
+        std::atomic_ref{*_sq_tail}.store(tail + 1, std::memory_order_release);
+        ++_unsubmitted;
+        ++_in_flight;
+    }
+
+    void _finish(FileRequest* request)
+    {
+        auto handler = std::move(request->handler);
+        auto result = request->take_result();
+
+        _requests.erase(request);
+        delete request;
+        --_pending;
+
+        handler(std::move(result));
+    }
+
+    void _complete(FileRequest* request, int result)
+    {
+        switch(request->stage)
+        {
+        case FileRequest::Stage::Open:
+            if(result < 0)
+            {
+                request->error = -result;
+                _finish(request);
+                return;
+            }
+
+            request->opened(result);
+            break;
+        case FileRequest::Stage::Transfer:
+            if(result < 0)
+            {
+                request->error = -result;
+                request->stage = FileRequest::Stage::Close;
+                break;
+            }
+
+            request->done += result;
+
+            if(request->is_finished(result))
+            {
+                request->stage = FileRequest::Stage::Close;
+            }
+            break;
+        case FileRequest::Stage::Close:
+        case FileRequest::Stage::Timeout:
+            if(result < 0 && result != -ETIME && request->error == 0)
+            {
+                request->error = -result;
+            }
+
+            _finish(request);
+            return;
+        }
+
+        _submit(request);
+    }
+
+    FileRequest* _start(FileRequest::Stage stage, Handler handler)
+    {
+        auto* request = new FileRequest{.stage = stage, .handler = std::move(handler)};
+        _requests.insert(request);
+        ++_pending;
+
+        return request;
+    }
+
+protected:
+    void _poll(bool block) override
+    {
+        auto empty = *_cq_head == std::atomic_ref{*_cq_tail}.load(std::memory_order_acquire);
+        unsigned wait = block && empty ? 1 : 0;
+
+        // Interrupted or short of resources; whatever is left is submitted next time.
+        if((_unsubmitted > 0 || wait > 0) && _enter(wait) < 0 && errno != EINTR && errno != EAGAIN
+           && errno != EBUSY)
+        {
+            std::abort();
+        }
+
+        while(true)
+        {
+            auto head = *_cq_head;
+
+            if(head == std::atomic_ref{*_cq_tail}.load(std::memory_order_acquire))
+            {
+                break;
+            }
+
+            auto cqe = _cqes[head & _cq_mask];
+            // Consume the entry before running any handler, which may poll again.
+            std::atomic_ref{*_cq_head}.store(head + 1, std::memory_order_release);
+            --_in_flight;
+
+            _complete(reinterpret_cast<FileRequest*>(cqe.user_data), cqe.res);
+
+            while(!_backlog.empty() && _in_flight < _entries)
+            {
+                auto* request = _backlog.front();
+                _backlog.pop_front();
+                _submit(request);
+            }
+        }
+    }
+
+public:
+    static std::unique_ptr<IoUringLoop> create()
+    {
+        auto loop = std::make_unique<IoUringLoop>();
+
+        return loop->_setup() ? std::move(loop) : nullptr;
+    }
+
+    ~IoUringLoop() override
+    {
+        // The kernel may still write into buffers of reads in flight, so wait for them. Timeouts
+        // copy their timespec on submission and need not be waited for.
+        auto busy = [this] {
+            return std::ranges::any_of(_requests, [this](FileRequest* request) {
+                return request->stage != FileRequest::Stage::Timeout
+                       && std::ranges::find(_backlog, request) == _backlog.end();
+            });
+        };
+
+        while(_ring >= 0 && busy())
+        {
+            if(_enter(1) < 0 && errno != EINTR)
+            {
+                break;
+            }
+
+            while(*_cq_head != std::atomic_ref{*_cq_tail}.load(std::memory_order_acquire))
+            {
+                auto cqe = _cqes[*_cq_head & _cq_mask];
+                std::atomic_ref{*_cq_head}.fetch_add(1, std::memory_order_release);
+
+                auto* request = reinterpret_cast<FileRequest*>(cqe.user_data);
+
+                if(request->stage == FileRequest::Stage::Open && cqe.res >= 0)
+                {
+                    close(cqe.res);
+                }
+                else if(request->stage == FileRequest::Stage::Transfer)
+                {
+                    close(request->fd);
+                }
+
+                _requests.erase(request);
+                delete request;
+            }
+        }
+
+        for(auto* request : _requests)
+        {
+            if(request->stage == FileRequest::Stage::Transfer)
+            {
+                close(request->fd);
+            }
+
+            delete request;
+        }
+
+        if(_sqes != MAP_FAILED)
+        {
+            munmap(_sqes, _entries * sizeof(io_uring_sqe));
+        }
+
+        if(_cq_map != MAP_FAILED && _cq_map != _sq_map)
+        {
+            munmap(_cq_map, _cq_map_size);
+        }
+
+        if(_sq_map != MAP_FAILED)
+        {
+            munmap(_sq_map, _sq_map_size);
+        }
+
+        if(_ring >= 0)
+        {
+            close(_ring);
+        }
+    }
+
+    void read_file(std::string path, Handler handler) override
+    {
+        auto* request = _start(FileRequest::Stage::Open, std::move(handler));
+        request->path = std::move(path);
+        _submit(request);
+    }
+
+    void write_file(std::string path, std::string data, Handler handler) override
+    {
+        auto* request = _start(FileRequest::Stage::Open, std::move(handler));
+        request->write = true;
+        request->path = std::move(path);
+        request->data = std::move(data);
+        _submit(request);
+    }
+
+    void sleep(std::chrono::milliseconds duration, Handler handler) override
+    {
+        auto* request = _start(FileRequest::Stage::Timeout, std::move(handler));
+        request->timeout.tv_sec = duration.count() / 1000;
+        request->timeout.tv_nsec = duration.count() % 1000 * 1'000'000;
+        _submit(request);
+    }
+
+    Backend get_backend() const override
+    {
+        return Backend::IoUring;
+    }
+};
+
+class EpollLoop final : public EventLoop
+{
+    struct Timer
+    {
+        Clock::time_point deadline;
+        uint64_t sequence;
+        Handler handler;
+
+        // Orders the heap so that the earliest timer, and among those the first set, is on top.
+        bool operator<(const Timer& other) const
+        {
+            return std::tie(deadline, sequence) > std::tie(other.deadline, other.sequence);
+        }
+    };
+
+    int _epoll = -1;
+    // Requests which can make progress without waiting.
+    std::vector<FileRequest*> _ready;
+    absl::flat_hash_set<FileRequest*> _requests;
+    std::vector<Timer> _timers;
+    uint64_t _timer_sequence = 0;
+
+    void _finish(FileRequest* request)
+    {
+        if(request->fd >= 0)
+        {
+            close(request->fd);
+        }
+
+        auto handler = std::move(request->handler);
+        auto result = request->take_result();
+
+        _requests.erase(request);
+        delete request;
+        --_pending;
+
+        handler(std::move(result));
+    }
+
+    // Moves the request on by one chunk, or parks it in epoll until its file is ready.
+    void _step(FileRequest* request)
+    {
+        if(request->fd < 0)
+        {
+            auto fd = open(request->path.c_str(), request->get_open_flags() | O_NONBLOCK, 0644);
+
+            if(fd < 0)
+            {
+                request->error = errno;
+                _finish(request);
+                return;
+            }
+
+            request->opened(fd);
+        }
+
+        request->reserve();
+
+        auto size = std::min(request->get_remaining(), CHUNK_SIZE);
+        auto result = request->write ? ::write(request->fd, request->get_cursor(), size)
+                                     : ::read(request->fd, request->get_cursor(), size);
+
+        if(result < 0 && errno == EINTR)
+        {
+            _ready.push_back(request);
+        }
+        else if(result < 0 && errno == EAGAIN)
+        {
+            epoll_event event{.events = (request->write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT,
+                              .data = {.ptr = request}};
+
+            // Files are added the first time they would block and re-armed after that.
+            if(epoll_ctl(_epoll, EPOLL_CTL_MOD, request->fd, &event) < 0
+               && epoll_ctl(_epoll, EPOLL_CTL_ADD, request->fd, &event) < 0)
+            {
+                request->error = errno;
+                _finish(request);
+            }
+        }
+        else if(result < 0)
+        {
+            request->error = errno;
+            _finish(request);
+        }
+        else
+        {
+            request->done += result;
+
+            if(request->is_finished(result))
+            {
+                _finish(request);
+            }
+            else
+            {
+                _ready.push_back(request);
+            }
+        }
+    }
+
+    FileRequest* _start(bool write, std::string path, Handler handler)
+    {
+        auto* request = new FileRequest{
+            .write = write, .path = std::move(path), .handler = std::move(handler)};
+        _requests.insert(request);
+        _ready.push_back(request);
+        ++_pending;
+
+        return request;
+    }
+
+protected:
+    void _poll(bool block) override
+    {
+        auto ready = std::exchange(_ready, {});
+        int timeout = -1;
+
+        if(!ready.empty() || !block)
+        {
+            timeout = 0;
+        }
+        else if(!_timers.empty())
+        {
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(_timers.front().deadline
+                                                                     - Clock::now());
+            timeout = static_cast<int>(std::max<int64_t>(wait.count(), 0));
+        }
+
+        std::array<epoll_event, 64> events;
+        auto count = epoll_wait(_epoll, events.data(), events.size(), timeout);
+
+        for(int i = 0; i < count; ++i)
+        {
+            _ready.push_back(static_cast<FileRequest*>(events[i].data.ptr));
+        }
+
+        for(auto* request : ready)
+        {
+            _step(request);
+        }
+
+        auto now = Clock::now();
+
+        while(!_timers.empty() && _timers.front().deadline <= now)
+        {
+            std::pop_heap(_timers.begin(), _timers.end());
+            auto handler = std::move(_timers.back().handler);
+            _timers.pop_back();
+            --_pending;
+
+            handler(std::string{});
+        }
+    }
+
+public:
+    static std::unique_ptr<EpollLoop> create()
+    {
+        auto loop = std::make_unique<EpollLoop>();
+        loop->_epoll = epoll_create1(EPOLL_CLOEXEC);
+
+        return loop->_epoll >= 0 ? std::move(loop) : nullptr;
+    }
+
+    ~EpollLoop() override
+    {
+        for(auto* request : _requests)
+        {
+            if(request->fd >= 0)
+            {
+                close(request->fd);
+            }
+
+            delete request;
+        }
+
+        if(_epoll >= 0)
+        {
+            close(_epoll);
+        }
+    }
+
+    void read_file(std::string path, Handler handler) override
+    {
+        _start(false, std::move(path), std::move(handler));
+    }
+
+    void write_file(std::string path, std::string data, Handler handler) override
+    {
+        _start(true, std::move(path), std::move(handler))->data = std::move(data);
+    }
+
+    void sleep(std::chrono::milliseconds duration, Handler handler) override
+    {
+        _timers.push_back({Clock::now() + duration, _timer_sequence++, std::move(handler)});
+        std::push_heap(_timers.begin(), _timers.end());
+        ++_pending;
+    }
+
+    Backend get_backend() const override
+    {
+        return Backend::Epoll;
+    }
+};
+
+// Resumes a fiber run by the event loop. A fiber which merely yielded is queued to run again.
+void run_scheduled(VM& vm,
+                   FiberObject& fiber,
+                   Value value,
+                   std::optional<std::string> error = std::nullopt)
+{
+    auto& loop = vm.get_event_loop();
+
+    fiber.waiting = false;
+
+    if(!vm.resume(fiber, value, std::move(error)))
+    {
+        loop.fail();
+    }
+
+    if(fiber.state == FiberObject::State::DONE)
+    {
+        vm.get_allocator().unpin(&fiber);
+    }
+    else if(!fiber.waiting)
+    {
+        loop.post([&vm, &fiber] { run_scheduled(vm, fiber, Value{}); });
+    }
+}
+
+// Starts an operation with start(loop, handler) and produces the value convert() makes of its
+// result. A fiber run by the event loop is suspended until then, anything else runs the loop.
+template <typename Start, typename Convert>
+Value await(VM& vm, std::string_view failure, Start start, Convert convert)
+{
+    auto& loop = vm.get_event_loop();
+    auto* fiber = vm.get_fiber();
+
+    if(fiber && fiber->scheduled && vm.yield(Value{}))
+    {
+        fiber->waiting = true;
+
+        start(loop,
+              [&vm, fiber, failure = std::string{failure}, convert](EventLoop::Result result) {
+                  if(result)
+                  {
+                      run_scheduled(vm, *fiber, convert(vm, std::move(*result)));
+                  }
+                  else
+                  {
+                      run_scheduled(vm,
+                                    *fiber,
+                                    Value{},
+                                    std::format("{}: {}.", failure, result.error().message()));
+                  }
+              });
+
+        return Value{};
+    }
+
+    // Should the loop fail, the handler is never called and may refer to this frame.
+    std::optional<EventLoop::Result> result;
+    start(loop, [&result](EventLoop::Result completed) { result = std::move(completed); });
+
+    if(!loop.run_until([&result] { return result.has_value(); }))
+    {
+        vm.raise("Error in fiber.");
+        return Value{};
+    }
+
+    if(!*result)
+    {
+        vm.raise(std::format("{}: {}.", failure, result->error().message()));
+        return Value{};
+    }
+
+    return convert(vm, std::move(**result));
+}
+
+Value nil_result(VM&, std::string)
+{
+    return Value{};
+}
+
+StringObject* as_string(Value value)
+{
+    return value.is_object() ? value.as_object()->as<StringObject>() : nullptr;
+}
+
+std::optional<std::chrono::milliseconds> as_duration(Value value)
+{
+    if(!value.is_number() || value.as_number() < 0 || value.as_number() > 1e12)
+    {
+        return std::nullopt;
+    }
+
+    return std::chrono::milliseconds{static_cast<int64_t>(value.as_number())};
+}
+
+// Creates a fiber for the event loop to run, which stays alive until it finishes.
+FiberObject* schedule(VM& vm, Value function, std::span<const Value> args)
+{
+    auto* closure = function.is_object() ? function.as_object()->as<ClosureObject>() : nullptr;
+
+    if(!closure || closure->function.arity != args.size())
+    {
+        return nullptr;
+    }
+
+    // Callers need not root the function and arguments while the fiber is created.
+    auto* fiber = vm.get_allocator().allocate<FiberObject>(false, function, args);
+    fiber->scheduled = true;
+    vm.get_allocator().pin(fiber);
+
+    return fiber;
+}
+
+Value read_file_async_native(VM& vm, std::span<Value> args)
+{
+    auto* path = args.size() == 1 ? as_string(args[0]) : nullptr;
+
+    if(!path)
+    {
+        vm.raise("read_file_async() expects a path.");
+        return Value{};
+    }
+
+    return await(
+        vm,
+        std::format("Could not read '{}'", path->value()),
+        [path = path->value()](EventLoop& loop, EventLoop::Handler handler) {
+            loop.read_file(path, std::move(handler));
+        },
+        [](VM& vm, std::string contents) {
+            return Value{vm.get_allocator().allocate_string(contents)};
+        });
+}
+
+Value write_file_async_native(VM& vm, std::span<Value> args)
+{
+    auto* path = args.size() == 2 ? as_string(args[0]) : nullptr;
+    auto* contents = path ? as_string(args[1]) : nullptr;
+
+    if(!contents)
+    {
+        vm.raise("write_file_async() expects a path and a string.");
+        return Value{};
+    }
+
+    return await(
+        vm,
+        std::format("Could not write '{}'", path->value()),
+        [path = path->value(), contents = contents->value()](EventLoop& loop,
+                                                             EventLoop::Handler handler) {
+            loop.write_file(path, contents, std::move(handler));
+        },
+        &nil_result);
+}
+
+Value sleep_native(VM& vm, std::span<Value> args)
+{
+    auto duration = args.size() == 1 ? as_duration(args[0]) : std::nullopt;
+
+    if(!duration)
+    {
+        vm.raise("sleep() expects a number of milliseconds.");
+        return Value{};
+    }
+
+    return await(
+        vm,
+        "Could not sleep",
+        [duration = *duration](EventLoop& loop, EventLoop::Handler handler) {
+            loop.sleep(duration, std::move(handler));
+        },
+        &nil_result);
+}
+
+Value timer_native(VM& vm, std::span<Value> args)
+{
+    auto duration = args.size() == 2 ? as_duration(args[0]) : std::nullopt;
+    auto* fiber = duration ? schedule(vm, args[1], {}) : nullptr;
+
+    if(!fiber)
+    {
+        vm.raise("timer() expects a number of milliseconds and a function taking no arguments.");
+        return Value{};
+    }
+
+    vm.get_event_loop().sleep(*duration, [&vm, fiber](EventLoop::Result) {
+        run_scheduled(vm, *fiber, Value{});
+    });
+
+    return Value{fiber};
+}
+
+} // namespace
+
+FiberObject* spawn(VM& vm, Value function, std::span<const Value> args)
+{
+    auto* fiber = schedule(vm, function, args);
+
+    if(fiber)
+    {
+        vm.get_event_loop().post([&vm, fiber] { run_scheduled(vm, *fiber, Value{}); });
+    }
+
+    return fiber;
+}
+
+Value spawn_native(VM& vm, std::span<Value> args)
+{
+    auto* fiber = args.empty() ? nullptr : spawn(vm, args[0], args.subspan(1));
+
+    if(!fiber)
+    {
+        vm.raise("spawn() expects a function and the arguments to call it with.");
+        return Value{};
+    }
+
+    return Value{fiber};
+}
+
+std::unique_ptr<EventLoop> EventLoop::create()
+{
+    auto* backend = std::getenv("LOX_EVENT_LOOP");
+
+    if(!backend || std::string_view{backend} != "epoll")
+    {
+        if(auto loop = create(Backend::IoUring))
+        {
+            return loop;
+        }
+    }
+
+    return create(Backend::Epoll);
+}
+
+std::unique_ptr<EventLoop> EventLoop::create(Backend backend)
+{
+    switch(backend)
+    {
+    case Backend::IoUring:
+        return IoUringLoop::create();
+    case Backend::Epoll:
+        return EpollLoop::create();
+    }
+
+    return nullptr;
+}
+
+bool EventLoop::run_once()
+{
+    if(_failed || get_pending() == 0)
+    {
+        return !_failed;
+    }
+
+    if(_posted.empty())
+    {
+        _poll(true);
+        return !_failed;
+    }
+
+    // Run only what was posted so far, so fibers which keep yielding cannot starve I/O.
+    for(auto count = _posted.size(); count > 0 && !_failed; --count)
+    {
+        auto function = std::move(_posted.front());
+        _posted.pop_front();
+        function();
+    }
+
+    if(_pending > 0 && !_failed)
+    {
+        _poll(false);
+    }
+
+    return !_failed;
+}
+
+bool EventLoop::run_until(const std::function<bool()>& done)
+{
+    while(!_failed && !done() && get_pending() > 0)
+    {
+        run_once();
+    }
+
+    return !_failed;
+}
+
+void define_event_loop_natives(VM& vm)
+{
+    vm.define_native("read_file_async", &read_file_async_native);
+    vm.define_native("write_file_async", &write_file_async_native);
+    vm.define_native("sleep", &sleep_native);
+    vm.define_native("timer", &timer_native);
+    vm.define_native("spawn", &spawn_native);
+}
+
+} // namespace lox
@@ -0,0 +1,121 @@
+#ifndef LOX_EVENT_LOOP_H
+#define LOX_EVENT_LOOP_H
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <system_error>
+
+#include "value.h"
+
+namespace lox
+{
+
+class VM;
+struct FiberObject;
+
+// Runs file reads, file writes and timers asynchronously on the thread which owns the loop,
+// calling a handler once each completes. Handlers are only ever called from run_until(), never
+// from the call which started the operation.
+//
+// The io_uring backend submits every step of an operation (open, read or write, close) to the
+// kernel and waits for completions. Where io_uring is unavailable, the epoll backend opens files
+// without blocking and waits for readiness instead; regular files are always ready, so those are
+// transferred a chunk at a time in between other work.
+class EventLoop
+{
+public:
+    enum class Backend
+    {
+        IoUring,
+        Epoll
+    };
+
+    // The contents read, or an empty string for writes and timers.
+    using Result = std::expected<std::string, std::error_code>;
+    using Handler = std::function<void(Result)>;
+
+    // Picks io_uring when the kernel supports it, unless LOX_EVENT_LOOP=epoll is set.
+    static std::unique_ptr<EventLoop> create();
+    // Returns nullptr if the backend is unavailable.
+    static std::unique_ptr<EventLoop> create(Backend);
+
+    EventLoop() = default;
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    virtual ~EventLoop() = default;
+
+    virtual void read_file(std::string path, Handler) = 0;
+    virtual void write_file(std::string path, std::string data, Handler) = 0;
+    virtual void sleep(std::chrono::milliseconds, Handler) = 0;
+
+    // Calls the function from the loop as soon as possible.
+    void post(std::function<void()> function)
+    {
+        _posted.push_back(std::move(function));
+    }
+
+    // Runs what was posted, or waits for an operation to complete and runs its handler if nothing
+    // was. Returns false if a handler called fail(), after which no more handlers are run.
+    bool run_once();
+
+    // Runs handlers as operations complete until done() holds or nothing is pending.
+    bool run_until(const std::function<bool()>& done);
+
+    bool run()
+    {
+        return run_until([] { return false; });
+    }
+
+    void fail()
+    {
+        _failed = true;
+    }
+
+    size_t get_pending() const
+    {
+        return _pending + _posted.size();
+    }
+
+    bool has_posted() const
+    {
+        return !_posted.empty();
+    }
+
+    virtual Backend get_backend() const = 0;
+
+protected:
+    // Operations started but whose handlers have not been called yet.
+    size_t _pending = 0;
+
+    // Waits for at least one operation to complete, unless block is false, and calls the handlers
+    // of those which have.
+    virtual void _poll(bool block) = 0;
+
+private:
+    std::deque<std::function<void()>> _posted;
+    bool _failed = false;
+};
+
+// Starts a fiber run by the event loop which calls the function with the arguments. Returns nullptr
+// if the function cannot be called with them.
+FiberObject* spawn(VM&, Value function, std::span<const Value> args);
+
+// Defines read_file_async(path), write_file_async(path, string), sleep(ms), timer(ms, fn) and
+// spawn(fn, args...).
+//
+// spawn(fn, args...) and timer(ms, fn) run a function in a fiber which the event loop resumes, at
+// once or after the delay. When such a fiber reads, writes or sleeps it is suspended
+// until the operation completes, letting the other fibers run, and yield() lets them run as well.
+// Elsewhere these calls block, but still run the event loop's fibers while they wait. Once the
+// script finishes, the event loop runs until no fibers are left.
+void define_event_loop_natives(VM&);
+
+} // namespace lox
+
+#endif // LOX_EVENT_LOOP_H
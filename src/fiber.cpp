@@ -0,0 +1,117 @@
+#include "fiber.h"
+
+#include <span>
+
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+namespace
+{
+
+FiberObject* as_fiber(Value value)
+{
+    return value.is_object() ? value.as_object()->as<FiberObject>() : nullptr;
+}
+
+Value fiber_native(VM& vm, std::span<Value> args)
+{
+    auto* closure = args.size() == 1 && args[0].is_object()
+                        ? args[0].as_object()->as<ClosureObject>()
+                        : nullptr;
+
+    if(!closure || closure->function.arity != 0)
+    {
+        vm.raise("fiber() expects a function taking no arguments.");
+        return Value{};
+    }
+
+    return Value{vm.get_allocator().allocate<FiberObject>(true, args[0])};
+}
+
+Value resume_native(VM& vm, std::span<Value> args)
+{
+    auto* fiber = !args.empty() && args.size() <= 2 ? as_fiber(args[0]) : nullptr;
+
+    if(!fiber)
+    {
+        vm.raise("resume() expects a fiber and an optional value.");
+        return Value{};
+    }
+
+    if(fiber->is_shared())
+    {
+        vm.raise("Parallel tasks cannot resume fibers created outside them.");
+        return Value{};
+    }
+
+    if(fiber->scheduled)
+    {
+        vm.raise("Cannot resume a fiber run by the event loop.");
+        return Value{};
+    }
+
+    switch(fiber->state)
+    {
+    case FiberObject::State::RUNNING:
+        vm.raise("Cannot resume a running fiber.");
+        return Value{};
+    case FiberObject::State::DONE:
+        vm.raise("Cannot resume a finished fiber.");
+        return Value{};
+    default:
+        break;
+    }
+
+    auto result = vm.resume(*fiber, args.size() == 2 ? args[1] : Value{});
+
+    if(!result)
+    {
+        vm.raise("Error in fiber.");
+        return Value{};
+    }
+
+    return *result;
+}
+
+Value yield_native(VM& vm, std::span<Value> args)
+{
+    if(args.size() > 1)
+    {
+        vm.raise("yield() expects an optional value.");
+        return Value{};
+    }
+
+    if(!vm.yield(args.empty() ? Value{} : args[0]))
+    {
+        vm.raise("Can only yield inside a fiber.");
+    }
+
+    return Value{};
+}
+
+Value done_native(VM& vm, std::span<Value> args)
+{
+    auto* fiber = args.size() == 1 ? as_fiber(args[0]) : nullptr;
+
+    if(!fiber)
+    {
+        vm.raise("done() expects a fiber.");
+        return Value{};
+    }
+
+    return Value{fiber->state == FiberObject::State::DONE};
+}
+
+} // namespace
+
+void define_fiber_natives(VM& vm)
+{
+    vm.define_native("fiber", &fiber_native);
+    vm.define_native("resume", &resume_native);
+    vm.define_native("yield", &yield_native);
+    vm.define_native("done", &done_native);
+}
+
+} // namespace lox
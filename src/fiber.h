@@ -0,0 +1,21 @@
+#ifndef LOX_FIBER_H
+#define LOX_FIBER_H
+
+namespace lox
+{
+
+class VM;
+
+// Defines fiber(fn), which wraps a function taking no arguments in a coroutine, resume(fiber,
+// value), which runs it until it yields or returns and produces what it yielded or returned,
+// yield(value), which suspends the running fiber and produces the value it is next resumed with,
+// and done(fiber).
+//
+// Every fiber runs on its own value stack and callstack, limited to FIBER_MAX_FRAMES frames, which
+// the VM switches to in place so a context switch copies no frames. The value the fiber is first
+// resumed with is ignored.
+void define_fiber_natives(VM&);
+
+} // namespace lox
+
+#endif // LOX_FIBER_H
@@ -0,0 +1,282 @@
+#include "heap_dump.h"
+
+#include <csignal>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <print>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "object.h"
+
+namespace lox
+{
+namespace
+{
+
+constexpr char MAGIC[8] = {'L', 'O', 'X', 'H', 'E', 'A', 'P', '\0'};
+constexpr uint32_t VERSION = 1;
+
+// Which heap dumps requested by signals are of and where they go, set before the handler is
+// installed.
+ObjectAllocator* signal_heap = nullptr;
+std::string signal_path;
+unsigned signal_dumps = 0;
+
+// The size of an object together with the buffers it owns, which the heap does not count.
+size_t get_size(Object& object)
+{
+    auto size = object.size();
+
+    if(auto* string = object.as<StringObject>())
+    {
+        size += string->value().capacity();
+    }
+    else if(auto* function = object.as<FunctionObject>())
+    {
+        size += function->chunk.size() + function->chunk.get_constants().size() * sizeof(Value);
+    }
+    else if(auto* instance = object.as<InstanceObject>())
+    {
+        size += instance->fields.capacity() * sizeof(HashMap<Value>::value_type);
+    }
+    else if(auto* list = object.as<ListObject>())
+    {
+        size += list->elements.capacity() * sizeof(Value);
+    }
+
+    return size;
+}
+
+std::string_view get_name(Object& object)
+{
+    if(auto* instance = object.as<InstanceObject>())
+    {
+        return instance->klass.name;
+    }
+
+    if(auto* klass = object.as<ClassObject>())
+    {
+        return klass->name;
+    }
+
+    if(auto* closure = object.as<ClosureObject>())
+    {
+        return closure->function.name.empty() ? "script" : closure->function.name;
+    }
+
+    if(auto* function = object.as<FunctionObject>())
+    {
+        return function->name.empty() ? "script" : function->name;
+    }
+
+    if(auto* native = object.as<NativeFunctionObject>())
+    {
+        return native->name;
+    }
+
+    if(auto* module = object.as<ModuleObject>())
+    {
+        return module->name;
+    }
+
+    return {};
+}
+
+class Writer
+{
+    ObjectAllocator& _allocator;
+    std::string _buffer;
+    std::vector<Object*> _objects;
+    absl::flat_hash_map<Object*, uint32_t> _indices;
+    std::vector<std::string_view> _names{""};
+    absl::flat_hash_map<std::string_view, uint32_t> _name_indices{{"", 0}};
+
+    template <typename T>
+    void _put(T value)
+    {
+        _buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    uint32_t _get_name_index(std::string_view name)
+    {
+        auto [it, inserted] = _name_indices.try_emplace(name, _names.size());
+
+        if(inserted)
+        {
+            _names.push_back(name);
+        }
+
+        return it->second;
+    }
+
+    // Numbers an object the first time it is seen, after the node of the roots.
+    uint32_t _get_index(Object* object)
+    {
+        auto [it, inserted] = _indices.try_emplace(object, _objects.size() + 1);
+
+        if(inserted)
+        {
+            _objects.push_back(object);
+        }
+
+        return it->second;
+    }
+
+    void _put_node(std::string_view kind,
+                   std::string_view name,
+                   size_t size,
+                   const std::vector<Object*>& references)
+    {
+        _put(_get_name_index(kind));
+        _put(_get_name_index(name));
+        _put(static_cast<uint32_t>(size));
+        _put(static_cast<uint32_t>(references.size()));
+
+        for(auto* reference : references)
+        {
+            _put(_get_index(reference));
+        }
+    }
+
+public:
+    explicit Writer(ObjectAllocator& allocator)
+        : _allocator(allocator)
+    { }
+
+    std::string write()
+    {
+        // Objects are numbered as they are first referred to, and written in that order, so a
+        // breadth-first walk writes each once.
+        _put_node("roots", "", 0, _allocator.get_roots());
+
+        for(size_t i = 0; i < _objects.size(); ++i)
+        {
+            auto& object = *_objects[i];
+            _put_node(get_kind_name(object),
+                      get_name(object),
+                      get_size(object),
+                      _allocator.get_references(object));
+        }
+
+        auto nodes = std::exchange(_buffer, {});
+
+        _buffer.append(MAGIC, sizeof(MAGIC));
+        _put(VERSION);
+        _put(static_cast<uint32_t>(_names.size()));
+
+        for(auto name : _names)
+        {
+            _put(static_cast<uint32_t>(name.size()));
+            _buffer.append(name);
+        }
+
+        _put(static_cast<uint32_t>(_objects.size() + 1));
+        _buffer.append(nodes);
+
+        return std::move(_buffer);
+    }
+};
+
+} // namespace
+
+std::atomic<bool> HeapDump::_requested = false;
+
+std::expected<std::string, HeapDump::Error> HeapDump::write(ObjectAllocator& allocator)
+{
+    if(allocator.is_concurrent())
+    {
+        return std::unexpected(Error::Concurrent);
+    }
+
+    return Writer{allocator}.write();
+}
+
+std::expected<void, HeapDump::Error> HeapDump::save(std::string_view path,
+                                                     ObjectAllocator& allocator)
+{
+    auto dump = write(allocator);
+
+    if(!dump)
+    {
+        return std::unexpected(dump.error());
+    }
+
+    std::ofstream ofs(std::string{path}, std::ios::binary | std::ios::trunc);
+
+    if(ofs.fail())
+    {
+        return std::unexpected(Error::OpenFailed);
+    }
+
+    ofs.write(dump->data(), dump->size());
+
+    if(ofs.fail())
+    {
+        return std::unexpected(Error::WriteFailed);
+    }
+
+    return {};
+}
+
+std::expected<void, HeapDump::Error>
+HeapDump::install_signal_handler(std::string path, ObjectAllocator& allocator)
+{
+    signal_heap = &allocator;
+    signal_path = std::move(path);
+
+    struct sigaction action{};
+    action.sa_handler = &HeapDump::_handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if(sigaction(SIGUSR1, &action, nullptr) != 0)
+    {
+        return std::unexpected(Error::SignalFailed);
+    }
+
+    return {};
+}
+
+void HeapDump::_handle_signal(int)
+{
+    _requested.store(true, std::memory_order_relaxed);
+}
+
+void HeapDump::_write_requested(ObjectAllocator& allocator)
+{
+    // Neither VMs of other heaps nor threads sharing a heap take the request from the VM it is for.
+    if(&allocator != signal_heap || allocator.is_concurrent() || !_requested.exchange(false))
+    {
+        return;
+    }
+
+    auto path = std::format("{}.{}", signal_path, ++signal_dumps);
+
+    if(auto saved = save(path, allocator); !saved)
+    {
+        std::println(stderr, "{}: {}", get_error_message(saved.error()), path);
+        return;
+    }
+
+    std::println(stderr, "Heap dumped to {}", path);
+}
+
+std::string_view HeapDump::get_error_message(Error error)
+{
+    switch(error)
+    {
+    case Error::OpenFailed:
+        return "Failed to open heap dump";
+    case Error::WriteFailed:
+        return "Failed to write heap dump";
+    case Error::Concurrent:
+        return "Heaps shared between threads cannot be dumped";
+    case Error::SignalFailed:
+        return "Could not install the SIGUSR1 handler";
+    }
+}
+
+} // namespace lox
@@ -0,0 +1,66 @@
+#ifndef LOX_HEAP_DUMP_H
+#define LOX_HEAP_DUMP_H
+
+#include <atomic>
+#include <expected>
+#include <string>
+#include <string_view>
+
+namespace lox
+{
+
+class ObjectAllocator;
+
+// Writes the graph of the objects reachable in a heap, from the roots a collection starts at, to
+// a file which the heap_analyzer tool reads to find out what holds on to memory.
+//
+// Dumps are written by the dump_heap(path) native, by the --heap-dump option once the script has
+// run, and, once the handler is installed for a heap, by the first of its VMs to reach a safepoint
+// after the process receives SIGUSR1. Objects of shared heaps are left out, and heaps shared
+// between threads cannot be dumped.
+//
+// The file, in the host byte order, holds the magic "LOXHEAP\0" and a uint32 version, then a
+// uint32 count of names followed by each as a uint32 size and its bytes, the first of them empty.
+// Then comes a uint32 count of nodes followed by each as the uint32 indices of its kind and its
+// name, such as the class of an instance or the name of a function, its uint32 size in bytes and
+// a uint32 count of the nodes it refers to, followed by their uint32 indices. The first node stands
+// for the roots and refers to each of them.
+class HeapDump
+{
+public:
+    enum class Error
+    {
+        OpenFailed,
+        WriteFailed,
+        Concurrent,
+        SignalFailed
+    };
+
+    static std::expected<void, Error> save(std::string_view path, ObjectAllocator&);
+    static std::expected<std::string, Error> write(ObjectAllocator&);
+
+    // Writes a dump of the heap whenever the process receives SIGUSR1, to the path followed by the
+    // number of the dump. VMs of other heaps leave the request to it.
+    static std::expected<void, Error> install_signal_handler(std::string path, ObjectAllocator&);
+
+    // Called at safepoints.
+    static void poll(ObjectAllocator& allocator)
+    {
+        if(_requested.load(std::memory_order_relaxed)) [[unlikely]]
+        {
+            _write_requested(allocator);
+        }
+    }
+
+    static std::string_view get_error_message(Error);
+
+private:
+    static std::atomic<bool> _requested;
+
+    static void _handle_signal(int);
+    static void _write_requested(ObjectAllocator&);
+};
+
+} // namespace lox
+
+#endif // LOX_HEAP_DUMP_H
@@ -0,0 +1,28 @@
+#include "host_class.h"
+
+#include <format>
+
+namespace lox
+{
+
+HostProperty& HostClass::_define(std::string_view name)
+{
+    if(auto it = _by_name.find(name); it != _by_name.end())
+    {
+        *it->second = HostProperty{.owner = this, .name = it->second->name};
+        return *it->second;
+    }
+
+    auto& property =
+        _properties.emplace_back(HostProperty{.owner = this, .name = std::string{name}});
+    _by_name[property.name] = &property;
+
+    return property;
+}
+
+std::string HostObject::to_string() const
+{
+    return std::format("<host {}>", klass.get_name());
+}
+
+} // namespace lox
@@ -0,0 +1,158 @@
+#ifndef LOX_HOST_CLASS_H
+#define LOX_HOST_CLASS_H
+
+#include <concepts>
+#include <deque>
+#include <format>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "bind.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+namespace lox
+{
+
+class VM;
+
+// A property of a host class, which scripts may read, assign to or call depending on which of the
+// functions it has. They raise errors through the VM as natives do.
+struct HostProperty
+{
+    const HostClass* owner;
+    std::string name;
+
+    Value (*get)(VM&, void* record) = nullptr;
+    void (*set)(VM&, void* record, Value) = nullptr;
+    Value (*call)(VM&, void* record, std::span<Value> args) = nullptr;
+};
+
+// Describes how scripts see C++ records of some type, which HostObjects wrap without copying.
+// Properties are defined once, before any script uses the class, and lookups made by property
+// accesses are cached in their chunks, so the class must outlive the programs which use it.
+class HostClass
+{
+    std::string _name;
+    // A deque keeps properties in place, where caches point at them.
+    std::deque<HostProperty> _properties;
+    HashMap<HostProperty*> _by_name;
+
+protected:
+    // Returns the property of that name, emptied if it was defined before.
+    HostProperty& _define(std::string_view name);
+
+public:
+    explicit HostClass(std::string name)
+        : _name(std::move(name))
+    { }
+
+    HostClass(const HostClass&) = delete;
+    HostClass& operator=(const HostClass&) = delete;
+
+    const std::string& get_name() const
+    {
+        return _name;
+    }
+
+    const HostProperty* find(std::string_view name) const
+    {
+        auto it = _by_name.find(name);
+        return it != _by_name.end() ? it->second : nullptr;
+    }
+};
+
+// The class of records of type T. Fields are read and written in place through member pointers,
+// and getters and methods are plain functions or captureless lambdas taking the record first,
+// after the VM if they take one, with their other parameters and results converted as for natives
+// bound with VM::bind():
+//
+//     HostType<Trade> trade_class{"Trade"};
+//     trade_class.field<&Trade::price>("price")
+//         .field<&Trade::symbol>("symbol")
+//         .getter("value", [](const Trade& trade) { return trade.price * trade.quantity; })
+//         .method("scale", [](Trade& trade, double factor) { trade.quantity *= factor; });
+//
+// Methods can only be called, not read as values.
+template <typename T>
+class HostType : public HostClass
+{
+public:
+    using HostClass::HostClass;
+
+    // Exposes a data member of an arithmetic, bool or string type, which scripts may also assign
+    // to unless it is const.
+    template <auto member>
+        requires std::is_member_object_pointer_v<decltype(member)>
+    HostType& field(std::string_view name)
+    {
+        using Field = std::remove_reference_t<decltype(std::declval<T&>().*member)>;
+        using Stored = std::remove_cv_t<Field>;
+        // Strings are assigned from the string in the script.
+        using Parameter = binding::Parameter<
+            std::conditional_t<std::same_as<Stored, std::string>, std::string_view, Stored>>;
+
+        auto& property = _define(name);
+
+        property.get = [](VM& vm, void* record) {
+            return binding::to_value(vm, static_cast<T*>(record)->*member);
+        };
+
+        if constexpr(!std::is_const_v<Field>)
+        {
+            property.set = [](VM& vm, void* record, Value value) {
+                if(auto converted = Parameter::get(value))
+                {
+                    static_cast<T*>(record)->*member = Stored(*converted);
+                    return;
+                }
+
+                vm.raise(std::format("Expected {} for this field.", Parameter::DESCRIPTION));
+            };
+        }
+
+        return *this;
+    }
+
+    // Exposes the result of a function of the record as a property which scripts can only read.
+    template <typename F>
+        requires std::is_empty_v<F> && std::default_initializable<F>
+    HostType& getter(std::string_view name, F)
+    {
+        _define(name).get = [](VM& vm, void* record) {
+            return Trampoline<F>::invoke(vm, {}, *static_cast<T*>(record));
+        };
+
+        return *this;
+    }
+
+    template <typename F>
+        requires std::is_empty_v<F> && std::default_initializable<F>
+    HostType& method(std::string_view name, F)
+    {
+        _define(name).call = [](VM& vm, void* record, std::span<Value> args) {
+            return Trampoline<F>::invoke(vm, args, *static_cast<T*>(record));
+        };
+
+        return *this;
+    }
+
+    // Wraps a record, which must outlive every script that can reach it.
+    HostObject* wrap(ObjectAllocator& allocator, T& record) const
+    {
+        return allocator.allocate<HostObject>(true, *this, &record);
+    }
+
+private:
+    template <typename F, typename Signature = binding::MethodSignature<binding::SignatureOf<F>>>
+        requires std::same_as<std::remove_cvref_t<typename Signature::Receiver>, T>
+    using Trampoline = binding::Trampoline<F, Signature, typename Signature::Parameters>;
+};
+
+} // namespace lox
+
+#endif // LOX_HOST_CLASS_H
@@ -0,0 +1,108 @@
+#include "isolate.h"
+
+#include <cassert>
+#include <memory>
+#include <string>
+
+#include "module.h"
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+std::expected<std::shared_ptr<const Program>, InterpretResult>
+Program::compile(const std::string& source, const std::filesystem::path& directory)
+{
+    auto program = std::make_shared<Program>();
+    auto script = ModuleLoader::compile(source, directory, program->_allocator);
+
+    if(!script)
+    {
+        return std::unexpected(script.error());
+    }
+
+    program->_script = script.value();
+    program->_allocator.freeze();
+
+    return program;
+}
+
+Isolate::Isolate(std::shared_ptr<const Program> program)
+    : Isolate(program ? std::shared_ptr<const ObjectAllocator>(program, &program->get_allocator())
+                      : nullptr)
+{
+    _program = std::move(program);
+}
+
+Isolate::Isolate(std::shared_ptr<const ObjectAllocator> shared_heap)
+    : _allocator(_stack, _globals, _callstack, _open_upvalues, std::move(shared_heap))
+    , _vm(_allocator, _stack, _globals, _callstack, _open_upvalues)
+{ }
+
+std::expected<FunctionObject*, InterpretResult>
+Isolate::compile(const std::string& source, const std::filesystem::path& directory)
+{
+    return ModuleLoader::compile(source, directory, _allocator);
+}
+
+InterpretResult Isolate::run()
+{
+    assert(_program && "Isolate was created without a program");
+    return _vm.interpret(_program->get_script());
+}
+
+InterpretResult Isolate::run(FunctionObject& script)
+{
+    return _vm.interpret(script);
+}
+
+void Isolate::define_channel(std::string_view name, std::shared_ptr<Channel> channel)
+{
+    auto* key = _allocator.allocate_string(name, false);
+    _allocator.pin(key);
+
+    _globals[key->value()] = Value{_allocator.allocate<ChannelObject>(false, std::move(channel))};
+}
+
+std::optional<Handle> Isolate::get_global(std::string_view name)
+{
+    auto it = _globals.find(name);
+
+    if(it == _globals.end())
+    {
+        return std::nullopt;
+    }
+
+    return Handle{_allocator, it->second};
+}
+
+std::optional<Function> Isolate::get_function(std::string_view name)
+{
+    auto it = _globals.find(name);
+    auto* closure = it != _globals.end() && it->second.is_object()
+                        ? it->second.as_object()->as<ClosureObject>()
+                        : nullptr;
+
+    if(!closure)
+    {
+        return std::nullopt;
+    }
+
+    return Function{_allocator, *closure};
+}
+
+int exit_status(InterpretResult result)
+{
+    switch(result)
+    {
+    case InterpretResult::OK:
+        return 0;
+    case InterpretResult::PARSE_ERROR:
+        return 65;
+    case InterpretResult::COMPILE_ERROR:
+    case InterpretResult::RUNTIME_ERROR:
+        return 70;
+    }
+}
+
+} // namespace lox
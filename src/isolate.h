@@ -0,0 +1,273 @@
+#ifndef LOX_ISOLATE_H
+#define LOX_ISOLATE_H
+
+#include <array>
+#include <expected>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "channel.h"
+#include "common.h"
+#include "object.h"
+#include "stack.h"
+#include "value.h"
+#include "vm.h"
+
+namespace lox
+{
+
+// Compiled code which can be run by any number of isolates, including concurrently from several
+// threads. The code lives in its own heap which is frozen once compilation finishes, so isolates
+// never mark or collect it and share its interned strings instead of re-creating them.
+class Program
+{
+    ObjectAllocator _allocator;
+    FunctionObject* _script = nullptr;
+
+public:
+    Program() = default;
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    // Compiles a script and the modules it imports, which are resolved against the directory.
+    static std::expected<std::shared_ptr<const Program>, InterpretResult>
+    compile(const std::string& source, const std::filesystem::path& directory = {});
+
+    FunctionObject& get_script() const
+    {
+        return *_script;
+    }
+
+    const ObjectAllocator& get_allocator() const
+    {
+        return _allocator;
+    }
+};
+
+// Keeps a value alive across collections for as long as the handle exists, for C++ code which
+// holds on to values between calls into scripts. Values which are not objects need no keeping
+// alive. Handles must not outlive the heap of their value.
+class Handle
+{
+    ObjectAllocator* _heap = nullptr;
+    Value _value;
+
+public:
+    Handle() = default;
+
+    Handle(ObjectAllocator& heap, Value value)
+        : _value(value)
+    {
+        if(_value.is_object())
+        {
+            _heap = &heap;
+            _heap->pin(_value.as_object());
+        }
+    }
+
+    Handle(const Handle& other)
+        : _heap(other._heap)
+        , _value(other._value)
+    {
+        if(_heap)
+        {
+            _heap->pin(_value.as_object());
+        }
+    }
+
+    Handle(Handle&& other) noexcept
+        : _heap(std::exchange(other._heap, nullptr))
+        , _value(other._value)
+    { }
+
+    Handle& operator=(Handle other) noexcept
+    {
+        std::swap(_heap, other._heap);
+        std::swap(_value, other._value);
+        return *this;
+    }
+
+    ~Handle()
+    {
+        if(_heap)
+        {
+            _heap->unpin(_value.as_object());
+        }
+    }
+
+    Value get() const
+    {
+        return _value;
+    }
+};
+
+// A function of a script held for calling from C++. It is known to be a function once it is
+// looked up, rather than being checked on every call.
+class Function
+{
+    Handle _handle;
+    ClosureObject* _closure;
+
+public:
+    Function(ObjectAllocator& heap, ClosureObject& closure)
+        : _handle(heap, Value{&closure})
+        , _closure(&closure)
+    { }
+
+    ClosureObject& get_closure() const
+    {
+        return *_closure;
+    }
+
+    const Handle& get_handle() const
+    {
+        return _handle;
+    }
+};
+
+// A self-contained interpreter: a VM together with its own heap, stacks and globals. Isolates
+// share nothing mutable with each other, so separate isolates may run on separate threads.
+//
+// Embedders compile a program once, create isolates for it, run() its script to define its
+// functions, and then look them up with get_global() and call() them as often as they like.
+class Isolate
+{
+    std::shared_ptr<const Program> _program;
+
+    CallStack _callstack;
+    FixedStack<Value> _stack;
+    HashMap<Value> _globals;
+    std::vector<UpValueObject*> _open_upvalues;
+
+    ObjectAllocator _allocator;
+    VM _vm;
+
+    Value _to_value(Value value)
+    {
+        return value;
+    }
+
+    Value _to_value(const Handle& handle)
+    {
+        return handle.get();
+    }
+
+    Value _to_value(Object* object)
+    {
+        return Value{object};
+    }
+
+    Value _to_value(bool boolean)
+    {
+        return Value{boolean};
+    }
+
+    template <typename T>
+        requires std::is_arithmetic_v<T>
+    Value _to_value(T number)
+    {
+        return Value{static_cast<double>(number)};
+    }
+
+    Value _to_value(std::string_view string)
+    {
+        return Value{_allocator.allocate_string(string, false)};
+    }
+
+    Value _to_value(const char* string)
+    {
+        return _to_value(std::string_view{string});
+    }
+
+    template <typename Callee, typename... Args>
+    std::expected<Value, InterpretResult> _call(Callee&& callee, Args&&... args)
+    {
+        // Strings are interned without collecting, so the arguments stay valid until the call.
+        std::array<Value, sizeof...(Args)> values{_to_value(std::forward<Args>(args))...};
+
+        if(_callstack.size() == 0)
+        {
+            _vm.start_run();
+        }
+
+        return _vm.call(callee, values);
+    }
+
+public:
+    explicit Isolate(std::shared_ptr<const Program> program = nullptr);
+
+    // Creates an isolate whose scripts may use objects of another heap in place. That heap must
+    // stay frozen for as long as this isolate exists.
+    explicit Isolate(std::shared_ptr<const ObjectAllocator> shared_heap);
+
+    Isolate(const Isolate&) = delete;
+    Isolate& operator=(const Isolate&) = delete;
+
+    // Compiles a script, and the modules it imports, into this isolate's own heap.
+    std::expected<FunctionObject*, InterpretResult>
+    compile(const std::string& source, const std::filesystem::path& directory = {});
+
+    // Runs the script of the program this isolate was created with.
+    InterpretResult run();
+    InterpretResult run(FunctionObject& script);
+
+    // Makes a channel, typically shared with other isolates, available to scripts as a global.
+    void define_channel(std::string_view name, std::shared_ptr<Channel> channel);
+
+    // Looks up a global, such as a function which the script defined.
+    std::optional<Handle> get_global(std::string_view name);
+    // Looks up a global which must be a function, for calling it repeatedly.
+    std::optional<Function> get_function(std::string_view name);
+
+    // Keeps a value alive, typically one which call() returned.
+    Handle hold(Value value)
+    {
+        return Handle{_allocator, value};
+    }
+
+    // Calls a function, class or native and runs it to completion. The arguments may be values,
+    // handles, numbers, booleans or strings. A call made from outside of any run is a run of its
+    // own as far as the limits are concerned. Natives may call back into scripts with this or
+    // with VM::call(), leaving their caller's frames as they were.
+    //
+    // The result is not kept alive, so it must be held before anything else may allocate.
+    template <typename... Args>
+    std::expected<Value, InterpretResult> call(const Handle& callee, Args&&... args)
+    {
+        return _call(callee.get(), std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::expected<Value, InterpretResult> call(const Function& function, Args&&... args)
+    {
+        return _call(function.get_closure(), std::forward<Args>(args)...);
+    }
+
+    ObjectAllocator& get_allocator()
+    {
+        return _allocator;
+    }
+
+    VM& get_vm()
+    {
+        return _vm;
+    }
+
+    HashMap<Value>& get_globals()
+    {
+        return _globals;
+    }
+};
+
+// Maps the result of compiling or running a script to the interpreter's exit status.
+int exit_status(InterpretResult);
+
+} // namespace lox
+
+#endif // LOX_ISOLATE_H
@@ -1,15 +1,30 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <print>
 #include <sstream>
+#include <thread>
+#include <unistd.h>
 
-#include "chunk.h"
-#include "common.h"
-#include "compiler.h"
-#include "object.h"
-#include "parser.h"
-#include "scanner.h"
-#include "stack.h"
+#include "alloc_profiler.h"
+#include "batch.h"
+#include "heap_dump.h"
+#include "isolate.h"
+#include "module.h"
+#include "op_stats.h"
+#include "profiler.h"
+#include "repl.h"
+#include "scheduler.h"
+#include "server.h"
+#include "shared_heap.h"
+#include "snapshot.h"
+#include "tracer.h"
 #include "vm.h"
 
 namespace
@@ -30,69 +45,551 @@ std::string read_file(std::string_view filename)
     return buf.str();
 }
 
-void repl(lox::VM& vm)
+// Imports in a script are resolved against the directory the script is in.
+std::filesystem::path get_directory(std::string_view filename)
 {
-    std::print("> ");
-    for(std::string line; std::getline(std::cin, line);)
+    return std::filesystem::path{filename}.parent_path();
+}
+
+struct Options
+{
+    std::optional<std::string_view> script;
+    // Image to restore the heap from before running the script.
+    std::optional<std::string_view> image;
+    // Image to write the heap to after running the script.
+    std::optional<std::string_view> snapshot;
+    // Socket to serve requests on once the script has run.
+    std::optional<std::string_view> serve;
+    // Socket of a server to run the script on.
+    std::optional<std::string_view> connect;
+    // Manifest listing scripts to run concurrently.
+    std::optional<std::string_view> batch;
+    // Number of threads to run a batch on.
+    std::optional<std::string_view> jobs;
+    // Number of threads to run the script's fibers on.
+    std::optional<std::string_view> workers;
+    // Whether to run the script's threads on one shared heap.
+    bool shared_heap = false;
+    // Limits on each run, see VM::Limits.
+    std::optional<std::string_view> step_limit;
+    std::optional<std::string_view> time_limit;
+    std::optional<std::string_view> time_slice;
+    // File to write the stacks the profiler sampled to, which turns it on.
+    std::optional<std::string_view> profile;
+    // Samples per second of CPU time.
+    std::optional<std::string_view> profile_rate;
+    // Whether to count the instructions the script runs.
+    bool op_stats = false;
+    // Whether to report the sites which allocate the most, and what survives collections.
+    bool alloc_profile = false;
+    // Bytes allocated between sampled allocations.
+    std::optional<std::string_view> alloc_sample;
+    // File to dump the heap to once the script has run, numbered for every dump SIGUSR1 asks for.
+    std::optional<std::string_view> heap_dump;
+    // File to write a timeline of calls, collections and compiles to, which turns tracing on.
+    std::optional<std::string_view> trace_out;
+    // Microseconds a call or native must take to be traced.
+    std::optional<std::string_view> trace_threshold;
+    // Whether to read scripts from stdin once the script has run.
+    bool repl = false;
+    // Directory to keep compiled modules in between runs.
+    std::optional<std::string_view> module_cache;
+};
+
+lox::VM::Limits parse_limits(const Options& options);
+unsigned parse_count(std::string_view option);
+
+// Runs the script under the profiler, then writes the stacks it sampled to the profile and a
+// summary to stderr, whether or not the script succeeded.
+lox::InterpretResult
+run_profiled(lox::Isolate& isolate, lox::FunctionObject& script, const Options& options)
+{
+    constexpr unsigned SAMPLES_PER_SECOND = 1000;
+    constexpr size_t REPORTED = 20;
+
+    std::unique_ptr<std::FILE, decltype(&std::fclose)> output{
+        std::fopen(std::string{*options.profile}.c_str(), "w"), &std::fclose};
+
+    if(!output)
+    {
+        std::println(stderr, "Could not open profile: {}", *options.profile);
+        std::exit(74);
+    }
+
+    lox::Profiler profiler{
+        isolate.get_vm(),
+        options.profile_rate ? parse_count(*options.profile_rate) : SAMPLES_PER_SECOND};
+
+    if(auto started = profiler.start(); !started)
+    {
+        std::println(stderr, "{}", lox::Profiler::get_error_message(started.error()));
+        std::exit(71);
+    }
+
+    auto result = isolate.run(script);
+
+    profiler.stop();
+    profiler.write_collapsed(output.get());
+    profiler.write_report(stderr, REPORTED);
+
+    return result;
+}
+
+// Writes the trace and stops tracing, if the trace was not written yet.
+void write_trace(std::optional<lox::Tracer>& tracer, lox::VM& vm, const Options& options)
+{
+    if(!tracer)
+    {
+        return;
+    }
+
+    tracer->stop();
+    vm.set_tracer(nullptr);
+
+    std::unique_ptr<std::FILE, decltype(&std::fclose)> output{
+        std::fopen(std::string{*options.trace_out}.c_str(), "w"), &std::fclose};
+
+    if(!output)
+    {
+        std::println(stderr, "Could not open trace: {}", *options.trace_out);
+        std::exit(74);
+    }
+
+    tracer->write(output.get());
+    tracer.reset();
+}
+
+void run_file(const Options& options)
+{
+    lox::Isolate isolate;
+    isolate.get_vm().set_limits(parse_limits(options));
+
+    // Covers loading the image and compiling and running the script, or else the whole session.
+    std::optional<lox::Tracer> tracer;
+
+    if(options.trace_out)
+    {
+        constexpr unsigned THRESHOLD_MICROSECONDS = 100;
+
+        tracer.emplace(std::chrono::microseconds{
+            options.trace_threshold ? parse_count(*options.trace_threshold)
+                                    : THRESHOLD_MICROSECONDS});
+        tracer->start();
+        isolate.get_vm().set_tracer(&*tracer);
+    }
+
+    if(options.heap_dump)
+    {
+        if(auto installed = lox::HeapDump::install_signal_handler(std::string{*options.heap_dump},
+                                                                  isolate.get_allocator());
+           !installed)
+        {
+            std::println(stderr, "{}", lox::HeapDump::get_error_message(installed.error()));
+            std::exit(71);
+        }
+    }
+
+    if(options.image)
+    {
+        auto loaded =
+            lox::Snapshot::load(*options.image, isolate.get_allocator(), isolate.get_globals());
+
+        if(!loaded)
+        {
+            std::println(stderr,
+                         "{}: {}",
+                         lox::Snapshot::get_error_message(loaded.error()),
+                         *options.image);
+            std::exit(74);
+        }
+    }
+
+    if(options.script)
+    {
+        auto script = isolate.compile(read_file(*options.script), get_directory(*options.script));
+
+        if(!script)
+        {
+            write_trace(tracer, isolate.get_vm(), options);
+            std::exit(lox::exit_status(script.error()));
+        }
+
+        std::optional<lox::OpStats> op_stats;
+        std::optional<lox::AllocationProfiler> alloc_profiler;
+
+        if(options.op_stats)
+        {
+            op_stats.emplace(isolate.get_allocator());
+            isolate.get_vm().set_op_stats(&*op_stats);
+        }
+
+        if(options.alloc_profile)
+        {
+            constexpr size_t SAMPLE_INTERVAL = 4096;
+
+            alloc_profiler.emplace(
+                isolate.get_vm(),
+                isolate.get_allocator(),
+                options.alloc_sample ? parse_count(*options.alloc_sample) : SAMPLE_INTERVAL);
+            alloc_profiler->start();
+        }
+
+        auto result = options.profile ? run_profiled(isolate, *script.value(), options)
+                                      : isolate.run(*script.value());
+
+        write_trace(tracer, isolate.get_vm(), options);
+
+        if(op_stats)
+        {
+            constexpr size_t REPORTED = 30;
+
+            isolate.get_vm().set_op_stats(nullptr);
+            op_stats->write_report(stderr, REPORTED);
+        }
+
+        if(alloc_profiler)
+        {
+            constexpr size_t REPORTED = 20;
+
+            alloc_profiler->stop();
+            alloc_profiler->write_report(stderr, REPORTED);
+        }
+
+        if(result != lox::InterpretResult::OK)
+        {
+            std::exit(lox::exit_status(result));
+        }
+    }
+
+    if(options.repl)
+    {
+        auto directory = options.script ? get_directory(*options.script) : std::filesystem::path{};
+        lox::Repl{isolate, directory}.run(std::cin);
+    }
+
+    write_trace(tracer, isolate.get_vm(), options);
+
+    if(options.heap_dump)
+    {
+        if(auto saved = lox::HeapDump::save(*options.heap_dump, isolate.get_allocator()); !saved)
+        {
+            std::println(stderr,
+                         "{}: {}",
+                         lox::HeapDump::get_error_message(saved.error()),
+                         *options.heap_dump);
+            std::exit(74);
+        }
+    }
+
+    if(options.snapshot)
     {
-        std::print("> ");
-        // vm.interpret();
+        if(auto saved = lox::Snapshot::save(*options.snapshot, isolate.get_globals()); !saved)
+        {
+            std::println(stderr,
+                         "{}: {}",
+                         lox::Snapshot::get_error_message(saved.error()),
+                         *options.snapshot);
+            std::exit(74);
+        }
+    }
+
+    if(options.serve)
+    {
+        auto served = lox::Server{isolate}.serve(*options.serve);
+        std::println(
+            stderr, "{}: {}", lox::Server::get_error_message(served.error()), *options.serve);
+        std::exit(74);
     }
 }
 
-void run_file(std::string_view filename)
+void run_remote(std::string_view socket_path, std::string_view filename)
 {
-    const auto source = read_file(filename);
+    auto status = lox::Server::request(
+        socket_path, read_file(filename), STDOUT_FILENO, STDERR_FILENO);
 
-    lox::Scanner scanner{source};
+    if(!status)
+    {
+        std::println(
+            stderr, "{}: {}", lox::Server::get_error_message(status.error()), socket_path);
+        std::exit(74);
+    }
 
-    lox::CallStack callstack;
-    lox::FixedStack<lox::Value> stack;
-    lox::HashMap<lox::Value> globals;
-    std::vector<lox::UpValueObject*> open_upvalues;
+    std::exit(status.value());
+}
 
-    lox::ObjectAllocator allocator{stack, globals, callstack, open_upvalues};
+[[noreturn]] void usage()
+{
+    std::println(stderr,
+                 "Usage: clox [--image path] [--snapshot path] [--serve socket] [--repl] [limits] "
+                 "[path]\n"
+                 "       clox --connect socket path\n"
+                 "       clox --batch manifest [-j jobs]\n"
+                 "       clox --workers n [limits] path\n"
+                 "       clox --shared-heap [limits] path\n"
+                 "Limits: [--step-limit n] [--time-limit ms] [--time-slice ms]\n"
+                 "Profile the script with [--profile stacks-file] [--profile-rate hz] [--opstats]\n"
+                 "                        [--alloc-profile] [--alloc-sample bytes]\n"
+                 "Dump the heap once the script has run, or on SIGUSR1, with [--heap-dump path]\n"
+                 "Trace calls, collections and compiles with [--trace-out trace.json]\n"
+                 "                                           [--trace-threshold us]\n"
+                 "Any of these may keep compiled modules with [--module-cache dir]\n");
+    std::exit(64);
+}
 
-    lox::Parser parser{scanner, allocator};
+unsigned parse_count(std::string_view option)
+{
+    unsigned count = 0;
+    auto [end, error] = std::from_chars(option.data(), option.data() + option.size(), count);
+
+    if(error != std::errc{} || end != option.data() + option.size() || count == 0)
+    {
+        usage();
+    }
 
-    auto declarations = parser.parse();
+    return count;
+}
+
+lox::VM::Limits parse_limits(const Options& options)
+{
+    lox::VM::Limits limits;
 
-    if(!declarations)
+    if(options.step_limit)
     {
-        std::exit(65);
+        limits.steps = parse_count(*options.step_limit);
     }
 
-    lox::Compiler compiler{allocator};
+    if(options.time_limit)
+    {
+        limits.time = std::chrono::milliseconds{parse_count(*options.time_limit)};
+    }
+
+    if(options.time_slice)
+    {
+        limits.time_slice = std::chrono::milliseconds{parse_count(*options.time_slice)};
+    }
+
+    return limits;
+}
+
+void run_batch(std::string_view manifest, std::optional<std::string_view> jobs_option)
+{
+    unsigned jobs = jobs_option ? parse_count(*jobs_option)
+                                : std::max(std::thread::hardware_concurrency(), 1u);
 
-    auto script = compiler.compile(declarations.value());
+    auto batch = lox::Batch::from_manifest(manifest);
 
-    if(!script)
+    if(!batch)
     {
-        std::exit(70);
+        std::println(stderr, "{}: {}", lox::Batch::get_error_message(batch.error()), manifest);
+        std::exit(74);
     }
 
-    lox::VM vm{allocator, stack, globals, callstack, open_upvalues};
-    auto result = vm.interpret(*script.value());
+    std::exit(batch->run(jobs) == 0 ? 0 : 1);
+}
+
+void run_scheduled(const Options& options)
+{
+    auto program =
+        lox::Program::compile(read_file(*options.script), get_directory(*options.script));
+
+    if(!program)
+    {
+        std::exit(lox::exit_status(program.error()));
+    }
 
-    if(result == lox::InterpretResult::RUNTIME_ERROR)
-        std::exit(70);
+    lox::Scheduler scheduler{program.value(), parse_count(*options.workers)};
+    scheduler.set_limits(parse_limits(options));
+
+    std::exit(lox::exit_status(scheduler.run()));
+}
+
+void run_shared(const Options& options)
+{
+    auto program =
+        lox::Program::compile(read_file(*options.script), get_directory(*options.script));
+
+    if(!program)
+    {
+        std::exit(lox::exit_status(program.error()));
+    }
+
+    lox::SharedHeap heap{program.value()};
+    heap.get_vm().set_limits(parse_limits(options));
+
+    std::exit(lox::exit_status(heap.run()));
+}
+
+Options parse_options(int argc, const char* argv[])
+{
+    Options options;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+
+        auto value = [&](std::optional<std::string_view>& option) {
+            if(i + 1 == argc)
+            {
+                usage();
+            }
+
+            option = argv[++i];
+        };
+
+        if(arg == "--image")
+        {
+            value(options.image);
+        }
+        else if(arg == "--snapshot")
+        {
+            value(options.snapshot);
+        }
+        else if(arg == "--serve")
+        {
+            value(options.serve);
+        }
+        else if(arg == "--connect")
+        {
+            value(options.connect);
+        }
+        else if(arg == "--batch")
+        {
+            value(options.batch);
+        }
+        else if(arg == "-j")
+        {
+            value(options.jobs);
+        }
+        else if(arg == "--workers")
+        {
+            value(options.workers);
+        }
+        else if(arg == "--shared-heap")
+        {
+            options.shared_heap = true;
+        }
+        else if(arg == "--step-limit")
+        {
+            value(options.step_limit);
+        }
+        else if(arg == "--time-limit")
+        {
+            value(options.time_limit);
+        }
+        else if(arg == "--time-slice")
+        {
+            value(options.time_slice);
+        }
+        else if(arg == "--profile")
+        {
+            value(options.profile);
+        }
+        else if(arg == "--profile-rate")
+        {
+            value(options.profile_rate);
+        }
+        else if(arg == "--opstats")
+        {
+            options.op_stats = true;
+        }
+        else if(arg == "--alloc-profile")
+        {
+            options.alloc_profile = true;
+        }
+        else if(arg == "--alloc-sample")
+        {
+            value(options.alloc_sample);
+        }
+        else if(arg == "--heap-dump")
+        {
+            value(options.heap_dump);
+        }
+        else if(arg == "--trace-out")
+        {
+            value(options.trace_out);
+        }
+        else if(arg == "--trace-threshold")
+        {
+            value(options.trace_threshold);
+        }
+        else if(arg == "--repl")
+        {
+            options.repl = true;
+        }
+        else if(arg == "--module-cache")
+        {
+            value(options.module_cache);
+        }
+        else if(!arg.starts_with("--") && !options.script)
+        {
+            options.script = arg;
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    return options;
 }
 } // namespace
 
 int main(int argc, const char* argv[])
 {
-    lox::Chunk chunk;
+    auto options = parse_options(argc, argv);
+
     if(argc == 1)
     {
-        // repl(vm);
+        options.repl = true;
+    }
+
+    if(options.module_cache)
+    {
+        lox::ModuleLoader::set_cache_directory(*options.module_cache);
+    }
+
+    if(options.connect)
+    {
+        if(!options.script || options.repl || options.heap_dump || options.trace_out)
+        {
+            usage();
+        }
+
+        run_remote(*options.connect, *options.script);
+    }
+    else if(options.batch)
+    {
+        if(options.script || options.repl || options.heap_dump || options.trace_out)
+        {
+            usage();
+        }
+
+        run_batch(*options.batch, options.jobs);
     }
-    else if(argc == 2)
+    else if(options.workers)
     {
-        run_file(argv[1]);
+        if(!options.script || options.image || options.snapshot || options.serve || options.repl
+           || options.profile || options.op_stats || options.alloc_profile || options.heap_dump
+           || options.trace_out)
+        {
+            usage();
+        }
+
+        run_scheduled(options);
+    }
+    else if(options.shared_heap)
+    {
+        if(!options.script || options.image || options.snapshot || options.serve || options.repl
+           || options.profile || options.op_stats || options.alloc_profile || options.heap_dump
+           || options.trace_out)
+        {
+            usage();
+        }
+
+        run_shared(options);
     }
     else
     {
-        std::println(stderr, "Usage: clox [path]\n");
-        std::exit(64);
+        run_file(options);
     }
 }
\ No newline at end of file
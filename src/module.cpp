@@ -0,0 +1,497 @@
+#include "module.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <span>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "common.h"
+#include "compiler.h"
+#include "parser.h"
+#include "scanner.h"
+#include "snapshot.h"
+#include "tracer.h"
+#include "value.h"
+
+namespace lox
+{
+namespace
+{
+
+constexpr char MAGIC[8] = {'L', 'O', 'X', 'M', 'O', 'D', '\0', '\0'};
+// Part of the key of every cached module, so that modules compiled differently are not reused.
+constexpr uint32_t VERSION = 1;
+// The global under which the image of a module holds its script.
+constexpr std::string_view SCRIPT = "script";
+
+struct CompiledModule
+{
+    std::string image;
+    std::vector<std::string> imports;
+};
+
+using CompileResult = std::expected<std::shared_ptr<const CompiledModule>, InterpretResult>;
+
+std::optional<std::string> read_file(const std::filesystem::path& path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+
+    if(ifs.fail())
+    {
+        return std::nullopt;
+    }
+
+    std::stringstream buf;
+
+    buf << ifs.rdbuf();
+
+    return buf.str();
+}
+
+std::expected<FunctionObject*, InterpretResult>
+compile_source(const std::string& source,
+               const std::filesystem::path& directory,
+               ObjectAllocator& allocator,
+               std::vector<std::string>& imports)
+{
+    Scanner scanner{source};
+    Parser parser{scanner, allocator};
+
+    // The parser scans tokens as it goes, so scanning is part of parsing.
+    auto declarations = [&parser] {
+        Tracer::Span span{"compile", "scan and parse"};
+        return parser.parse();
+    }();
+
+    if(!declarations)
+    {
+        return std::unexpected(InterpretResult::PARSE_ERROR);
+    }
+
+    Compiler compiler{allocator};
+
+    auto script = [&] {
+        Tracer::Span span{"compile", "compile script"};
+        return compiler.compile(declarations.value(), directory);
+    }();
+
+    if(!script)
+    {
+        return std::unexpected(InterpretResult::COMPILE_ERROR);
+    }
+
+    imports = compiler.get_imports();
+
+    return script.value();
+}
+
+// FNV-1a of everything a compiled module depends on.
+uint64_t hash_module(std::string_view path, std::string_view source)
+{
+    uint64_t hash = 14695981039346656037u;
+
+    auto add = [&hash](std::string_view bytes) {
+        for(auto byte : bytes)
+        {
+            hash = (hash ^ static_cast<uint8_t>(byte)) * 1099511628211u;
+        }
+    };
+
+    add({reinterpret_cast<const char*>(&VERSION), sizeof(VERSION)});
+    add(path);
+    add({"", 1});
+    add(source);
+
+    return hash;
+}
+
+// Compiled modules of the process, by path, and those in the cache directory.
+class ModuleCache
+{
+    struct Entry
+    {
+        std::string source;
+        std::shared_ptr<const CompiledModule> module;
+    };
+
+    std::mutex _mutex;
+    absl::flat_hash_map<std::string, Entry> _modules;
+    std::filesystem::path _directory;
+
+    static std::filesystem::path _get_file(const std::filesystem::path& directory,
+                                           std::string_view path,
+                                           std::string_view source)
+    {
+        return directory / std::format("{:016x}.loxc", hash_module(path, source));
+    }
+
+    static std::shared_ptr<const CompiledModule>
+    _read(const std::filesystem::path& file, std::string_view path, std::string_view source);
+    static void _write(const std::filesystem::path& file,
+                       std::string_view path,
+                       std::string_view source,
+                       const CompiledModule&);
+
+public:
+    static ModuleCache& get()
+    {
+        static ModuleCache cache;
+        return cache;
+    }
+
+    void set_directory(std::filesystem::path directory)
+    {
+        std::lock_guard lock{_mutex};
+        _directory = std::move(directory);
+    }
+
+    std::shared_ptr<const CompiledModule> find(const std::string& path, const std::string& source);
+    void insert(const std::string& path, std::string source, std::shared_ptr<const CompiledModule>);
+};
+
+std::shared_ptr<const CompiledModule> ModuleCache::_read(const std::filesystem::path& file,
+                                                         std::string_view path,
+                                                         std::string_view source)
+{
+    auto contents = read_file(file);
+
+    if(!contents)
+    {
+        return nullptr;
+    }
+
+    std::string_view data = *contents;
+
+    auto get_bytes = [&data](size_t size) -> std::optional<std::string_view> {
+        if(size > data.size())
+        {
+            return std::nullopt;
+        }
+
+        auto bytes = data.substr(0, size);
+        data.remove_prefix(size);
+
+        return bytes;
+    };
+
+    auto get_size = [&get_bytes]() -> std::optional<uint64_t> {
+        auto bytes = get_bytes(sizeof(uint64_t));
+
+        if(!bytes)
+        {
+            return std::nullopt;
+        }
+
+        uint64_t size;
+        std::memcpy(&size, bytes->data(), sizeof(size));
+
+        return size;
+    };
+
+    auto get_string = [&]() -> std::optional<std::string_view> {
+        auto size = get_size();
+        return size ? get_bytes(*size) : std::nullopt;
+    };
+
+    auto magic = get_bytes(sizeof(MAGIC));
+    auto version = get_size();
+    auto stored_path = get_string();
+    auto source_size = get_size();
+    auto import_count = get_size();
+
+    // A file for another module whose hash collides, or one which was cut short, is not used.
+    if(!magic || *magic != std::string_view{MAGIC, sizeof(MAGIC)} || version != VERSION
+       || stored_path != path || source_size != source.size() || !import_count)
+    {
+        return nullptr;
+    }
+
+    auto module = std::make_shared<CompiledModule>();
+
+    for(auto count = *import_count; count > 0; --count)
+    {
+        auto import = get_string();
+
+        if(!import)
+        {
+            return nullptr;
+        }
+
+        module->imports.emplace_back(*import);
+    }
+
+    module->image = data;
+
+    return module;
+}
+
+void ModuleCache::_write(const std::filesystem::path& file,
+                         std::string_view path,
+                         std::string_view source,
+                         const CompiledModule& module)
+{
+    std::string contents{MAGIC, sizeof(MAGIC)};
+
+    auto put_size = [&contents](uint64_t size) {
+        contents.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    };
+
+    auto put_string = [&](std::string_view string) {
+        put_size(string.size());
+        contents.append(string);
+    };
+
+    put_size(VERSION);
+    put_string(path);
+    put_size(source.size());
+    put_size(module.imports.size());
+
+    for(const auto& import : module.imports)
+    {
+        put_string(import);
+    }
+
+    contents.append(module.image);
+
+    // Renaming a complete file into place keeps other processes from reading a partial one.
+    std::error_code error;
+    std::filesystem::create_directories(file.parent_path(), error);
+
+    auto temporary = file;
+    temporary += std::format(
+        ".{}.{}", ::getpid(), std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+    {
+        std::ofstream ofs(temporary, std::ios::binary | std::ios::trunc);
+        ofs.write(contents.data(), contents.size());
+
+        if(ofs.fail())
+        {
+            ofs.close();
+            std::filesystem::remove(temporary, error);
+            return;
+        }
+    }
+
+    std::filesystem::rename(temporary, file, error);
+
+    if(error)
+    {
+        std::filesystem::remove(temporary, error);
+    }
+}
+
+std::shared_ptr<const CompiledModule> ModuleCache::find(const std::string& path,
+                                                        const std::string& source)
+{
+    std::filesystem::path directory;
+
+    {
+        std::lock_guard lock{_mutex};
+
+        if(auto it = _modules.find(path); it != _modules.end() && it->second.source == source)
+        {
+            return it->second.module;
+        }
+
+        directory = _directory;
+    }
+
+    if(directory.empty())
+    {
+        return nullptr;
+    }
+
+    auto module = _read(_get_file(directory, path, source), path, source);
+
+    if(module)
+    {
+        std::lock_guard lock{_mutex};
+        _modules[path] = {source, module};
+    }
+
+    return module;
+}
+
+void ModuleCache::insert(const std::string& path,
+                         std::string source,
+                         std::shared_ptr<const CompiledModule> module)
+{
+    std::filesystem::path directory;
+
+    {
+        std::lock_guard lock{_mutex};
+        _modules[path] = {source, module};
+        directory = _directory;
+    }
+
+    if(!directory.empty())
+    {
+        _write(_get_file(directory, path, source), path, source, *module);
+    }
+}
+
+CompileResult compile_module(const std::string& path)
+{
+    auto source = read_file(path);
+
+    if(!source)
+    {
+        std::println(get_diagnostics(), "Could not read module '{}'.", path);
+        return std::unexpected(InterpretResult::COMPILE_ERROR);
+    }
+
+    Tracer::Span span{"compile", path};
+    auto& cache = ModuleCache::get();
+
+    if(auto module = cache.find(path, *source))
+    {
+        return module;
+    }
+
+    // A heap of its own lets modules compile concurrently. Names go to the common table, from
+    // where the heap of the script finds the same ones when loading the image.
+    ObjectAllocator heap;
+    auto module = std::make_shared<CompiledModule>();
+    auto script =
+        compile_source(*source, std::filesystem::path{path}.parent_path(), heap, module->imports);
+
+    if(!script)
+    {
+        std::println(get_diagnostics(), "In module '{}'.", path);
+        return std::unexpected(script.error());
+    }
+
+    HashMap<Value> globals{{SCRIPT, Value{script.value()}}};
+    auto image = Snapshot::write(globals);
+
+    if(!image)
+    {
+        std::println(get_diagnostics(), "{}: {}", Snapshot::get_error_message(image.error()), path);
+        return std::unexpected(InterpretResult::COMPILE_ERROR);
+    }
+
+    module->image = std::move(image.value());
+    cache.insert(path, std::move(source.value()), module);
+
+    return module;
+}
+
+// Compiles the modules on up to as many threads as the hardware runs at once, this one included.
+std::vector<CompileResult> compile_modules(const std::vector<std::string>& paths)
+{
+    std::vector<CompileResult> compiled(paths.size());
+    std::atomic<size_t> next = 0;
+    // Errors in modules go wherever those of the importing script do.
+    auto* errors = get_diagnostics();
+
+    auto work = [&] {
+        set_diagnostics(errors);
+
+        for(size_t index; (index = next++) < paths.size();)
+        {
+            compiled[index] = compile_module(paths[index]);
+        }
+    };
+
+    {
+        auto threads =
+            std::min<size_t>(paths.size(), std::max(std::thread::hardware_concurrency(), 1u));
+        std::vector<std::jthread> workers;
+
+        for(size_t i = 1; i < threads; ++i)
+        {
+            workers.emplace_back(work);
+        }
+
+        work();
+    }
+
+    return compiled;
+}
+
+} // namespace
+
+std::expected<FunctionObject*, InterpretResult> ModuleLoader::compile(
+    const std::string& source, const std::filesystem::path& directory, ObjectAllocator& allocator)
+{
+    std::vector<std::string> pending;
+    auto script = compile_source(source, directory, allocator, pending);
+
+    if(!script)
+    {
+        return script;
+    }
+
+    absl::flat_hash_set<std::string> seen(pending.begin(), pending.end());
+
+    // Modules registered by earlier compiles into the heap, such as earlier inputs of a REPL, are
+    // not compiled again, so that importing them again gets the module already loaded.
+    std::erase_if(pending, [&allocator](const auto& path) { return allocator.find_module(path); });
+
+    while(!pending.empty())
+    {
+        auto compiled = compile_modules(pending);
+        std::vector<std::string> imported;
+
+        // Loading allocates from the heap of the script, which only this thread may do.
+        for(size_t i = 0; i < pending.size(); ++i)
+        {
+            if(!compiled[i])
+            {
+                return std::unexpected(compiled[i].error());
+            }
+
+            const auto& module = *compiled[i].value();
+            HashMap<Value> globals;
+            auto loaded = Snapshot::read(module.image, allocator, globals);
+            auto* function = loaded && globals.contains(SCRIPT) && globals[SCRIPT].is_object()
+                                 ? globals[SCRIPT].as_object()->as<FunctionObject>()
+                                 : nullptr;
+
+            if(!function)
+            {
+                std::println(get_diagnostics(), "Malformed compiled module: {}", pending[i]);
+                return std::unexpected(InterpretResult::COMPILE_ERROR);
+            }
+
+            allocator.add_module(pending[i], function);
+
+            for(const auto& import : module.imports)
+            {
+                if(seen.insert(import).second && !allocator.find_module(import))
+                {
+                    imported.push_back(import);
+                }
+            }
+        }
+
+        pending = std::move(imported);
+    }
+
+    return script;
+}
+
+void ModuleLoader::set_cache_directory(std::filesystem::path directory)
+{
+    ModuleCache::get().set_directory(std::move(directory));
+}
+
+} // namespace lox
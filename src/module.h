@@ -0,0 +1,43 @@
+#ifndef LOX_MODULE_H
+#define LOX_MODULE_H
+
+#include <expected>
+#include <filesystem>
+#include <string>
+
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+
+// Compiles scripts together with every module they import, directly or through other modules.
+//
+// Each module is compiled on its own, into a heap of its own, and then written out as a snapshot
+// image which is loaded into the heap of the script. The images are kept in memory for the
+// lifetime of the process, keyed by the path and contents of the module, so that scripts which
+// import the same libraries only compile them once. Once a cache directory is set, they are also
+// kept there as files named after a hash of the path and contents, for later processes.
+//
+// Imports are compiled a level at a time: every module imported by the modules of one level which
+// was not compiled yet is compiled at once, on as many threads as there are modules, up to the
+// hardware's concurrency.
+class ModuleLoader
+{
+public:
+    // Compiles the script into the heap, with imports resolved against the directory, and
+    // registers every module it imports with the heap. Modules the heap has already registered
+    // are left as they are.
+    static std::expected<FunctionObject*, InterpretResult>
+    compile(const std::string& source,
+            const std::filesystem::path& directory,
+            ObjectAllocator& allocator);
+
+    // Keeps compiled modules in the directory, which is created if need be. Writing to the cache
+    // is best effort, and files written for other contents or versions are ignored.
+    static void set_cache_directory(std::filesystem::path directory);
+};
+
+} // namespace lox
+
+#endif // LOX_MODULE_H
@@ -1,12 +1,59 @@
 #include "object.h"
 #include "common.h"
 
+#include <cassert>
+#include <condition_variable>
 #include <new>
 #include <print>
 #include <vector>
 
+#include "alloc_profiler.h"
+#include "string_table.h"
+#include "tracer.h"
+
 namespace lox
 {
+namespace
+{
+
+// How much a thread sharing a heap allocates before handing its objects over to the heap.
+constexpr size_t ALLOCATION_BUFFER_SIZE = 64 * 1024;
+// Bounds on the common table, which only grows, so that scripts cannot make it grow without end.
+constexpr size_t MAX_COMMON_STRINGS = 64 * 1024;
+constexpr size_t MAX_IDENTIFIER_LENGTH = 64;
+
+} // namespace
+
+struct ObjectAllocator::Threads
+{
+    std::mutex mutex;
+    // Notified whenever a thread parks and whenever a collection finishes.
+    std::condition_variable changed;
+    std::vector<Mutator*> mutators;
+    size_t parked = 0;
+
+    // Interned strings, which threads look up without locking. Collections remove white strings
+    // while every thread is stopped.
+    StringTable strings;
+
+    std::shared_mutex globals_mutex;
+};
+
+thread_local Mutator* ObjectAllocator::_mutator = nullptr;
+
+ObjectAllocator::ObjectAllocator() = default;
+
+ObjectAllocator::ObjectAllocator(FixedStack<Value>& stack,
+                                 HashMap<Value>& globals,
+                                 CallStack& callstack,
+                                 std::vector<UpValueObject*>& open_upvalues,
+                                 std::shared_ptr<const ObjectAllocator> shared)
+    : _shared(std::move(shared))
+    , _stack(&stack)
+    , _globals(&globals)
+    , _callstack(&callstack)
+    , _open_upvalues(&open_upvalues)
+{ }
 
 void ObjectAllocator::_deallocate(Object* object)
 {
@@ -14,21 +61,66 @@ void ObjectAllocator::_deallocate(Object* object)
     std::println(
         "Object deallocated: {:p}, object: {}", static_cast<void*>(object), object->to_string());
 #endif // DEBUG_LOG_GC
+    if(_allocation_profiler)
+    {
+        _allocation_profiler->freed(object);
+    }
+
     _bytes_allocated -= object->size();
-    ::operator delete(object);
+    delete object;
+}
+
+void ObjectAllocator::_profile_allocation(Object* object, size_t size)
+{
+    _allocation_profiler->allocated(object, size);
 }
 
 void ObjectAllocator::collect_garbage()
+{
+    assert(_stack && "Heaps without roots cannot be collected");
+
+    if(_threads)
+    {
+        _collect_with_threads(true);
+        return;
+    }
+
+    _collect();
+}
+
+void ObjectAllocator::_collect()
 {
 #ifdef DEBUG_LOG_GC
     std::println("-- GC begin --");
     size_t before = _bytes_allocated;
 #endif // DEBUG_LOG_GC
 
-    _mark_roots();
-    _trace_references();
-    _remove_white_strings();
-    _sweep();
+    Tracer::Span collection{"gc", "collect garbage"};
+
+    {
+        Tracer::Span span{"gc", "mark roots"};
+        _mark_roots(true);
+    }
+
+    {
+        Tracer::Span span{"gc", "trace references"};
+        _trace_references();
+    }
+
+    {
+        Tracer::Span span{"gc", "remove white strings"};
+        _remove_white_strings();
+    }
+
+    {
+        Tracer::Span span{"gc", "sweep"};
+        _sweep();
+    }
+
+    if(_allocation_profiler)
+    {
+        _allocation_profiler->collected();
+    }
 
     _next_collection = _bytes_allocated * _growth_factor;
 #ifdef DEBUG_LOG_GC
@@ -41,31 +133,99 @@ void ObjectAllocator::collect_garbage()
 #endif // DEBUG_LOG_GC
 }
 
-void ObjectAllocator::_mark_roots()
+void ObjectAllocator::_mark_roots(bool keep_last_allocated)
 {
-    // Always mark the last allocated object. This is to prevent freeing
-    // temporaries which are yet to be placed on the stack.
-    _objects.back()->mark(_grey_list);
+    auto mark_stacks = [this](FixedStack<Value>& stack,
+                              CallStack& callstack,
+                              std::vector<UpValueObject*>& open_upvalues) {
+        for(auto i = 0; i < stack.size(); ++i)
+        {
+            stack[i].mark(_grey_list);
+        }
+
+        for(auto i = 0; i < callstack.size(); ++i)
+        {
+            callstack[i].closure->mark(_grey_list);
+        }
+
+        for(auto upvalue : open_upvalues)
+        {
+            upvalue->mark(_grey_list);
+        }
+    };
+
+    if(_threads)
+    {
+        for(auto* mutator : _threads->mutators)
+        {
+            if(keep_last_allocated && mutator->last_allocated)
+            {
+                mutator->last_allocated->mark(_grey_list);
+            }
 
-    for(auto i = 0; i < _stack.size(); ++i)
+            mark_stacks(*mutator->stack, *mutator->callstack, *mutator->open_upvalues);
+        }
+    }
+    else
     {
-        _stack[i].mark(_grey_list);
+        // Always mark the last allocated object. This is to prevent freeing
+        // temporaries which are yet to be placed on the stack.
+        if(keep_last_allocated)
+        {
+            _objects.back()->mark(_grey_list);
+        }
+
+        mark_stacks(*_stack, *_callstack, *_open_upvalues);
     }
 
-    for(auto i = 0; i < _callstack.size(); ++i)
+    for(auto& [key, value] : *_globals)
     {
-        _callstack[i].closure->mark(_grey_list);
+        value.mark(_grey_list);
     }
 
-    for(auto upvalue : _open_upvalues)
+    for(auto [object, count] : _pinned)
     {
-        upvalue->mark(_grey_list);
+        object->mark(_grey_list);
     }
+}
+
+std::vector<Object*> ObjectAllocator::get_roots()
+{
+    assert(_stack && "Heaps without roots cannot be walked");
+    assert(!_threads && "Heaps shared between threads cannot be walked");
 
-    for(auto& [key, value] : _globals)
+    std::vector<Object*> roots;
+
+    // The last object allocated is only kept for the sake of collections, not held by anything.
+    _mark_roots(false);
+
+    while(!_grey_list.empty())
     {
-        value.mark(_grey_list);
+        roots.push_back(_grey_list.top());
+        _grey_list.pop();
+        roots.back()->unmark();
     }
+
+    return roots;
+}
+
+std::vector<Object*> ObjectAllocator::get_references(Object& object)
+{
+    // Nothing is marked between collections, so blackening the object pushes everything it
+    // refers to exactly once. Unmarking them again leaves the heap as it was.
+    GreyList<Object*> grey_list;
+    std::vector<Object*> references;
+
+    object.blacken(grey_list);
+
+    while(!grey_list.empty())
+    {
+        references.push_back(grey_list.top());
+        grey_list.pop();
+        references.back()->unmark();
+    }
+
+    return references;
 }
 
 void ObjectAllocator::_trace_references()
@@ -94,15 +254,293 @@ void ObjectAllocator::_sweep()
 
 void ObjectAllocator::_remove_white_strings()
 {
-    for(auto it = _interned_strings.begin(), end = _interned_strings.end(); it != end;)
-    {
-        // erase() will invalidate the iterator, so advance it first.
-        auto temp = it++;
-
-        if(!temp->second->is_marked())
+    auto remove = [](HashMap<StringObject*>& strings) {
+        for(auto it = strings.begin(), end = strings.end(); it != end;)
         {
-            _interned_strings.erase(temp);
+            // erase() will invalidate the iterator, so advance it first.
+            auto temp = it++;
+
+            if(!temp->second->is_marked())
+            {
+                strings.erase(temp);
+            }
         }
+    };
+
+    remove(_interned_strings);
+
+    if(_threads)
+    {
+        // Strings of other heaps are never marked, but are as alive as their heaps.
+        _threads->strings.sweep(
+            [](StringObject* string) { return !string->is_marked() && !string->is_shared(); });
+    }
+}
+
+void ObjectAllocator::pin(Object* object)
+{
+    std::unique_lock<std::mutex> lock;
+
+    if(_threads)
+    {
+        lock = std::unique_lock{_threads->mutex};
+    }
+
+    ++_pinned[object];
+}
+
+void ObjectAllocator::unpin(Object* object)
+{
+    std::unique_lock<std::mutex> lock;
+
+    if(_threads)
+    {
+        lock = std::unique_lock{_threads->mutex};
+    }
+
+    if(auto it = _pinned.find(object); it != _pinned.end() && --it->second == 0)
+    {
+        _pinned.erase(it);
+    }
+}
+
+void ObjectAllocator::enable_threads()
+{
+    _threads = std::make_unique<Threads>();
+
+    for(auto [key, string] : _interned_strings)
+    {
+        _threads->strings.insert(string);
+    }
+
+    _interned_strings.clear();
+}
+
+void ObjectAllocator::attach(Mutator& mutator)
+{
+    std::scoped_lock lock{_threads->mutex};
+
+    mutator.parked = true;
+    _threads->mutators.push_back(&mutator);
+    ++_threads->parked;
+}
+
+void ObjectAllocator::detach(Mutator& mutator)
+{
+    std::scoped_lock lock{_threads->mutex};
+
+    assert(mutator.parked && "Only parked threads can be detached");
+
+    _flush(mutator);
+    std::erase(_threads->mutators, &mutator);
+    --_threads->parked;
+
+    if(_mutator == &mutator)
+    {
+        _mutator = nullptr;
+    }
+}
+
+void ObjectAllocator::enter(Mutator& mutator)
+{
+    _mutator = &mutator;
+
+    std::unique_lock lock{_threads->mutex};
+    _threads->changed.wait(lock, [this] { return !_stopping.load(); });
+
+    mutator.parked = false;
+    --_threads->parked;
+}
+
+void ObjectAllocator::leave()
+{
+    std::scoped_lock lock{_threads->mutex};
+
+    _mutator->parked = true;
+    ++_threads->parked;
+    _threads->changed.notify_all();
+}
+
+ObjectAllocator::Parked::Parked(ObjectAllocator& heap)
+    : _heap(heap._threads ? &heap : nullptr)
+    , _mutator(ObjectAllocator::_mutator)
+{
+    if(_heap)
+    {
+        _heap->leave();
+    }
+}
+
+ObjectAllocator::Parked::~Parked()
+{
+    if(_heap)
+    {
+        _heap->enter(*_mutator);
+    }
+}
+
+std::shared_mutex& ObjectAllocator::get_globals_mutex()
+{
+    return _threads->globals_mutex;
+}
+
+void ObjectAllocator::_add_to_buffer(Object* object, size_t size, bool collect)
+{
+    auto& mutator = *_mutator;
+
+    mutator.objects.push_back(object);
+    mutator.bytes += size;
+    mutator.last_allocated = object;
+
+    auto due = false;
+
+    if(mutator.bytes >= ALLOCATION_BUFFER_SIZE)
+    {
+        std::scoped_lock lock{_threads->mutex};
+        _flush(mutator);
+        due = _bytes_allocated > _next_collection;
+    }
+
+    if(!collect)
+    {
+        return;
+    }
+
+#ifdef DEBUG_STRESS_GC
+    _collect_with_threads(true);
+#else
+    if(due)
+    {
+        _collect_with_threads(false);
+    }
+    else
+    {
+        safepoint();
+    }
+#endif // DEBUG_STRESS_GC
+}
+
+void ObjectAllocator::_flush(Mutator& mutator)
+{
+    _objects.insert(_objects.end(), mutator.objects.begin(), mutator.objects.end());
+    _bytes_allocated += mutator.bytes;
+    _peak_bytes_allocated = std::max(_peak_bytes_allocated, _bytes_allocated);
+    _objects_allocated += mutator.objects.size();
+    _total_bytes_allocated += mutator.bytes;
+
+    mutator.objects.clear();
+    mutator.bytes = 0;
+}
+
+void ObjectAllocator::_collect_with_threads(bool forced)
+{
+    std::unique_lock lock{_threads->mutex};
+
+    // Another thread got there first, so stop for its collection instead.
+    if(_stopping.load())
+    {
+        _park(lock);
+        return;
+    }
+
+    if(!forced && _bytes_allocated <= _next_collection)
+    {
+        return;
+    }
+
+    _stopping = true;
+    _mutator->parked = true;
+    ++_threads->parked;
+
+    _threads->changed.wait(lock, [this] { return _threads->parked == _threads->mutators.size(); });
+
+    for(auto* mutator : _threads->mutators)
+    {
+        _flush(*mutator);
+    }
+
+    _collect();
+
+    _mutator->parked = false;
+    --_threads->parked;
+    _stopping = false;
+    _threads->changed.notify_all();
+}
+
+void ObjectAllocator::_park(std::unique_lock<std::mutex>& lock)
+{
+    _mutator->parked = true;
+    ++_threads->parked;
+    _threads->changed.notify_all();
+
+    _threads->changed.wait(lock, [this] { return !_stopping.load(); });
+
+    _mutator->parked = false;
+    --_threads->parked;
+}
+
+void ObjectAllocator::_safepoint_slow()
+{
+    std::unique_lock lock{_threads->mutex};
+
+    if(_stopping.load())
+    {
+        _park(lock);
+    }
+}
+
+void ObjectAllocator::freeze()
+{
+    for(auto* object : _objects)
+    {
+        object->share();
+    }
+}
+
+void ObjectAllocator::thaw()
+{
+    for(auto* object : _objects)
+    {
+        object->unshare();
+    }
+}
+
+std::vector<Object*> ObjectAllocator::freeze_reachable()
+{
+    assert(_stack && "Heaps without roots cannot be walked");
+    assert(!_threads && "Heaps shared between threads cannot be walked");
+
+    std::vector<Object*> frozen;
+
+    _mark_roots(false);
+
+    // Other heaps find these by value, whether anything refers to them or not.
+    for(auto [value, string] : _interned_strings)
+    {
+        string->mark(_grey_list);
+    }
+
+    // An object is marked until it is shared, and mark() skips both, so each is traced once.
+    while(!_grey_list.empty())
+    {
+        auto* object = _grey_list.top();
+        _grey_list.pop();
+
+        object->unmark();
+        object->share();
+        frozen.push_back(object);
+
+        object->blacken(_grey_list);
+    }
+
+    return frozen;
+}
+
+void ObjectAllocator::thaw(std::span<Object* const> objects)
+{
+    for(auto* object : objects)
+    {
+        object->unshare();
     }
 }
 
@@ -116,7 +554,7 @@ ObjectAllocator::~ObjectAllocator()
 
 void Object::mark(GreyList<Object*>& grey_list)
 {
-    if(_is_marked)
+    if(_is_marked || _is_shared)
     {
         return;
     }
@@ -129,13 +567,47 @@ void Object::mark(GreyList<Object*>& grey_list)
     grey_list.push(this);
 }
 
-StringObject* ObjectAllocator::allocate_string(std::string_view value, bool collect)
+StringObject* ObjectAllocator::_find_string(std::string_view value) const
 {
+    for(const auto* heap = _shared.get(); heap; heap = heap->_shared.get())
+    {
+        if(auto it = heap->_interned_strings.find(value); it != heap->_interned_strings.end())
+        {
+            return it->second;
+        }
+    }
+
+    if(_threads)
+    {
+        return _threads->strings.find(value);
+    }
+
     auto it = _interned_strings.find(value);
 
-    if(it != _interned_strings.end())
+    return it != _interned_strings.end() ? it->second : nullptr;
+}
+
+StringObject* ObjectAllocator::allocate_string(std::string_view value, bool collect)
+{
+    if(auto* string = _find_string(value))
     {
-        return it->second;
+        return string;
+    }
+
+    // Consulted after our own strings, since we may have interned one before the common table had
+    // it, and must keep using that one.
+    auto* common = StringTable::get_common().find(value);
+
+    if(_threads)
+    {
+        // Another thread may intern the same string meanwhile, and whichever is inserted first
+        // wins. Common strings are inserted too, so that every thread sticks to the same one.
+        return _threads->strings.insert(common ? common : allocate<StringObject>(false, value));
+    }
+
+    if(common)
+    {
+        return common;
     }
 
     auto* string = allocate<StringObject>(false, value);
@@ -145,6 +617,140 @@ StringObject* ObjectAllocator::allocate_string(std::string_view value, bool coll
     return string;
 }
 
+StringObject* ObjectAllocator::allocate_identifier(std::string_view name)
+{
+    if(auto* string = _find_string(name))
+    {
+        return string;
+    }
+
+    auto& common = StringTable::get_common();
+    auto* interned = common.find(name);
+
+    if(!interned)
+    {
+        if(name.size() > MAX_IDENTIFIER_LENGTH || common.size() >= MAX_COMMON_STRINGS)
+        {
+            return allocate_string(name, false);
+        }
+
+        // Never collected, as any heap may refer to it from now on.
+        auto* string = new StringObject(name);
+        string->share();
+
+        interned = common.insert(string);
+
+        if(interned != string)
+        {
+            delete string;
+        }
+    }
+
+    return _threads ? _threads->strings.insert(interned) : interned;
+}
+
+void ObjectAllocator::add_module(std::string_view path, FunctionObject* script)
+{
+    pin(script);
+
+    // Compiling the module again replaces the script run by later imports.
+    if(auto it = _modules.find(path); it != _modules.end())
+    {
+        unpin(it->second);
+        it->second = script;
+        return;
+    }
+
+    auto* key = allocate_string(path, false);
+    pin(key);
+
+    _modules[key->value()] = script;
+}
+
+FunctionObject* ObjectAllocator::find_module(std::string_view path) const
+{
+    for(const auto* heap = this; heap; heap = heap->_shared.get())
+    {
+        if(auto it = heap->_modules.find(path); it != heap->_modules.end())
+        {
+            return it->second;
+        }
+    }
+
+    return nullptr;
+}
+
+std::string_view get_kind_name(Object& object)
+{
+    if(object.as<StringObject>())
+    {
+        return "string";
+    }
+
+    if(object.as<FunctionObject>())
+    {
+        return "function";
+    }
+
+    if(object.as<UpValueObject>())
+    {
+        return "upvalue";
+    }
+
+    if(object.as<ModuleObject>())
+    {
+        return "module";
+    }
+
+    if(object.as<ClosureObject>())
+    {
+        return "closure";
+    }
+
+    if(object.as<BoundMethodObject>())
+    {
+        return "bound method";
+    }
+
+    if(object.as<ClassObject>())
+    {
+        return "class";
+    }
+
+    if(object.as<InstanceObject>())
+    {
+        return "instance";
+    }
+
+    if(object.as<HostObject>())
+    {
+        return "host object";
+    }
+
+    if(object.as<NativeFunctionObject>())
+    {
+        return "native";
+    }
+
+    if(object.as<ListObject>())
+    {
+        return "list";
+    }
+
+    if(object.as<FiberObject>())
+    {
+        return "fiber";
+    }
+
+    if(object.as<ChannelObject>())
+    {
+        return "channel";
+    }
+
+
+    return "object";
+}
+
 Object::~Object() { }
 StringObject::~StringObject(){};
 FunctionObject::~FunctionObject() { }
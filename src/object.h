@@ -1,12 +1,20 @@
 #ifndef LOX_OBJECT_H
 #define LOX_OBJECT_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <format>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include "absl/container/flat_hash_map.h"
 #include "chunk.h"
 #include "common.h"
 #include "stack.h"
@@ -15,6 +23,9 @@
 namespace lox
 {
 
+class AllocationProfiler;
+class Channel;
+class HostClass;
 class ObjectAllocator;
 
 #define ADD_SIZE_METHOD(type)                                                                      \
@@ -23,9 +34,33 @@ class ObjectAllocator;
         return sizeof(type);                                                                       \
     }
 
+// Guards the contents of an object while several threads share its heap. Critical sections only
+// ever look up or store a value, so waiters spin rather than sleep.
+class ObjectLock
+{
+    std::atomic_flag _locked;
+
+public:
+    void lock()
+    {
+        while(_locked.test_and_set(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    void unlock()
+    {
+        _locked.clear(std::memory_order_release);
+    }
+};
+
 class Object
 {
     bool _is_marked = false;
+    // Shared objects belong to a frozen heap which outlives every heap referring to it. They are
+    // never marked, so several heaps may trace through them concurrently.
+    bool _is_shared = false;
 
 public:
     Object(const Object&) = delete;
@@ -58,6 +93,21 @@ public:
         return _is_marked;
     }
 
+    void share()
+    {
+        _is_shared = true;
+    }
+
+    void unshare()
+    {
+        _is_shared = false;
+    }
+
+    bool is_shared() const
+    {
+        return _is_shared;
+    }
+
     virtual void blacken(GreyList<Object*>&) { }
     virtual std::string to_string() const = 0;
     virtual ~Object();
@@ -137,6 +187,9 @@ struct UpValueObject : public Object
 
     Value* location = nullptr;
     Value closed;
+    // The fiber whose stack an open upvalue points into, if any.
+    Object* stack_owner = nullptr;
+    ObjectLock lock;
 
     std::string to_string() const override
     {
@@ -148,11 +201,45 @@ struct UpValueObject : public Object
         Object::blacken(grey_list);
 
         closed.mark(grey_list);
+
+        if(stack_owner)
+        {
+            stack_owner->mark(grey_list);
+        }
     }
 
     virtual ~UpValueObject(){};
 };
 
+// The globals of a module, which are separate from those of the program and of other modules.
+// Scripts reach them as properties of the variable an import defines.
+struct ModuleObject : public Object
+{
+    ModuleObject(std::string name)
+        : name(std::move(name))
+    { }
+
+    ADD_SIZE_METHOD(ModuleObject)
+
+    const std::string name;
+    HashMap<Value> globals;
+
+    void blacken(GreyList<Object*>& grey_list) override
+    {
+        Object::blacken(grey_list);
+
+        for(auto& [key, value] : globals)
+        {
+            value.mark(grey_list);
+        }
+    }
+
+    std::string to_string() const override
+    {
+        return std::format("<module {}>", name);
+    }
+};
+
 struct ClosureObject : public Object
 {
     ClosureObject(FunctionObject& function, std::vector<UpValueObject*> upvalues)
@@ -164,6 +251,8 @@ struct ClosureObject : public Object
 
     FunctionObject& function;
     const std::vector<UpValueObject*> upvalues;
+    // The module whose globals the function uses, or none for those of the VM.
+    ModuleObject* module = nullptr;
 
     std::string to_string() const override
     {
@@ -177,6 +266,11 @@ struct ClosureObject : public Object
         {
             upvalue->mark(grey_list);
         }
+
+        if(module)
+        {
+            module->mark(grey_list);
+        }
     }
 
     virtual ~ClosureObject(){};
@@ -218,6 +312,8 @@ struct ClassObject : public Object
 
     const std::string name;
     HashMap<ClosureObject*> methods;
+    // Methods are added while the class may already be visible to other threads.
+    mutable ObjectLock lock;
 
     void blacken(GreyList<Object*>& grey_list) override
     {
@@ -225,7 +321,7 @@ struct ClassObject : public Object
 
         for(auto& [key, method] : methods)
         {
-            method->blacken(grey_list);
+            method->mark(grey_list);
         }
     }
 
@@ -245,6 +341,7 @@ struct InstanceObject : public Object
 
     ClassObject& klass;
     HashMap<Value> fields;
+    ObjectLock lock;
 
     void blacken(GreyList<Object*>& grey_list) override
     {
@@ -264,14 +361,33 @@ struct InstanceObject : public Object
     }
 };
 
+// A C++ record which scripts access in place through the properties its class describes. The
+// embedder owns the record, which must outlive every script that can reach it.
+struct HostObject : public Object
+{
+    HostObject(const HostClass& klass, void* record)
+        : klass(klass)
+        , record(record)
+    { }
+
+    ADD_SIZE_METHOD(HostObject)
+
+    const HostClass& klass;
+    void* record;
+
+    std::string to_string() const override;
+};
+
 struct NativeFunctionObject : public Object
 {
-    NativeFunctionObject(NativeFn native_fn)
-        : native_fn(native_fn)
+    NativeFunctionObject(std::string name, NativeFn native_fn)
+        : name(std::move(name))
+        , native_fn(native_fn)
     { }
 
     ADD_SIZE_METHOD(NativeFunctionObject)
 
+    const std::string name;
     NativeFn native_fn;
 
     std::string to_string() const override
@@ -319,53 +435,292 @@ struct ListObject : public Object
     }
 
     std::vector<Value> elements;
+    ObjectLock lock;
+};
+
+// A coroutine with stacks of its own, which the VM switches to while the fiber runs.
+struct FiberObject : public Object
+{
+    enum class State
+    {
+        NEW,
+        SUSPENDED,
+        RUNNING,
+        DONE
+    };
+
+    // The fiber calls the function with the arguments when it is first resumed.
+    FiberObject(Value function, std::span<const Value> args = {})
+        : stack(FIBER_MAX_FRAMES * FRAME_SLOTS)
+        , callstack(FIBER_MAX_FRAMES)
+    {
+        stack.push(function);
+
+        for(auto arg : args)
+        {
+            stack.push(arg);
+        }
+    }
+
+    // Counts the stacks, which the fiber owns and which make up most of its size.
+    constexpr size_t size() const override
+    {
+        return sizeof(FiberObject) + stack.capacity() * sizeof(Value)
+               + callstack.capacity() * sizeof(CallFrame);
+    }
+
+    State state = State::NEW;
+    // Run by the event loop rather than resumed by scripts.
+    bool scheduled = false;
+    // Suspended until an operation of the event loop completes.
+    bool waiting = false;
+    // Suspended at a safepoint rather than in a call to yield(), so there is no result to replace.
+    bool preempted = false;
+    FixedStack<Value> stack;
+    CallStack callstack;
+    std::vector<UpValueObject*> open_upvalues;
+
+    void blacken(GreyList<Object*>& grey_list) override
+    {
+        Object::blacken(grey_list);
+
+        for(size_t i = 0; i < stack.size(); ++i)
+        {
+            stack[i].mark(grey_list);
+        }
+
+        for(size_t i = 0; i < callstack.size(); ++i)
+        {
+            callstack[i].closure->mark(grey_list);
+        }
+
+        for(auto* upvalue : open_upvalues)
+        {
+            upvalue->mark(grey_list);
+        }
+    }
+
+    std::string to_string() const override
+    {
+        return "<fiber>";
+    }
+};
+
+// A reference to a channel, which may be shared with other isolates.
+struct ChannelObject : public Object
+{
+    ChannelObject(std::shared_ptr<Channel> channel)
+        : channel(std::move(channel))
+    { }
+
+    ADD_SIZE_METHOD(ChannelObject)
+
+    const std::shared_ptr<Channel> channel;
+
+    std::string to_string() const override
+    {
+        return "<channel>";
+    }
+};
+
+// A short name for the type of an object, such as "instance", for reports about the heap.
+std::string_view get_kind_name(Object&);
+
+// The roots and allocation buffer of one of several threads sharing a heap.
+struct Mutator
+{
+    Mutator(FixedStack<Value>& stack,
+            CallStack& callstack,
+            std::vector<UpValueObject*>& open_upvalues)
+        : stack(&stack)
+        , callstack(&callstack)
+        , open_upvalues(&open_upvalues)
+    { }
+
+    FixedStack<Value>* stack;
+    CallStack* callstack;
+    std::vector<UpValueObject*>* open_upvalues;
+
+    // Objects allocated since the buffer was last handed over to the heap, and their size.
+    std::vector<Object*> objects;
+    size_t bytes = 0;
+    // Kept alive, as the last object allocated by a heap only one thread uses is.
+    Object* last_allocated = nullptr;
+    // Set while the thread is stopped for a collection or blocked outside the heap, when its
+    // roots and buffer may be used by the thread collecting.
+    bool parked = true;
 };
 
 class ObjectAllocator
 {
     size_t _bytes_allocated = 0;
+    size_t _peak_bytes_allocated = 0;
+    // Everything ever allocated, whether or not it was collected since.
+    size_t _objects_allocated = 0;
+    size_t _total_bytes_allocated = 0;
     size_t _next_collection = 1024 * 1024;
     static constexpr size_t _growth_factor = 2;
 
     std::vector<Object*> _objects;
+    // Objects which are kept alive regardless of reachability, with how many times each was pinned.
+    absl::flat_hash_map<Object*, size_t> _pinned;
     HashMap<StringObject*> _interned_strings;
-    FixedStack<Value>& _stack;
-    HashMap<Value>& _globals;
-    CallStack& _callstack;
-    std::vector<UpValueObject*>& _open_upvalues;
+    // The scripts of the modules compiled into this heap, by their canonical paths.
+    HashMap<FunctionObject*> _modules;
+    // Frozen heap whose interned strings, and those of its own shared heap in turn, are used in
+    // preference to our own.
+    std::shared_ptr<const ObjectAllocator> _shared;
+
+    // Roots, which are absent for heaps which are never collected.
+    FixedStack<Value>* _stack = nullptr;
+    HashMap<Value>* _globals = nullptr;
+    CallStack* _callstack = nullptr;
+    std::vector<UpValueObject*>* _open_upvalues = nullptr;
     std::stack<Object*, std::vector<Object*>> _grey_list;
 
+    // State for sharing the heap between threads, present once enable_threads() was called.
+    struct Threads;
+    std::unique_ptr<Threads> _threads;
+    // Set while a collection waits for, or runs with, every other thread stopped.
+    std::atomic<bool> _stopping = false;
+    static thread_local Mutator* _mutator;
+
+    // Told about every allocation and collection while set.
+    AllocationProfiler* _allocation_profiler = nullptr;
+
     void _deallocate(Object* object);
-    void _mark_roots();
+    void _profile_allocation(Object* object, size_t size);
+    void _collect();
+    // Collections also keep the last object allocated, which may not be rooted yet.
+    void _mark_roots(bool keep_last_allocated);
     void _trace_references();
     void _sweep();
     void _remove_white_strings();
 
+    void _add_to_buffer(Object* object, size_t size, bool collect);
+    void _flush(Mutator&);
+    void _collect_with_threads(bool forced);
+    void _park(std::unique_lock<std::mutex>&);
+    void _safepoint_slow();
+    // Looks for a string interned by the shared heaps or this heap, but not the common table.
+    StringObject* _find_string(std::string_view value) const;
+
 public:
+    // Creates a heap without roots, which only ever allocates without collecting. Used to hold
+    // compiled code which is frozen and then shared.
+    ObjectAllocator();
+
     ObjectAllocator(FixedStack<Value>& stack,
                     HashMap<Value>& globals,
                     CallStack& callstack,
-                    std::vector<UpValueObject*>& open_upvalues)
-        : _stack(stack)
-        , _globals(globals)
-        , _callstack(callstack)
-        , _open_upvalues(open_upvalues)
-    { }
+                    std::vector<UpValueObject*>& open_upvalues,
+                    std::shared_ptr<const ObjectAllocator> shared = nullptr);
+
+    ObjectAllocator(const ObjectAllocator&) = delete;
+    ObjectAllocator& operator=(const ObjectAllocator&) = delete;
 
     void collect_garbage();
 
+    // Marks every object allocated so far as shared. After this the heap must no longer be
+    // modified, and it must outlive every heap created with it as their shared heap.
+    void freeze();
+
+    // Reverses freeze() once no other heap refers to this one any more.
+    void thaw();
+
+    // Like freeze(), but only for what other heaps can reach: the objects reachable from the roots
+    // and the strings this heap interned. Garbage costs nothing, and is left for the next
+    // collection. Returns the objects it marked as shared, for thaw() to reverse.
+    std::vector<Object*> freeze_reachable();
+    void thaw(std::span<Object* const> objects);
+
+    // Keeps an object alive until it was unpinned as many times as it was pinned.
+    void pin(Object* object);
+    void unpin(Object* object);
+
+    // Lets several threads allocate from the heap and use its objects, each with a Mutator of its
+    // own. Allocation then hands objects to the heap a buffer at a time, and collections stop
+    // every thread at a safepoint.
+    void enable_threads();
+
+    bool is_concurrent() const
+    {
+        return _threads != nullptr;
+    }
+
+    // Registers a thread's roots, which may be done from another thread before it starts. The
+    // thread starts out parked.
+    void attach(Mutator&);
+    // Unregisters a parked thread's roots, keeping the objects it allocated.
+    void detach(Mutator&);
+
+    // Makes the calling thread the one using the mutator and unparks it.
+    void enter(Mutator&);
+    // Parks the calling thread until it enters again. Collections trace its roots meanwhile.
+    void leave();
+
+    // Stops the calling thread if a collection is waiting for it. Called at the VM's safepoints,
+    // where everything the thread refers to is reachable from its roots.
+    void safepoint()
+    {
+        if(_stopping.load(std::memory_order_relaxed))
+        {
+            _safepoint_slow();
+        }
+    }
+
+    // Parks the calling thread while it blocks outside the heap, such as waiting on another
+    // thread or a channel, so that collections need not wait for it. It must not use any
+    // objects until the guard is gone. Does nothing for heaps which only one thread uses.
+    class Parked
+    {
+        ObjectAllocator* _heap;
+        Mutator* _mutator;
+
+    public:
+        explicit Parked(ObjectAllocator& heap);
+        Parked(const Parked&) = delete;
+        Parked& operator=(const Parked&) = delete;
+        ~Parked();
+    };
+
+    // Guards the globals, which every thread sharing the heap uses.
+    std::shared_mutex& get_globals_mutex();
+
+    const std::shared_ptr<const ObjectAllocator>& get_shared() const
+    {
+        return _shared;
+    }
+
     template <typename T, typename... Args>
     T* allocate(bool collect, Args&&... args)
     {
         auto* ptr = ::new T{std::forward<Args>(args)...};
-        _bytes_allocated += sizeof(T);
+        // The same size is taken off again when the object is freed.
+        auto size = ptr->size();
 
 #ifdef DEBUG_LOG_GC
-        std::println("Object allocated: {} bytes", sizeof(T));
+        std::println("Object allocated: {} bytes", size);
 #endif // DEBUG_LOG_GC
 
+        // Threads sharing the heap account for their objects when handing them over.
+        if(_threads)
+        {
+            _add_to_buffer(ptr, size, collect);
+            return ptr;
+        }
+
+        _bytes_allocated += size;
+        _peak_bytes_allocated = std::max(_peak_bytes_allocated, _bytes_allocated);
+        _objects_allocated += 1;
+        _total_bytes_allocated += size;
         _objects.push_back(ptr);
 
+        if(_allocation_profiler) [[unlikely]]
+        {
+            _profile_allocation(ptr, size);
+        }
+
 #ifdef DEBUG_STRESS_GC
         if(collect)
         {
@@ -383,6 +738,49 @@ public:
 
     StringObject* allocate_string(std::string_view value, bool collect = true);
 
+    // Interns a name used by code, such as that of a variable, property or method. Names which
+    // no heap has interned yet go into the common table, from where every heap in the process uses
+    // them, so that compiling many programs or starting many isolates does not repeat them. Never
+    // collects.
+    StringObject* allocate_identifier(std::string_view name);
+
+    // Registers the script of the module at a path, keeping it alive for the lifetime of the heap.
+    void add_module(std::string_view path, FunctionObject* script);
+
+    // Looks for the script of a module compiled into this heap or one of its shared heaps.
+    FunctionObject* find_module(std::string_view path) const;
+
+    // What a collection would start tracing from. Only for heaps which one thread uses, outside of
+    // collections.
+    std::vector<Object*> get_roots();
+
+    // The objects an object refers to directly, leaving out those of shared heaps. Only outside of
+    // collections, like get_roots().
+    std::vector<Object*> get_references(Object&);
+
+    void set_allocation_profiler(AllocationProfiler* profiler)
+    {
+        _allocation_profiler = profiler;
+    }
+
+    // The largest number of bytes which were live at once, not counting the shared heap.
+    size_t get_peak_bytes_allocated() const
+    {
+        return _peak_bytes_allocated;
+    }
+
+    // How many objects, and bytes of them, were allocated so far. Threads sharing the heap count
+    // theirs once they hand them over.
+    size_t get_objects_allocated() const
+    {
+        return _objects_allocated;
+    }
+
+    size_t get_total_bytes_allocated() const
+    {
+        return _total_bytes_allocated;
+    }
+
     ~ObjectAllocator();
 };
 
@@ -0,0 +1,191 @@
+#include "op_stats.h"
+
+#include <algorithm>
+#include <format>
+#include <print>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "object.h"
+#include "value.h"
+
+namespace lox
+{
+namespace
+{
+
+// Whether the operand of the opcode is a constant naming what it uses, such as a global.
+bool has_name_operand(OpCode op)
+{
+    switch(op)
+    {
+    case OpCode::DEFINE_GLOBAL:
+    case OpCode::GET_GLOBAL:
+    case OpCode::SET_GLOBAL:
+    case OpCode::GET_PROPERTY:
+    case OpCode::SET_PROPERTY:
+    case OpCode::METHOD:
+    case OpCode::INVOKE:
+    case OpCode::GET_SUPER:
+    case OpCode::SUPER_INVOKE:
+    case OpCode::CLASS:
+    case OpCode::IMPORT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+double get_percentage(uint64_t count, uint64_t total)
+{
+    return total > 0 ? 100.0 * count / total : 0;
+}
+
+} // namespace
+
+OpStats::OpStats(ObjectAllocator& allocator)
+    : _allocator(allocator)
+{ }
+
+OpStats::~OpStats()
+{
+    for(auto& [function, sites] : _functions)
+    {
+        _allocator.unpin(const_cast<FunctionObject*>(function));
+    }
+}
+
+void OpStats::_switch_function(const FunctionObject& function)
+{
+    auto [it, inserted] = _functions.try_emplace(&function);
+
+    if(inserted)
+    {
+        it->second.resize(function.chunk.size());
+        _allocator.pin(const_cast<FunctionObject*>(&function));
+    }
+
+    _function = &function;
+    _sites = &it->second;
+}
+
+void OpStats::write_report(std::FILE* file, size_t top) const
+{
+    uint64_t total = 0;
+
+    for(auto count : _ops)
+    {
+        total += count;
+    }
+
+    std::vector<std::pair<uint64_t, OpCode>> ops;
+
+    for(size_t op = 0; op < OPCODE_COUNT; ++op)
+    {
+        if(_ops[op] > 0)
+        {
+            ops.emplace_back(_ops[op], static_cast<OpCode>(op));
+        }
+    }
+
+    std::ranges::sort(ops, std::greater{});
+
+    std::println(file, "{} instructions\n\n{:<32} {:>14} {:>8}", total, "Opcode", "count", "%");
+
+    for(auto [count, op] : ops)
+    {
+        std::println(file,
+                     "{:<32} {:>14} {:>7.2f}%",
+                     get_opcode_name(op),
+                     count,
+                     get_percentage(count, total));
+    }
+
+    std::vector<std::tuple<uint64_t, OpCode, OpCode>> pairs;
+
+    for(size_t first = 0; first < OPCODE_COUNT; ++first)
+    {
+        for(size_t second = 0; second < OPCODE_COUNT; ++second)
+        {
+            if(auto count = _pairs[first][second]; count > 0)
+            {
+                pairs.emplace_back(count, static_cast<OpCode>(first), static_cast<OpCode>(second));
+            }
+        }
+    }
+
+    std::ranges::sort(pairs, std::greater{});
+    pairs.resize(std::min(pairs.size(), top));
+
+    std::println(file, "\n{:<32} {:>14} {:>8}", "Pair", "count", "%");
+
+    for(auto [count, first, second] : pairs)
+    {
+        std::println(file,
+                     "{:<32} {:>14} {:>7.2f}%",
+                     std::format("{} {}", get_opcode_name(first), get_opcode_name(second)),
+                     count,
+                     get_percentage(count, total));
+    }
+
+    struct Site
+    {
+        uint64_t count;
+        const FunctionObject* function;
+        size_t offset;
+    };
+
+    std::vector<Site> sites;
+
+    for(const auto& [function, counts] : _functions)
+    {
+        for(size_t offset = 0; offset < counts.size(); ++offset)
+        {
+            if(counts[offset] > 0)
+            {
+                sites.push_back({counts[offset], function, offset});
+            }
+        }
+    }
+
+    auto reported = std::min(top, sites.size());
+    std::ranges::partial_sort(
+        sites, sites.begin() + reported, std::ranges::greater{}, &Site::count);
+    sites.resize(reported);
+
+    std::println(file,
+                 "\n{:<32} {:>6} {:<32} {:>14} {:>8}",
+                 "Instruction",
+                 "offset",
+                 "opcode",
+                 "count",
+                 "%");
+
+    for(const auto& site : sites)
+    {
+        const auto& chunk = site.function->chunk;
+        auto op = static_cast<OpCode>(chunk[site.offset]);
+        std::string instruction = get_opcode_name(op);
+
+        if(has_name_operand(op))
+        {
+            instruction += " " + chunk.get_constant(chunk[site.offset + 1]).to_string();
+        }
+
+        auto name = site.function->name.empty() ? std::string_view{"script"}
+                                                : std::string_view{site.function->name};
+
+        std::println(file,
+                     "{:<32} {:>6} {:<32} {:>14} {:>7.2f}%",
+                     std::format("{}:{}", name, chunk.get_line(site.offset)),
+                     site.offset,
+                     instruction,
+                     site.count,
+                     get_percentage(site.count, total));
+    }
+}
+
+} // namespace lox
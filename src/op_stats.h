@@ -0,0 +1,73 @@
+#ifndef LOX_OP_STATS_H
+#define LOX_OP_STATS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "chunk.h"
+
+namespace lox
+{
+
+class ObjectAllocator;
+class FunctionObject;
+
+// Counts the instructions a VM runs: each opcode, each pair of opcodes run one after the other,
+// and each instruction in the code, such as a particular GET_GLOBAL.
+//
+// The VM only calls count() from a second copy of its dispatch loop, which it runs instead of the
+// usual one while it has stats to count into, so that running without them costs nothing.
+class OpStats
+{
+public:
+    explicit OpStats(ObjectAllocator&);
+    ~OpStats();
+
+    OpStats(const OpStats&) = delete;
+    OpStats& operator=(const OpStats&) = delete;
+
+    // Counts the instruction at an offset of the function's code, which is about to run.
+    void count(const FunctionObject& function, size_t offset, OpCode op)
+    {
+        auto index = static_cast<size_t>(op);
+
+        ++_ops[index];
+        ++_pairs[_previous][index];
+        _previous = index;
+
+        if(&function != _function)
+        {
+            _switch_function(function);
+        }
+
+        ++(*_sites)[offset];
+    }
+
+    // Writes every opcode, and the pairs and instructions run most, in order of their counts.
+    void write_report(std::FILE*, size_t top) const;
+
+private:
+    ObjectAllocator& _allocator;
+
+    std::array<uint64_t, OPCODE_COUNT> _ops{};
+    // Counts by the opcode run first and then the one run after it. The row after the last opcode
+    // is for the first instruction, which no other was run before.
+    std::array<std::array<uint64_t, OPCODE_COUNT>, OPCODE_COUNT + 1> _pairs{};
+    size_t _previous = OPCODE_COUNT;
+
+    // Counts by offset for every function run, which is kept alive for as long as its counts are,
+    // so that they are never attributed to another function allocated in its place.
+    absl::flat_hash_map<const FunctionObject*, std::vector<uint64_t>> _functions;
+    const FunctionObject* _function = nullptr;
+    std::vector<uint64_t>* _sites = nullptr;
+
+    void _switch_function(const FunctionObject&);
+};
+
+} // namespace lox
+
+#endif // LOX_OP_STATS_H
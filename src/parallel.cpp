@@ -0,0 +1,308 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <print>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "channel.h"
+#include "isolate.h"
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+namespace
+{
+
+using Range = std::pair<uint32_t, uint32_t>;
+
+// A range of indices which its owner consumes from the front while other workers steal from the
+// back. Both ends are kept in a single word so that either side claims indices with one CAS.
+class WorkRange
+{
+    alignas(64) std::atomic<uint64_t> _range = 0;
+
+    static uint64_t _pack(uint32_t begin, uint32_t end)
+    {
+        return static_cast<uint64_t>(begin) << 32 | end;
+    }
+
+    static Range _unpack(uint64_t range)
+    {
+        return {static_cast<uint32_t>(range >> 32), static_cast<uint32_t>(range)};
+    }
+
+public:
+    // Only called by the owner while the range is empty, when nobody else updates it.
+    void reset(Range range)
+    {
+        _range.store(_pack(range.first, range.second), std::memory_order_release);
+    }
+
+    // Claims up to count indices from the front.
+    std::optional<Range> take(uint32_t count)
+    {
+        auto range = _range.load(std::memory_order_acquire);
+
+        while(true)
+        {
+            auto [begin, end] = _unpack(range);
+
+            if(begin >= end)
+            {
+                return std::nullopt;
+            }
+
+            auto stop = begin + std::min(count, end - begin);
+
+            if(_range.compare_exchange_weak(range, _pack(stop, end), std::memory_order_acq_rel))
+            {
+                return Range{begin, stop};
+            }
+        }
+    }
+
+    // Claims the back half of the remaining indices, rounded up.
+    std::optional<Range> steal()
+    {
+        auto range = _range.load(std::memory_order_acquire);
+
+        while(true)
+        {
+            auto [begin, end] = _unpack(range);
+
+            if(begin >= end)
+            {
+                return std::nullopt;
+            }
+
+            auto middle = begin + (end - begin) / 2;
+
+            if(_range.compare_exchange_weak(
+                   range, _pack(begin, middle), std::memory_order_acq_rel))
+            {
+                return Range{middle, end};
+            }
+        }
+    }
+};
+
+unsigned worker_count(size_t count)
+{
+    auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    return static_cast<unsigned>(std::min<size_t>(threads, count));
+}
+
+// Calls task(worker_vm, worker, index) for every index below count, spread over the given number
+// of worker isolates. Returns false if any task failed, in which case the rest are abandoned.
+template <typename Task>
+bool run_parallel(VM& caller, uint32_t count, unsigned workers, Task task)
+{
+    if(count == 0)
+    {
+        return true;
+    }
+
+    // Freezing the heap would race with the other threads using it.
+    if(caller.get_allocator().is_concurrent())
+    {
+        std::println(caller.get_error_output(), "Parallel tasks cannot run on a shared heap.");
+        return false;
+    }
+
+    std::unique_ptr<WorkRange[]> ranges{new WorkRange[workers]};
+
+    for(unsigned w = 0; w < workers; ++w)
+    {
+        ranges[w].reset({static_cast<uint32_t>(uint64_t{count} * w / workers),
+                          static_cast<uint32_t>(uint64_t{count} * (w + 1) / workers)});
+    }
+
+    auto grain = std::clamp<uint32_t>(count / (workers * 16), 1, 1024);
+
+    // Workers use the caller's objects in place. Freezing what they can reach keeps their
+    // collectors from marking it, and the caller is blocked in this native so nothing else touches
+    // it meanwhile.
+    auto& heap = caller.get_allocator();
+    auto frozen = heap.freeze_reachable();
+
+    std::shared_ptr<const ObjectAllocator> shared_heap{std::shared_ptr<void>{}, &heap};
+    std::atomic<bool> failed = false;
+
+    {
+        std::vector<std::jthread> threads;
+
+        for(unsigned w = 0; w < workers; ++w)
+        {
+            threads.emplace_back([&, w] {
+                Isolate isolate{shared_heap};
+                isolate.get_globals() = caller.get_globals();
+
+                auto& vm = isolate.get_vm();
+                vm.set_output(caller.get_output(), caller.get_error_output());
+                vm.set_limits(caller.get_limits());
+                vm.follow_cancel(caller);
+                vm.start_run();
+
+                while(!failed.load(std::memory_order_relaxed))
+                {
+                    auto chunk = ranges[w].take(grain);
+
+                    if(!chunk)
+                    {
+                        for(unsigned k = 1; k < workers && !chunk; ++k)
+                        {
+                            chunk = ranges[(w + k) % workers].steal();
+                        }
+
+                        if(!chunk)
+                        {
+                            break;
+                        }
+
+                        ranges[w].reset(*chunk);
+                        continue;
+                    }
+
+                    for(auto index = chunk->first; index < chunk->second; ++index)
+                    {
+                        if(!task(vm, w, index))
+                        {
+                            failed = true;
+                            break;
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    heap.thaw(frozen);
+
+    return !failed;
+}
+
+Value parallel_map_native(VM& vm, std::span<Value> args)
+{
+    auto* list = args.size() == 2 && args[0].is_object() ? args[0].as_object()->as<ListObject>()
+                                                         : nullptr;
+
+    if(!list || list->elements.size() > std::numeric_limits<uint32_t>::max())
+    {
+        vm.raise("parallel_map() expects a list and a function.");
+        return Value{};
+    }
+
+    auto function = args[1];
+    auto count = static_cast<uint32_t>(list->elements.size());
+    auto workers = worker_count(count);
+
+    std::vector<Value> results(count);
+    // Results which are objects of a worker's own heap, to be recreated in the caller's heap.
+    std::vector<std::vector<std::pair<uint32_t, Message>>> messages(workers);
+
+    auto succeeded = run_parallel(vm, count, workers, [&](VM& worker, unsigned w, uint32_t index) {
+        auto result = worker.call(function, {&list->elements[index], 1});
+
+        if(!result)
+        {
+            return false;
+        }
+
+        if(!result->is_object() || result->as_object()->is_shared())
+        {
+            results[index] = *result;
+            return true;
+        }
+
+        auto message = Message::copy(*result, worker.get_allocator());
+
+        if(!message)
+        {
+            std::println(worker.get_error_output(),
+                         "parallel_map(): {}",
+                         Message::get_error_message(message.error()));
+            return false;
+        }
+
+        messages[w].emplace_back(index, std::move(message.value()));
+
+        return true;
+    });
+
+    if(!succeeded)
+    {
+        vm.raise("A parallel task failed.");
+        return Value{};
+    }
+
+    // Nothing is collected until the new list holds every result.
+    for(auto& worker_messages : messages)
+    {
+        for(auto& [index, message] : worker_messages)
+        {
+            auto result = message.unpack(vm);
+
+            if(!result)
+            {
+                vm.raise(std::format("parallel_map(): {}",
+                                     Message::get_error_message(result.error())));
+                return Value{};
+            }
+
+            results[index] = *result;
+        }
+    }
+
+    auto* mapped = vm.get_allocator().allocate<ListObject>(false, std::span<Value>{});
+    mapped->elements = std::move(results);
+
+    return Value{mapped};
+}
+
+Value parallel_for_native(VM& vm, std::span<Value> args)
+{
+    if(args.size() != 2 || !args[0].is_number() || args[0].as_number() < 0
+       || args[0].as_number() > std::numeric_limits<uint32_t>::max())
+    {
+        vm.raise("parallel_for() expects a count and a function.");
+        return Value{};
+    }
+
+    auto function = args[1];
+    auto count = static_cast<uint32_t>(args[0].as_number());
+
+    auto succeeded =
+        run_parallel(vm, count, worker_count(count), [&](VM& worker, unsigned, uint32_t index) {
+            std::array index_arg{Value{static_cast<double>(index)}};
+            return worker.call(function, index_arg).has_value();
+        });
+
+    if(!succeeded)
+    {
+        vm.raise("A parallel task failed.");
+    }
+
+    return Value{};
+}
+
+} // namespace
+
+void define_parallel_natives(VM& vm)
+{
+    vm.define_native("parallel_map", &parallel_map_native);
+    vm.define_native("parallel_for", &parallel_for_native);
+}
+
+} // namespace lox
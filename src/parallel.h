@@ -0,0 +1,24 @@
+#ifndef LOX_PARALLEL_H
+#define LOX_PARALLEL_H
+
+namespace lox
+{
+
+class VM;
+
+// Defines parallel_map(list, fn), which returns a new list of fn applied to every element, and
+// parallel_for(n, fn), which calls fn with every index below n.
+//
+// Calls are spread over worker isolates, one per hardware thread. While they run, what the workers
+// can reach of the calling heap is frozen and they read it in place, so its objects are read-only
+// to them: captured variables, instances and module globals from the caller cannot be assigned to,
+// and its lists cannot be transferred. Each worker starts from a copy of the caller's globals,
+// which it may assign, runs under the caller's limits, and is cancelled along with the caller.
+//
+// Every worker owns a range of indices which it works through in chunks from the front; a worker
+// which runs out steals the back half of another worker's remaining range.
+void define_parallel_natives(VM&);
+
+} // namespace lox
+
+#endif // LOX_PARALLEL_H
@@ -1,6 +1,7 @@
 #include "parser.h"
 
 #include <cstdint>
+#include <format>
 #include <limits>
 #include <memory>
 #include <optional>
@@ -76,6 +77,7 @@ Parser::ParseRule Parser::_parse_rules[] = {
     [type_to_int(TokenType::FOR)] = {nullptr, nullptr, Precedence::NONE},
     [type_to_int(TokenType::FUN)] = {nullptr, nullptr, Precedence::NONE},
     [type_to_int(TokenType::IF)] = {nullptr, nullptr, Precedence::NONE},
+    [type_to_int(TokenType::IMPORT)] = {nullptr, nullptr, Precedence::NONE},
     [type_to_int(TokenType::NIL)] = {&Parser::_parse_literal, nullptr, Precedence::NONE},
     [type_to_int(TokenType::OR)] = {nullptr, &Parser::_parse_binary_expression, Precedence::OR},
     [type_to_int(TokenType::RETURN)] = {nullptr, nullptr, Precedence::NONE},
@@ -150,6 +152,10 @@ ASTNodePtr Parser::_parse_declaration()
     {
         ret = _parse_class_declaration();
     }
+    else if(_match(TokenType::IMPORT))
+    {
+        ret = _parse_import_declaration();
+    }
     else
     {
         ret = _parse_statement();
@@ -321,6 +327,35 @@ ASTNodePtr Parser::_parse_var_declaration()
     return std::make_unique<ASTNode>(ASTNode{VarDeclNode{identifier, std::move(initializer)}});
 }
 
+ASTNodePtr Parser::_parse_import_declaration()
+{
+    auto keyword = _previous;
+    auto path = _consume(TokenType::STRING, "Expected module path after 'import'.");
+
+    if(!path)
+    {
+        return nullptr;
+    }
+
+    std::optional<Token> alias;
+
+    // 'as' is only a keyword here, so it remains usable as a name elsewhere.
+    if(_current.type == TokenType::IDENTIFIER && _current.lexeme == "as")
+    {
+        _advance();
+        alias = _consume(TokenType::IDENTIFIER, "Expected module name after 'as'.");
+
+        if(!alias)
+        {
+            return nullptr;
+        }
+    }
+
+    _consume(TokenType::SEMICOLON, "Expect ';' after import.");
+
+    return std::make_unique<ASTNode>(ASTNode{ImportStmtNode{keyword, path.value(), alias}});
+}
+
 ASTNodePtr Parser::_parse_this()
 {
     return _parse_variable();
@@ -662,11 +697,12 @@ void Parser::_error_at(const Token& token, std::string_view message)
     if(_panic_mode)
         return;
 
-    std::print(stderr, "[line {}] Error", token.line);
+    // Written in one go, since other threads may be compiling into the same output.
+    auto error = std::format("[line {}] Error", token.line);
 
     if(token.type == TokenType::END_OF_FILE)
     {
-        std::print(stderr, " at end");
+        error += " at end";
     }
     else if(token.type == TokenType::ERROR)
     {
@@ -674,10 +710,10 @@ void Parser::_error_at(const Token& token, std::string_view message)
     }
     else
     {
-        std::print(stderr, " at '{:{}s}'", token.lexeme, token.lexeme.size());
+        error += std::format(" at '{:{}s}'", token.lexeme, token.lexeme.size());
     }
 
-    std::println(stderr, ": {}", message);
+    std::println(get_diagnostics(), "{}: {}", error, message);
     _had_error = true;
     _panic_mode = true;
 }
@@ -719,6 +755,7 @@ void Parser::_synchronize()
         case TokenType::CLASS:
         case TokenType::FUN:
         case TokenType::VAR:
+        case TokenType::IMPORT:
         case TokenType::FOR:
         case TokenType::IF:
         case TokenType::WHILE:
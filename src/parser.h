@@ -34,6 +34,7 @@ struct PropertyExprNode;
 struct SuperExprNode;
 struct ListDeclNode;
 struct ListIndexExprNode;
+struct ImportStmtNode;
 
 using ASTNode = std::variant<BinExprNode,
                              ValueNode,
@@ -53,7 +54,8 @@ using ASTNode = std::variant<BinExprNode,
                              ReturnStmtNode,
                              SuperExprNode,
                              ListDeclNode,
-                             ListIndexExprNode>;
+                             ListIndexExprNode,
+                             ImportStmtNode>;
 
 using ASTNodePtr = std::unique_ptr<ASTNode>;
 
@@ -182,6 +184,15 @@ struct ListIndexExprNode
     ASTNodePtr index;
 };
 
+// Imports the module at a path relative to the importing file, as a variable named by the alias
+// or else by the file name without its extension.
+struct ImportStmtNode
+{
+    Token keyword;
+    Token path;
+    std::optional<Token> alias;
+};
+
 class Parser
 {
     Scanner& _scanner;
@@ -239,6 +250,7 @@ class Parser
     ASTNodePtr _parse_for_statement();
     ASTNodePtr _parse_return_statement();
     ASTNodePtr _parse_var_declaration();
+    ASTNodePtr _parse_import_declaration();
     ASTNodePtr _parse_this();
     ASTNodePtr _parse_function_declaration(bool method);
     ASTNodePtr _parse_variable();
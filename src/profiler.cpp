@@ -0,0 +1,299 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <format>
+#include <print>
+#include <ranges>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "object.h"
+#include "stack.h"
+#include "vm.h"
+
+// Older C libraries only define the field behind this name.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace lox
+{
+namespace
+{
+
+constexpr std::string_view SCRIPT = "script";
+
+struct sigaction previous_action;
+
+// Prints the entries with the highest count of one kind, with their share of every sample.
+void write_table(std::FILE* file,
+                 std::string_view title,
+                 const absl::flat_hash_map<std::string, size_t>& counts,
+                 size_t samples,
+                 size_t top)
+{
+    std::vector<std::pair<std::string_view, size_t>> sorted(counts.begin(), counts.end());
+
+    std::ranges::sort(sorted, [](const auto& a, const auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    std::println(file, "\n{:<40} {:>10} {:>8}", title, "samples", "%");
+
+    for(const auto& [name, count] : sorted | std::views::take(top))
+    {
+        std::println(file, "{:<40} {:>10} {:>7.2f}%", name, count, 100.0 * count / samples);
+    }
+}
+
+} // namespace
+
+// Adds one to the total of every distinct name.
+void Profiler::_count_distinct(std::vector<std::string>& names,
+                              absl::flat_hash_map<std::string, Counts>& counts)
+{
+    std::ranges::sort(names);
+
+    for(auto it = names.begin(); it != names.end(); it = std::upper_bound(it, names.end(), *it))
+    {
+        ++counts[*it].total;
+    }
+}
+
+std::atomic<Profiler*> Profiler::_running = nullptr;
+
+Profiler::Profiler(VM& vm, unsigned samples_per_second)
+    : _vm(vm)
+    , _samples_per_second(std::max(samples_per_second, 1u))
+    , _samples(std::make_unique<Sample[]>(CAPACITY))
+{ }
+
+Profiler::~Profiler()
+{
+    stop();
+}
+
+std::expected<void, Profiler::Error> Profiler::start()
+{
+    Profiler* expected = nullptr;
+
+    if(!_running.compare_exchange_strong(expected, this))
+    {
+        return std::unexpected(Error::AlreadyRunning);
+    }
+
+    struct sigaction action{};
+    action.sa_handler = &Profiler::_handle_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if(sigaction(SIGPROF, &action, &previous_action) != 0)
+    {
+        _running = nullptr;
+        return std::unexpected(Error::SignalFailed);
+    }
+
+    // Counting CPU time of this thread alone leaves out time spent blocked, and other threads.
+    sigevent event{};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = static_cast<pid_t>(::syscall(SYS_gettid));
+
+    constexpr long NANOSECONDS_PER_SECOND = 1'000'000'000;
+    auto nanoseconds = NANOSECONDS_PER_SECOND / _samples_per_second;
+    timespec interval{.tv_sec = nanoseconds / NANOSECONDS_PER_SECOND,
+                      .tv_nsec = nanoseconds % NANOSECONDS_PER_SECOND};
+    itimerspec spec{.it_interval = interval, .it_value = interval};
+
+    if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &_timer) != 0)
+    {
+        sigaction(SIGPROF, &previous_action, nullptr);
+        _running = nullptr;
+        return std::unexpected(Error::TimerFailed);
+    }
+
+    if(timer_settime(_timer, 0, &spec, nullptr) != 0)
+    {
+        timer_delete(_timer);
+        sigaction(SIGPROF, &previous_action, nullptr);
+        _running = nullptr;
+        return std::unexpected(Error::TimerFailed);
+    }
+
+    _started = true;
+    _vm.set_profiler(this);
+
+    return {};
+}
+
+void Profiler::stop()
+{
+    if(!std::exchange(_started, false))
+    {
+        return;
+    }
+
+    // A signal which is already pending finds no profiler running.
+    timer_delete(_timer);
+    _running = nullptr;
+    sigaction(SIGPROF, &previous_action, nullptr);
+    _vm.set_profiler(nullptr);
+
+    drain();
+}
+
+void Profiler::_handle_signal(int)
+{
+    auto saved_errno = errno;
+
+    if(auto* profiler = _running.load(std::memory_order_acquire))
+    {
+        profiler->_take_sample();
+    }
+
+    errno = saved_errno;
+}
+
+void Profiler::_take_sample()
+{
+    const auto& callstack = _vm.get_callstack();
+
+    // Nothing is running, such as between compiling and running a script.
+    if(callstack.size() == 0)
+    {
+        return;
+    }
+
+    auto head = _head.load(std::memory_order_relaxed);
+
+    if(head - _tail.load(std::memory_order_acquire) == CAPACITY)
+    {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto& sample = _samples[head % CAPACITY];
+    sample.depth = std::min(callstack.size(), MAX_DEPTH);
+    // Pairs with the fence pushing a frame, so the frames below the depth are written.
+    std::atomic_signal_fence(std::memory_order_acquire);
+
+    for(size_t i = 0; i < sample.depth; ++i)
+    {
+        const auto& call_frame = callstack[i];
+        const auto& function = call_frame.closure->function;
+        auto& frame = sample.frames[i];
+
+        std::string_view name = function.name.empty() ? SCRIPT : function.name;
+        frame.name_size = static_cast<uint8_t>(std::min(name.size(), MAX_NAME_SIZE));
+        std::copy_n(name.data(), frame.name_size, frame.name.data());
+
+        // Frames point past the instruction they run, or at the first one before it has run.
+        auto offset = call_frame.ip - function.chunk.get_code();
+        frame.line = function.chunk.get_line(offset > 0 ? offset - 1 : 0);
+    }
+
+    _head.store(head + 1, std::memory_order_release);
+}
+
+void Profiler::drain()
+{
+    auto tail = _tail.load(std::memory_order_relaxed);
+    auto head = _head.load(std::memory_order_acquire);
+
+    std::vector<std::string> functions;
+    std::vector<std::string> lines;
+
+    for(; tail != head; ++tail)
+    {
+        const auto& sample = _samples[tail % CAPACITY];
+        std::string stack;
+
+        functions.clear();
+        lines.clear();
+
+        for(size_t i = 0; i < sample.depth; ++i)
+        {
+            const auto& frame = sample.frames[i];
+            std::string function{frame.name.data(), frame.name_size};
+            auto line = std::format("{}:{}", function, frame.line);
+
+            stack += i > 0 ? ";" : "";
+            stack += line;
+
+            functions.push_back(std::move(function));
+            lines.push_back(std::move(line));
+        }
+
+        ++_stacks[stack];
+        ++_functions[functions.back()].self;
+        ++_lines[lines.back()].self;
+
+        // Recursive calls count once towards the total of each function and line.
+        _count_distinct(functions, _functions);
+        _count_distinct(lines, _lines);
+
+        ++_sampled;
+    }
+
+    _tail.store(tail, std::memory_order_release);
+}
+
+void Profiler::write_collapsed(std::FILE* file) const
+{
+    std::vector<std::pair<std::string_view, size_t>> stacks(_stacks.begin(), _stacks.end());
+    std::ranges::sort(stacks);
+
+    for(const auto& [stack, count] : stacks)
+    {
+        std::println(file, "{} {}", stack, count);
+    }
+}
+
+void Profiler::write_report(std::FILE* file, size_t top) const
+{
+    std::println(file,
+                 "{} samples, {} dropped, one every {} us of CPU time",
+                 _sampled,
+                 _dropped.load(std::memory_order_relaxed),
+                 1'000'000 / _samples_per_second);
+
+    if(_sampled == 0)
+    {
+        return;
+    }
+
+    auto get = [](const absl::flat_hash_map<std::string, Counts>& counts, size_t Counts::*count) {
+        absl::flat_hash_map<std::string, size_t> selected;
+
+        for(const auto& [name, entry] : counts)
+        {
+            selected[name] = entry.*count;
+        }
+
+        return selected;
+    };
+
+    write_table(file, "Function (self)", get(_functions, &Counts::self), _sampled, top);
+    write_table(file, "Function (total)", get(_functions, &Counts::total), _sampled, top);
+    write_table(file, "Line (self)", get(_lines, &Counts::self), _sampled, top);
+    write_table(file, "Line (total)", get(_lines, &Counts::total), _sampled, top);
+}
+
+std::string_view Profiler::get_error_message(Error error)
+{
+    switch(error)
+    {
+    case Error::AlreadyRunning:
+        return "Another profiler is already running";
+    case Error::SignalFailed:
+        return "Could not install the SIGPROF handler";
+    case Error::TimerFailed:
+        return "Could not create the profiling timer";
+    }
+}
+
+} // namespace lox
@@ -0,0 +1,114 @@
+#ifndef LOX_PROFILER_H
+#define LOX_PROFILER_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <expected>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+
+namespace lox
+{
+
+class VM;
+
+// Samples the call stack of the scripts a VM runs at a fixed rate of CPU time, and reports where
+// the time went.
+//
+// A SIGPROF timer on the CPU clock of the thread which starts the profiler interrupts it, and the
+// signal handler copies the name and current line of every frame into a ring buffer, without
+// allocating or locking. The VM drains the buffer into totals at its safepoints, and stop() drains
+// whatever is left. Samples taken while the buffer is full are dropped and counted. Only one
+// profiler may run at a time.
+class Profiler
+{
+public:
+    enum class Error
+    {
+        AlreadyRunning,
+        SignalFailed,
+        TimerFailed
+    };
+
+    Profiler(VM&, unsigned samples_per_second);
+    ~Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    // Starts sampling the calling thread, which must be the one running the VM.
+    std::expected<void, Error> start();
+    void stop();
+
+    // Moves samples from the ring buffer into the totals. Called on the thread being sampled.
+    void drain();
+
+    // Writes a line for every distinct stack, its frames outermost first, followed by how many
+    // samples it was seen in, as flame graph tools take.
+    void write_collapsed(std::FILE*) const;
+
+    // Writes the functions and lines with the most samples of their own (self) and the most
+    // samples they were on the stack for (total).
+    void write_report(std::FILE*, size_t top) const;
+
+    static std::string_view get_error_message(Error);
+
+private:
+    static constexpr size_t MAX_NAME_SIZE = 31;
+    static constexpr size_t MAX_DEPTH = 64;
+    static constexpr size_t CAPACITY = 512;
+
+    struct Frame
+    {
+        std::array<char, MAX_NAME_SIZE> name;
+        uint8_t name_size;
+        int line;
+    };
+
+    struct Sample
+    {
+        size_t depth;
+        std::array<Frame, MAX_DEPTH> frames;
+    };
+
+    struct Counts
+    {
+        size_t self = 0;
+        size_t total = 0;
+    };
+
+    static std::atomic<Profiler*> _running;
+    static void _handle_signal(int);
+
+    VM& _vm;
+    unsigned _samples_per_second;
+    timer_t _timer{};
+    bool _started = false;
+
+    // Written by the signal handler at _head and read by drain() from _tail.
+    std::unique_ptr<Sample[]> _samples;
+    std::atomic<size_t> _head = 0;
+    std::atomic<size_t> _tail = 0;
+    std::atomic<size_t> _dropped = 0;
+
+    size_t _sampled = 0;
+    absl::flat_hash_map<std::string, size_t> _stacks;
+    absl::flat_hash_map<std::string, Counts> _functions;
+    absl::flat_hash_map<std::string, Counts> _lines;
+
+    void _take_sample();
+    static void _count_distinct(std::vector<std::string>& names,
+                               absl::flat_hash_map<std::string, Counts>& counts);
+};
+
+} // namespace lox
+
+#endif // LOX_PROFILER_H
@@ -0,0 +1,161 @@
+#include "repl.h"
+
+#include <chrono>
+#include <cstdio>
+#include <print>
+#include <utility>
+
+#include "object.h"
+#include "scanner.h"
+#include "vm.h"
+
+namespace lox
+{
+namespace
+{
+
+constexpr std::string_view PROMPT = "> ";
+constexpr std::string_view CONTINUATION_PROMPT = ". ";
+
+// Whether the source closes every brace, parenthesis and string it opens. Nothing is compiled
+// until it does, so that declarations may span several lines.
+bool is_complete(const std::string& source)
+{
+    Scanner scanner{source};
+    int depth = 0;
+
+    for(auto token = scanner.scan_token(); token.type != TokenType::END_OF_FILE;
+        token = scanner.scan_token())
+    {
+        switch(token.type)
+        {
+        case TokenType::LEFT_PAREN:
+        case TokenType::LEFT_SQUARE_PAREN:
+        case TokenType::LEFT_BRACE:
+            ++depth;
+            break;
+        case TokenType::RIGHT_PAREN:
+        case TokenType::RIGHT_SQUARE_PAREN:
+        case TokenType::RIGHT_BRACE:
+            --depth;
+            break;
+        case TokenType::ERROR:
+            // An unterminated string runs to the end of the source.
+            return token.lexeme != "Unterminated string";
+        default:
+            break;
+        }
+    }
+
+    return depth <= 0;
+}
+
+} // namespace
+
+Repl::Repl(Isolate& isolate, std::filesystem::path directory)
+    : _isolate(isolate)
+    , _directory(std::move(directory))
+{ }
+
+void Repl::run(std::istream& input)
+{
+    std::string source;
+
+    std::print("{}", PROMPT);
+
+    for(std::string line; std::getline(input, line);)
+    {
+        if(source.empty() && line.starts_with(':'))
+        {
+            if(!_run_command(line))
+            {
+                return;
+            }
+        }
+        else
+        {
+            source += line;
+            source += '\n';
+
+            if(!is_complete(source))
+            {
+                std::print("{}", CONTINUATION_PROMPT);
+                continue;
+            }
+
+            _evaluate(std::exchange(source, {}), _timing);
+        }
+
+        std::print("{}", PROMPT);
+    }
+
+    std::println();
+}
+
+bool Repl::_run_command(std::string_view command)
+{
+    auto end = command.find(' ');
+    auto name = command.substr(0, end);
+    auto argument = end == std::string_view::npos ? std::string_view{} : command.substr(end + 1);
+
+    if(name == ":quit")
+    {
+        return false;
+    }
+
+    if(name == ":time")
+    {
+        if(argument.find_first_not_of(' ') == std::string_view::npos)
+        {
+            _timing = !_timing;
+            std::println(stderr, "Timing is {}.", _timing ? "on" : "off");
+        }
+        else
+        {
+            _evaluate(std::string{argument} + '\n', true);
+        }
+
+        return true;
+    }
+
+    std::println(stderr, "Unknown command '{}'. Commands are :time [input] and :quit.", name);
+
+    return true;
+}
+
+void Repl::_evaluate(const std::string& source, bool timed)
+{
+    using Milliseconds = std::chrono::duration<double, std::milli>;
+
+    auto& allocator = _isolate.get_allocator();
+    auto objects = allocator.get_objects_allocated();
+    auto bytes = allocator.get_total_bytes_allocated();
+    auto start = std::chrono::steady_clock::now();
+
+    // Errors in the input have been reported by the time either step fails, and leave the
+    // isolate ready for the next input.
+    auto script = _isolate.compile(source, _directory);
+    auto compiled = std::chrono::steady_clock::now();
+
+    if(script)
+    {
+        _isolate.run(*script.value());
+    }
+
+    if(!timed)
+    {
+        return;
+    }
+
+    auto finished = std::chrono::steady_clock::now();
+
+    std::fflush(stdout);
+    std::println(stderr,
+                 "compile {:.3f} ms, run {:.3f} ms, {} objects ({} bytes) allocated",
+                 Milliseconds{compiled - start}.count(),
+                 Milliseconds{finished - compiled}.count(),
+                 allocator.get_objects_allocated() - objects,
+                 allocator.get_total_bytes_allocated() - bytes);
+}
+
+} // namespace lox
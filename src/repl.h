@@ -0,0 +1,46 @@
+#ifndef LOX_REPL_H
+#define LOX_REPL_H
+
+#include <filesystem>
+#include <istream>
+#include <string>
+#include <string_view>
+
+#include "isolate.h"
+
+namespace lox
+{
+
+// Reads scripts from the user and runs each in one isolate, so that what earlier inputs defined,
+// and whatever was loaded into the isolate beforehand, stays available to later ones.
+//
+// Each input is compiled on its own into the isolate's heap. Globals are resolved by name when
+// the code runs, so an input may use the globals of earlier ones without them being compiled
+// again. Input whose braces, parentheses or strings are still open continues on the next line.
+// Lines starting with ':' are commands:
+//
+//   :time        toggles reporting the time and allocations of every input
+//   :time input  runs the input and reports its time and allocations
+//   :quit        ends the session
+class Repl
+{
+public:
+    // Imports in the inputs are resolved against the directory.
+    explicit Repl(Isolate&, std::filesystem::path directory = {});
+
+    // Reads inputs until the end of the stream or :quit.
+    void run(std::istream&);
+
+private:
+    Isolate& _isolate;
+    std::filesystem::path _directory;
+    bool _timing = false;
+
+    // Returns false once the session should end.
+    bool _run_command(std::string_view command);
+    void _evaluate(const std::string& source, bool timed);
+};
+
+} // namespace lox
+
+#endif // LOX_REPL_H
@@ -42,6 +42,7 @@ const char* get_token_type_name(TokenType type)
         CASE(FOR)
         CASE(FUN)
         CASE(IF)
+        CASE(IMPORT)
         CASE(NIL)
         CASE(OR)
         CASE(RETURN)
@@ -58,7 +59,7 @@ const char* get_token_type_name(TokenType type)
 
 namespace
 {
-constexpr std::array<std::pair<std::string_view, TokenType>, 16> keywords = {{
+constexpr std::array<std::pair<std::string_view, TokenType>, 17> keywords = {{
     {"and", TokenType::AND},
     {"class", TokenType::CLASS},
     {"else", TokenType::ELSE},
@@ -66,6 +67,7 @@ constexpr std::array<std::pair<std::string_view, TokenType>, 16> keywords = {{
     {"for", TokenType::FOR},
     {"fun", TokenType::FUN},
     {"if", TokenType::IF},
+    {"import", TokenType::IMPORT},
     {"nil", TokenType::NIL},
     {"or", TokenType::OR},
     {"return", TokenType::RETURN},
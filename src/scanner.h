@@ -44,6 +44,7 @@ enum class TokenType
     FOR,
     FUN,
     IF,
+    IMPORT,
     NIL,
     OR,
     RETURN,
@@ -0,0 +1,361 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <print>
+#include <thread>
+#include <utility>
+
+#include "channel.h"
+#include "event_loop.h"
+#include "isolate.h"
+#include "object.h"
+
+namespace lox
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+std::chrono::nanoseconds percentile(const std::vector<std::chrono::nanoseconds>& sorted,
+                                    double fraction)
+{
+    if(sorted.empty())
+    {
+        return {};
+    }
+
+    return sorted[static_cast<size_t>(fraction * (sorted.size() - 1))];
+}
+
+} // namespace
+
+// A call of a function of the program, with its arguments detached from the heap which spawned it
+// so that any worker can start it.
+struct Scheduler::Task
+{
+    FunctionObject* function = nullptr;
+    // The module whose globals the function uses, which is frozen with the rest of the program.
+    ModuleObject* module = nullptr;
+    std::vector<Message> args;
+    Clock::time_point spawned;
+};
+
+struct Scheduler::Worker
+{
+    Worker(Scheduler& scheduler, unsigned index, std::shared_ptr<const ObjectAllocator> heap)
+        : scheduler(scheduler)
+        , index(index)
+        , isolate(std::move(heap))
+    { }
+
+    Scheduler& scheduler;
+    const unsigned index;
+    Isolate isolate;
+
+    std::mutex mutex;
+    std::deque<Task> tasks;
+
+    // Only touched by the worker's own thread until the run is over.
+    size_t started = 0;
+    size_t steals = 0;
+    std::vector<std::chrono::nanoseconds> latencies;
+};
+
+thread_local Scheduler::Worker* Scheduler::_current = nullptr;
+
+Scheduler::Scheduler(std::shared_ptr<const Program> program, unsigned workers)
+    : _program(std::move(program))
+    , _top_level(std::make_unique<Isolate>(_program))
+{
+    std::shared_ptr<const ObjectAllocator> heap{std::shared_ptr<void>{},
+                                                &_top_level->get_allocator()};
+
+    for(unsigned w = 0; w < std::max(workers, 1u); ++w)
+    {
+        _workers.push_back(std::make_unique<Worker>(*this, w, heap));
+    }
+}
+
+Scheduler::~Scheduler() = default;
+
+void Scheduler::set_limits(const VM::Limits& limits)
+{
+    _top_level->get_vm().set_limits(limits);
+
+    for(auto& worker : _workers)
+    {
+        worker->isolate.get_vm().set_limits(limits);
+    }
+}
+
+InterpretResult Scheduler::run()
+{
+    auto start = Clock::now();
+
+    if(auto result = _top_level->run(); result != InterpretResult::OK)
+    {
+        return result;
+    }
+
+    // From here on the workers use the objects of the top level in place.
+    _top_level->get_allocator().freeze();
+
+    for(auto& worker : _workers)
+    {
+        worker->isolate.get_globals() = _top_level->get_globals();
+    }
+
+    _work = _workers.size();
+
+    {
+        std::vector<std::jthread> threads;
+
+        for(auto& worker : _workers)
+        {
+            threads.emplace_back([this, &worker] { _work_on(*worker); });
+        }
+    }
+
+    _stats.wall_time = Clock::now() - start;
+
+    std::vector<std::chrono::nanoseconds> latencies;
+
+    for(auto& worker : _workers)
+    {
+        _stats.tasks += worker->started;
+        _stats.steals += worker->steals;
+        latencies.insert(latencies.end(), worker->latencies.begin(), worker->latencies.end());
+    }
+
+    std::ranges::sort(latencies);
+
+    _stats.latency_p50 = percentile(latencies, 0.5);
+    _stats.latency_p99 = percentile(latencies, 0.99);
+    _stats.latency_max = latencies.empty() ? std::chrono::nanoseconds{} : latencies.back();
+
+    return _failed ? InterpretResult::RUNTIME_ERROR : InterpretResult::OK;
+}
+
+void Scheduler::_work_on(Worker& worker)
+{
+    _current = &worker;
+
+    auto& vm = worker.isolate.get_vm();
+    vm.define_native("spawn", &_spawn_native);
+    vm.start_run();
+
+    if(worker.index == 0)
+    {
+        auto main = vm.get_globals().find("main");
+        auto* closure = main != vm.get_globals().end() && main->second.is_object()
+                            ? main->second.as_object()->as<ClosureObject>()
+                            : nullptr;
+
+        if(!closure || closure->function.arity != 0 || !closure->function.is_shared())
+        {
+            std::println(vm.get_error_output(),
+                         "Scripts run on several workers must define main() taking no arguments.");
+            _finish(true);
+            return;
+        }
+
+        _push(worker, Task{&closure->function, closure->module, {}, Clock::now()});
+    }
+
+    auto& loop = vm.get_event_loop();
+    Task task;
+
+    while(!_failed.load(std::memory_order_relaxed))
+    {
+        // Start at most one task per round, so that fibers already running keep making progress.
+        if(_take(worker, task))
+        {
+            _start(worker, task);
+        }
+
+        if(loop.get_pending() > 0)
+        {
+            if(!loop.run_once())
+            {
+                _finish(true);
+                break;
+            }
+        }
+        else if(!_idle())
+        {
+            break;
+        }
+    }
+
+    _current = nullptr;
+}
+
+void Scheduler::_start(Worker& worker, Task& task)
+{
+    worker.latencies.push_back(Clock::now() - task.spawned);
+    ++worker.started;
+
+    // Neither unpacking nor these allocations collect, and spawn() roots everything in the fiber.
+    auto& vm = worker.isolate.get_vm();
+    auto& allocator = worker.isolate.get_allocator();
+
+    std::vector<Value> args;
+    args.reserve(task.args.size());
+
+    for(auto& arg : task.args)
+    {
+        auto value = arg.unpack(vm);
+
+        if(!value)
+        {
+            std::println(vm.get_error_output(),
+                         "spawn(): {}",
+                         Message::get_error_message(value.error()));
+            _finish(true);
+            return;
+        }
+
+        args.push_back(*value);
+    }
+
+    auto* closure =
+        allocator.allocate<ClosureObject>(false, *task.function, std::vector<UpValueObject*>{});
+    closure->module = task.module;
+
+    spawn(vm, Value{closure}, args);
+}
+
+void Scheduler::_push(Worker& worker, Task task)
+{
+    // Counted first, so the run cannot be seen to be over while the task is on its way.
+    _work.fetch_add(1);
+
+    {
+        std::scoped_lock lock{worker.mutex};
+        worker.tasks.push_back(std::move(task));
+    }
+
+    _wake();
+}
+
+bool Scheduler::_take(Worker& worker, Task& task)
+{
+    {
+        std::scoped_lock lock{worker.mutex};
+
+        if(!worker.tasks.empty())
+        {
+            task = std::move(worker.tasks.back());
+            worker.tasks.pop_back();
+            _work.fetch_sub(1);
+            return true;
+        }
+    }
+
+    for(size_t k = 1; k < _workers.size(); ++k)
+    {
+        auto& victim = *_workers[(worker.index + k) % _workers.size()];
+        std::scoped_lock lock{victim.mutex};
+
+        if(!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            _work.fetch_sub(1);
+            ++worker.steals;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Scheduler::_idle()
+{
+    auto seen = _generation.load();
+
+    if(_work.fetch_sub(1) == 1)
+    {
+        _finish(false);
+        return false;
+    }
+
+    ++_sleeping;
+    _generation.wait(seen);
+    --_sleeping;
+
+    if(_finished.load())
+    {
+        return false;
+    }
+
+    _work.fetch_add(1);
+
+    return true;
+}
+
+void Scheduler::_wake()
+{
+    ++_generation;
+
+    if(_sleeping.load() > 0)
+    {
+        _generation.notify_all();
+    }
+}
+
+void Scheduler::_finish(bool failed)
+{
+    if(failed)
+    {
+        _failed = true;
+    }
+
+    _finished = true;
+    ++_generation;
+    _generation.notify_all();
+}
+
+Value Scheduler::_spawn_native(VM& vm, std::span<Value> args)
+{
+    auto* closure = !args.empty() && args[0].is_object() ? args[0].as_object()->as<ClosureObject>()
+                                                         : nullptr;
+
+    // A function of a module the worker imported itself uses globals which no other worker has.
+    if(closure && closure->upvalues.empty() && closure->function.is_shared()
+       && (!closure->module || closure->module->is_shared())
+       && closure->function.arity == args.size() - 1)
+    {
+        Task task{&closure->function, closure->module, {}, Clock::now()};
+
+        for(auto arg : args.subspan(1))
+        {
+            auto message = Message::copy(arg, vm.get_allocator());
+
+            if(!message)
+            {
+                break;
+            }
+
+            task.args.push_back(std::move(message.value()));
+        }
+
+        if(task.args.size() == args.size() - 1)
+        {
+            _current->scheduler._push(*_current, std::move(task));
+            return Value{};
+        }
+    }
+
+    if(args.empty() || !spawn(vm, args[0], args.subspan(1)))
+    {
+        vm.raise("spawn() expects a function and the arguments to call it with.");
+    }
+
+    return Value{};
+}
+
+} // namespace lox
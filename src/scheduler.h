@@ -0,0 +1,101 @@
+#ifndef LOX_SCHEDULER_H
+#define LOX_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "vm.h"
+
+namespace lox
+{
+
+class Isolate;
+class Program;
+
+// Runs a program's fibers on a pool of worker threads, each of which owns an isolate.
+//
+// The program's top level code runs once, in an isolate of its own, whose heap is then frozen and
+// shared by the workers as parallel_map() shares the heap of its caller: every worker starts from
+// a copy of its globals, and the objects they refer to are read-only. The first worker then calls
+// main() in a fiber, and the others only run the tasks they steal. spawn(fn, args...), which only
+// code run by the workers can call, queues a task on the spawning worker, which idle workers steal
+// from the front while the owner takes the newest from the back. Once a task starts, its fiber
+// belongs to that worker's heap and is resumed by that worker's event loop only. Only tasks which
+// can move between heaps are queued: functions of the program which capture no variables, called
+// with arguments a channel could carry. Other spawns start a fiber on the spawning worker straight
+// away.
+class Scheduler
+{
+public:
+    struct Stats
+    {
+        size_t tasks = 0;
+        size_t steals = 0;
+        // Time from being spawned until starting to run.
+        std::chrono::nanoseconds latency_p50{};
+        std::chrono::nanoseconds latency_p99{};
+        std::chrono::nanoseconds latency_max{};
+        std::chrono::duration<double, std::milli> wall_time{};
+    };
+
+    Scheduler(std::shared_ptr<const Program> program, unsigned workers);
+    ~Scheduler();
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // Applies to the top level code and to every worker, whose run lasts from then until the end.
+    void set_limits(const VM::Limits&);
+
+    // Runs until every task has finished or one of them fails.
+    InterpretResult run();
+
+    const Stats& get_stats() const
+    {
+        return _stats;
+    }
+
+private:
+    struct Task;
+    struct Worker;
+
+    std::shared_ptr<const Program> _program;
+    // Runs the top level code. Outlives the workers, which use its heap.
+    std::unique_ptr<Isolate> _top_level;
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    // Workers which are not idle plus tasks which have not been taken yet. The run finishes once
+    // this drops to zero.
+    alignas(64) std::atomic<size_t> _work = 0;
+    // Bumped whenever idle workers should look for work again.
+    alignas(64) std::atomic<uint32_t> _generation = 0;
+    std::atomic<bool> _finished = false;
+    std::atomic<bool> _failed = false;
+
+    // Idle workers waiting on _generation, which only needs to be notified while there are any.
+    std::atomic<unsigned> _sleeping = 0;
+
+    Stats _stats;
+
+    static thread_local Worker* _current;
+
+    void _work_on(Worker&);
+    void _start(Worker&, Task&);
+    void _push(Worker&, Task);
+    bool _take(Worker&, Task&);
+    // Waits until there may be work again. Returns false once the run is over.
+    bool _idle();
+    void _wake();
+    void _finish(bool failed);
+
+    static Value _spawn_native(VM&, std::span<Value> args);
+};
+
+} // namespace lox
+
+#endif // LOX_SCHEDULER_H
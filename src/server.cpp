@@ -0,0 +1,404 @@
+#include "server.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <print>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "absl/hash/hash.h"
+#include "isolate.h"
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+namespace
+{
+
+struct RequestHeader
+{
+    uint32_t source_size;
+};
+
+// Closes a file descriptor when going out of scope.
+class FileDescriptor
+{
+    int _fd;
+
+public:
+    explicit FileDescriptor(int fd)
+        : _fd(fd)
+    { }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const
+    {
+        return _fd;
+    }
+
+    ~FileDescriptor()
+    {
+        if(_fd != -1)
+        {
+            ::close(_fd);
+        }
+    }
+};
+
+bool read_all(int fd, void* data, size_t size)
+{
+    auto* bytes = static_cast<char*>(data);
+
+    while(size > 0)
+    {
+        auto n = ::read(fd, bytes, size);
+
+        if(n <= 0)
+        {
+            return false;
+        }
+
+        bytes += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// Writes to a socket, failing rather than raising SIGPIPE if the other end has gone away.
+bool write_all(int fd, const void* data, size_t size)
+{
+    const auto* bytes = static_cast<const char*>(data);
+
+    while(size > 0)
+    {
+        auto n = ::send(fd, bytes, size, MSG_NOSIGNAL);
+
+        if(n <= 0)
+        {
+            return false;
+        }
+
+        bytes += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+std::expected<sockaddr_un, Server::Error> make_address(std::string_view socket_path)
+{
+    sockaddr_un address{.sun_family = AF_UNIX};
+
+    if(socket_path.size() >= sizeof(address.sun_path))
+    {
+        return std::unexpected(Server::Error::SocketFailed);
+    }
+
+    socket_path.copy(address.sun_path, socket_path.size());
+
+    return address;
+}
+
+// Points stdout and stderr at the given descriptors until going out of scope.
+class RedirectOutput
+{
+    int _saved_out;
+    int _saved_err;
+
+public:
+    RedirectOutput(int out_fd, int err_fd)
+        : _saved_out(::dup(STDOUT_FILENO))
+        , _saved_err(::dup(STDERR_FILENO))
+    {
+        std::fflush(nullptr);
+        ::dup2(out_fd, STDOUT_FILENO);
+        ::dup2(err_fd, STDERR_FILENO);
+    }
+
+    ~RedirectOutput()
+    {
+        std::fflush(nullptr);
+        ::dup2(_saved_out, STDOUT_FILENO);
+        ::dup2(_saved_err, STDERR_FILENO);
+        ::close(_saved_out);
+        ::close(_saved_err);
+    }
+};
+
+// FNV-1a, which unlike absl::Hash is the same in every process.
+uint64_t fnv1a(std::string_view bytes)
+{
+    uint64_t hash = 14695981039346656037u;
+
+    for(auto byte : bytes)
+    {
+        hash = (hash ^ static_cast<uint8_t>(byte)) * 1099511628211u;
+    }
+
+    return hash;
+}
+
+} // namespace
+
+Server::Server(Isolate& isolate)
+    : _isolate(isolate)
+{ }
+
+std::optional<std::expected<FunctionObject*, InterpretResult>>
+Server::_compile_cached(const std::string& source)
+{
+    SourceHash hash{fnv1a(source), absl::HashOf(source)};
+
+    if(auto it = _cache.find(hash); it != _cache.end())
+    {
+        // A colliding source is compiled in the child, like any other script which is not cached.
+        if(it->second.source != source)
+        {
+            return std::nullopt;
+        }
+
+        return it->second.script;
+    }
+
+    if(_cache.size() == MAX_CACHED_SCRIPTS)
+    {
+        return std::nullopt;
+    }
+
+    auto script = _isolate.compile(source);
+
+    if(script)
+    {
+        // Cached scripts are not reachable from any root.
+        _isolate.get_allocator().pin(script.value());
+        _cache.emplace(hash, CachedScript{source, script.value()});
+    }
+
+    return script;
+}
+
+void Server::_handle(int connection)
+{
+    RequestHeader header;
+    int fds[2];
+
+    iovec iov{.iov_base = &header, .iov_len = sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr message{
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    if(::recvmsg(connection, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(header))
+    {
+        return;
+    }
+
+    auto* cmsg = CMSG_FIRSTHDR(&message);
+
+    if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        return;
+    }
+
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    FileDescriptor out{fds[0]};
+    FileDescriptor err{fds[1]};
+
+    if(header.source_size > MAX_SCRIPT_SIZE)
+    {
+        return;
+    }
+
+    std::string source(header.source_size, '\0');
+
+    if(!read_all(connection, source.data(), source.size()))
+    {
+        return;
+    }
+
+    std::optional<std::expected<FunctionObject*, InterpretResult>> script;
+
+    {
+        // Send any diagnostics to the client.
+        RedirectOutput redirect{out.get(), err.get()};
+        script = _compile_cached(source);
+    }
+
+    if(script && !*script)
+    {
+        int32_t status = exit_status(script->error());
+        write_all(connection, &status, sizeof(status));
+        return;
+    }
+
+    std::fflush(nullptr);
+
+    auto child = ::fork();
+
+    if(child == -1)
+    {
+        // Running the script here would leave whatever it does in the warm VM, so turn it away.
+        auto* reason = std::strerror(errno);
+
+        {
+            RedirectOutput redirect{out.get(), err.get()};
+            std::println(stderr, "Could not start the script: {}", reason);
+        }
+
+        int32_t status = 70;
+        write_all(connection, &status, sizeof(status));
+        return;
+    }
+
+    if(child != 0)
+    {
+        return;
+    }
+
+    // Child: run the script with the client's output and report the exit status.
+    ::dup2(out.get(), STDOUT_FILENO);
+    ::dup2(err.get(), STDERR_FILENO);
+
+    if(!script)
+    {
+        script = _isolate.compile(source);
+    }
+
+    int32_t status = *script ? exit_status(_isolate.run(*script->value()))
+                             : exit_status(script->error());
+
+    std::fflush(nullptr);
+    write_all(connection, &status, sizeof(status));
+
+    ::_exit(0);
+}
+
+std::expected<void, Server::Error> Server::serve(std::string_view socket_path)
+{
+    auto address = make_address(socket_path);
+
+    if(!address)
+    {
+        return std::unexpected(address.error());
+    }
+
+    FileDescriptor listener{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+
+    if(listener.get() == -1)
+    {
+        return std::unexpected(Error::SocketFailed);
+    }
+
+    ::unlink(address->sun_path);
+
+    if(::bind(listener.get(), reinterpret_cast<sockaddr*>(&*address), sizeof(*address)) == -1
+       || ::listen(listener.get(), SOMAXCONN) == -1)
+    {
+        return std::unexpected(Error::BindFailed);
+    }
+
+    // Children are never waited on, so let the kernel reap them. Clients which go away while
+    // their diagnostics are written must not take the server down with them.
+    std::signal(SIGCHLD, SIG_IGN);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    while(true)
+    {
+        FileDescriptor connection{::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC)};
+
+        if(connection.get() == -1)
+        {
+            continue;
+        }
+
+        // Requests are read before serving the next client, so one which stalls is dropped.
+        timeval timeout{.tv_sec = RECEIVE_TIMEOUT_SECONDS, .tv_usec = 0};
+        ::setsockopt(connection.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        _handle(connection.get());
+    }
+}
+
+std::expected<int, Server::Error>
+Server::request(std::string_view socket_path, std::string_view source, int out_fd, int err_fd)
+{
+    auto address = make_address(socket_path);
+
+    if(!address)
+    {
+        return std::unexpected(address.error());
+    }
+
+    FileDescriptor connection{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+
+    if(connection.get() == -1)
+    {
+        return std::unexpected(Error::SocketFailed);
+    }
+
+    if(::connect(connection.get(), reinterpret_cast<sockaddr*>(&*address), sizeof(*address))
+       == -1)
+    {
+        return std::unexpected(Error::ConnectFailed);
+    }
+
+    RequestHeader header{.source_size = static_cast<uint32_t>(source.size())};
+    int fds[2] = {out_fd, err_fd};
+
+    iovec iov{.iov_base = &header, .iov_len = sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr message{
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    auto* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status;
+
+    if(::sendmsg(connection.get(), &message, MSG_NOSIGNAL) != sizeof(header)
+       || !write_all(connection.get(), source.data(), source.size())
+       || !read_all(connection.get(), &status, sizeof(status)))
+    {
+        return std::unexpected(Error::ProtocolError);
+    }
+
+    return status;
+}
+
+std::string_view Server::get_error_message(Error error)
+{
+    switch(error)
+    {
+    case Error::SocketFailed:
+        return "Failed to create socket";
+    case Error::BindFailed:
+        return "Failed to listen on socket";
+    case Error::ConnectFailed:
+        return "Failed to connect to server";
+    case Error::ProtocolError:
+        return "Server closed the connection unexpectedly";
+    }
+}
+
+} // namespace lox
@@ -0,0 +1,78 @@
+#ifndef LOX_SERVER_H
+#define LOX_SERVER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/container/flat_hash_map.h"
+#include "isolate.h"
+#include "object.h"
+#include "vm.h"
+
+namespace lox
+{
+
+// Serves script execution requests over a unix domain socket from an already initialized VM.
+//
+// Each request carries the client's stdout and stderr descriptors followed by the script source.
+// The server compiles the script (reusing earlier compilations of identical sources) and then
+// forks, so the script runs in a copy-on-write child of the warm VM and writes its output straight
+// to the client's descriptors. The child finishes by sending back its exit status.
+//
+// Requests are read one at a time, and a client which stalls for longer than a timeout is dropped.
+// Once the cache is full, new scripts are compiled in the child instead, so that neither their
+// compilation holds up other clients nor what it allocates stays in the server's heap.
+class Server
+{
+public:
+    enum class Error
+    {
+        SocketFailed,
+        BindFailed,
+        ConnectFailed,
+        ProtocolError
+    };
+
+    explicit Server(Isolate&);
+
+    // Only returns if the socket could not be set up.
+    std::expected<void, Error> serve(std::string_view socket_path);
+
+    // Runs a script on the server listening at the given path, returning its exit status.
+    static std::expected<int, Error>
+    request(std::string_view socket_path, std::string_view source, int out_fd, int err_fd);
+
+    static std::string_view get_error_message(Error);
+
+private:
+    static constexpr size_t MAX_SCRIPT_SIZE = 64 * 1024 * 1024;
+    static constexpr size_t MAX_CACHED_SCRIPTS = 1024;
+    static constexpr int RECEIVE_TIMEOUT_SECONDS = 5;
+
+    // Two unrelated hashes of the source, which find a cached script without hashing it twice over.
+    using SourceHash = std::pair<uint64_t, size_t>;
+
+    // The source is kept to be compared, as sources whose hashes collide must not share a script.
+    struct CachedScript
+    {
+        std::string source;
+        FunctionObject* script;
+    };
+
+    Isolate& _isolate;
+    absl::flat_hash_map<SourceHash, CachedScript> _cache;
+
+    // Returns nothing if the script is not cached and there is no room to cache it.
+    std::optional<std::expected<FunctionObject*, InterpretResult>>
+    _compile_cached(const std::string& source);
+    void _handle(int connection);
+};
+
+} // namespace lox
+
+#endif // LOX_SERVER_H
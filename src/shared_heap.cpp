@@ -0,0 +1,236 @@
+#include "shared_heap.h"
+
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "isolate.h"
+
+namespace lox
+{
+namespace
+{
+
+// Lets threads share the heap and enters it from the calling thread, before the VM allocates.
+ObjectAllocator& share(ObjectAllocator& allocator, Mutator& mutator)
+{
+    allocator.enable_threads();
+    allocator.attach(mutator);
+    allocator.enter(mutator);
+
+    return allocator;
+}
+
+} // namespace
+
+// A thread started by thread(fn, args...). Its stack holds the function and its arguments until
+// the thread starts, and the result once it finishes, so they stay reachable until it is joined.
+struct SharedHeap::Thread
+{
+    Thread()
+        : mutator(stack, callstack, open_upvalues)
+    { }
+
+    CallStack callstack;
+    FixedStack<Value> stack;
+    std::vector<UpValueObject*> open_upvalues;
+    Mutator mutator;
+
+    std::jthread thread;
+    bool failed = false;
+    std::atomic<bool> joined = false;
+};
+
+// The handle scripts join a thread with.
+struct SharedHeap::ThreadObject : public Object
+{
+    explicit ThreadObject(Thread& thread)
+        : thread(thread)
+    { }
+
+    ADD_SIZE_METHOD(ThreadObject)
+
+    Thread& thread;
+
+    std::string to_string() const override
+    {
+        return "<thread>";
+    }
+};
+
+thread_local SharedHeap* SharedHeap::_current = nullptr;
+
+SharedHeap::SharedHeap(std::shared_ptr<const Program> program)
+    : _program(std::move(program))
+    , _allocator(_stack,
+                 _globals,
+                 _callstack,
+                 _open_upvalues,
+                 std::shared_ptr<const ObjectAllocator>(_program, &_program->get_allocator()))
+    , _mutator(_stack, _callstack, _open_upvalues)
+    , _vm(share(_allocator, _mutator), _stack, _globals, _callstack, _open_upvalues)
+{
+    _vm.define_native("thread", &_thread_native);
+    _vm.define_native("join", &_join_native);
+}
+
+SharedHeap::~SharedHeap()
+{
+    _join_all();
+
+    _allocator.leave();
+    _allocator.detach(_mutator);
+}
+
+InterpretResult SharedHeap::run()
+{
+    _current = this;
+
+    auto result = _vm.interpret(_program->get_script());
+
+    if(!_join_all() && result == InterpretResult::OK)
+    {
+        result = InterpretResult::RUNTIME_ERROR;
+    }
+
+    _current = nullptr;
+
+    return result;
+}
+
+void SharedHeap::_run_thread(Thread& thread)
+{
+    _current = this;
+    _allocator.enter(thread.mutator);
+
+    {
+        VM vm{_allocator, thread.stack, _globals, thread.callstack, thread.open_upvalues, false};
+        vm.set_output(_vm.get_output(), _vm.get_error_output());
+        vm.set_limits(_vm.get_limits());
+
+        auto function = thread.stack[0];
+        std::vector<Value> args(thread.stack.data() + 1, thread.stack.data() + thread.stack.size());
+
+        auto result = vm.call(function, args);
+        thread.failed = !result || !vm.drain_event_loop();
+
+        thread.stack.pop_to(0);
+        thread.stack.push(result.value_or(Value{}));
+    }
+
+    _allocator.leave();
+    _current = nullptr;
+}
+
+bool SharedHeap::_join(Thread& thread)
+{
+    {
+        ObjectAllocator::Parked parked{_allocator};
+        thread.thread.join();
+    }
+
+    _allocator.detach(thread.mutator);
+
+    return !thread.failed;
+}
+
+bool SharedHeap::_join_all()
+{
+    auto succeeded = true;
+
+    // Threads being joined may start more threads, so look again after every join.
+    while(true)
+    {
+        Thread* next = nullptr;
+
+        {
+            std::scoped_lock lock{_threads_mutex};
+
+            for(auto& thread : _threads)
+            {
+                if(!thread->joined.exchange(true))
+                {
+                    next = thread.get();
+                    break;
+                }
+            }
+        }
+
+        if(!next)
+        {
+            return succeeded;
+        }
+
+        succeeded = _join(*next) && succeeded;
+    }
+}
+
+Value SharedHeap::_thread_native(VM& vm, std::span<Value> args)
+{
+    auto* closure = !args.empty() && args[0].is_object() ? args[0].as_object()->as<ClosureObject>()
+                                                         : nullptr;
+
+    if(!closure || closure->function.arity != args.size() - 1)
+    {
+        vm.raise("thread() expects a function and the arguments to call it with.");
+        return Value{};
+    }
+
+    if(!closure->upvalues.empty())
+    {
+        vm.raise("thread() cannot start functions which capture variables.");
+        return Value{};
+    }
+
+    auto& heap = *_current;
+    auto thread = std::make_unique<Thread>();
+
+    for(auto arg : args)
+    {
+        thread->stack.push(arg);
+    }
+
+    // From here on collections trace the function and arguments on the new thread's stack.
+    heap._allocator.attach(thread->mutator);
+
+    auto* handle = heap._allocator.allocate<ThreadObject>(true, *thread);
+
+    thread->thread = std::jthread{[&heap, &started = *thread] { heap._run_thread(started); }};
+
+    std::scoped_lock lock{heap._threads_mutex};
+    heap._threads.push_back(std::move(thread));
+
+    return Value{handle};
+}
+
+Value SharedHeap::_join_native(VM& vm, std::span<Value> args)
+{
+    auto* handle = args.size() == 1 && args[0].is_object()
+                       ? args[0].as_object()->as<ThreadObject>()
+                       : nullptr;
+
+    if(!handle)
+    {
+        vm.raise("join() expects a thread.");
+        return Value{};
+    }
+
+    auto& thread = handle->thread;
+
+    if(thread.joined.exchange(true))
+    {
+        vm.raise("Cannot join a thread twice.");
+        return Value{};
+    }
+
+    if(!_current->_join(thread))
+    {
+        vm.raise("Error in thread.");
+        return Value{};
+    }
+
+    // Nothing is collected before the result is on the caller's stack.
+    return thread.stack[0];
+}
+
+} // namespace lox
@@ -0,0 +1,88 @@
+#ifndef LOX_SHARED_HEAP_H
+#define LOX_SHARED_HEAP_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "common.h"
+#include "object.h"
+#include "stack.h"
+#include "value.h"
+#include "vm.h"
+
+namespace lox
+{
+
+class Program;
+
+// Runs a program on any number of threads which share one heap, as an alternative to isolates
+// which share nothing. Scripts start threads with thread(fn, args...) and wait for their results
+// with join(thread); the threads use the same globals and the same objects, without copying them.
+//
+// Each thread allocates into a buffer of its own, handing its objects over to the heap a buffer at
+// a time. A collection stops every thread at a safepoint, or while it blocks in join(), send() or
+// recv(), and then marks from all of their stacks. The globals are guarded by a reader-writer
+// lock, and the fields of instances, the elements of lists, the methods of classes and captured
+// variables by a lock per object, so threads never observe them half written. The function
+// declaring a captured variable uses it on its own stack without locking, so functions which
+// capture variables cannot be started as threads. Other natives which block delay collections
+// until they return.
+class SharedHeap
+{
+public:
+    explicit SharedHeap(std::shared_ptr<const Program> program);
+    // Waits for threads which were never joined.
+    ~SharedHeap();
+
+    SharedHeap(const SharedHeap&) = delete;
+    SharedHeap& operator=(const SharedHeap&) = delete;
+
+    // Runs the program's script on the calling thread, which must be the one which created the
+    // heap, and then waits for threads which were not joined. Fails if any thread failed.
+    InterpretResult run();
+
+    VM& get_vm()
+    {
+        return _vm;
+    }
+
+    ObjectAllocator& get_allocator()
+    {
+        return _allocator;
+    }
+
+private:
+    struct Thread;
+    struct ThreadObject;
+
+    std::shared_ptr<const Program> _program;
+
+    CallStack _callstack;
+    FixedStack<Value> _stack;
+    HashMap<Value> _globals;
+    std::vector<UpValueObject*> _open_upvalues;
+
+    ObjectAllocator _allocator;
+    Mutator _mutator;
+    VM _vm;
+
+    std::mutex _threads_mutex;
+    std::vector<std::unique_ptr<Thread>> _threads;
+
+    static thread_local SharedHeap* _current;
+
+    void _run_thread(Thread&);
+    // Waits for a thread, parked, and stops tracing its stack. Returns false if it failed.
+    bool _join(Thread&);
+    bool _join_all();
+
+    static Value _thread_native(VM&, std::span<Value> args);
+    static Value _join_native(VM&, std::span<Value> args);
+};
+
+} // namespace lox
+
+#endif // LOX_SHARED_HEAP_H
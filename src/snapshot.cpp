@@ -0,0 +1,775 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+namespace lox
+{
+namespace
+{
+
+constexpr char MAGIC[8] = {'L', 'O', 'X', 'I', 'M', 'G', '\0', '\0'};
+constexpr uint32_t VERSION = 1;
+
+// Objects are written grouped by kind in this order, so that everything an object needs at
+// construction time has already been created when it is loaded. References which are not needed
+// at construction time are written in a second pass and patched in once every object exists.
+enum class Kind : uint8_t
+{
+    STRING,
+    FUNCTION,
+    UPVALUE,
+    NATIVE,
+    CLASS,
+    CLOSURE,
+    INSTANCE,
+    BOUND_METHOD,
+    LIST
+};
+
+enum class Tag : uint8_t
+{
+    NIL,
+    FALSE,
+    TRUE,
+    NUMBER,
+    OBJECT
+};
+
+struct SnapshotError
+{
+    Snapshot::Error error;
+};
+
+Kind kind_of(Object* object)
+{
+    if(object->as<StringObject>())
+        return Kind::STRING;
+    if(object->as<FunctionObject>())
+        return Kind::FUNCTION;
+    if(object->as<UpValueObject>())
+        return Kind::UPVALUE;
+    if(object->as<NativeFunctionObject>())
+        return Kind::NATIVE;
+    if(object->as<ClassObject>())
+        return Kind::CLASS;
+    if(object->as<ClosureObject>())
+        return Kind::CLOSURE;
+    if(object->as<InstanceObject>())
+        return Kind::INSTANCE;
+    if(object->as<BoundMethodObject>())
+        return Kind::BOUND_METHOD;
+    if(object->as<ListObject>())
+        return Kind::LIST;
+
+    throw SnapshotError{Snapshot::Error::Unsupported};
+}
+
+class Writer
+{
+    std::vector<Object*> _objects;
+    absl::flat_hash_map<Object*, uint32_t> _indices;
+    std::string _buffer;
+
+    template <typename T>
+    void _put(T value)
+    {
+        _buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void _put_string(std::string_view value)
+    {
+        _put<uint32_t>(value.size());
+        _buffer.append(value);
+    }
+
+    void _put_value(Value value)
+    {
+        switch(value.get_type())
+        {
+        case ValueType::NIL:
+            _put(Tag::NIL);
+            break;
+        case ValueType::BOOL:
+            _put(value.as_bool() ? Tag::TRUE : Tag::FALSE);
+            break;
+        case ValueType::NUMBER:
+            _put(Tag::NUMBER);
+            _put(value.as_number());
+            break;
+        case ValueType::OBJECT:
+            _put(Tag::OBJECT);
+            _put(_indices.at(value.as_object()));
+            break;
+        }
+    }
+
+    void _collect(HashMap<Value>& globals);
+    void _write_object(Object*);
+    void _write_references(Object*);
+
+public:
+    std::string write(HashMap<Value>& globals);
+};
+
+void Writer::_collect(HashMap<Value>& globals)
+{
+    absl::flat_hash_set<Object*> seen;
+    std::vector<Object*> pending;
+
+    auto visit = [&](Value value) {
+        if(value.is_object() && seen.insert(value.as_object()).second)
+        {
+            pending.push_back(value.as_object());
+        }
+    };
+
+    for(auto& [name, value] : globals)
+    {
+        visit(value);
+    }
+
+    while(!pending.empty())
+    {
+        auto* object = pending.back();
+        pending.pop_back();
+        _objects.push_back(object);
+
+        if(auto* function = object->as<FunctionObject>())
+        {
+            for(auto constant : function->chunk.get_constants())
+            {
+                visit(constant);
+            }
+        }
+        else if(auto* upvalue = object->as<UpValueObject>())
+        {
+            visit(*upvalue->location);
+        }
+        else if(auto* closure = object->as<ClosureObject>())
+        {
+            if(closure->module)
+            {
+                throw SnapshotError{Snapshot::Error::Unsupported};
+            }
+
+            visit(Value{&closure->function});
+
+            for(auto* upvalue : closure->upvalues)
+            {
+                visit(Value{upvalue});
+            }
+        }
+        else if(auto* bound_method = object->as<BoundMethodObject>())
+        {
+            visit(bound_method->receiver);
+            visit(Value{bound_method->method});
+        }
+        else if(auto* klass = object->as<ClassObject>())
+        {
+            for(auto& [name, method] : klass->methods)
+            {
+                visit(Value{method});
+            }
+        }
+        else if(auto* instance = object->as<InstanceObject>())
+        {
+            visit(Value{&instance->klass});
+
+            for(auto& [name, value] : instance->fields)
+            {
+                visit(value);
+            }
+        }
+        else if(auto* list = object->as<ListObject>())
+        {
+            for(auto element : list->elements)
+            {
+                visit(element);
+            }
+        }
+    }
+
+    std::ranges::stable_sort(_objects, std::less{}, kind_of);
+
+    for(uint32_t i = 0; i < _objects.size(); ++i)
+    {
+        _indices[_objects[i]] = i;
+    }
+}
+
+void Writer::_write_object(Object* object)
+{
+    auto kind = kind_of(object);
+    _put(kind);
+
+    switch(kind)
+    {
+    case Kind::STRING:
+        _put_string(object->as<StringObject>()->value());
+        break;
+    case Kind::FUNCTION: {
+        const auto* function = object->as<FunctionObject>();
+        const auto& chunk = function->chunk;
+
+        _put_string(function->name);
+        _put(function->arity);
+        _put<uint32_t>(function->upvalue_count);
+        _put_string({reinterpret_cast<const char*>(chunk.get_code()), chunk.size()});
+
+        _put<uint32_t>(chunk.get_lines().size());
+        for(auto [offset, line] : chunk.get_lines())
+        {
+            _put(offset);
+            _put<int32_t>(line);
+        }
+        break;
+    }
+    case Kind::UPVALUE:
+    case Kind::LIST:
+        break;
+    case Kind::NATIVE:
+        _put_string(object->as<NativeFunctionObject>()->name);
+        break;
+    case Kind::CLASS:
+        _put_string(object->as<ClassObject>()->name);
+        break;
+    case Kind::CLOSURE: {
+        auto* closure = object->as<ClosureObject>();
+
+        _put(_indices.at(&closure->function));
+        _put<uint32_t>(closure->upvalues.size());
+        for(auto* upvalue : closure->upvalues)
+        {
+            _put(_indices.at(upvalue));
+        }
+        break;
+    }
+    case Kind::INSTANCE:
+        _put(_indices.at(&object->as<InstanceObject>()->klass));
+        break;
+    case Kind::BOUND_METHOD:
+        _put(_indices.at(object->as<BoundMethodObject>()->method));
+        break;
+    }
+}
+
+void Writer::_write_references(Object* object)
+{
+    if(auto* function = object->as<FunctionObject>())
+    {
+        _put<uint32_t>(function->chunk.get_constants().size());
+        for(auto constant : function->chunk.get_constants())
+        {
+            _put_value(constant);
+        }
+    }
+    else if(auto* upvalue = object->as<UpValueObject>())
+    {
+        _put_value(*upvalue->location);
+    }
+    else if(auto* bound_method = object->as<BoundMethodObject>())
+    {
+        _put_value(bound_method->receiver);
+    }
+    else if(auto* klass = object->as<ClassObject>())
+    {
+        _put<uint32_t>(klass->methods.size());
+        for(auto& [name, method] : klass->methods)
+        {
+            _put_string(name);
+            _put(_indices.at(method));
+        }
+    }
+    else if(auto* instance = object->as<InstanceObject>())
+    {
+        _put<uint32_t>(instance->fields.size());
+        for(auto& [name, value] : instance->fields)
+        {
+            _put_string(name);
+            _put_value(value);
+        }
+    }
+    else if(auto* list = object->as<ListObject>())
+    {
+        _put<uint32_t>(list->elements.size());
+        for(auto element : list->elements)
+        {
+            _put_value(element);
+        }
+    }
+}
+
+std::string Writer::write(HashMap<Value>& globals)
+{
+    _collect(globals);
+
+    _buffer.append(MAGIC, sizeof(MAGIC));
+    _put(VERSION);
+    _put<uint32_t>(_objects.size());
+
+    for(auto* object : _objects)
+    {
+        _write_object(object);
+    }
+
+    for(auto* object : _objects)
+    {
+        _write_references(object);
+    }
+
+    _put<uint32_t>(globals.size());
+    for(auto& [name, value] : globals)
+    {
+        _put_string(name);
+        _put_value(value);
+    }
+
+    return std::move(_buffer);
+}
+
+class MappedFile
+{
+    void* _data = MAP_FAILED;
+    size_t _size = 0;
+
+public:
+    MappedFile(const std::string& path)
+    {
+        auto fd = ::open(path.c_str(), O_RDONLY);
+
+        if(fd == -1)
+        {
+            return;
+        }
+
+        struct stat st;
+
+        if(::fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            _size = st.st_size;
+            _data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+
+        ::close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool is_open() const
+    {
+        return _data != MAP_FAILED;
+    }
+
+    std::span<const char> data() const
+    {
+        return {static_cast<const char*>(_data), _size};
+    }
+
+    ~MappedFile()
+    {
+        if(is_open())
+        {
+            ::munmap(_data, _size);
+        }
+    }
+};
+
+class Loader
+{
+    std::span<const char> _data;
+    size_t _position = 0;
+
+    ObjectAllocator& _allocator;
+    HashMap<Value>& _globals;
+    std::vector<Object*> _objects;
+    std::vector<Kind> _kinds;
+
+    std::span<const char> _get_bytes(size_t size)
+    {
+        if(size > _data.size() - _position)
+        {
+            throw SnapshotError{Snapshot::Error::BadFormat};
+        }
+
+        auto ret = _data.subspan(_position, size);
+        _position += size;
+
+        return ret;
+    }
+
+    template <typename T>
+    T _get()
+    {
+        T value;
+        std::memcpy(&value, _get_bytes(sizeof(T)).data(), sizeof(T));
+        return value;
+    }
+
+    // A count of items which each take at least the given number of bytes, checked against what is
+    // left of the image before anything is allocated for them.
+    uint32_t _get_count(size_t min_item_size)
+    {
+        auto count = _get<uint32_t>();
+
+        if(count > (_data.size() - _position) / min_item_size)
+        {
+            throw SnapshotError{Snapshot::Error::BadFormat};
+        }
+
+        return count;
+    }
+
+    std::string_view _get_string()
+    {
+        auto bytes = _get_bytes(_get<uint32_t>());
+        return {bytes.data(), bytes.size()};
+    }
+
+    // Names of globals, methods and fields are only referenced as keys of hash maps, which the
+    // garbage collector cannot see, so keep them alive for the lifetime of the heap.
+    StringObject* _get_pinned_string()
+    {
+        auto* string = _allocator.allocate_string(_get_string(), false);
+        _allocator.pin(string);
+
+        return string;
+    }
+
+    template <typename T>
+    T* _get_object()
+    {
+        auto index = _get<uint32_t>();
+        T* object = index < _objects.size() ? _objects[index]->as<T>() : nullptr;
+
+        if(!object)
+        {
+            throw SnapshotError{Snapshot::Error::BadFormat};
+        }
+
+        return object;
+    }
+
+    Value _get_value()
+    {
+        switch(_get<Tag>())
+        {
+        case Tag::NIL:
+            return Value{};
+        case Tag::FALSE:
+            return Value{false};
+        case Tag::TRUE:
+            return Value{true};
+        case Tag::NUMBER:
+            return Value{_get<double>()};
+        case Tag::OBJECT:
+            return Value{_get_object<Object>()};
+        }
+
+        throw SnapshotError{Snapshot::Error::BadFormat};
+    }
+
+    Object* _load_object(Kind);
+    FunctionObject* _load_function();
+    void _load_references(Object*, Kind);
+
+public:
+    Loader(std::span<const char> data, ObjectAllocator& allocator, HashMap<Value>& globals)
+        : _data(data)
+        , _allocator(allocator)
+        , _globals(globals)
+    { }
+
+    void load();
+};
+
+FunctionObject* Loader::_load_function()
+{
+    auto name = _get_string();
+    auto arity = _get<uint8_t>();
+    auto upvalue_count = _get<uint32_t>();
+    auto code = _get_bytes(_get<uint32_t>());
+
+    auto* function = _allocator.allocate<FunctionObject>(false, std::string{name}, arity);
+    function->upvalue_count = upvalue_count;
+
+    std::vector<Chunk::LineStart> lines(_get_count(sizeof(uint32_t) + sizeof(int32_t)));
+
+    for(auto& start : lines)
+    {
+        start.offset = _get<uint32_t>();
+        start.line = _get<int32_t>();
+    }
+
+    if(!code.empty() && (lines.empty() || lines.front().offset != 0))
+    {
+        throw SnapshotError{Snapshot::Error::BadFormat};
+    }
+
+    // Re-emit the code run by run, which rebuilds the line table as a side effect.
+    for(size_t i = 0; i < lines.size(); ++i)
+    {
+        size_t end = i + 1 < lines.size() ? lines[i + 1].offset : code.size();
+
+        if(end > code.size() || end < lines[i].offset)
+        {
+            throw SnapshotError{Snapshot::Error::BadFormat};
+        }
+
+        for(size_t offset = lines[i].offset; offset < end; ++offset)
+        {
+            function->chunk.write(static_cast<uint8_t>(code[offset]), lines[i].line);
+        }
+    }
+
+    return function;
+}
+
+Object* Loader::_load_object(Kind kind)
+{
+    switch(kind)
+    {
+    case Kind::STRING:
+        return _allocator.allocate_string(_get_string(), false);
+    case Kind::FUNCTION:
+        return _load_function();
+    case Kind::UPVALUE: {
+        auto* upvalue = _allocator.allocate<UpValueObject>(false, nullptr);
+        upvalue->location = &upvalue->closed;
+        return upvalue;
+    }
+    case Kind::NATIVE: {
+        auto it = _globals.find(_get_string());
+        auto* native = it != _globals.end() && it->second.is_object()
+                           ? it->second.as_object()->as<NativeFunctionObject>()
+                           : nullptr;
+
+        if(!native)
+        {
+            throw SnapshotError{Snapshot::Error::UnknownNative};
+        }
+
+        return native;
+    }
+    case Kind::CLASS:
+        return _allocator.allocate<ClassObject>(false, std::string{_get_string()});
+    case Kind::CLOSURE: {
+        auto& function = *_get_object<FunctionObject>();
+        std::vector<UpValueObject*> upvalues(_get_count(sizeof(uint32_t)));
+
+        for(auto& upvalue : upvalues)
+        {
+            upvalue = _get_object<UpValueObject>();
+        }
+
+        return _allocator.allocate<ClosureObject>(false, function, std::move(upvalues));
+    }
+    case Kind::INSTANCE:
+        return _allocator.allocate<InstanceObject>(false, *_get_object<ClassObject>());
+    case Kind::BOUND_METHOD:
+        return _allocator.allocate<BoundMethodObject>(
+            false, Value{}, _get_object<ClosureObject>());
+    case Kind::LIST:
+        return _allocator.allocate<ListObject>(false, std::span<Value>{});
+    }
+
+    throw SnapshotError{Snapshot::Error::BadFormat};
+}
+
+void Loader::_load_references(Object* object, Kind kind)
+{
+    switch(kind)
+    {
+    case Kind::FUNCTION: {
+        auto& chunk = object->as<FunctionObject>()->chunk;
+
+        for(auto count = _get<uint32_t>(); count > 0; --count)
+        {
+            chunk.add_constant(_get_value());
+        }
+        break;
+    }
+    case Kind::UPVALUE:
+        object->as<UpValueObject>()->closed = _get_value();
+        break;
+    case Kind::BOUND_METHOD:
+        object->as<BoundMethodObject>()->receiver = _get_value();
+        break;
+    case Kind::CLASS: {
+        auto& methods = object->as<ClassObject>()->methods;
+
+        for(auto count = _get<uint32_t>(); count > 0; --count)
+        {
+            auto* name = _get_pinned_string();
+            methods[name->value()] = _get_object<ClosureObject>();
+        }
+        break;
+    }
+    case Kind::INSTANCE: {
+        auto& fields = object->as<InstanceObject>()->fields;
+
+        for(auto count = _get<uint32_t>(); count > 0; --count)
+        {
+            auto* name = _get_pinned_string();
+            fields[name->value()] = _get_value();
+        }
+        break;
+    }
+    case Kind::LIST: {
+        auto& elements = object->as<ListObject>()->elements;
+
+        elements.resize(_get_count(sizeof(Tag)));
+        for(auto& element : elements)
+        {
+            element = _get_value();
+        }
+        break;
+    }
+    case Kind::STRING:
+    case Kind::NATIVE:
+    case Kind::CLOSURE:
+        break;
+    }
+}
+
+void Loader::load()
+{
+    auto magic = _get_bytes(sizeof(MAGIC));
+
+    if(!std::ranges::equal(magic, MAGIC) || _get<uint32_t>() != VERSION)
+    {
+        throw SnapshotError{Snapshot::Error::BadFormat};
+    }
+
+    auto count = _get<uint32_t>();
+
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        auto kind = _get<Kind>();
+
+        if(kind > Kind::LIST || (!_kinds.empty() && kind < _kinds.back()))
+        {
+            throw SnapshotError{Snapshot::Error::BadFormat};
+        }
+
+        _kinds.push_back(kind);
+        _objects.push_back(_load_object(kind));
+    }
+
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        _load_references(_objects[i], _kinds[i]);
+    }
+
+    for(auto globals = _get<uint32_t>(); globals > 0; --globals)
+    {
+        auto* name = _get_pinned_string();
+        _globals[name->value()] = _get_value();
+    }
+}
+
+} // namespace
+
+std::expected<std::string, Snapshot::Error> Snapshot::write(HashMap<Value>& globals)
+{
+    try
+    {
+        return Writer{}.write(globals);
+    }
+    catch(const SnapshotError& ex)
+    {
+        return std::unexpected(ex.error);
+    }
+}
+
+std::expected<void, Snapshot::Error>
+Snapshot::read(std::span<const char> image, ObjectAllocator& allocator, HashMap<Value>& globals)
+{
+    try
+    {
+        Loader{image, allocator, globals}.load();
+    }
+    catch(const SnapshotError& ex)
+    {
+        return std::unexpected(ex.error);
+    }
+
+    return {};
+}
+
+std::expected<void, Snapshot::Error> Snapshot::save(std::string_view path, HashMap<Value>& globals)
+{
+    auto image = write(globals);
+
+    if(!image)
+    {
+        return std::unexpected(image.error());
+    }
+
+    std::ofstream ofs(std::string{path}, std::ios::binary | std::ios::trunc);
+
+    if(ofs.fail())
+    {
+        return std::unexpected(Error::OpenFailed);
+    }
+
+    ofs.write(image->data(), image->size());
+
+    if(ofs.fail())
+    {
+        return std::unexpected(Error::WriteFailed);
+    }
+
+    return {};
+}
+
+std::expected<void, Snapshot::Error>
+Snapshot::load(std::string_view path, ObjectAllocator& allocator, HashMap<Value>& globals)
+{
+    MappedFile file{std::string{path}};
+
+    if(!file.is_open())
+    {
+        return std::unexpected(Error::OpenFailed);
+    }
+
+    return read(file.data(), allocator, globals);
+}
+
+std::string_view Snapshot::get_error_message(Error error)
+{
+    switch(error)
+    {
+    case Error::OpenFailed:
+        return "Failed to open image";
+    case Error::WriteFailed:
+        return "Failed to write image";
+    case Error::BadFormat:
+        return "Malformed image";
+    case Error::UnknownNative:
+        return "Image references an unknown native function";
+    case Error::Unsupported:
+        return "Heap contains objects which cannot be saved";
+    }
+}
+
+} // namespace lox
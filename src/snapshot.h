@@ -0,0 +1,54 @@
+#ifndef LOX_SNAPSHOT_H
+#define LOX_SNAPSHOT_H
+
+#include <expected>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+namespace lox
+{
+
+// Serializes everything reachable from the globals of an initialized heap to an image file, and
+// restores such an image into a fresh heap. Restoring an image skips scanning, parsing, compiling
+// and running the code which originally built the heap.
+//
+// Objects are written as flat records which refer to each other by index. Loading maps the image
+// and fixes those indices up into pointers to freshly allocated objects. Native functions are not
+// written out; they are resolved by name against the natives already defined in the target VM.
+// Channels and modules cannot be written, since they are shared with other isolates or belong to
+// the VM which imported them. Images use the host byte order and are not portable between
+// architectures.
+class Snapshot
+{
+public:
+    enum class Error
+    {
+        OpenFailed,
+        WriteFailed,
+        BadFormat,
+        UnknownNative,
+        Unsupported
+    };
+
+    static std::expected<void, Error> save(std::string_view path, HashMap<Value>& globals);
+
+    // The globals must already contain the natives referenced by the image.
+    static std::expected<void, Error>
+    load(std::string_view path, ObjectAllocator& allocator, HashMap<Value>& globals);
+
+    // Like save() and load(), but with the image in memory.
+    static std::expected<std::string, Error> write(HashMap<Value>& globals);
+    static std::expected<void, Error>
+    read(std::span<const char> image, ObjectAllocator& allocator, HashMap<Value>& globals);
+
+    static std::string_view get_error_message(Error);
+};
+
+} // namespace lox
+
+#endif // LOX_SNAPSHOT_H
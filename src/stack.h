@@ -1,36 +1,71 @@
 #ifndef LOX_STACK_H
 #define LOX_STACK_H
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <limits>
 #include <memory>
+#include <type_traits>
 
 #include "common.h"
 
 namespace lox
 {
 
-template <typename T, size_t MAX_SIZE>
+// Stacks which are SIGNAL_SAFE can be read by a signal handler interrupting the thread pushing
+// to them: the size is only raised once the pushed element is written.
+template <typename T, size_t MAX_SIZE, bool SIGNAL_SAFE = false>
 class Stack
 {
-    std::unique_ptr<T[]> _data;
+    static_assert(std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>);
+
+    struct Free
+    {
+        void operator()(T* data) const
+        {
+            std::free(data);
+        }
+    };
+
+    std::unique_ptr<T[], Free> _data;
     size_t _top = 0;
+    size_t _capacity;
+
+    // Keeps the compiler from raising the size before the element is written.
+    static void _publish()
+    {
+        if constexpr(SIGNAL_SAFE)
+        {
+            std::atomic_signal_fence(std::memory_order_release);
+        }
+    }
 
 public:
-    Stack()
-        : _data(new T[MAX_SIZE])
+    // Slots are always pushed before they are read, so they are left uninitialised. That way a
+    // stack only touches the memory it grows into, which keeps creating fibers cheap.
+    explicit Stack(size_t capacity = MAX_SIZE)
+        : _data(static_cast<T*>(std::malloc(capacity * sizeof(T))))
+        , _capacity(capacity)
     { }
 
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+
     void push(T&& val)
     {
         _data[_top] = std::move(val);
+        _publish();
         ++_top;
     }
 
     void push(const T& val)
     {
         _data[_top] = val;
+        _publish();
         ++_top;
     }
 
@@ -87,12 +122,17 @@ public:
 };
 
 inline constexpr int MAX_FRAMES = 64;
-inline constexpr int STACK_MAX = MAX_FRAMES * (std::numeric_limits<uint8_t>::max() + 1);
+// Every frame can address this many stack slots.
+inline constexpr int FRAME_SLOTS = std::numeric_limits<uint8_t>::max() + 1;
+inline constexpr int STACK_MAX = MAX_FRAMES * FRAME_SLOTS;
+// Fibers get shallower stacks than the main one, since there may be many of them.
+inline constexpr int FIBER_MAX_FRAMES = 16;
 
 template <typename T>
 using FixedStack = Stack<T, STACK_MAX>;
 
-using CallStack = Stack<CallFrame, MAX_FRAMES>;
+// The profiler samples call stacks from a signal handler.
+using CallStack = Stack<CallFrame, MAX_FRAMES, true>;
 
 } // namespace lox
 
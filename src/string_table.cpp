@@ -0,0 +1,146 @@
+#include "string_table.h"
+
+#include <algorithm>
+#include <bit>
+
+#include "absl/hash/hash.h"
+#include "object.h"
+
+namespace lox
+{
+namespace
+{
+
+constexpr size_t INITIAL_CAPACITY = 256;
+
+size_t hash(std::string_view value)
+{
+    return absl::Hash<std::string_view>{}(value);
+}
+
+} // namespace
+
+StringTable::Slots::Slots(size_t capacity)
+    : capacity(capacity)
+    , strings(new std::atomic<StringObject*>[capacity]{})
+{ }
+
+StringTable::StringTable()
+{
+    _arrays.push_back(std::make_unique<Slots>(INITIAL_CAPACITY));
+    _slots.store(_arrays.back().get());
+}
+
+StringTable::~StringTable() = default;
+
+StringTable& StringTable::get_common()
+{
+    // Leaked, so that threads still running while the process exits can keep using it.
+    static auto* common = new StringTable;
+    return *common;
+}
+
+StringObject* StringTable::find(std::string_view value) const
+{
+    const auto& slots = *_slots.load(std::memory_order_acquire);
+    auto mask = slots.capacity - 1;
+
+    for(auto i = hash(value) & mask;; i = (i + 1) & mask)
+    {
+        auto* string = slots.strings[i].load(std::memory_order_acquire);
+
+        if(!string)
+        {
+            return nullptr;
+        }
+
+        if(string != TOMBSTONE && string->value() == value)
+        {
+            return string;
+        }
+    }
+}
+
+bool StringTable::contains(const StringObject* string) const
+{
+    return find(string->value()) == string;
+}
+
+StringObject* StringTable::insert(StringObject* string)
+{
+    auto value = std::string_view{string->value()};
+    auto start = hash(value);
+
+    while(true)
+    {
+        std::shared_lock lock{_growing};
+        auto* slots = _slots.load(std::memory_order_acquire);
+        auto mask = slots->capacity - 1;
+
+        // Kept at most half full, so that probes stay short and always end at an empty slot.
+        if(_used.load(std::memory_order_relaxed) >= slots->capacity / 2)
+        {
+            lock.unlock();
+            _grow(slots);
+            continue;
+        }
+
+        for(auto i = start & mask;; i = (i + 1) & mask)
+        {
+            StringObject* found = nullptr;
+
+            if(slots->strings[i].compare_exchange_strong(found, string, std::memory_order_acq_rel))
+            {
+                _used.fetch_add(1, std::memory_order_relaxed);
+                _size.fetch_add(1, std::memory_order_relaxed);
+                return string;
+            }
+
+            if(found != TOMBSTONE && found->value() == value)
+            {
+                return found;
+            }
+        }
+    }
+}
+
+void StringTable::_grow(Slots* full)
+{
+    std::unique_lock lock{_growing};
+
+    // Another insert grew the table first.
+    if(_slots.load(std::memory_order_relaxed) != full)
+    {
+        return;
+    }
+
+    // Sized by the strings alone, since tombstones are not copied.
+    auto capacity = std::max(INITIAL_CAPACITY, std::bit_ceil(_size.load() * 4));
+    auto grown = std::make_unique<Slots>(capacity);
+    auto mask = capacity - 1;
+
+    for(size_t i = 0; i < full->capacity; ++i)
+    {
+        auto* string = full->strings[i].load(std::memory_order_relaxed);
+
+        if(!string || string == TOMBSTONE)
+        {
+            continue;
+        }
+
+        auto j = hash(string->value()) & mask;
+
+        while(grown->strings[j].load(std::memory_order_relaxed))
+        {
+            j = (j + 1) & mask;
+        }
+
+        grown->strings[j].store(string, std::memory_order_relaxed);
+    }
+
+    _used.store(_size.load());
+    _slots.store(grown.get(), std::memory_order_release);
+    _arrays.push_back(std::move(grown));
+}
+
+} // namespace lox
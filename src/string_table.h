@@ -0,0 +1,103 @@
+#ifndef LOX_STRING_TABLE_H
+#define LOX_STRING_TABLE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <vector>
+
+namespace lox
+{
+
+class StringObject;
+
+// A set of interned strings which any number of threads may use at once.
+//
+// The strings live in an open-addressed array of atomic slots. Lookups take no locks: they probe
+// from the string's hash until they reach an empty slot. Inserts claim an empty slot with a
+// compare-and-swap, so concurrent inserts of the same string find each other's, and only stop for
+// the array growing. Slots go from empty to a string and never back while the table is in use, so
+// a lookup never misses a string which was inserted before it started.
+//
+// Entries are weak: the table does not own its strings. Their owner removes the dead ones with
+// sweep(), while no other thread uses the table.
+class StringTable
+{
+public:
+    StringTable();
+    ~StringTable();
+
+    StringTable(const StringTable&) = delete;
+    StringTable& operator=(const StringTable&) = delete;
+
+    // Returns the string with the given value, or nullptr.
+    StringObject* find(std::string_view value) const;
+
+    // Adds the string unless one with the same value is there already. Returns the one which is
+    // in the table afterwards.
+    StringObject* insert(StringObject* string);
+
+    bool contains(const StringObject* string) const;
+
+    size_t size() const
+    {
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    // Removes the strings for which dead(string) returns true. Nothing else may use the table
+    // meanwhile, which also lets it free the arrays which lookups stopped using.
+    template <typename Dead>
+    void sweep(Dead&& dead)
+    {
+        auto& slots = *_slots.load(std::memory_order_relaxed);
+
+        for(size_t i = 0; i < slots.capacity; ++i)
+        {
+            auto* string = slots.strings[i].load(std::memory_order_relaxed);
+
+            if(string && string != TOMBSTONE && dead(string))
+            {
+                slots.strings[i].store(TOMBSTONE, std::memory_order_relaxed);
+                _size.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        std::erase_if(_arrays, [&slots](const auto& array) { return array.get() != &slots; });
+    }
+
+    // The table of identifiers shared by every heap in the process, see
+    // ObjectAllocator::allocate_identifier(). Its strings are never freed.
+    static StringTable& get_common();
+
+private:
+    struct Slots
+    {
+        explicit Slots(size_t capacity);
+
+        const size_t capacity;
+        std::unique_ptr<std::atomic<StringObject*>[]> strings;
+    };
+
+    // Left behind by sweep() so that probes carry on past removed strings.
+    static inline StringObject* const TOMBSTONE = reinterpret_cast<StringObject*>(uintptr_t{1});
+
+    std::atomic<Slots*> _slots;
+    // Slots which were grown out of stay alive until the next sweep, as lookups may still use them.
+    std::vector<std::unique_ptr<Slots>> _arrays;
+    // Held shared by inserts and exclusively while growing.
+    std::shared_mutex _growing;
+
+    std::atomic<size_t> _size = 0;
+    // Slots holding either a string or a tombstone.
+    std::atomic<size_t> _used = 0;
+
+    void _grow(Slots* full);
+};
+
+} // namespace lox
+
+#endif // LOX_STRING_TABLE_H
@@ -0,0 +1,159 @@
+#include "tracer.h"
+
+#include <format>
+#include <print>
+#include <unistd.h>
+#include <utility>
+
+#include "object.h"
+
+namespace lox
+{
+namespace
+{
+
+constexpr std::string_view SCRIPT = "script";
+
+// Small numbers for the threads which record events, in the order they first do.
+uint32_t get_thread_id()
+{
+    static std::atomic<uint32_t> next = 1;
+    thread_local uint32_t id = next++;
+
+    return id;
+}
+
+std::string escape(std::string_view value)
+{
+    std::string escaped;
+
+    for(auto c : value)
+    {
+        if(c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if(static_cast<unsigned char>(c) < 0x20)
+        {
+            escaped += std::format("\\u{:04x}", static_cast<unsigned>(c));
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
+
+} // namespace
+
+std::atomic<Tracer*> Tracer::_running = nullptr;
+
+Tracer::Tracer(std::chrono::nanoseconds threshold)
+    : _threshold(std::chrono::duration_cast<Clock::duration>(threshold))
+{ }
+
+Tracer::~Tracer()
+{
+    stop();
+}
+
+bool Tracer::start()
+{
+    Tracer* expected = nullptr;
+
+    if(!_running.compare_exchange_strong(expected, this))
+    {
+        return false;
+    }
+
+    _started = true;
+
+    return true;
+}
+
+void Tracer::stop()
+{
+    if(std::exchange(_started, false))
+    {
+        _running = nullptr;
+    }
+}
+
+void Tracer::add(std::string_view category, std::string_view name, Clock::time_point start)
+{
+    auto now = Clock::now();
+    std::scoped_lock lock{_mutex};
+
+    _events.push_back({.name = std::string{name},
+                       .category = category,
+                       .start = start,
+                       .duration = now - start,
+                       .thread = get_thread_id()});
+}
+
+void Tracer::enter(const CallFrame& frame)
+{
+    _entered[&frame] = Clock::now();
+}
+
+void Tracer::exit(const CallFrame& frame)
+{
+    auto it = _entered.find(&frame);
+
+    // Frames entered before the tracer was set on the VM.
+    if(it == _entered.end())
+    {
+        return;
+    }
+
+    auto start = it->second;
+    _entered.erase(it);
+
+    if(Clock::now() - start >= _threshold)
+    {
+        const auto& name = frame.closure->function.name;
+        add("call", name.empty() ? SCRIPT : std::string_view{name}, start);
+    }
+}
+
+void Tracer::called(const NativeFunctionObject& native, Clock::time_point start)
+{
+    if(Clock::now() - start >= _threshold)
+    {
+        add("native", native.name, start);
+    }
+}
+
+void Tracer::write(std::FILE* file) const
+{
+    using Microseconds = std::chrono::duration<double, std::micro>;
+
+    std::scoped_lock lock{_mutex};
+    auto pid = ::getpid();
+
+    std::println(file, R"({{"displayTimeUnit": "ms", "traceEvents": [)");
+
+    for(size_t i = 0; i < _events.size(); ++i)
+    {
+        const auto& event = _events[i];
+
+        std::println(
+            file,
+            R"(  {{"name": "{}", "cat": "{}", "ph": "X", "ts": {:.3f}, "dur": {:.3f}, "pid": {}, )"
+            R"("tid": {}}}{})",
+            escape(event.name),
+            event.category,
+            Microseconds{event.start - _created}.count(),
+            Microseconds{event.duration}.count(),
+            pid,
+            event.thread,
+            i + 1 < _events.size() ? "," : "");
+    }
+
+    std::println(file, "]}}");
+}
+
+} // namespace lox
@@ -0,0 +1,120 @@
+#ifndef LOX_TRACER_H
+#define LOX_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "common.h"
+
+namespace lox
+{
+
+struct NativeFunctionObject;
+
+// Records what the interpreter spends its time on as Chrome trace events, which Perfetto and
+// chrome://tracing show as a timeline of every thread: the calls of the VM which traces with it
+// and the natives they call, collections and their phases, and parsing and compiling of the
+// script, its modules and every function in them.
+//
+// Calls and natives are only recorded if they take at least the threshold, which keeps the trace
+// to the calls that matter and the overhead low for scripts making many short calls. Collections
+// and compiles on any thread report to the running tracer, of which there is at most one.
+class Tracer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit Tracer(std::chrono::nanoseconds threshold);
+    ~Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    // Makes this the running tracer. Returns false if another one is running.
+    bool start();
+    void stop();
+
+    // Records a span which started at the time given and ends now.
+    void add(std::string_view category, std::string_view name, Clock::time_point start);
+
+    // Called by the VM as it pushes and pops frames, and after it called a native. Only the
+    // thread running the VM may call these.
+    void enter(const CallFrame&);
+    void exit(const CallFrame&);
+    void called(const NativeFunctionObject&, Clock::time_point start);
+
+    // Writes the events as a JSON trace.
+    void write(std::FILE*) const;
+
+    static Tracer* get_running()
+    {
+        return _running.load(std::memory_order_acquire);
+    }
+
+    // Records a span from its construction to its destruction with the running tracer, if any.
+    // The name must outlive the span.
+    class Span
+    {
+        Tracer* _tracer;
+        std::string_view _category;
+        std::string_view _name;
+        Clock::time_point _start;
+
+    public:
+        Span(std::string_view category, std::string_view name)
+            : _tracer(get_running())
+            , _category(category)
+            , _name(name)
+        {
+            if(_tracer)
+            {
+                _start = Clock::now();
+            }
+        }
+
+        ~Span()
+        {
+            if(_tracer)
+            {
+                _tracer->add(_category, _name, _start);
+            }
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+    };
+
+private:
+    struct Event
+    {
+        std::string name;
+        std::string_view category;
+        Clock::time_point start;
+        Clock::duration duration;
+        uint32_t thread;
+    };
+
+    static std::atomic<Tracer*> _running;
+
+    Clock::duration _threshold;
+    Clock::time_point _created = Clock::now();
+    bool _started = false;
+
+    mutable std::mutex _mutex;
+    std::vector<Event> _events;
+
+    // When each frame on the stacks of the VM was entered. Frames are told apart by address,
+    // which stays the same while they are on a stack, fibers included.
+    absl::flat_hash_map<const CallFrame*, Clock::time_point> _entered;
+};
+
+} // namespace lox
+
+#endif // LOX_TRACER_H
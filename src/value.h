@@ -16,6 +16,7 @@ enum class ValueType
 };
 
 class Object;
+class VM;
 
 class Value
 {
@@ -141,7 +142,7 @@ public:
     std::string to_string() const;
 };
 
-using NativeFn = Value (*)(std::span<Value>);
+using NativeFn = Value (*)(VM&, std::span<Value>);
 
 } // namespace lox
 
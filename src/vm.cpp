@@ -1,17 +1,29 @@
 #include "vm.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <ctime>
+#include <utility>
 #include <print>
 #include <span>
 #include <string_view>
 #include <vector>
 
+#include "bind.h"
+#include "channel.h"
 #include "chunk.h"
 #include "common.h"
+#include "event_loop.h"
+#include "fiber.h"
+#include "heap_dump.h"
+#include "host_class.h"
 #include "object.h"
+#include "op_stats.h"
+#include "parallel.h"
+#include "profiler.h"
 #include "stack.h"
+#include "tracer.h"
 #include "value.h"
 
 namespace lox
@@ -19,50 +31,344 @@ namespace lox
 namespace
 {
 
-Value clock_native(std::span<Value>)
+HostObject* as_host(Value value)
 {
-    return Value{(double)clock() / CLOCKS_PER_SEC};
+    return value.is_object() ? value.as_object()->as<HostObject>() : nullptr;
 }
 
-Value print_native(std::span<Value> args)
+ModuleObject* as_module(Value value)
+{
+    return value.is_object() ? value.as_object()->as<ModuleObject>() : nullptr;
+}
+
+Value print_native(VM& vm, std::span<Value> args)
 {
     for(size_t i = 0; i < args.size() - 1; ++i)
     {
-        std::print("{}, ", args[i].to_string());
+        std::print(vm.get_output(), "{}, ", args[i].to_string());
     }
 
-    std::println("{}", args.back().to_string());
+    std::println(vm.get_output(), "{}", args.back().to_string());
 
     return Value{};
 }
 
+std::expected<void, std::string_view> dump_heap_native(VM& vm, std::string_view path)
+{
+    if(auto saved = HeapDump::save(path, vm.get_allocator()); !saved)
+    {
+        return std::unexpected(HeapDump::get_error_message(saved.error()));
+    }
+
+    return {};
+}
+
 } // namespace
 
 VM::VM(ObjectAllocator& allocator,
        FixedStack<Value>& stack,
        HashMap<Value>& globals,
        CallStack& callstack,
-       std::vector<UpValueObject*>& open_upvalues)
+       std::vector<UpValueObject*>& open_upvalues,
+       bool define_natives)
     : _allocator(allocator)
-    , _stack(stack)
+    , _stack(&stack)
     , _globals(globals)
-    , _callstack(callstack)
-    , _open_upvalues(open_upvalues)
+    , _callstack(&callstack)
+    , _open_upvalues(&open_upvalues)
 {
-    define_native("clock", &clock_native);
-    define_native("print", &print_native);
+    if(allocator.is_concurrent())
+    {
+        _globals_mutex = &allocator.get_globals_mutex();
+    }
+
+    if(define_natives)
+    {
+        bind("clock", [] { return (double)clock() / CLOCKS_PER_SEC; });
+        define_native("print", &print_native);
+        bind<&dump_heap_native>("dump_heap");
+        define_channel_natives(*this);
+        define_parallel_natives(*this);
+        define_fiber_natives(*this);
+        define_event_loop_natives(*this);
+    }
 
-    _open_upvalues.reserve(256);
+    _open_upvalues->reserve(256);
+}
+
+void VM::start_run()
+{
+    _steps = 0;
+
+    // Embedders start a run for every call, so the clock is only read when it matters.
+    if(_limits.time)
+    {
+        _run_start = std::chrono::steady_clock::now();
+    }
+
+    _rearm(SAFEPOINT_INTERVAL);
 }
 
 InterpretResult VM::interpret(FunctionObject& function)
 {
-    _stack.push(
-        Value{_allocator.allocate<ClosureObject>(false, function, std::vector<UpValueObject*>{})});
+    start_run();
 
-    _call_value(_stack.top(), 0);
+    auto* closure =
+        _allocator.allocate<ClosureObject>(false, function, std::vector<UpValueObject*>{});
 
-    return _run();
+    auto result = call(Value{closure}, {});
+
+    if(!result)
+    {
+        return result.error();
+    }
+
+    // Finish whatever the script left for the event loop.
+    return drain_event_loop() ? InterpretResult::OK : InterpretResult::RUNTIME_ERROR;
+}
+
+bool VM::drain_event_loop()
+{
+    return !_event_loop || _event_loop->run();
+}
+
+VM::~VM() = default;
+
+EventLoop& VM::get_event_loop()
+{
+    if(!_event_loop)
+    {
+        _event_loop = EventLoop::create();
+    }
+
+    return *_event_loop;
+}
+
+template <typename Enter>
+std::expected<Value, InterpretResult>
+VM::_call_and_run(Value callee, std::span<const Value> args, Enter enter)
+{
+    auto base = _stack->size();
+    auto depth = _callstack->size();
+    auto exit_depth = std::exchange(_exit_depth, depth);
+    // Yielding would unwind the native which made this call.
+    auto can_yield = std::exchange(_can_yield, false);
+    auto preempting = std::exchange(_preempting, false);
+
+    _stack->push(callee);
+
+    for(auto arg : args)
+    {
+        _stack->push(arg);
+    }
+
+    auto result = InterpretResult::RUNTIME_ERROR;
+
+    if(enter((*_stack)[base], static_cast<int>(args.size())))
+    {
+        // Natives, and classes without initializers, have already finished.
+        result = _callstack->size() > depth ? _run() : InterpretResult::OK;
+    }
+
+    _exit_depth = exit_depth;
+    _can_yield = can_yield;
+    _preempting = preempting;
+
+    if(result != InterpretResult::OK)
+    {
+        _close_upvalues(_stack->data() + base);
+        _stack->pop_to(base);
+        _callstack->pop_to(depth);
+        _current_frame = depth > 0 ? _callstack->top_addr() : nullptr;
+
+        return std::unexpected(result);
+    }
+
+    return _stack->pop();
+}
+
+std::expected<Value, InterpretResult> VM::call(Value callee, std::span<const Value> args)
+{
+    return _call_and_run(callee, args, [this](Value& callee, int arg_count) {
+        return _call_value(callee, arg_count);
+    });
+}
+
+std::expected<Value, InterpretResult> VM::call(ClosureObject& closure,
+                                               std::span<const Value> args)
+{
+    return _call_and_run(Value{&closure}, args, [this, &closure](Value&, int arg_count) {
+        return _call(&closure, arg_count);
+    });
+}
+
+std::expected<Value, InterpretResult>
+VM::resume(FiberObject& fiber, Value value, std::optional<std::string> error)
+{
+    auto* stack = std::exchange(_stack, &fiber.stack);
+    auto* callstack = std::exchange(_callstack, &fiber.callstack);
+    auto* open_upvalues = std::exchange(_open_upvalues, &fiber.open_upvalues);
+    auto* frame = _current_frame;
+    auto exit_depth = std::exchange(_exit_depth, 0);
+    auto* caller = std::exchange(_fiber, &fiber);
+    auto can_yield = std::exchange(_can_yield, true);
+
+    auto result = InterpretResult::OK;
+    auto state = std::exchange(fiber.state, FiberObject::State::RUNNING);
+
+    _preempting = false;
+
+    if(_limits.time_slice)
+    {
+        _slice_start = std::chrono::steady_clock::now();
+    }
+
+    if(state == FiberObject::State::NEW)
+    {
+        if(!_call_value(fiber.stack[0], fiber.stack.size() - 1))
+        {
+            result = InterpretResult::RUNTIME_ERROR;
+        }
+        else if(_callstack->size() > 0)
+        {
+            result = _run();
+        }
+    }
+    else if(error)
+    {
+        _runtime_error("{}", *error);
+        result = InterpretResult::RUNTIME_ERROR;
+    }
+    else
+    {
+        // Replace what the suspended yield() call returned.
+        if(!std::exchange(fiber.preempted, false))
+        {
+            fiber.stack.top() = value;
+        }
+
+        _current_frame = _callstack->top_addr();
+        result = _run();
+    }
+
+    Value ret;
+
+    if(result != InterpretResult::OK)
+    {
+        // Closures made by the fiber may outlive it.
+        _close_upvalues(fiber.stack.data());
+        fiber.state = FiberObject::State::DONE;
+    }
+    else if(_yielding)
+    {
+        _yielding = false;
+        ret = _yielded;
+        fiber.state = FiberObject::State::SUSPENDED;
+    }
+    else
+    {
+        ret = fiber.stack.pop();
+        fiber.state = FiberObject::State::DONE;
+    }
+
+    _stack = stack;
+    _callstack = callstack;
+    _open_upvalues = open_upvalues;
+    _current_frame = frame;
+    _exit_depth = exit_depth;
+    _fiber = caller;
+    _can_yield = can_yield;
+
+    if(result != InterpretResult::OK)
+    {
+        return std::unexpected(result);
+    }
+
+    return ret;
+}
+
+bool VM::yield(Value value)
+{
+    if(!_can_yield)
+    {
+        return false;
+    }
+
+    _yielding = true;
+    _yielded = value;
+
+    return true;
+}
+
+void VM::_rearm(int32_t quantum)
+{
+    if(_limits.steps)
+    {
+        quantum = static_cast<int32_t>(std::min<uint64_t>(quantum, *_limits.steps - _steps));
+    }
+
+    _quantum = quantum;
+    _ticks = quantum;
+}
+
+bool VM::_safepoint()
+{
+    _allocator.safepoint();
+    HeapDump::poll(_allocator);
+
+    if(_profiler)
+    {
+        _profiler->drain();
+    }
+
+    // Once the run has failed, every following safepoint fails as well while it unwinds.
+    _steps += std::exchange(_quantum, 0);
+
+    if(is_cancelled())
+    {
+        _runtime_error("Script was cancelled.");
+        return false;
+    }
+
+    if(_limits.steps && _steps >= *_limits.steps)
+    {
+        _runtime_error("Script exceeded its limit of {} steps.", *_limits.steps);
+        return false;
+    }
+
+    if(_limits.time || _limits.time_slice)
+    {
+        auto now = std::chrono::steady_clock::now();
+
+        if(_limits.time && now - _run_start >= *_limits.time)
+        {
+            _runtime_error("Script exceeded its time limit.");
+            return false;
+        }
+
+        if(_limits.time_slice && now - _slice_start >= *_limits.time_slice && _fiber
+           && _fiber->scheduled && _can_yield)
+        {
+            _preempting = true;
+        }
+    }
+
+    _rearm(SAFEPOINT_INTERVAL);
+
+    return true;
+}
+
+void VM::_suspend()
+{
+    // A native which yielded has a result for resume() to replace, unlike a preempted fiber.
+    if(!_yielding)
+    {
+        _fiber->preempted = true;
+        _yielding = true;
+        _yielded = Value{};
+    }
+
+    _preempting = false;
 }
 
 bool VM::_call_value(Value& callee, int arg_count)
@@ -75,11 +381,11 @@ bool VM::_call_value(Value& callee, int arg_count)
         }
         else if(auto klass = callee.as_object()->as<ClassObject>())
         {
-            _stack[_stack.size() - arg_count - 1] =
+            (*_stack)[_stack->size() - arg_count - 1] =
                 Value{_allocator.allocate<InstanceObject>(true, *klass)};
-            auto* initializer = klass->methods["init"];
-
-            if(initializer)
+            // Classes may be shared between threads, so look the initializer up without
+            // inserting into the method table.
+            if(auto* initializer = _find_method(*klass, "init"))
             {
                 return _call(initializer, arg_count);
             }
@@ -93,16 +399,27 @@ bool VM::_call_value(Value& callee, int arg_count)
         }
         else if(auto bound_method = callee.as_object()->as<BoundMethodObject>())
         {
-            _stack[_stack.size() - arg_count - 1] = bound_method->receiver;
+            (*_stack)[_stack->size() - arg_count - 1] = bound_method->receiver;
             return _call(bound_method->method, arg_count);
         }
         else if(auto native_func = callee.as_object()->as<NativeFunctionObject>())
         {
-            auto ret =
-                native_func->native_fn({_stack.top_addr() - arg_count + 1, _stack.top_addr() + 1});
+            auto start = _tracer ? Tracer::Clock::now() : Tracer::Clock::time_point{};
+            auto ret = native_func->native_fn(
+                *this, {_stack->top_addr() - arg_count + 1, _stack->top_addr() + 1});
+
+            if(_tracer) [[unlikely]]
+            {
+                _tracer->called(*native_func, start);
+            }
 
-            _stack.pop_by(arg_count + 1);
-            _stack.push(ret);
+            if(_report_native_error())
+            {
+                return false;
+            }
+
+            _stack->pop_by(arg_count + 1);
+            _stack->push(ret);
 
             return true;
         }
@@ -121,37 +438,56 @@ bool VM::_call(ClosureObject* closure, int arg_count)
         return false;
     }
 
-    if(_callstack.size() == MAX_FRAMES)
+    if(_callstack->size() == _callstack->capacity())
     {
         _runtime_error("Stack overflow.");
         return false;
     }
 
-    _callstack.push({
+    _callstack->push({
         .closure = closure,
         .ip = closure->function.chunk.get_code(),
-        .offset = static_cast<int>(_stack.size() - arg_count - 1),
+        .offset = static_cast<int>(_stack->size() - arg_count - 1),
     });
 
-    _current_frame = _callstack.top_addr();
+    _current_frame = _callstack->top_addr();
+
+    if(_tracer) [[unlikely]]
+    {
+        _tracer->enter(*_current_frame);
+    }
 
     return true;
 }
 
-bool VM::_invoke(std::string_view name, int arg_count, ClassObject* klass)
+bool VM::_invoke(uint8_t constant, int arg_count, ClassObject* klass)
 {
-    auto* receiver = _stack[_stack.size() - arg_count - 1].as_object()->as<InstanceObject>();
-    klass = klass ? klass : &receiver->klass;
+    auto receiver_value = (*_stack)[_stack->size() - arg_count - 1];
+    auto* receiver =
+        receiver_value.is_object() ? receiver_value.as_object()->as<InstanceObject>() : nullptr;
 
     if(!receiver)
     {
+        if(auto* host = as_host(receiver_value); host && !klass)
+        {
+            return _invoke_host(*host, constant, arg_count);
+        }
+
+        if(auto* module = as_module(receiver_value); module && !klass)
+        {
+            return _invoke_module(*module, constant, arg_count);
+        }
+
         _runtime_error("Only instances have methods.");
         return false;
     }
 
-    auto method_it = klass->methods.find(name);
+    auto name = _constant_string(constant);
+    klass = klass ? klass : &receiver->klass;
+
+    auto* method = _find_method(*klass, name);
 
-    if(method_it == klass->methods.end())
+    if(!method)
     {
         // This is a super call so only methods are allowed.
         if(klass != &receiver->klass)
@@ -160,19 +496,285 @@ bool VM::_invoke(std::string_view name, int arg_count, ClassObject* klass)
             return false;
         }
 
-        auto field_it = receiver->fields.find(name);
-        if(field_it == receiver->fields.end())
+        auto field = _get_field(*receiver, name);
+
+        if(!field)
         {
             _runtime_error("Undefined property '{}'.", name);
             return false;
         }
 
-        _stack[_stack.size() - arg_count - 1] = field_it->second;
+        auto& callee = (*_stack)[_stack->size() - arg_count - 1];
+        callee = *field;
+
+        return _call_value(callee, arg_count);
+    }
+
+    return _call(method, arg_count);
+}
+
+bool VM::_report_native_error()
+{
+    if(!_native_error)
+    {
+        return false;
+    }
+
+    _runtime_error("{}", *_native_error);
+    _native_error.reset();
+
+    return true;
+}
+
+const HostProperty* VM::_find_host_property(const HostObject& object, uint8_t constant)
+{
+    auto& cache = _current_chunk().get_property_cache(constant);
+
+    if(auto* property = cache.get(); property && property->owner == &object.klass)
+    {
+        return property;
+    }
+
+    auto* property = object.klass.find(_constant_string(constant));
+
+    if(property)
+    {
+        cache.set(property);
+    }
+
+    return property;
+}
+
+bool VM::_get_host_property(HostObject& object, uint8_t constant)
+{
+    auto* property = _find_host_property(object, constant);
+
+    if(!property || !property->get)
+    {
+        _runtime_error(property ? "Host method '{}' can only be called."
+                                : "Undefined property '{}'.",
+                       _constant_string(constant));
+        return false;
+    }
+
+    // The object stays on the stack while the getter may allocate.
+    auto value = property->get(*this, object.record);
 
-        return _call_value(field_it->second, arg_count);
+    if(_report_native_error())
+    {
+        return false;
     }
 
-    return _call(method_it->second, arg_count);
+    _stack->top() = value;
+
+    return true;
+}
+
+bool VM::_set_host_property(HostObject& object, uint8_t constant)
+{
+    auto* property = _find_host_property(object, constant);
+
+    if(!property || !property->set)
+    {
+        _runtime_error(property ? "Property '{}' cannot be assigned to."
+                                : "Undefined property '{}'.",
+                       _constant_string(constant));
+        return false;
+    }
+
+    property->set(*this, object.record, _stack->top());
+
+    if(_report_native_error())
+    {
+        return false;
+    }
+
+    auto& value = _stack->pop();
+    // Replace the object on the top of the stack with the assigned value.
+    _stack->top() = value;
+
+    return true;
+}
+
+bool VM::_invoke_host(HostObject& object, uint8_t constant, int arg_count)
+{
+    auto* property = _find_host_property(object, constant);
+
+    if(property && property->call)
+    {
+        auto ret = property->call(
+            *this, object.record, {_stack->top_addr() - arg_count + 1, _stack->top_addr() + 1});
+
+        if(_report_native_error())
+        {
+            return false;
+        }
+
+        _stack->pop_by(arg_count + 1);
+        _stack->push(ret);
+
+        return true;
+    }
+
+    if(property && property->get)
+    {
+        auto callee = property->get(*this, object.record);
+
+        if(_report_native_error())
+        {
+            return false;
+        }
+
+        auto& slot = (*_stack)[_stack->size() - arg_count - 1];
+        slot = callee;
+
+        return _call_value(slot, arg_count);
+    }
+
+    _runtime_error("Undefined property '{}'.", _constant_string(constant));
+
+    return false;
+}
+
+bool VM::_import(uint8_t constant)
+{
+    auto path = _constant_string(constant);
+
+    if(auto it = _modules.find(path); it != _modules.end())
+    {
+        _stack->push(Value{it->second});
+        _stack->push(Value{});
+        return true;
+    }
+
+    auto* script = _allocator.find_module(path);
+
+    if(!script)
+    {
+        _runtime_error("Module '{}' was not compiled.", path);
+        return false;
+    }
+
+    auto* module = _allocator.allocate<ModuleObject>(true, std::string{path});
+    // Imported modules stay loaded for as long as the VM, like its own globals.
+    _allocator.pin(module);
+    _modules.emplace(path, module);
+    _stack->push(Value{module});
+
+    auto* closure =
+        _allocator.allocate<ClosureObject>(true, *script, std::vector<UpValueObject*>{});
+    closure->module = module;
+    _stack->push(Value{closure});
+
+    return _call(closure, 0);
+}
+
+bool VM::_get_module_property(ModuleObject& module, uint8_t constant)
+{
+    auto name = _constant_string(constant);
+    auto lock = _read_globals();
+
+    if(auto it = module.globals.find(name); it != module.globals.end())
+    {
+        _stack->top() = it->second;
+        return true;
+    }
+
+    _runtime_error("Undefined property '{}' of module {}.", name, module.name);
+
+    return false;
+}
+
+bool VM::_set_module_property(ModuleObject& module, uint8_t constant)
+{
+    auto name = _constant_string(constant);
+
+    if(module.is_shared())
+    {
+        _runtime_error("Parallel tasks cannot modify modules imported outside them.");
+        return false;
+    }
+
+    {
+        auto lock = _write_globals();
+        auto it = module.globals.find(name);
+
+        // Scripts may assign to what a module defines, but not add to it.
+        if(it == module.globals.end())
+        {
+            _runtime_error("Undefined property '{}' of module {}.", name, module.name);
+            return false;
+        }
+
+        it->second = _stack->top();
+    }
+
+    auto& value = _stack->pop();
+    _stack->top() = value;
+
+    return true;
+}
+
+bool VM::_invoke_module(ModuleObject& module, uint8_t constant, int arg_count)
+{
+    auto name = _constant_string(constant);
+    auto& slot = (*_stack)[_stack->size() - arg_count - 1];
+
+    {
+        auto lock = _read_globals();
+        auto it = module.globals.find(name);
+
+        if(it == module.globals.end())
+        {
+            _runtime_error("Undefined property '{}' of module {}.", name, module.name);
+            return false;
+        }
+
+        // The callee replaces the module below the arguments.
+        slot = it->second;
+    }
+
+    return _call_value(slot, arg_count);
+}
+
+std::optional<Value> VM::_get_field(InstanceObject& instance, std::string_view name)
+{
+    auto lock = _lock(instance.lock);
+
+    if(auto it = instance.fields.find(name); it != instance.fields.end())
+    {
+        return it->second;
+    }
+
+    return std::nullopt;
+}
+
+Value* VM::_find_global(std::string_view name)
+{
+    auto* module = _current_frame->closure->module;
+
+    if(module)
+    {
+        if(auto it = module->globals.find(name); it != module->globals.end())
+        {
+            return &it->second;
+        }
+    }
+
+    auto it = _globals.find(name);
+
+    if(it == _globals.end())
+    {
+        return nullptr;
+    }
+
+    // Modules see the natives but not the globals of the script importing them.
+    if(module && !(it->second.is_object() && it->second.as_object()->as<NativeFunctionObject>()))
+    {
+        return nullptr;
+    }
+
+    return &it->second;
 }
 
 Chunk& VM::_current_chunk()
@@ -180,97 +782,139 @@ Chunk& VM::_current_chunk()
     return _current_frame->closure->function.chunk;
 }
 
+std::string_view VM::_constant_string(uint8_t constant)
+{
+    return _current_chunk().get_constant(constant).as_object()->as<StringObject>()->value();
+}
+
 void VM::define_native(std::string_view name, NativeFn fn)
 {
-    _globals[name] = Value{_allocator.allocate<NativeFunctionObject>(false, fn)};
+    auto* native = _allocator.allocate<NativeFunctionObject>(false, std::string{name}, fn);
+    auto lock = _write_globals();
+
+    _globals[name] = Value{native};
 }
 
 UpValueObject* VM::_capture_upvalue(Value* local)
 {
     auto ret = std::ranges::find_if(
-        _open_upvalues, [local](UpValueObject* upvalue) { return upvalue->location == local; });
+        *_open_upvalues, [local](UpValueObject* upvalue) { return upvalue->location == local; });
 
-    if(ret != _open_upvalues.end())
+    if(ret != _open_upvalues->end())
     {
         return *ret;
     }
-    _open_upvalues.push_back(_allocator.allocate<UpValueObject>(true, local));
+    auto* upvalue = _allocator.allocate<UpValueObject>(true, local);
+    // Keep the fiber whose stack the variable lives on alive for as long as the upvalue is open.
+    upvalue->stack_owner = _fiber;
+    _open_upvalues->push_back(upvalue);
 
-    return _open_upvalues.back();
+    return upvalue;
 }
 
 template <class... Args>
 constexpr void VM::_runtime_error(std::string_view format, Args&&... args)
 {
-    std::cerr << std::vformat(format, std::make_format_args(args...)) << '\n';
+    std::println(_error_output, "{}", std::vformat(format, std::make_format_args(args...)));
 
-    for(int i = _callstack.size() - 1; i >= 0; i--)
+    for(int i = _callstack->size() - 1; i >= 0; i--)
     {
-        const auto& frame = _callstack[i];
+        const auto& frame = (*_callstack)[i];
         const auto& function = frame.closure->function;
         size_t instruction = frame.ip - function.chunk.get_code() - 1;
 
         int line = function.chunk.get_line(instruction);
 
-        std::print(stderr, "[line {}] in ", line);
+        std::print(_error_output, "[line {}] in ", line);
 
         if(function.name.empty())
         {
-            std::println(stderr, "script");
+            std::println(_error_output, "script");
         }
         else
         {
-            std::println(stderr, "{}()", function.name);
+            std::println(_error_output, "{}()", function.name);
         }
     }
 }
 
 void VM::_close_upvalues(Value* last)
 {
-    std::erase_if(_open_upvalues, [last](UpValueObject* upvalue) {
+    std::erase_if(*_open_upvalues, [this, last](UpValueObject* upvalue) {
         if(upvalue->location < last)
         {
             return false;
         }
 
+        auto lock = _lock(upvalue->lock);
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        upvalue->stack_owner = nullptr;
 
         return true;
     });
 }
 
+ClosureObject* VM::_find_method(const ClassObject& klass, std::string_view name)
+{
+    auto lock = _lock(klass.lock);
+    auto it = klass.methods.find(name);
+
+    return it != klass.methods.end() ? it->second : nullptr;
+}
+
 bool VM::_bind_method(const ClassObject& klass, std::string_view name)
 {
-    auto method_it = klass.methods.find(name);
+    auto* method = _find_method(klass, name);
 
-    if(method_it == klass.methods.end())
+    if(!method)
     {
         return false;
     }
 
-    auto* bound_method =
-        _allocator.allocate<BoundMethodObject>(true, _stack.top(), method_it->second);
+    auto* bound_method = _allocator.allocate<BoundMethodObject>(true, _stack->top(), method);
 
-    _stack.pop();
-    _stack.push(Value{bound_method});
+    _stack->pop();
+    _stack->push(Value{bound_method});
 
     return true;
 }
 
-InterpretResult VM::_run()
+template <bool COUNT_OPS>
+InterpretResult VM::_dispatch()
 {
 #define BINARY_OP(op)                                                                              \
     do                                                                                             \
     {                                                                                              \
-        auto b = _stack.pop();                                                                     \
-        auto a = _stack.pop();                                                                     \
+        auto b = _stack->pop();                                                                    \
+        auto a = _stack->pop();                                                                    \
         if(!a.is_number() || !b.is_number())                                                       \
         {                                                                                          \
             _runtime_error("{}", "Operands must be numbers.");                                     \
             return InterpretResult::RUNTIME_ERROR;                                                 \
         }                                                                                          \
-        _stack.push(Value{a.as_number() op b.as_number()});                                        \
+        _stack->push(Value{a.as_number() op b.as_number()});                                       \
+    } while(false)
+
+// Checked before jumping or calling, so that errors point at the loop or call.
+#define SAFEPOINT()                                                                                \
+    do                                                                                             \
+    {                                                                                              \
+        if(--_ticks <= 0 && !_safepoint())                                                         \
+        {                                                                                          \
+            return InterpretResult::RUNTIME_ERROR;                                                 \
+        }                                                                                          \
+    } while(false)
+
+// Checked once the frame is ready to continue, after jumping or calling.
+#define SUSPEND_IF_YIELDING()                                                                      \
+    do                                                                                             \
+    {                                                                                              \
+        if(_yielding || _preempting)                                                               \
+        {                                                                                          \
+            _suspend();                                                                            \
+            return InterpretResult::OK;                                                            \
+        }                                                                                          \
     } while(false)
 
     while(true)
@@ -278,54 +922,73 @@ InterpretResult VM::_run()
 #ifdef DEBUG_TRACE_EXECUTION
         _current_chunk().disassemble_instruction(_current_frame->ip);
 #endif
+        if constexpr(COUNT_OPS)
+        {
+            const auto& function = _current_frame->closure->function;
+            _op_stats->count(function,
+                             _current_frame->ip - function.chunk.get_code(),
+                             static_cast<OpCode>(*_current_frame->ip));
+        }
+
         switch(auto instruction = static_cast<OpCode>(_read_byte()); instruction)
         {
         case OpCode::RETURN: {
-            auto ret = _stack.pop();
+            auto ret = _stack->pop();
+
+            if(_tracer) [[unlikely]]
+            {
+                _tracer->exit(*_current_frame);
+            }
 
-            // Returning from top level script function
-            if(_callstack.size() == 1)
+            // Returning from the function call() was asked to make
+            if(_callstack->size() == _exit_depth + 1)
             {
-                _callstack.pop();
-                _stack.pop();
+                auto& frame = _callstack->pop();
+
+                _close_upvalues(_stack->data() + frame.offset);
+                _stack->pop_to(frame.offset);
+                _stack->push(ret);
+
+                _current_frame = _exit_depth > 0 ? _callstack->top_addr() : nullptr;
+
                 return InterpretResult::OK;
             }
 
-            auto& previous_frame = _callstack.pop();
+            auto& previous_frame = _callstack->pop();
 
-            _current_frame = _callstack.top_addr();
+            _current_frame = _callstack->top_addr();
 
             // Reset the stack to where it was before the function call
-            _stack.pop_to(previous_frame.offset);
+            _stack->pop_to(previous_frame.offset);
             // Close over any stack values from the returning function
-            _close_upvalues(_stack.top_addr());
+            _close_upvalues(_stack->top_addr());
 
             // Push the return value
-            _stack.push(ret);
+            _stack->push(ret);
 
             break;
         }
         case OpCode::CONSTANT: {
             auto& value = _current_chunk().get_constant(_read_byte());
-            _stack.push(value);
+            _stack->push(value);
             break;
         }
         case OpCode::NEGATE:
-            if(!_stack.top().is_number())
+            if(!_stack->top().is_number())
             {
                 _runtime_error("{}", "Operand must be a number.");
                 return InterpretResult::RUNTIME_ERROR;
             }
-            _stack.top().negate();
+            _stack->top().negate();
             break;
         case OpCode::ADD: {
-            auto& b = _stack.top();
-            auto& a = _stack[_stack.size() - 2];
+            auto& b = _stack->top();
+            auto& a = (*_stack)[_stack->size() - 2];
 
             if(a.is_number() && b.is_number())
             {
-                _stack.pop_by(2);
-                _stack.push(Value{a.as_number() + b.as_number()});
+                _stack->pop_by(2);
+                _stack->push(Value{a.as_number() + b.as_number()});
                 break;
             }
             else if(a.is_object() && b.is_object())
@@ -335,8 +998,9 @@ InterpretResult VM::_run()
 
                 if(a_str && b_str)
                 {
-                    _stack.pop_by(2);
-                    _stack.push(Value{_allocator.allocate_string(a_str->value() + b_str->value())});
+                    _stack->pop_by(2);
+                    _stack->push(
+                        Value{_allocator.allocate_string(a_str->value() + b_str->value())});
                     break;
                 }
             }
@@ -353,21 +1017,21 @@ InterpretResult VM::_run()
             BINARY_OP(/);
             break;
         case OpCode::TRUE:
-            _stack.push(true);
+            _stack->push(true);
             break;
         case OpCode::FALSE:
-            _stack.push(false);
+            _stack->push(false);
             break;
         case OpCode::NIL:
-            _stack.push(Value{});
+            _stack->push(Value{});
             break;
         case OpCode::NOT:
-            _stack.top().not_op();
+            _stack->top().not_op();
             break;
         case OpCode::EQUAL: {
-            auto a = _stack.pop();
-            auto b = _stack.pop();
-            _stack.push(a == b);
+            auto a = _stack->pop();
+            auto b = _stack->pop();
+            _stack->push(a == b);
             break;
         }
         case OpCode::GREATER:
@@ -377,14 +1041,19 @@ InterpretResult VM::_run()
             BINARY_OP(<);
             break;
         case OpCode::POP:
-            _stack.pop();
+            _stack->pop();
             break;
         case OpCode::DEFINE_GLOBAL: {
             const auto* global_name =
                 _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
 
-            _globals[global_name->value()] = _stack.top();
-            _stack.pop();
+            {
+                auto* module = _current_frame->closure->module;
+                auto lock = _write_globals();
+                (module ? module->globals : _globals)[global_name->value()] = _stack->top();
+            }
+
+            _stack->pop();
 
             break;
         }
@@ -392,51 +1061,72 @@ InterpretResult VM::_run()
             const auto* global_name =
                 _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
 
-            auto it = _globals.find(global_name->value());
+            auto lock = _read_globals();
+            auto* value = _find_global(global_name->value());
 
-            if(it == _globals.end())
+            if(!value)
             {
                 _runtime_error("Undefined variable '{}'.", global_name->value());
                 return InterpretResult::RUNTIME_ERROR;
             }
 
-            _stack.push(it->second);
+            _stack->push(*value);
             break;
         }
         case OpCode::SET_GLOBAL: {
             const auto* global_name =
                 _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
 
-            auto it = _globals.find(global_name->value());
+            auto* module = _current_frame->closure->module;
 
-            if(it == _globals.end())
+            if(module && module->is_shared())
+            {
+                _runtime_error("Parallel tasks cannot modify modules imported outside them.");
+                return InterpretResult::RUNTIME_ERROR;
+            }
+
+            auto lock = _write_globals();
+            Value* value = nullptr;
+
+            // Modules only assign their own globals, not the natives they see.
+            if(module)
+            {
+                auto it = module->globals.find(global_name->value());
+                value = it != module->globals.end() ? &it->second : nullptr;
+            }
+            else
+            {
+                value = _find_global(global_name->value());
+            }
+
+            if(!value)
             {
                 _runtime_error("Undefined variable '{}'.", global_name->value());
                 return InterpretResult::RUNTIME_ERROR;
             }
 
-            it->second = _stack.top();
+            *value = _stack->top();
             break;
         }
         case OpCode::GET_LOCAL: {
             auto slot = _read_byte();
-            _stack.push(_stack[slot + _current_frame->offset]);
+            _stack->push((*_stack)[slot + _current_frame->offset]);
             break;
         }
         case OpCode::SET_LOCAL: {
             auto slot = _read_byte();
-            _stack[slot + _current_frame->offset] = _stack.top();
+            (*_stack)[slot + _current_frame->offset] = _stack->top();
             break;
         }
         case OpCode::JUMP_IF_FALSE: {
             auto jmp = _read_short();
-            if(_stack.top().is_falsey())
+            if(_stack->top().is_falsey())
                 _current_frame->ip += jmp;
             break;
         }
         case OpCode::JUMP_IF_TRUE: {
             auto jmp = _read_short();
-            if(!_stack.top().is_falsey())
+            if(!_stack->top().is_falsey())
                 _current_frame->ip += jmp;
             break;
         }
@@ -445,15 +1135,22 @@ InterpretResult VM::_run()
             break;
         }
         case OpCode::LOOP: {
-            _current_frame->ip -= _read_short();
+            auto offset = _read_short();
+            SAFEPOINT();
+            _current_frame->ip -= offset;
+            SUSPEND_IF_YIELDING();
             break;
         }
         case OpCode::CALL: {
             auto arg_count = _read_byte();
-            if(!_call_value(_stack[_stack.size() - arg_count - 1], arg_count))
+            SAFEPOINT();
+
+            if(!_call_value((*_stack)[_stack->size() - arg_count - 1], arg_count))
             {
                 return InterpretResult::RUNTIME_ERROR;
             }
+
+            SUSPEND_IF_YIELDING();
             break;
         }
         case OpCode::CLOSURE: {
@@ -470,7 +1167,8 @@ InterpretResult VM::_run()
 
                 if(is_local)
                 {
-                    upvalues.push_back(_capture_upvalue(&_stack[index + _current_frame->offset]));
+                    upvalues.push_back(
+                        _capture_upvalue(&(*_stack)[index + _current_frame->offset]));
                 }
                 else
                 {
@@ -478,47 +1176,80 @@ InterpretResult VM::_run()
                 }
             }
 
-            _stack.push(_allocator.allocate<ClosureObject>(true, *function, std::move(upvalues)));
+            auto* closure =
+                _allocator.allocate<ClosureObject>(true, *function, std::move(upvalues));
+            // Functions use the globals of the module they are declared in, wherever called from.
+            closure->module = _current_frame->closure->module;
+            _stack->push(Value{closure});
             break;
         }
         case OpCode::GET_UPVALUE: {
-            auto slot = _read_byte();
-            _stack.push(*_current_frame->closure->upvalues[slot]->location);
+            auto* upvalue = _current_frame->closure->upvalues[_read_byte()];
+            auto lock = _lock(upvalue->lock);
+            _stack->push(*upvalue->location);
             break;
         }
         case OpCode::SET_UPVALUE: {
-            auto slot = _read_byte();
-            *_current_frame->closure->upvalues[slot]->location = _stack.top();
+            auto* upvalue = _current_frame->closure->upvalues[_read_byte()];
+
+            if(upvalue->is_shared())
+            {
+                _runtime_error("Parallel tasks cannot assign to captured variables.");
+                return InterpretResult::RUNTIME_ERROR;
+            }
+
+            auto lock = _lock(upvalue->lock);
+            *upvalue->location = _stack->top();
             break;
         }
         case OpCode::CLOSE_UPVALUE: {
-            _close_upvalues(_stack.top_addr());
-            _stack.pop();
+            _close_upvalues(_stack->top_addr());
+            _stack->pop();
             break;
         }
         case OpCode::CLASS: {
             auto& value = _current_chunk().get_constant(_read_byte());
-            _stack.push(Value{_allocator.allocate<ClassObject>(
+            _stack->push(Value{_allocator.allocate<ClassObject>(
                 true, value.as_object()->as<StringObject>()->value())});
             break;
         }
         case OpCode::GET_PROPERTY: {
-            auto* instance = _stack.top().as_object()->as<InstanceObject>();
-            auto* name =
-                _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
+            auto receiver = _stack->top();
+            auto* instance =
+                receiver.is_object() ? receiver.as_object()->as<InstanceObject>() : nullptr;
+            auto constant = _read_byte();
 
             if(!instance)
             {
+                if(auto* host = as_host(receiver))
+                {
+                    if(!_get_host_property(*host, constant))
+                    {
+                        return InterpretResult::RUNTIME_ERROR;
+                    }
+
+                    break;
+                }
+
+                if(auto* module = as_module(receiver))
+                {
+                    if(!_get_module_property(*module, constant))
+                    {
+                        return InterpretResult::RUNTIME_ERROR;
+                    }
+
+                    break;
+                }
+
                 _runtime_error("Only instances have properties.");
                 return InterpretResult::RUNTIME_ERROR;
             }
 
-            auto field_it = instance->fields.find(name->value());
+            auto* name = _current_chunk().get_constant(constant).as_object()->as<StringObject>();
 
-            if(field_it != instance->fields.end())
+            if(auto field = _get_field(*instance, name->value()))
             {
-                _stack.pop();
-                _stack.push(field_it->second);
+                _stack->top() = *field;
                 break;
             }
 
@@ -531,50 +1262,86 @@ InterpretResult VM::_run()
             break;
         }
         case OpCode::SET_PROPERTY: {
-            auto* instance = _stack[_stack.size() - 2].as_object()->as<InstanceObject>();
+            auto receiver = (*_stack)[_stack->size() - 2];
+            auto* instance =
+                receiver.is_object() ? receiver.as_object()->as<InstanceObject>() : nullptr;
 
             if(!instance)
             {
+                if(auto* host = as_host(receiver))
+                {
+                    if(!_set_host_property(*host, _read_byte()))
+                    {
+                        return InterpretResult::RUNTIME_ERROR;
+                    }
+
+                    break;
+                }
+
+                if(auto* module = as_module(receiver))
+                {
+                    if(!_set_module_property(*module, _read_byte()))
+                    {
+                        return InterpretResult::RUNTIME_ERROR;
+                    }
+
+                    break;
+                }
+
                 _runtime_error("Only instances have fields.");
                 return InterpretResult::RUNTIME_ERROR;
             }
 
+            if(instance->is_shared())
+            {
+                _runtime_error("Parallel tasks cannot modify instances created outside them.");
+                return InterpretResult::RUNTIME_ERROR;
+            }
+
             auto name = _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
 
-            instance->fields[name->value()] = _stack.top();
+            {
+                auto lock = _lock(instance->lock);
+                instance->fields[name->value()] = _stack->top();
+            }
 
-            auto& val = _stack.pop();
+            auto& val = _stack->pop();
             // Replace the instance on the top of the stack with the assigned value.
-            _stack.top() = val;
+            _stack->top() = val;
 
             break;
         }
         case OpCode::METHOD: {
             auto name = _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
 
-            auto& method = _stack.top();
-            auto* klass = _stack[_stack.size() - 2].as_object()->as<ClassObject>();
+            auto& method = _stack->top();
+            auto* klass = (*_stack)[_stack->size() - 2].as_object()->as<ClassObject>();
 
-            klass->methods[name->value()] = method.as_object()->as<ClosureObject>();
+            {
+                auto lock = _lock(klass->lock);
+                klass->methods[name->value()] = method.as_object()->as<ClosureObject>();
+            }
 
-            _stack.pop();
+            _stack->pop();
 
             break;
         }
         case OpCode::INVOKE: {
-            auto method =
-                _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
+            auto method = _read_byte();
             auto arg_count = _read_byte();
+            SAFEPOINT();
 
-            if(!_invoke(method->value(), arg_count))
+            if(!_invoke(method, arg_count))
             {
                 return InterpretResult::RUNTIME_ERROR;
             }
+
+            SUSPEND_IF_YIELDING();
             break;
         }
         case OpCode::INHERIT: {
-            auto* subclass = _stack.top().as_object()->as<ClassObject>();
-            auto* superclass = _stack[_stack.size() - 2].as_object()->as<ClassObject>();
+            auto* subclass = _stack->top().as_object()->as<ClassObject>();
+            auto* superclass = (*_stack)[_stack->size() - 2].as_object()->as<ClassObject>();
 
             if(!superclass)
             {
@@ -582,15 +1349,20 @@ InterpretResult VM::_run()
                 return InterpretResult::RUNTIME_ERROR;
             }
 
-            subclass->methods = superclass->methods;
+            {
+                // The subclass is new, so locking both cannot deadlock with other threads.
+                auto superclass_lock = _lock(superclass->lock);
+                auto subclass_lock = _lock(subclass->lock);
+                subclass->methods = superclass->methods;
+            }
 
             // Pop the subclass and superclass.
-            _stack.pop();
+            _stack->pop();
 
             break;
         }
         case OpCode::GET_SUPER: {
-            auto* superclass = _stack[_stack.size() - 2].as_object()->as<ClassObject>();
+            auto* superclass = (*_stack)[_stack->size() - 2].as_object()->as<ClassObject>();
 
             auto* method =
                 _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
@@ -603,34 +1375,42 @@ InterpretResult VM::_run()
             break;
         }
         case OpCode::SUPER_INVOKE: {
-            auto* method =
-                _current_chunk().get_constant(_read_byte()).as_object()->as<StringObject>();
-
+            auto method = _read_byte();
             auto arg_count = _read_byte();
 
-            auto* superclass = _stack.pop().as_object()->as<ClassObject>();
+            auto* superclass = _stack->pop().as_object()->as<ClassObject>();
+            SAFEPOINT();
 
-            if(!_invoke(method->value(), arg_count, superclass))
+            if(!_invoke(method, arg_count, superclass))
             {
                 return InterpretResult::RUNTIME_ERROR;
             }
 
+            SUSPEND_IF_YIELDING();
             break;
         }
         case OpCode::LIST: {
             auto size = _read_byte();
 
             auto list = Value{_allocator.allocate<ListObject>(
-                true, std::span<Value>(_stack.top_addr() + 1 - size, size))};
+                true, std::span<Value>(_stack->top_addr() + 1 - size, size))};
 
-            _stack.pop_by(size);
-            _stack.push(list);
+            _stack->pop_by(size);
+            _stack->push(list);
+
+            break;
+        }
+        case OpCode::IMPORT: {
+            if(!_import(_read_byte()))
+            {
+                return InterpretResult::RUNTIME_ERROR;
+            }
 
             break;
         }
         case OpCode::LIST_INDEX: {
-            auto& index = _stack.pop();
-            auto* list = _stack.pop().as_object()->as<ListObject>();
+            auto& index = _stack->pop();
+            auto* list = _stack->pop().as_object()->as<ListObject>();
 
             if(!list)
             {
@@ -644,13 +1424,21 @@ InterpretResult VM::_run()
                 return InterpretResult::RUNTIME_ERROR;
             }
 
-            _stack.push(list->elements[index.as_number()]);
+            auto lock = _lock(list->lock);
+            _stack->push(list->elements[index.as_number()]);
 
             break;
         }
         }
 #undef BINARY_OP
+#undef SAFEPOINT
+#undef SUSPEND_IF_YIELDING
     }
 }
 
+InterpretResult VM::_run()
+{
+    return _op_stats ? _dispatch<true>() : _dispatch<false>();
+}
+
 } // namespace lox
\ No newline at end of file
@@ -1,10 +1,23 @@
 #ifndef LOX_VM_H
 #define LOX_VM_H
 
+#include <atomic>
+#include <chrono>
+#include <concepts>
 #include <cstdint>
+#include <cstdio>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <print>
+#include <shared_mutex>
+#include <span>
+#include <string>
 #include <string_view>
+#include <type_traits>
 
+#include "absl/container/flat_hash_map.h"
 #include "chunk.h"
 #include "common.h"
 #include "object.h"
@@ -16,48 +29,320 @@ namespace lox
 enum class InterpretResult
 {
     OK,
+    PARSE_ERROR,
+    COMPILE_ERROR,
     RUNTIME_ERROR
 };
 
+class EventLoop;
+class OpStats;
+class Profiler;
+class Tracer;
+struct HostObject;
+struct HostProperty;
+struct ModuleObject;
 class ObjectAllocator;
 class FunctionObject;
+struct FiberObject;
 struct UpValueObject;
 struct ClosureObject;
 
 class VM
 {
 public:
+    // Bounds on a run, from interpret() until it returns, which are checked at safepoints: every
+    // backward jump and every call. A run which exceeds one fails with a runtime error.
+    struct Limits
+    {
+        // Safepoints passed. Every loop iteration and call passes one, so this bounds the
+        // instructions run without counting each of them.
+        std::optional<uint64_t> steps;
+        std::optional<std::chrono::nanoseconds> time;
+        // How long a fiber run by the event loop may run before it is made to yield to the others.
+        std::optional<std::chrono::nanoseconds> time_slice;
+    };
+
     void define_native(std::string_view name, NativeFn function);
+
+    // Defines a native from a plain C++ function or captureless lambda, whose arguments and result
+    // are checked and converted as described in bind.h, which defines these.
+    template <typename F>
+        requires std::is_empty_v<F> && std::default_initializable<F>
+    void bind(std::string_view name, F function);
+    template <auto function>
+    void bind(std::string_view name);
+
     InterpretResult interpret(FunctionObject&);
 
+    // Starts a new run, to which the limits apply afresh, as interpret() does. For calls into
+    // scripts made from outside of any run. A pending cancel() still applies.
+    void start_run();
+
+    // Calls a function, class or native and runs it to completion. May be called from within a
+    // native, in which case the calling frames are left as they were.
+    std::expected<Value, InterpretResult> call(Value callee, std::span<const Value> args);
+    // The same for a callee known to be a closure, which saves finding out what it is.
+    std::expected<Value, InterpretResult> call(ClosureObject& closure,
+                                               std::span<const Value> args);
+
+    // Switches to a fiber and runs it until it yields or returns, producing the value it yielded
+    // or returned. The value it is resumed with becomes the result of the yield() it is suspended
+    // in. The fiber must be reachable, which it is when resumed by a native.
+    // If an error is given, the fiber fails with it where it is suspended instead.
+    std::expected<Value, InterpretResult> resume(FiberObject&,
+                                                 Value value,
+                                                 std::optional<std::string> error = std::nullopt);
+
+    // Called by natives to suspend the running fiber once they return. Returns false if there is
+    // no fiber to suspend from here.
+    bool yield(Value value);
+
+    // Redirects what scripts print and the errors they raise.
+    void set_output(std::FILE* output, std::FILE* error_output)
+    {
+        _output = output;
+        _error_output = error_output;
+    }
+
+    std::FILE* get_output()
+    {
+        return _output;
+    }
+
+    std::FILE* get_error_output()
+    {
+        return _error_output;
+    }
+
+    // The fiber running now, if any.
+    FiberObject* get_fiber()
+    {
+        return _fiber;
+    }
+
+    // Created the first time it is needed.
+    EventLoop& get_event_loop();
+
+    // Runs the event loop, if it was ever created, until no fibers are left. Returns false if one
+    // of them failed.
+    bool drain_event_loop();
+
+    HashMap<Value>& get_globals()
+    {
+        return _globals;
+    }
+
+    // Looks a global up, locking the globals if threads share them.
+    std::optional<Value> get_global(std::string_view name)
+    {
+        auto lock = _read_globals();
+        auto it = _globals.find(name);
+
+        return it != _globals.end() ? std::optional{it->second} : std::nullopt;
+    }
+
+    // The frames of the script or fiber running now.
+    const CallStack& get_callstack() const
+    {
+        return *_callstack;
+    }
+
+    // Lets a profiler collect its samples at safepoints while it runs.
+    void set_profiler(Profiler* profiler)
+    {
+        _profiler = profiler;
+    }
+
+    // Reports calls and natives to the tracer from now on, or stops reporting them.
+    void set_tracer(Tracer* tracer)
+    {
+        _tracer = tracer;
+    }
+
+    // Counts every instruction run from now on into the stats, or stops counting.
+    void set_op_stats(OpStats* op_stats)
+    {
+        _op_stats = op_stats;
+    }
+
+    ObjectAllocator& get_allocator()
+    {
+        return _allocator;
+    }
+
+    const Limits& get_limits() const
+    {
+        return _limits;
+    }
+
+    void set_limits(const Limits& limits)
+    {
+        _limits = limits;
+    }
+
+    // Fails the current run at its next safepoint check, or the next run if none is running. May
+    // be called from any thread. A run which is blocked in a native, waiting for I/O or a channel,
+    // is only stopped once it returns. Every later run fails as well until the cancellation is
+    // reset, so that a cancel racing with the start of a run is never lost.
+    void cancel()
+    {
+        _cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    void reset_cancel()
+    {
+        _cancelled.store(false, std::memory_order_relaxed);
+    }
+
+    // Also fails runs while the given VM is cancelled, for a VM which works on its behalf and
+    // finishes before it does.
+    void follow_cancel(const VM& parent)
+    {
+        _cancel_parent = &parent;
+    }
+
+    bool is_cancelled() const
+    {
+        return _cancelled.load(std::memory_order_relaxed)
+               || (_cancel_parent && _cancel_parent->is_cancelled());
+    }
+
+    // Called by natives to fail with a runtime error once they return.
+    void raise(std::string message)
+    {
+        _native_error = std::move(message);
+    }
+
+    // VMs of threads sharing a heap also share its globals, natives included, so only the first
+    // of them defines the natives.
     VM(ObjectAllocator&,
        FixedStack<Value>& stack,
        HashMap<Value>& globals,
        CallStack& callstack,
-       std::vector<UpValueObject*>& open_upvalues);
+       std::vector<UpValueObject*>& open_upvalues,
+       bool define_natives = true);
+    ~VM();
 
 private:
     HashMap<Value>& _globals;
-    std::vector<UpValueObject*>& _open_upvalues;
+    // Set while threads share the heap, when globals, instances and lists are locked around use.
+    std::shared_mutex* _globals_mutex = nullptr;
+
+    std::shared_lock<std::shared_mutex> _read_globals()
+    {
+        return _globals_mutex ? std::shared_lock{*_globals_mutex}
+                              : std::shared_lock<std::shared_mutex>{};
+    }
+
+    std::unique_lock<std::shared_mutex> _write_globals()
+    {
+        return _globals_mutex ? std::unique_lock{*_globals_mutex}
+                              : std::unique_lock<std::shared_mutex>{};
+    }
+
+    std::unique_lock<ObjectLock> _lock(ObjectLock& lock)
+    {
+        return _globals_mutex ? std::unique_lock{lock} : std::unique_lock<ObjectLock>{};
+    }
+
+    std::optional<Value> _get_field(InstanceObject&, std::string_view name);
+    ClosureObject* _find_method(const ClassObject&, std::string_view name);
+    // Finds a global of the module the running function belongs to, or else of the VM. Modules
+    // only see the natives among the globals of the VM. The globals must be locked.
+    Value* _find_global(std::string_view name);
+
+    // The modules imported so far by their canonical paths. Each runs once, on the first import,
+    // and later imports, including those from a module still running or from later scripts run by
+    // the VM, get the module as it is.
+    absl::flat_hash_map<std::string, ModuleObject*> _modules;
+    std::vector<UpValueObject*>* _open_upvalues;
 
     UpValueObject* _capture_upvalue(Value*);
     void _close_upvalues(Value*);
 
-    CallStack& _callstack;
+    CallStack* _callstack;
     CallFrame* _current_frame = nullptr;
+    // Depth of the callstack below the frame call() is running, which returns once it is popped.
+    size_t _exit_depth = 0;
+
+    // While a fiber runs, the stacks and open upvalues point at its own.
+    FiberObject* _fiber = nullptr;
+    // Only set while running a fiber outside of any nested call().
+    bool _can_yield = false;
+    bool _yielding = false;
+    Value _yielded;
 
-    FixedStack<Value>& _stack;
+    FixedStack<Value>* _stack;
     ObjectAllocator& _allocator;
 
+    std::FILE* _output = stdout;
+    std::FILE* _error_output = stderr;
+
+    std::optional<std::string> _native_error;
+
+    std::unique_ptr<EventLoop> _event_loop;
+    Profiler* _profiler = nullptr;
+    OpStats* _op_stats = nullptr;
+    Tracer* _tracer = nullptr;
+
+    // Safepoints only decrement a counter, and check the limits once every SAFEPOINT_INTERVAL.
+    static constexpr int32_t SAFEPOINT_INTERVAL = 1024;
+
+    Limits _limits;
+    std::atomic<bool> _cancelled = false;
+    const VM* _cancel_parent = nullptr;
+    int32_t _ticks = SAFEPOINT_INTERVAL;
+    // What _ticks counts down from now, which is less than the interval near the step limit.
+    int32_t _quantum = SAFEPOINT_INTERVAL;
+    uint64_t _steps = 0;
+    std::chrono::steady_clock::time_point _run_start;
+    std::chrono::steady_clock::time_point _slice_start;
+
+    // Set by a safepoint once the time slice of the fiber running now has run out.
+    bool _preempting = false;
+
+    // Called once _ticks runs out. Returns false if the run must fail.
+    bool _safepoint();
+    void _rearm(int32_t quantum);
+    // Prepares to return from _run() because the fiber yielded or is preempted. A preempted fiber
+    // is suspended as though it had yielded nil.
+    void _suspend();
+
     template <class... Args>
     constexpr void _runtime_error(std::string_view format, Args&&... args);
 
+    // Pushes the callee and arguments, enters the callee and runs it until it returns.
+    template <typename Enter>
+    std::expected<Value, InterpretResult>
+    _call_and_run(Value callee, std::span<const Value> args, Enter enter);
     bool _call_value(Value& callee, int arg_count);
     bool _call(ClosureObject* callee, int arg_count);
     bool _bind_method(const ClassObject& klass, std::string_view name);
-    bool _invoke(std::string_view name, int arg_count, ClassObject* = nullptr);
+    // The value of a string constant of the current chunk, such as a property name.
+    std::string_view _constant_string(uint8_t constant);
+
+    // Invokes the method named by a constant of the current chunk.
+    bool _invoke(uint8_t constant, int arg_count, ClassObject* = nullptr);
+
+    // Reports the error the last native or host property raised, if any.
+    bool _report_native_error();
+
+    // Looks up a property of a host object named by a constant, through the cache of the constant.
+    const HostProperty* _find_host_property(const HostObject&, uint8_t constant);
+    bool _get_host_property(HostObject&, uint8_t constant);
+    bool _set_host_property(HostObject&, uint8_t constant);
+    bool _invoke_host(HostObject&, uint8_t constant, int arg_count);
+
+    // Imports the module whose path is a constant, pushing the module and then its result.
+    bool _import(uint8_t constant);
+    bool _get_module_property(ModuleObject&, uint8_t constant);
+    bool _set_module_property(ModuleObject&, uint8_t constant);
+    bool _invoke_module(ModuleObject&, uint8_t constant, int arg_count);
 
     InterpretResult _run();
+    // The dispatch loop, with a copy which counts instructions for when there are op stats.
+    template <bool COUNT_OPS>
+    InterpretResult _dispatch();
 
     uint8_t _read_byte()
     {
@@ -0,0 +1,431 @@
+// Reads a heap dump written by the interpreter (see src/heap_dump.h) and reports what holds on to
+// memory: the objects of every class, or of every kind of object other than instances, with their
+// own size and the size they retain, and the objects retaining the most.
+//
+// An object retains every object which only stays reachable through it, which is the subtree of
+// the object in the dominator tree of the heap. Dominators are found with the iterative algorithm
+// of Cooper, Harvey and Kennedy. The retained size of a class counts each object once, leaving out
+// objects retained by another object of the same class.
+//
+// Usage: heap_analyzer <dump> [-n top]
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <print>
+#include <ranges>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+constexpr char MAGIC[8] = {'L', 'O', 'X', 'H', 'E', 'A', 'P', '\0'};
+constexpr uint32_t VERSION = 1;
+constexpr uint32_t UNREACHED = UINT32_MAX;
+// Links of the dominator chain shown for each of the objects retaining the most.
+constexpr size_t SHOWN_DOMINATORS = 4;
+
+struct Node
+{
+    uint32_t kind;
+    uint32_t name;
+    uint32_t size;
+    // Into the references of the heap.
+    uint32_t first_reference;
+    uint32_t reference_count;
+};
+
+struct Heap
+{
+    std::vector<std::string> names;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> references;
+};
+
+struct Group
+{
+    std::string label;
+    size_t objects = 0;
+    uint64_t size = 0;
+    uint64_t retained = 0;
+};
+
+[[noreturn]] void malformed(std::string_view path)
+{
+    std::println(stderr, "Malformed heap dump: {}", path);
+    std::exit(65);
+}
+
+class Reader
+{
+    std::string_view _data;
+    std::string_view _path;
+
+public:
+    Reader(std::string_view data, std::string_view path)
+        : _data(data)
+        , _path(path)
+    { }
+
+    std::string_view get_bytes(size_t size)
+    {
+        if(_data.size() < size)
+        {
+            malformed(_path);
+        }
+
+        auto bytes = _data.substr(0, size);
+        _data.remove_prefix(size);
+
+        return bytes;
+    }
+
+    uint32_t get()
+    {
+        uint32_t value;
+        std::memcpy(&value, get_bytes(sizeof(value)).data(), sizeof(value));
+
+        return value;
+    }
+};
+
+Heap read_heap(std::string_view path)
+{
+    std::ifstream file{std::string{path}, std::ios::binary};
+
+    if(file.fail())
+    {
+        std::println(stderr, "Could not open heap dump: {}", path);
+        std::exit(66);
+    }
+
+    std::string data{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+    Reader reader{data, path};
+    Heap heap;
+
+    if(reader.get_bytes(sizeof(MAGIC)) != std::string_view{MAGIC, sizeof(MAGIC)}
+       || reader.get() != VERSION)
+    {
+        malformed(path);
+    }
+
+    heap.names.resize(reader.get());
+
+    for(auto& name : heap.names)
+    {
+        name = reader.get_bytes(reader.get());
+    }
+
+    heap.nodes.resize(reader.get());
+
+    for(auto& node : heap.nodes)
+    {
+        node.kind = reader.get();
+        node.name = reader.get();
+        node.size = reader.get();
+        node.first_reference = heap.references.size();
+        node.reference_count = reader.get();
+
+        for(uint32_t i = 0; i < node.reference_count; ++i)
+        {
+            heap.references.push_back(reader.get());
+        }
+
+        if(node.kind >= heap.names.size() || node.name >= heap.names.size())
+        {
+            malformed(path);
+        }
+    }
+
+    if(heap.nodes.empty()
+       || std::ranges::any_of(heap.references,
+                              [&heap](uint32_t index) { return index >= heap.nodes.size(); }))
+    {
+        malformed(path);
+    }
+
+    return heap;
+}
+
+std::span<const uint32_t> get_references(const Heap& heap, uint32_t node)
+{
+    return std::span{heap.references}.subspan(heap.nodes[node].first_reference,
+                                              heap.nodes[node].reference_count);
+}
+
+// The nodes reachable from the roots, each after every node through which it was first reached.
+std::vector<uint32_t> get_reverse_postorder(const Heap& heap)
+{
+    std::vector<uint32_t> postorder;
+    std::vector<bool> seen(heap.nodes.size());
+    // Nodes on the path being walked, with how many of their references were followed.
+    std::vector<std::pair<uint32_t, uint32_t>> path{{0, 0}};
+
+    seen[0] = true;
+
+    while(!path.empty())
+    {
+        auto& [node, followed] = path.back();
+        auto references = get_references(heap, node);
+
+        if(followed == references.size())
+        {
+            postorder.push_back(node);
+            path.pop_back();
+            continue;
+        }
+
+        auto next = references[followed++];
+
+        if(!seen[next])
+        {
+            seen[next] = true;
+            path.emplace_back(next, 0);
+        }
+    }
+
+    std::ranges::reverse(postorder);
+
+    return postorder;
+}
+
+// The immediate dominator of every node, or UNREACHED for nodes which are not reachable.
+std::vector<uint32_t> get_dominators(const Heap& heap, const std::vector<uint32_t>& order)
+{
+    std::vector<uint32_t> position(heap.nodes.size(), UNREACHED);
+
+    for(uint32_t i = 0; i < order.size(); ++i)
+    {
+        position[order[i]] = i;
+    }
+
+    std::vector<std::vector<uint32_t>> referrers(heap.nodes.size());
+
+    for(auto node : order)
+    {
+        for(auto reference : get_references(heap, node))
+        {
+            referrers[reference].push_back(node);
+        }
+    }
+
+    std::vector<uint32_t> dominators(heap.nodes.size(), UNREACHED);
+    dominators[0] = 0;
+
+    auto intersect = [&](uint32_t a, uint32_t b) {
+        while(a != b)
+        {
+            while(position[a] > position[b])
+            {
+                a = dominators[a];
+            }
+
+            while(position[b] > position[a])
+            {
+                b = dominators[b];
+            }
+        }
+
+        return a;
+    };
+
+    for(auto changed = true; changed;)
+    {
+        changed = false;
+
+        for(auto node : order | std::views::drop(1))
+        {
+            auto dominator = UNREACHED;
+
+            for(auto referrer : referrers[node])
+            {
+                if(dominators[referrer] == UNREACHED)
+                {
+                    continue;
+                }
+
+                dominator = dominator == UNREACHED ? referrer : intersect(referrer, dominator);
+            }
+
+            if(dominators[node] != dominator)
+            {
+                dominators[node] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    return dominators;
+}
+
+// Instances are told apart by their class, other objects by their kind alone.
+std::string get_group_label(const Heap& heap, const Node& node)
+{
+    const auto& kind = heap.names[node.kind];
+
+    return kind == "instance" ? std::format("instance {}", heap.names[node.name]) : kind;
+}
+
+std::string get_node_label(const Heap& heap, uint32_t index)
+{
+    const auto& node = heap.nodes[index];
+
+    if(node.name == 0)
+    {
+        return heap.names[node.kind];
+    }
+
+    return std::format("{} {}", heap.names[node.kind], heap.names[node.name]);
+}
+
+[[noreturn]] void usage()
+{
+    std::println(stderr, "Usage: heap_analyzer <dump> [-n top]");
+    std::exit(64);
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    if(argc != 2 && !(argc == 4 && std::string_view{argv[2]} == "-n"))
+    {
+        usage();
+    }
+
+    auto top = argc == 4 ? std::max(1, std::atoi(argv[3])) : 20;
+    auto heap = read_heap(argv[1]);
+    auto order = get_reverse_postorder(heap);
+    auto dominators = get_dominators(heap, order);
+
+    // Dominators come before the nodes they dominate, so going backwards adds every subtree up
+    // before its root is added to its own dominator.
+    std::vector<uint64_t> retained(heap.nodes.size());
+
+    for(auto node : order | std::views::reverse)
+    {
+        retained[node] += heap.nodes[node].size;
+
+        if(node != 0)
+        {
+            retained[dominators[node]] += retained[node];
+        }
+    }
+
+    std::vector<Group> groups;
+    std::unordered_map<std::string, uint32_t> group_indices;
+    std::vector<uint32_t> group_of(heap.nodes.size());
+
+    for(auto node : order | std::views::drop(1))
+    {
+        auto label = get_group_label(heap, heap.nodes[node]);
+        auto [it, inserted] = group_indices.try_emplace(label, groups.size());
+
+        if(inserted)
+        {
+            groups.push_back({.label = std::move(label)});
+        }
+
+        auto& group = groups[it->second];
+        group_of[node] = it->second;
+        ++group.objects;
+        group.size += heap.nodes[node].size;
+    }
+
+    // Walks the dominator tree, counting an object towards its group unless another object of the
+    // group already retains it.
+    std::vector<std::vector<uint32_t>> dominated(heap.nodes.size());
+
+    for(auto node : order | std::views::drop(1))
+    {
+        dominated[dominators[node]].push_back(node);
+    }
+
+    std::vector<uint32_t> active(groups.size());
+    std::vector<std::pair<uint32_t, bool>> pending;
+
+    for(auto child : dominated[0])
+    {
+        pending.emplace_back(child, false);
+    }
+
+    while(!pending.empty())
+    {
+        auto [node, leaving] = pending.back();
+        pending.pop_back();
+        auto group = group_of[node];
+
+        if(leaving)
+        {
+            --active[group];
+            continue;
+        }
+
+        if(active[group]++ == 0)
+        {
+            groups[group].retained += retained[node];
+        }
+
+        pending.emplace_back(node, true);
+
+        for(auto child : dominated[node])
+        {
+            pending.emplace_back(child, false);
+        }
+    }
+
+    auto total = retained[0];
+
+    std::println("{} objects, {} bytes reachable, {} objects unreachable in the dump",
+                 order.size() - 1,
+                 total,
+                 heap.nodes.size() - order.size());
+
+    std::ranges::sort(groups, std::ranges::greater{}, &Group::retained);
+
+    std::println(
+        "\n{:<40} {:>10} {:>14} {:>14} {:>8}", "class", "objects", "size", "retained", "%");
+
+    for(const auto& group : groups | std::views::take(top))
+    {
+        std::println("{:<40} {:>10} {:>14} {:>14} {:>7.2f}%",
+                     group.label,
+                     group.objects,
+                     group.size,
+                     group.retained,
+                     total ? 100.0 * group.retained / total : 0.0);
+    }
+
+    std::vector<uint32_t> largest(order.begin() + 1, order.end());
+    std::ranges::sort(largest, std::ranges::greater{}, [&retained](uint32_t node) {
+        return retained[node];
+    });
+
+    std::println("\n{:<40} {:>14}  {}", "object", "retained", "retained by");
+
+    for(auto node : largest | std::views::take(top))
+    {
+        std::string chain;
+        auto dominator = dominators[node];
+
+        for(size_t i = 0; dominator != 0 && i < SHOWN_DOMINATORS; ++i)
+        {
+            chain += std::format("{}{}", i > 0 ? " < " : "", get_node_label(heap, dominator));
+            dominator = dominators[dominator];
+        }
+
+        std::println("{:<40} {:>14}  {}",
+                     get_node_label(heap, node),
+                     retained[node],
+                     chain.empty() ? "roots" : dominator == 0 ? chain : chain + " < ...");
+    }
+}